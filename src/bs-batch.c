@@ -0,0 +1,193 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bs-batch.h"
+#include "bs-cpp.h"
+#include "bs-util.h"
+
+struct bs_batch {
+	struct bs_batch_job *jobs;
+	size_t len;
+	atomic_size_t next;
+	const struct bs_deps_opts *deps;
+	FILE *log;
+};
+
+static void *bs_batch_worker(void *arg)
+{
+	struct bs_batch *batch = (struct bs_batch *)arg;
+	size_t i;
+	while ((i = atomic_fetch_add(&batch->next, 1)) < batch->len) {
+		struct bs_batch_job *job = batch->jobs + i;
+		bs_translation_unit_reset();
+		/* forking from a thread is not an option, each unit is fused */
+		job->err = bs_c_pre_proc_unit(job->in_path, job->out_path,
+					      batch->deps, batch->log);
+		if (job->err) {
+			Bs_log_error(batch->log, "%s: failed (%d)",
+				     job->in_path, job->err);
+		}
+	}
+	/* the thread-local state of the last unit */
+	bs_thread_release();
+	return NULL;
+}
+
+int bs_batch_run(struct bs_batch_job *jobs, size_t len, size_t workers,
+		 const struct bs_deps_opts *deps, FILE *log)
+{
+	struct bs_batch batch;
+	batch.jobs = jobs;
+	batch.len = len;
+	atomic_init(&batch.next, 0);
+	batch.deps = deps;
+	batch.log = log;
+
+	workers = (workers > len) ? len : workers;
+	workers = workers ? workers : 1;
+	size_t threads_size = (workers - 1) * sizeof(pthread_t);
+	pthread_t *threads = threads_size ? bs_malloc(threads_size) : NULL;
+	size_t started = 0;
+	for (; threads && started < workers - 1; ++started) {
+		int err = pthread_create(threads + started, NULL,
+					 bs_batch_worker, &batch);
+		if (err) {
+			/* fewer workers, but every job still gets done */
+			errno = err;
+			Bs_log_errno(log, "pthread_create (%zu of %zu)",
+				     started + 1, workers - 1);
+			break;
+		}
+	}
+
+	/* this thread is a worker as well */
+	bs_batch_worker(&batch);
+
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	bs_free(threads);
+
+	int err = 0;
+	for (size_t i = 0; i < len && !err; ++i) {
+		err = jobs[i].err;
+	}
+	return err;
+}
+
+/* the next whitespace separated field of the line, NUL terminated */
+static char *bs_batch_field(char **pos, char *end)
+{
+	char *s = *pos;
+	while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) {
+		++s;
+	}
+	if (s == end) {
+		*pos = s;
+		return NULL;
+	}
+	char *e = s;
+	while (e < end && !isspace((unsigned char)*e)) {
+		++e;
+	}
+	*pos = (e < end) ? e + 1 : e;
+	*e = '\0';
+	return s;
+}
+
+int bs_batch_manifest(const char *path, char **text,
+		      struct bs_batch_job **jobs, size_t *len, FILE *log)
+{
+	*text = NULL;
+	*jobs = NULL;
+	*len = 0;
+
+	int err = 0;
+	size_t size = 0;
+	size_t used = 0;
+	FILE *in = bs_fopen(path, "r");
+	if (!in) {
+		err = Bs_log_errno(log, "fopen(\"%s\", \"r\")", path);
+		return err ? err : 1;
+	}
+	do {
+		if (used == size) {
+			size = size ? size * 2 : 4096;
+			char *grown = bs_malloc(size + 1);
+			if (!grown) {
+				err = ENOMEM;
+				Bs_log_error(log, "malloc(%zu) failed", size);
+				goto bs_batch_manifest_end;
+			}
+			if (used) {
+				memcpy(grown, *text, used);
+			}
+			bs_free(*text);
+			*text = grown;
+		}
+		used += fread(*text + used, 1, size - used, in);
+	} while (used == size);
+	if (ferror(in)) {
+		err = Bs_log_errno(log, "fread(\"%s\")", path);
+		err = err ? err : 1;
+		goto bs_batch_manifest_end;
+	}
+	(*text)[used] = '\0';
+
+	size_t lines = 1;
+	for (const char *s = *text; (s = strchr(s, '\n')); ++s) {
+		++lines;
+	}
+	*jobs = bs_malloc(lines * sizeof(struct bs_batch_job));
+	if (!*jobs) {
+		err = ENOMEM;
+		Bs_log_error(log, "malloc(%zu jobs) failed", lines);
+		goto bs_batch_manifest_end;
+	}
+
+	char *line = *text;
+	for (size_t lineno = 1; line < *text + used; ++lineno) {
+		char *eol = memchr(line, '\n', (size_t)(*text + used - line));
+		eol = eol ? eol : *text + used;
+		char *pos = line;
+		char *in_path = bs_batch_field(&pos, eol);
+		if (in_path && in_path[0] != '#') {
+			char *out_path = bs_batch_field(&pos, eol);
+			if (!out_path || bs_batch_field(&pos, eol)) {
+				err = EINVAL;
+				Bs_log_error(log, "%s:%zu: expected 'in out'",
+					     path, lineno);
+				goto bs_batch_manifest_end;
+			}
+			struct bs_batch_job *job = *jobs + (*len)++;
+			job->in_path = in_path;
+			job->out_path = out_path;
+			job->err = 0;
+		}
+		line = eol + 1;
+	}
+
+bs_batch_manifest_end:
+	bs_fclose(in);
+	if (err) {
+		bs_free(*jobs);
+		*jobs = NULL;
+		*len = 0;
+		bs_free(*text);
+		*text = NULL;
+	}
+	return err;
+}
+
+size_t bs_batch_cpus(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (size_t)cpus : 1;
+}
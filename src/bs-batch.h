@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_BATCH_H
+#define BS_BATCH_H 1
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "bs-deps.h"
+
+/*
+ * Batch mode: many translation units in one run, on a pool of threads.
+ * Each worker takes the next job not yet taken, so a worker which gets
+ * small files simply takes more of them. The include search cache, the
+ * guard table and the processed output of the included files are shared
+ * by all of the workers; the macros are per translation unit.
+ */
+struct bs_batch_job {
+	const char *in_path;
+	const char *out_path;
+	int err;
+};
+
+/*
+ * returns 0 if every job succeeded, each job's own error is in job->err;
+ * with "deps", each job writes its make rule as well
+ */
+int bs_batch_run(struct bs_batch_job *jobs, size_t len, size_t workers,
+		 const struct bs_deps_opts *deps, FILE *log);
+
+/*
+ * Reads a manifest of "in out" path pairs, one pair per line, blank lines
+ * and lines starting with '#' are skipped. The paths point into *text,
+ * which is to be freed along with *jobs.
+ */
+int bs_batch_manifest(const char *path, char **text,
+		      struct bs_batch_job **jobs, size_t *len, FILE *log);
+
+/* the number of CPUs online, at least 1 */
+size_t bs_batch_cpus(void);
+
+#endif /* BS_BATCH_H */
@@ -0,0 +1,582 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bs-cache.h"
+#include "bs-deps.h"
+#include "bs-search.h"
+#include "bs-util.h"
+
+#define BS_CACHE_MAGIC "bs-cpp-cache/2"
+
+/* as kept in the meta file, ahead of each note */
+struct bs_cache_stamp {
+	unsigned long long size;
+	long long mtime_sec;
+	long long mtime_nsec;
+	unsigned long long hash;	/* of the contents, FNV-1a */
+};
+
+/* set up before any unit is run, then only read */
+static char *bs_cache_dir = NULL;
+static char *bs_cache_options = NULL;
+static size_t bs_cache_options_len = 0;
+static char bs_cache_cwd[PATH_MAX];
+
+/*
+ * The hash of the contents of each file hashed so far in this run, for
+ * as long as the file keeps its identity: a header is read and hashed
+ * once, not once per unit which includes it.
+ */
+struct bs_cache_hashed {
+	struct bs_cache_hashed *next;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	unsigned long long hash;
+};
+
+#define BS_CACHE_HASHED_BUCKETS 1024
+
+static struct bs_cache_hashed *bs_cache_hashed[BS_CACHE_HASHED_BUCKETS];
+static pthread_mutex_t bs_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int bs_cache_open(const char *dir, const char *options, size_t options_len,
+		  FILE *log)
+{
+	bs_cache_close();
+	if (mkdir(dir, 0777) && errno != EEXIST) {
+		int err = Bs_log_errno(log, "mkdir(\"%s\")", dir);
+		return err ? err : 1;
+	}
+	struct stat st;
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		Bs_log_error(log, "%s is not a directory", dir);
+		return ENOTDIR;
+	}
+	if (!getcwd(bs_cache_cwd, sizeof(bs_cache_cwd))) {
+		int err = Bs_log_errno(log, "getcwd");
+		return err ? err : 1;
+	}
+	size_t len = strlen(dir);
+	bs_cache_dir = bs_malloc(len + 1);
+	bs_cache_options = bs_malloc(options_len ? options_len : 1);
+	if (!bs_cache_dir || !bs_cache_options) {
+		bs_cache_close();
+		Bs_log_error(log, "out of memory for the cache in %s", dir);
+		return ENOMEM;
+	}
+	memcpy(bs_cache_dir, dir, len + 1);
+	if (options_len) {
+		memcpy(bs_cache_options, options, options_len);
+	}
+	bs_cache_options_len = options_len;
+	return 0;
+}
+
+void bs_cache_close(void)
+{
+	bs_free(bs_cache_dir);
+	bs_cache_dir = NULL;
+	bs_free(bs_cache_options);
+	bs_cache_options = NULL;
+	bs_cache_options_len = 0;
+
+	pthread_mutex_lock(&bs_cache_mutex);
+	for (size_t i = 0; i < BS_CACHE_HASHED_BUCKETS; ++i) {
+		while (bs_cache_hashed[i]) {
+			struct bs_cache_hashed *h = bs_cache_hashed[i];
+			bs_cache_hashed[i] = h->next;
+			bs_free(h);
+		}
+	}
+	pthread_mutex_unlock(&bs_cache_mutex);
+}
+
+int bs_cache_enabled(void)
+{
+	return bs_cache_dir != NULL;
+}
+
+static int bs_cache_same_file(const struct bs_cache_hashed *h,
+			      const struct stat *st)
+{
+	return h->dev == st->st_dev && h->ino == st->st_ino
+	    && h->size == st->st_size
+	    && h->mtime.tv_sec == st->st_mtim.tv_sec
+	    && h->mtime.tv_nsec == st->st_mtim.tv_nsec
+	    && h->ctime.tv_sec == st->st_ctim.tv_sec
+	    && h->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* returns 0, or non-zero if the file could not be read */
+static int bs_cache_hash_file(const char *path, const struct stat *st,
+			      unsigned long long *hash)
+{
+	size_t bucket = (size_t)(st->st_ino ^ st->st_dev)
+	    % BS_CACHE_HASHED_BUCKETS;
+	pthread_mutex_lock(&bs_cache_mutex);
+	struct bs_cache_hashed *h = bs_cache_hashed[bucket];
+	for (; h; h = h->next) {
+		if (bs_cache_same_file(h, st)) {
+			*hash = h->hash;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bs_cache_mutex);
+	if (h) {
+		return 0;
+	}
+
+	*hash = BS_FNV1A_INIT;
+	size_t len = (size_t)st->st_size;
+	if (len) {
+		int fd = bs_open(path, O_RDONLY);
+		if (fd < 0) {
+			return 1;
+		}
+		char *buf = bs_mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		bs_close(fd);
+		if (buf == MAP_FAILED) {
+			return 1;
+		}
+		*hash = bs_fnv1a(*hash, buf, len);
+		bs_munmap(buf, len);
+	}
+
+	h = bs_malloc(sizeof(struct bs_cache_hashed));
+	if (!h) {
+		/* still hashed, just not remembered */
+		return 0;
+	}
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime = st->st_mtim;
+	h->ctime = st->st_ctim;
+	h->hash = *hash;
+	pthread_mutex_lock(&bs_cache_mutex);
+	h->next = bs_cache_hashed[bucket];
+	bs_cache_hashed[bucket] = h;
+	pthread_mutex_unlock(&bs_cache_mutex);
+	return 0;
+}
+
+/* the key of a unit: the working directory, the input and the options */
+static char *bs_cache_key(const char *in_path, size_t *len)
+{
+	size_t cwd_len = strlen(bs_cache_cwd);
+	size_t in_len = strlen(in_path);
+	*len = cwd_len + 1 + in_len + 1 + bs_cache_options_len;
+	char *key = bs_malloc(*len);
+	if (key) {
+		memcpy(key, bs_cache_cwd, cwd_len + 1);
+		memcpy(key + cwd_len + 1, in_path, in_len + 1);
+		memcpy(key + cwd_len + 1 + in_len + 1, bs_cache_options,
+		       bs_cache_options_len);
+	}
+	return key;
+}
+
+/* "dir/0123456789abcdef" and the suffix, or non-zero if too long */
+static int bs_cache_path(char *buf, const char *key, size_t key_len,
+			 const char *suffix)
+{
+	unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, BS_CACHE_MAGIC,
+					   sizeof(BS_CACHE_MAGIC));
+	hash = bs_fnv1a(hash, key, key_len);
+	int len = snprintf(buf, PATH_MAX, "%s/%016llx%s", bs_cache_dir, hash,
+			   suffix);
+	return len < 0 || len >= PATH_MAX;
+}
+
+/* a reflink where the file system can share the blocks, else a copy */
+static int bs_cache_copy(int fd_from, int fd_to, FILE *log)
+{
+	if (ioctl(fd_to, FICLONE, fd_from) == 0) {
+		return 0;
+	}
+	char *buf = bs_malloc(BS_IO_BUFSIZE);
+	if (!buf) {
+		Bs_log_error(log, "out of memory copying %d", fd_from);
+		return ENOMEM;
+	}
+	int err = bs_fd_copy(fd_from, fd_to, buf, BS_IO_BUFSIZE, log);
+	bs_free(buf);
+	return err;
+}
+
+/*
+ * writes "data", or the contents of "fd_from", to a new file beside
+ * "path", which then replaces "path": a reader sees either all or none
+ */
+static int bs_cache_install(const char *path, int fd_from, const char *data,
+			    size_t len, FILE *log)
+{
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= PATH_MAX) {
+		Bs_log_error(log, "path too long: %s", path);
+		return ENAMETOOLONG;
+	}
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		int err = Bs_log_errno(log, "mkstemp(\"%s\")", tmp);
+		return err ? err : 1;
+	}
+	int err = (fd_from >= 0) ? bs_cache_copy(fd_from, fd, log)
+	    : bs_write_all(fd, data, len, log);
+	if (bs_close(fd) && !err) {
+		err = Bs_log_errno(log, "close(\"%s\")", tmp);
+		err = err ? err : 1;
+	}
+	if (!err && rename(tmp, path)) {
+		err = Bs_log_errno(log, "rename(\"%s\", \"%s\")", tmp, path);
+		err = err ? err : 1;
+	}
+	if (err) {
+		unlink(tmp);
+	}
+	return err;
+}
+
+/* returns 0, or non-zero if missing, not regular, or too new to trust */
+static int bs_cache_stamp(const char *path, const struct timespec *start,
+			  struct bs_cache_stamp *stamp)
+{
+	struct stat st;
+	if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+		return 1;
+	}
+	if (st.st_mtim.tv_sec > start->tv_sec
+	    || (st.st_mtim.tv_sec == start->tv_sec
+		&& st.st_mtim.tv_nsec >= start->tv_nsec)) {
+		return 1;
+	}
+	stamp->size = (unsigned long long)st.st_size;
+	stamp->mtime_sec = (long long)st.st_mtim.tv_sec;
+	stamp->mtime_nsec = (long long)st.st_mtim.tv_nsec;
+	return bs_cache_hash_file(path, &st, &stamp->hash);
+}
+
+/*
+ * returns 1 if "path" is as stamped: the same size and mtime, or, if only
+ * the mtime changed, the same contents, in which case *refresh is set and
+ * the stamp gets the new mtime
+ */
+static int bs_cache_stamp_holds(const char *path,
+				struct bs_cache_stamp *stamp, int *refresh)
+{
+	struct stat st;
+	if (stat(path, &st) || !S_ISREG(st.st_mode)
+	    || (unsigned long long)st.st_size != stamp->size) {
+		return 0;
+	}
+	if ((long long)st.st_mtim.tv_sec == stamp->mtime_sec
+	    && (long long)st.st_mtim.tv_nsec == stamp->mtime_nsec) {
+		return 1;
+	}
+	unsigned long long hash;
+	if (bs_cache_hash_file(path, &st, &hash) || hash != stamp->hash) {
+		return 0;
+	}
+	stamp->mtime_sec = (long long)st.st_mtim.tv_sec;
+	stamp->mtime_nsec = (long long)st.st_mtim.tv_nsec;
+	*refresh = 1;
+	return 1;
+}
+
+/* if the name of the note is still found where it was, or still not */
+static int bs_cache_found_same(const struct bs_deps_note *note, FILE *log)
+{
+	const char *path = NULL;
+	int fd = -1;
+	enum bs_search_kind kind = note->angle ? bs_search_angle
+	    : bs_search_quote;
+	int found = !bs_search_find(note->name, kind, note->from, &path, &fd,
+				    log);
+	if (fd >= 0) {
+		bs_close(fd);
+	}
+	if (!found) {
+		return note->path[0] == '\0';
+	}
+	return strcmp(path, note->path) == 0;
+}
+
+/* the length of the note at "pos", 0 if there is none */
+static size_t bs_cache_note_len(const char *block, size_t len, size_t pos)
+{
+	struct bs_deps_note note;
+	size_t next = pos;
+	if (!bs_deps_block_next(block, len, &next, &note)) {
+		return 0;
+	}
+	return next - pos;
+}
+
+/* the notes, each distinct note once, in the order first noted */
+static int bs_cache_put_notes(FILE *meta, const char *notes, size_t len,
+			      const struct timespec *start)
+{
+	size_t count = 0;
+	for (size_t pos = 0, n; (n = bs_cache_note_len(notes, len, pos));) {
+		pos += n;
+		++count;
+	}
+	size_t capacity = 64;
+	while (capacity < count * 2) {
+		capacity *= 2;
+	}
+	/* offsets + 1, so that zero is empty */
+	size_t *slots = bs_malloc(capacity * sizeof(size_t));
+	if (!slots) {
+		return ENOMEM;
+	}
+	memset(slots, 0x00, capacity * sizeof(size_t));
+
+	int err = 0;
+	size_t pos = 0;
+	size_t n;
+	while (!err && (n = bs_cache_note_len(notes, len, pos))) {
+		const char *note = notes + pos;
+		unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, note, n);
+		size_t j = (size_t)(hash & (capacity - 1));
+		int seen = 0;
+		for (; slots[j]; j = (j + 1) & (capacity - 1)) {
+			const char *other = notes + slots[j] - 1;
+			if (bs_cache_note_len(notes, len, slots[j] - 1) == n
+			    && memcmp(other, note, n) == 0) {
+				seen = 1;
+				break;
+			}
+		}
+		if (!seen) {
+			slots[j] = pos + 1;
+			struct bs_cache_stamp stamp;
+			memset(&stamp, 0x00, sizeof(struct bs_cache_stamp));
+			/* a probe which found nothing has no file to stamp */
+			const char *path = note + 2;
+			if (path[0]) {
+				err = bs_cache_stamp(path, start, &stamp);
+			}
+			fwrite(&stamp, sizeof(struct bs_cache_stamp), 1, meta);
+			fwrite(note, 1, n, meta);
+		}
+		pos += n;
+	}
+	bs_free(slots);
+	return err;
+}
+
+void bs_cache_store(const char *in_path, const char *out_path,
+		    const struct timespec *start, FILE *log)
+{
+	char path[PATH_MAX];
+	char *notes = NULL;
+	size_t notes_len = 0;
+	char *meta_buf = NULL;
+	size_t meta_len = 0;
+	FILE *meta = NULL;
+	int fdout = -1;
+	size_t key_len = 0;
+	char *key = bs_cache_key(in_path, &key_len);
+	if (!key || bs_deps_copy(0, &notes, &notes_len)) {
+		Bs_log_error(log, "out of memory caching %s", in_path);
+		goto bs_cache_store_end;
+	}
+
+	struct bs_cache_stamp stamp;
+	if (bs_cache_stamp(in_path, start, &stamp)) {
+		goto bs_cache_store_end;
+	}
+	meta = open_memstream(&meta_buf, &meta_len);
+	if (!meta) {
+		Bs_log_errno(log, "open_memstream");
+		goto bs_cache_store_end;
+	}
+	fwrite(BS_CACHE_MAGIC, 1, sizeof(BS_CACHE_MAGIC), meta);
+	unsigned long long stored_key_len = key_len;
+	fwrite(&stored_key_len, sizeof(stored_key_len), 1, meta);
+	fwrite(key, 1, key_len, meta);
+	fwrite(&stamp, sizeof(struct bs_cache_stamp), 1, meta);
+	int err = bs_cache_put_notes(meta, notes, notes_len, start);
+	if (fclose(meta) || err) {
+		/* a file too new to trust is not an error, just not kept */
+		meta = NULL;
+		goto bs_cache_store_end;
+	}
+	meta = NULL;
+
+	/* the output first, so that the meta never names an older one */
+	int err_path = bs_cache_path(path, key, key_len, ".i");
+	fdout = err_path ? -1 : Bs_open_ro(out_path, &err, log);
+	if (fdout < 0 || bs_cache_install(path, fdout, NULL, 0, log)) {
+		goto bs_cache_store_end;
+	}
+	if (!bs_cache_path(path, key, key_len, ".meta")) {
+		bs_cache_install(path, -1, meta_buf, meta_len, log);
+	}
+
+bs_cache_store_end:
+	if (fdout >= 0) {
+		Bs_close_fd(fdout, out_path, log);
+	}
+	if (meta) {
+		fclose(meta);
+	}
+	free(meta_buf);
+	bs_free(notes);
+	bs_free(key);
+}
+
+/* the stamp at *pos, and the note after it; 0 if there is none */
+static int bs_cache_next(char *meta, size_t len, size_t *pos,
+			 struct bs_cache_stamp *stamp, char **stamp_at,
+			 struct bs_deps_note *note)
+{
+	if (*pos + sizeof(struct bs_cache_stamp) > len) {
+		return 0;
+	}
+	*stamp_at = meta + *pos;
+	memcpy(stamp, *stamp_at, sizeof(struct bs_cache_stamp));
+	*pos += sizeof(struct bs_cache_stamp);
+	return bs_deps_block_next(meta, len, pos, note);
+}
+
+int bs_cache_fetch(const char *in_path, const char *out_path, int *hit,
+		   FILE *log)
+{
+	*hit = 0;
+	int err = 0;
+	char path[PATH_MAX];
+	char *meta = MAP_FAILED;
+	size_t meta_len = 0;
+	int fd = -1;
+	int fdout = -1;
+	size_t key_len = 0;
+	char *key = bs_cache_key(in_path, &key_len);
+	if (!key) {
+		/* just a miss */
+		goto bs_cache_fetch_end;
+	}
+	if (bs_cache_path(path, key, key_len, ".meta")) {
+		goto bs_cache_fetch_end;
+	}
+	fd = bs_open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || !st.st_size) {
+		goto bs_cache_fetch_end;
+	}
+	/* private: the stamps of a refresh are written over the mapping */
+	meta_len = (size_t)st.st_size;
+	meta = bs_mmap(NULL, meta_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		       fd, 0);
+	Bs_close_fd(fd, path, log);
+	fd = -1;
+	if (meta == MAP_FAILED) {
+		goto bs_cache_fetch_end;
+	}
+
+	size_t pos = sizeof(BS_CACHE_MAGIC);
+	unsigned long long stored_key_len;
+	if (meta_len < pos + sizeof(stored_key_len)
+	    || memcmp(meta, BS_CACHE_MAGIC, sizeof(BS_CACHE_MAGIC)) != 0) {
+		goto bs_cache_fetch_end;
+	}
+	memcpy(&stored_key_len, meta + pos, sizeof(stored_key_len));
+	pos += sizeof(stored_key_len);
+	if (stored_key_len != key_len || meta_len - pos < key_len
+	    || memcmp(meta + pos, key, key_len) != 0) {
+		goto bs_cache_fetch_end;
+	}
+	pos += key_len;
+
+	/* the input, then the notes: each file, and each search */
+	int refresh = 0;
+	struct bs_cache_stamp stamp;
+	if (pos + sizeof(struct bs_cache_stamp) > meta_len) {
+		goto bs_cache_fetch_end;
+	}
+	memcpy(&stamp, meta + pos, sizeof(struct bs_cache_stamp));
+	if (!bs_cache_stamp_holds(in_path, &stamp, &refresh)) {
+		goto bs_cache_fetch_end;
+	}
+	memcpy(meta + pos, &stamp, sizeof(struct bs_cache_stamp));
+	pos += sizeof(struct bs_cache_stamp);
+	size_t notes_pos = pos;
+
+	char *stamp_at;
+	struct bs_deps_note note;
+	while (bs_cache_next(meta, meta_len, &pos, &stamp, &stamp_at, &note)) {
+		if (note.path[0]
+		    && !bs_cache_stamp_holds(note.path, &stamp, &refresh)) {
+			goto bs_cache_fetch_end;
+		}
+		memcpy(stamp_at, &stamp, sizeof(struct bs_cache_stamp));
+		if (!bs_cache_found_same(&note, log)) {
+			goto bs_cache_fetch_end;
+		}
+	}
+
+	if (out_path) {
+		if (bs_cache_path(path, key, key_len, ".i")) {
+			goto bs_cache_fetch_end;
+		}
+		fd = bs_open(path, O_RDONLY);
+		if (fd < 0) {
+			goto bs_cache_fetch_end;
+		}
+		fdout = Bs_open_rw(out_path, 0644, &err, log);
+		if (fdout < 0) {
+			goto bs_cache_fetch_end;
+		}
+		err = bs_cache_copy(fd, fdout, log);
+		if (err) {
+			goto bs_cache_fetch_end;
+		}
+	}
+
+	pos = notes_pos;
+	while (bs_cache_next(meta, meta_len, &pos, &stamp, &stamp_at, &note)) {
+		err = bs_deps_note(note.kind, note.angle, note.name, note.path,
+				   note.from);
+		if (err) {
+			Bs_log_error(log, "out of memory noting '%s'",
+				     note.name);
+			goto bs_cache_fetch_end;
+		}
+	}
+	*hit = 1;
+
+	/* so that the next run need not read the files again */
+	if (refresh && !bs_cache_path(path, key, key_len, ".meta")) {
+		bs_cache_install(path, -1, meta, meta_len, log);
+	}
+
+bs_cache_fetch_end:
+	if (fdout >= 0) {
+		Bs_close_fd(fdout, out_path, log);
+	}
+	if (fd >= 0) {
+		Bs_close_fd(fd, path, log);
+	}
+	if (meta != MAP_FAILED) {
+		bs_munmap(meta, meta_len);
+	}
+	bs_free(key);
+	return err;
+}
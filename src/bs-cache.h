@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_CACHE_H
+#define BS_CACHE_H 1
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * An optional on-disk cache of whole translation units, kept between runs.
+ * Each unit has two files in the cache directory, named for a hash of the
+ * working directory, the input path and the -I/-isystem options: "*.i" is
+ * the output, and "*.meta" what it was made from. That is the input and
+ * every file of its include walk, with the name each was looked for by
+ * and the size, mtime and a hash of the contents of each, as noted by
+ * bs-deps.h.
+ *
+ * A unit is unchanged if each of its files has the same size and mtime,
+ * and each name is still found at the same path. Only stat() and the
+ * include search are needed for that; a file is read and hashed again
+ * only if its mtime changed but its size did not, as after a fresh
+ * checkout, and the new mtime is then kept so the next run need not.
+ */
+
+/* returns 0, or non-zero if "dir" can not be made or is not a dir */
+int bs_cache_open(const char *dir, const char *options, size_t options_len,
+		  FILE *log);
+
+void bs_cache_close(void);
+
+int bs_cache_enabled(void);
+
+/*
+ * if "in_path" is unchanged since it was stored, copies its output to
+ * "out_path", if not NULL, notes its include walk again as bs_deps_note()
+ * does, and sets *hit; returns 0, or non-zero if "out_path" failed
+ */
+int bs_cache_fetch(const char *in_path, const char *out_path, int *hit,
+		   FILE *log);
+
+/*
+ * keeps "out_path", just preprocessed from "in_path" on this thread, with
+ * the notes of its include walk; not if a file of the unit was changed
+ * at or after "start", as the output may not be of the contents hashed
+ */
+void bs_cache_store(const char *in_path, const char *out_path,
+		    const struct timespec *start, FILE *log);
+
+#endif /* BS_CACHE_H */
@@ -1,302 +1,1539 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 /* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
 
-#include <limits.h>
+#define _GNU_SOURCE
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bs-batch.h"
+#include "bs-cache.h"
 #include "bs-cpp.h"
+#include "bs-deps.h"
+#include "bs-expr.h"
+#include "bs-guard.h"
+#include "bs-macro.h"
+#include "bs-prefetch.h"
+#include "bs-scan.h"
+#include "bs-search.h"
+#include "bs-server.h"
+#include "bs-uring.h"
 #include "bs-util.h"
 
 char *bs_name_from_include(char *buf, char start_delim, char until_delim,
 			   char **name_end, FILE *log);
 
-int bs_strip_backslash_newline(int fd_from, int fd_to, FILE *log)
+/*
+ * Each transform is a resumable state machine: "feed" may be called with
+ * any size of span (even one byte at a time) and "finish" flushes whatever
+ * is pending at end of input. A stage emits either into the next stage of
+ * the chain, or, if it is the last, into a buffered writer. The forked
+ * pipeline runs one stage per process, the fused engine chains all three
+ * by direct calls in a single process.
+ */
+struct bs_stage;
+
+typedef int (*bs_stage_feed_func)(struct bs_stage *st, const char *buf,
+				  size_t len);
+typedef int (*bs_stage_finish_func)(struct bs_stage *st);
+typedef void (*bs_stage_release_func)(struct bs_stage *st);
+
+struct bs_stage {
+	bs_stage_feed_func feed;
+	bs_stage_finish_func finish;
+	bs_stage_release_func release;
+	struct bs_stage *next;
+	struct bs_writer *out;
+	FILE *log;
+};
+
+static int bs_stage_emit(struct bs_stage *st, const char *buf, size_t len)
+{
+	if (!len) {
+		return 0;
+	}
+	if (st->next) {
+		return st->next->feed(st->next, buf, len);
+	}
+	return bs_writer_write(st->out, buf, len);
+}
+
+static int bs_stage_finish_next(struct bs_stage *st)
 {
-	const size_t bufsize = sizeof(size_t) + 1;
-	char buf[sizeof(size_t) + 1];
-	memset(buf, 0x00, bufsize);
+	return st->next ? st->next->finish(st->next) : 0;
+}
+
+struct bs_strip_stage {
+	struct bs_stage base;
+	int have_backslash;
+};
+
+static const struct bs_scan_set bs_scan_backslash = Bs_scan_set('\\');
 
-	int have_backslash = 0;
+static int bs_strip_feed(struct bs_stage *st, const char *buf, size_t len)
+{
+	struct bs_strip_stage *ss = (struct bs_strip_stage *)st;
 	int err = 0;
+	size_t start = 0;
+	size_t i = 0;
 
-	while (1) {
-		int skip = 0;
-		size_t read_size = 1;
-		ssize_t bytes = bs_read(fd_from, buf, read_size);
-		if (bytes < 0) {
-			const char *fmt = "read(fd, buf, %zu) returned %zd";
-			int save_err = Bs_log_errno(log, fmt, read_size, bytes);
-			err = save_err ? save_err : 1;
-			goto bs_strip_backslash_newline_end;
-		}
-		if (!bytes) {
-			if (have_backslash) {
-				buf[0] = '\\';
-				buf[1] = '\0';
-				bs_write(fd_to, buf, 1);
+	while (i < len) {
+		if (ss->have_backslash) {
+			ss->have_backslash = 0;
+			if (buf[i] == '\n') {
+				start = ++i;
+				continue;
 			}
-			goto bs_strip_backslash_newline_end;
-		}
-
-		char c = buf[0];
-		if (have_backslash) {
-			if (c == '\n') {
-				have_backslash = 0;
-				skip = 1;
-			} else {
-				buf[0] = '\\';
-				buf[1] = '\0';
-				bs_write(fd_to, buf, 1);
-				have_backslash = 0;
-				skip = 0;
+			if ((err = bs_stage_emit(st, "\\", 1))) {
+				return err;
 			}
 		}
-		if (c == '\\') {
-			have_backslash = 1;
-		} else if (!skip) {
-			buf[0] = c;
-			buf[1] = '\0';
-			bs_write(fd_to, buf, 1);
+		i += bs_scan(buf + i, len - i, &bs_scan_backslash);
+		if (i == len) {
+			break;
+		}
+		if ((err = bs_stage_emit(st, buf + start, i - start))) {
+			return err;
 		}
+		ss->have_backslash = 1;
+		start = ++i;
 	}
+	return bs_stage_emit(st, buf + start, len - start);
+}
 
-bs_strip_backslash_newline_end:
-	/* done with "fd_from" */
-	Bs_close_fd(fd_from, "strip-backslash-from", log);
+static int bs_strip_finish(struct bs_stage *st)
+{
+	struct bs_strip_stage *ss = (struct bs_strip_stage *)st;
+	if (ss->have_backslash) {
+		ss->have_backslash = 0;
+		int err = bs_stage_emit(st, "\\", 1);
+		if (err) {
+			return err;
+		}
+	}
+	return bs_stage_finish_next(st);
+}
 
-	return err;
+static void bs_strip_stage_init(struct bs_strip_stage *ss, FILE *log)
+{
+	memset(ss, 0x00, sizeof(struct bs_strip_stage));
+	ss->base.feed = bs_strip_feed;
+	ss->base.finish = bs_strip_finish;
+	ss->base.log = log;
 }
 
-int bs_replace_comments(int fd_from, int fd_to, FILE *log)
+enum bs_comment_state {
+	bs_comment_none = 0,
+	bs_comment_slash,
+	bs_comment_line,
+	bs_comment_block,
+	bs_comment_block_star,
+	bs_comment_string,
+	bs_comment_string_escape,
+	bs_comment_char,
+	bs_comment_char_escape
+};
+
+struct bs_comments_stage {
+	struct bs_stage base;
+	enum bs_comment_state state;
+};
+
+static const struct bs_scan_set bs_scan_comment_none =
+Bs_scan_set('/', '"', '\'');
+static const struct bs_scan_set bs_scan_comment_line = Bs_scan_set('\n');
+static const struct bs_scan_set bs_scan_comment_block = Bs_scan_set('*');
+static const struct bs_scan_set bs_scan_comment_string =
+Bs_scan_set('\\', '"', '\n');
+static const struct bs_scan_set bs_scan_comment_char =
+Bs_scan_set('\\', '\'', '\n');
+
+/* the bytes which may change the state, NULL if every byte may */
+static const struct bs_scan_set *bs_comment_scan_set(enum bs_comment_state s)
 {
-	const size_t bufsize = sizeof(size_t) + 1;
-	char buf[sizeof(size_t) + 1];
-	memset(buf, 0x00, bufsize);
+	switch (s) {
+	case bs_comment_none:
+		return &bs_scan_comment_none;
+	case bs_comment_line:
+		return &bs_scan_comment_line;
+	case bs_comment_block:
+		return &bs_scan_comment_block;
+	case bs_comment_string:
+		return &bs_scan_comment_string;
+	case bs_comment_char:
+		return &bs_scan_comment_char;
+	default:
+		return NULL;
+	}
+}
 
-	int have_slash = 0;
-	int have_double_slash = 0;
-	int have_slash_star = 0;
-	int have_slash_star_star = 0;
-	int skip = 0;
+static int bs_comments_feed(struct bs_stage *st, const char *buf, size_t len)
+{
+	struct bs_comments_stage *cs = (struct bs_comments_stage *)st;
 	int err = 0;
+	size_t start = 0;
 
-	while (1) {
-		size_t read_size = 1;
-		ssize_t bytes = bs_read(fd_from, buf, read_size);
-		if (bytes < 0) {
-			const char *fmt = "read(fd, buf, %zu) returned %zd";
-			int save_err = Bs_log_errno(log, fmt, read_size, bytes);
-			err = save_err ? save_err : 1;
-			goto bs_replace_comments_end;
-		}
-		if (!bytes) {
-			if (have_slash) {
-				buf[0] = '/';
-				buf[1] = '\0';
-				bs_write(fd_to, buf, 1);
+	for (size_t i = 0; i < len; ++i) {
+		const struct bs_scan_set *set = bs_comment_scan_set(cs->state);
+		if (set) {
+			i += bs_scan(buf + i, len - i, set);
+			if (i == len) {
+				break;
 			}
-			goto bs_replace_comments_end;
 		}
-
-		char c = buf[0];
-		if (have_slash) {
-			char d;
+		char c = buf[i];
+		switch (cs->state) {
+		case bs_comment_slash:
+			if (c == '/' || c == '*') {
+				/* a comment becomes a single space */
+				err = bs_stage_emit(st, " ", 1);
+				cs->state = (c == '/') ? bs_comment_line
+				    : bs_comment_block;
+				start = i + 1;
+				break;
+			}
+			/* just a slash, then look at this char as usual */
+			err = bs_stage_emit(st, "/", 1);
+			cs->state = bs_comment_none;
+			start = i;
+			if (err) {
+				break;
+			}
+			/* fall through */
+		case bs_comment_none:
 			if (c == '/') {
-				have_double_slash = 1;
-				d = ' ';
-			} else if (c == '*') {
-				have_slash_star = 1;
-				d = ' ';
-			} else {
-				d = '/';
+				err = bs_stage_emit(st, buf + start, i - start);
+				cs->state = bs_comment_slash;
+				start = i + 1;
+			} else if (c == '"') {
+				cs->state = bs_comment_string;
+			} else if (c == '\'') {
+				cs->state = bs_comment_char;
 			}
-			buf[0] = d;
-			buf[1] = '\0';
-			bs_write(fd_to, buf, 1);
-			have_slash = 0;
-		}
-		if (have_double_slash) {
+			break;
+		case bs_comment_line:
 			if (c == '\n') {
-				have_double_slash = 0;
+				cs->state = bs_comment_none;
+				start = i;
+			} else {
+				start = i + 1;
+			}
+			break;
+		case bs_comment_block:
+			if (c == '*') {
+				cs->state = bs_comment_block_star;
 			}
-		} else if (have_slash_star_star) {
+			start = i + 1;
+			break;
+		case bs_comment_block_star:
 			if (c == '/') {
-				have_slash_star_star = 0;
-				skip = 1;
+				cs->state = bs_comment_none;
+			} else if (c != '*') {
+				cs->state = bs_comment_block;
 			}
-		} else if (have_slash_star) {
-			if (c == '*') {
-				have_slash_star = 0;
-				have_slash_star_star = 1;
+			start = i + 1;
+			break;
+		case bs_comment_string:
+			if (c == '\\') {
+				cs->state = bs_comment_string_escape;
+			} else if (c == '"' || c == '\n') {
+				cs->state = bs_comment_none;
 			}
-		} else if (c == '/') {
-			have_slash = 1;
+			break;
+		case bs_comment_string_escape:
+			cs->state = bs_comment_string;
+			break;
+		case bs_comment_char:
+			if (c == '\\') {
+				cs->state = bs_comment_char_escape;
+			} else if (c == '\'' || c == '\n') {
+				cs->state = bs_comment_none;
+			}
+			break;
+		case bs_comment_char_escape:
+			cs->state = bs_comment_char;
+			break;
 		}
-		if (!(skip || have_slash || have_double_slash
-		      || have_slash_star_star || have_slash_star)) {
-			buf[0] = c;
-			buf[1] = '\0';
-			bs_write(fd_to, buf, 1);
+		if (err) {
+			return err;
 		}
-		skip = 0;
 	}
 
-bs_replace_comments_end:
-	/* done with "fd_from" */
-	Bs_close_fd(fd_from, "replace-comments-in", log);
+	switch (cs->state) {
+	case bs_comment_slash:
+	case bs_comment_line:
+	case bs_comment_block:
+	case bs_comment_block_star:
+		return 0;
+	default:
+		return bs_stage_emit(st, buf + start, len - start);
+	}
+}
 
-	return err;
+static int bs_comments_finish(struct bs_stage *st)
+{
+	struct bs_comments_stage *cs = (struct bs_comments_stage *)st;
+	if (cs->state == bs_comment_slash) {
+		int err = bs_stage_emit(st, "/", 1);
+		if (err) {
+			return err;
+		}
+	}
+	cs->state = bs_comment_none;
+	return bs_stage_finish_next(st);
+}
+
+static void bs_comments_stage_init(struct bs_comments_stage *cs, FILE *log)
+{
+	memset(cs, 0x00, sizeof(struct bs_comments_stage));
+	cs->base.feed = bs_comments_feed;
+	cs->base.finish = bs_comments_finish;
+	cs->base.log = log;
 }
 
 int bs_include(int fdout, char *buf, size_t bufsize, size_t offset, FILE *log);
 
+static int bs_include_to(struct bs_writer *out, char *buf, size_t offset,
+			 FILE *log);
+
+/* the fewest clean bytes at the end of an include worth copying as is */
+#ifndef BS_CLEAN_MIN
+#define BS_CLEAN_MIN (4 * 1024)
+#endif
+
+/* each level of #if nesting, the innermost is the last */
+enum bs_cond_state {
+	bs_cond_taking = 0,	/* in the group being taken */
+	bs_cond_seeking,	/* none taken yet, an #elif or #else may be */
+	bs_cond_done		/* a group was taken, or the whole is skipped */
+};
+
+struct bs_cond {
+	unsigned char state;
+	unsigned char had_else;
+};
+
+/*
+ * The directive lines of a unit are kept in an arena of the thread: the
+ * line of a stage is allocated when it starts, is started over for each
+ * directive by moving back its cursor, and is moved to twice the space
+ * if it outgrows it; so there is no longest line. Nested includes take
+ * their lines from above the line of the includer, and give them back as
+ * they finish; the outermost gives back the arena.
+ */
+static _Thread_local struct bs_arena bs_line_arena;
+
+#ifndef BS_LINE_BUF_SIZE
+#define BS_LINE_BUF_SIZE 256
+#endif
+
+/* NUL terminated */
+struct bs_line_buf {
+	struct bs_arena_mark mark;	/* the arena before the line */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int bs_line_open(struct bs_line_buf *line, FILE *log)
+{
+	memset(line, 0x00, sizeof(struct bs_line_buf));
+	bs_arena_mark(&bs_line_arena, &line->mark);
+	line->buf = bs_arena_alloc(&bs_line_arena, BS_LINE_BUF_SIZE);
+	if (!line->buf) {
+		int save_err = Bs_log_errno(log, "line of %zu bytes failed",
+					    (size_t)BS_LINE_BUF_SIZE);
+		return save_err ? save_err : 1;
+	}
+	line->size = BS_LINE_BUF_SIZE;
+	line->buf[0] = '\0';
+	return 0;
+}
+
+static int bs_line_push(struct bs_line_buf *line, char c, FILE *log)
+{
+	if (line->len + 1 >= line->size) {
+		size_t size = 2 * line->size;
+		char *buf = bs_arena_alloc(&bs_line_arena, size);
+		if (!buf) {
+			int save_err = Bs_log_errno(log, "line of %zu bytes"
+						    " failed", size);
+			return save_err ? save_err : 1;
+		}
+		memcpy(buf, line->buf, line->len);
+		line->buf = buf;
+		line->size = size;
+	}
+	line->buf[line->len++] = c;
+	line->buf[line->len] = '\0';
+	return 0;
+}
+
+static void bs_line_reset(struct bs_line_buf *line)
+{
+	line->len = 0;
+	line->buf[0] = '\0';
+}
+
+/* gives back what was taken after "mark", all of it if it was empty */
+static void bs_line_arena_rewind(struct bs_arena_mark *mark)
+{
+	if (mark->head) {
+		bs_arena_rewind(&bs_line_arena, mark);
+	} else {
+		bs_arena_release(&bs_line_arena);
+	}
+}
+
+static void bs_line_close(struct bs_line_buf *line)
+{
+	if (!line->buf) {
+		return;
+	}
+	bs_line_arena_rewind(&line->mark);
+	memset(line, 0x00, sizeof(struct bs_line_buf));
+}
+
 struct bs_directive_state {
+	struct bs_stage base;
 	char c;
-	char *directive;
-	size_t directive_size;
-	size_t pos;
+	struct bs_line_buf directive;
 	int is_preproc;
 	int may_be_pre_proc_line;
-	int fd_to;
+	char *line;		/* a text line split across feeds */
+	size_t line_len;
+	size_t line_size;
+	size_t newlines;	/* spread over by the invocation in line */
+	struct bs_token_stream tokens;	/* of the text line being expanded */
+	struct bs_cond *cond;
+	size_t cond_len;
+	size_t cond_size;
 };
 
+static int bs_directives_skipping(struct bs_directive_state *ds)
+{
+	return ds->cond_len && ds->cond[ds->cond_len - 1].state
+	    != bs_cond_taking;
+}
+
+/* "args" is set to where the arguments after the directive's name start */
+static int bs_directive_is(const char *directive, size_t len,
+			   const char *name, size_t *args)
+{
+	size_t i = 0;
+	while (i < len && (directive[i] == ' ' || directive[i] == '\t')) {
+		++i;
+	}
+	size_t name_len = strlen(name);
+	if (len - i < name_len || memcmp(directive + i, name, name_len)) {
+		return 0;
+	}
+	i += name_len;
+	if (i < len && (isalnum((unsigned char)directive[i])
+			|| directive[i] == '_')) {
+		return 0;
+	}
+	*args = i;
+	return 1;
+}
+
+static int bs_cond_push(struct bs_directive_state *ds, unsigned char state)
+{
+	if (ds->cond_len == ds->cond_size) {
+		size_t size = ds->cond_size ? ds->cond_size * 2 : 16;
+		size_t bytes = size * sizeof(struct bs_cond);
+		struct bs_cond *cond = bs_malloc(bytes);
+		if (!cond) {
+			const char *fmt = "malloc(%zu) failed";
+			int save_err = Bs_log_errno(ds->base.log, fmt, bytes);
+			return save_err ? save_err : 1;
+		}
+		if (ds->cond_len) {
+			memcpy(cond, ds->cond,
+			       ds->cond_len * sizeof(struct bs_cond));
+		}
+		bs_free(ds->cond);
+		ds->cond = cond;
+		ds->cond_size = size;
+	}
+	ds->cond[ds->cond_len].state = state;
+	ds->cond[ds->cond_len].had_else = 0;
+	++ds->cond_len;
+	return 0;
+}
+
+/* the condition of an #if, #ifdef, #ifndef, or any #elif */
+static int bs_cond_eval(const char *kind, const char *args, size_t len,
+			int *value, FILE *log)
+{
+	if (strcmp(kind, "if") && strcmp(kind, "elif")) {
+		size_t i = 0;
+		while (i < len && (args[i] == ' ' || args[i] == '\t')) {
+			++i;
+		}
+		size_t start = i;
+		while (i < len && (isalnum((unsigned char)args[i])
+				   || args[i] == '_')) {
+			++i;
+		}
+		if (i == start || isdigit((unsigned char)args[start])) {
+			Bs_log_error(log, "#%s without a macro name", kind);
+			return EINVAL;
+		}
+		int defined = bs_macro_find(args + start, i - start) != NULL;
+		*value = strstr(kind, "ndef") ? !defined : defined;
+		return 0;
+	}
+
+	long long result = 0;
+	if (bs_expr_if(args, len, &result, log)) {
+		Bs_log_error(log, "bad #%s '%.*s'", kind, (int)len, args);
+		return EINVAL;
+	}
+	*value = (result != 0);
+	return 0;
+}
+
+/*
+ * Handles the conditional directives, setting *handled, or leaves
+ * *handled zero for any other directive.
+ */
+static int bs_handle_conditional(struct bs_directive_state *ds,
+				 const char *directive, size_t len,
+				 int *handled, FILE *log)
+{
+	static const char *const opens[] = { "if", "ifdef", "ifndef", NULL };
+	static const char *const elifs[] = {
+		"elif", "elifdef", "elifndef", NULL
+	};
+	size_t args = 0;
+	int value = 0;
+	int err = 0;
+	struct bs_cond *top = ds->cond_len ? ds->cond + ds->cond_len - 1
+	    : NULL;
+
+	*handled = 1;
+	for (size_t i = 0; opens[i]; ++i) {
+		if (!bs_directive_is(directive, len, opens[i], &args)) {
+			continue;
+		}
+		if (bs_directives_skipping(ds)) {
+			/* nested in a skipped group, only its #endif matters */
+			return bs_cond_push(ds, bs_cond_done);
+		}
+		err = bs_cond_eval(opens[i], directive + args, len - args,
+				   &value, log);
+		if (err) {
+			return err;
+		}
+		return bs_cond_push(ds, value ? bs_cond_taking
+				    : bs_cond_seeking);
+	}
+	for (size_t i = 0; elifs[i]; ++i) {
+		if (!bs_directive_is(directive, len, elifs[i], &args)) {
+			continue;
+		}
+		if (!top || top->had_else) {
+			Bs_log_error(log, "#%s %s", elifs[i],
+				     top ? "after #else" : "without #if");
+			return EINVAL;
+		}
+		if (top->state == bs_cond_taking) {
+			top->state = bs_cond_done;
+		} else if (top->state == bs_cond_seeking) {
+			err = bs_cond_eval(elifs[i], directive + args,
+					   len - args, &value, log);
+			top->state = value ? bs_cond_taking : bs_cond_seeking;
+		}
+		return err;
+	}
+	if (bs_directive_is(directive, len, "else", &args)) {
+		if (!top || top->had_else) {
+			Bs_log_error(log, "#else %s",
+				     top ? "after #else" : "without #if");
+			return EINVAL;
+		}
+		top->had_else = 1;
+		top->state = (top->state == bs_cond_seeking) ? bs_cond_taking
+		    : bs_cond_done;
+		return 0;
+	}
+	if (bs_directive_is(directive, len, "endif", &args)) {
+		if (!top) {
+			Bs_log_error(log, "#endif without #if");
+			return EINVAL;
+		}
+		--ds->cond_len;
+		return 0;
+	}
+	*handled = 0;
+	return 0;
+}
+
 static int bs_handle_directive(struct bs_directive_state *ds, FILE *log)
 {
 	int err = 0;
+	struct bs_writer *out = ds->base.out;
 	if (ds->c == '\n') {
-		size_t offset = 8;	// TODO
+		size_t offset = 0;
+		char *directive = ds->directive.buf;
+		size_t len = ds->directive.len;
+		int handled = 0;
 
-		if (strncmp("include", ds->directive, 7) == 0) {
-			err =
-			    bs_include(ds->fd_to, ds->directive,
-				       ds->directive_size, offset, log);
+		err = bs_handle_conditional(ds, directive, len, &handled, log);
+		if (err) {
+			goto bs_handle_directive_end;
+		}
+		if (handled || bs_directives_skipping(ds)) {
+			/* only the line is left of it */
+		} else if (bs_directive_is(directive, len, "include",
+					   &offset)) {
+			/* the nested include writes on after this file */
+			err = bs_include_to(out, directive, offset, log);
 			const char *fmt =
 			    "bs_include err: %d from '%s', offset %zu\n";
 			if (err) {
-				Bs_log_error(log, fmt, err, ds->directive,
-					     offset);
+				Bs_log_error(log, fmt, err, directive, offset);
+				goto bs_handle_directive_end;
+			}
+		} else if (bs_directive_is(directive, len, "define", &offset)) {
+			err = bs_macro_define_directive(directive + offset,
+							len - offset, log);
+			if (err) {
+				goto bs_handle_directive_end;
+			}
+		} else if (bs_directive_is(directive, len, "undef", &offset)) {
+			err = bs_macro_undef_directive(directive + offset,
+						       len - offset, log);
+			if (err) {
 				goto bs_handle_directive_end;
 			}
 		} else {
 			// un-handled directive ...
-			bs_write(ds->fd_to, "#", 1);
-			bs_write(ds->fd_to, ds->directive, ds->pos);
+			bs_writer_putc(out, '#');
+			bs_writer_write(out, directive, len);
 		}
-		bs_write(ds->fd_to, "\n", 1);
+		bs_writer_putc(out, '\n');
 		ds->is_preproc = 0;
 		ds->may_be_pre_proc_line = 1;
-		memset(ds->directive, 0x00, ds->directive_size);
-		ds->pos = 0;
+		bs_line_reset(&ds->directive);
 	} else {
-		if (ds->pos >= ds->directive_size) {
-			err = 1;
-			goto bs_handle_directive_end;
-		}
-		if (ds->c == ' ' || ds->c == '\t') {
-			if (!ds->pos || ds->directive[ds->pos] != ' ') {
-				ds->directive[ds->pos++] = ds->c;
-			}
-
-		} else {
-			ds->directive[ds->pos++] = ds->c;
-		}
+		err = bs_line_push(&ds->directive, ds->c, log);
 	}
 bs_handle_directive_end:
 	return err;
 }
 
-int bs_replace_directives(int fd_from, int fd_to, FILE *log)
+static int bs_directives_line_append(struct bs_directive_state *ds,
+				     const char *text, size_t len)
 {
-	const size_t bufsize = sizeof(size_t) + 1;
-	char buf[sizeof(size_t) + 1];
-	memset(buf, 0x00, bufsize);
+	if (ds->line_len + len > ds->line_size) {
+		size_t size = ds->line_size ? ds->line_size : 256;
+		while (ds->line_len + len > size) {
+			size *= 2;
+		}
+		char *line = bs_malloc(size);
+		if (!line) {
+			int save_err = Bs_log_errno(ds->base.log,
+						    "malloc(%zu) failed", size);
+			return save_err ? save_err : 1;
+		}
+		memcpy(line, ds->line, ds->line_len);
+		bs_free(ds->line);
+		ds->line = line;
+		ds->line_size = size;
+	}
+	memcpy(ds->line + ds->line_len, text, len);
+	ds->line_len += len;
+	return 0;
+}
 
-	struct bs_directive_state directive_state;
-	struct bs_directive_state *ds = &directive_state;
-	memset(ds, 0x00, sizeof(struct bs_directive_state));
+/*
+ * Macros are expanded a whole line at a time, or more than one line when
+ * the arguments of an invocation go on past the end of the line. A line
+ * is lexed once, into ds->tokens, which the expansion then works from.
+ */
+static int bs_directives_expand(struct bs_directive_state *ds,
+				const char *text, size_t len, int final,
+				size_t *consumed)
+{
+	int err = bs_stream_lex(&ds->tokens, text, len);
+	if (err) {
+		const char *fmt = "lexing %zu bytes failed";
+		Bs_log_error(ds->base.log, fmt, len);
+		return err;
+	}
+	return bs_macro_expand(&ds->tokens, final, consumed, &ds->newlines,
+			       ds->base.out, ds->base.log);
+}
 
-	int err = 0;
+static int bs_directives_text(struct bs_directive_state *ds, const char *text,
+			      size_t len, int eol)
+{
+	struct bs_writer *out = ds->base.out;
+	if (!ds->line_len && !bs_macro_count()) {
+		return bs_writer_write(out, text, len);
+	}
+	if (!eol || ds->line_len) {
+		int err = bs_directives_line_append(ds, text, len);
+		if (err || !eol) {
+			return err;
+		}
+		text = ds->line;
+		len = ds->line_len;
+	}
 
-	ds->fd_to = fd_to;
-	ds->may_be_pre_proc_line = 1;
+	size_t consumed = 0;
+	int err = bs_directives_expand(ds, text, len, 0, &consumed);
+	if (text == ds->line) {
+		memmove(ds->line, ds->line + consumed, len - consumed);
+		ds->line_len = len - consumed;
+	} else if (!err && consumed < len) {
+		err = bs_directives_line_append(ds, text + consumed,
+						len - consumed);
+	}
+	return err;
+}
 
-	const size_t longest_line_we_tollerate = 1000 + (2 * PATH_MAX);
-	ds->directive_size = longest_line_we_tollerate;
-	ds->directive = bs_malloc(ds->directive_size);
-	if (!ds->directive) {
-		const char *fmt = "malloc(%zu) failed";
-		int save_err = Bs_log_errno(log, fmt, ds->directive_size);
-		err = save_err ? save_err : 1;
-		goto bs_replace_directives_end;
+/* no more text is coming for an invocation still waiting for it */
+static int bs_directives_text_end(struct bs_directive_state *ds)
+{
+	if (!ds->line_len) {
+		return 0;
+	}
+	size_t len = ds->line_len;
+	size_t consumed = 0;
+	ds->line_len = 0;
+	return bs_directives_expand(ds, ds->line, len, 1, &consumed);
+}
+
+/* whitespace between lines goes after a waiting invocation, if any */
+static int bs_directives_putc(struct bs_directive_state *ds, char c)
+{
+	if (ds->line_len) {
+		return bs_directives_line_append(ds, &c, 1);
 	}
-	memset(ds->directive, 0x00, ds->directive_size);
-	ds->pos = 0;
+	return bs_writer_putc(ds->base.out, c);
+}
 
-	while (1) {
-		size_t read_size = 1;
-		ssize_t bytes = bs_read(fd_from, buf, read_size);
-		if (bytes < 0) {
-			const char *fmt = "read(fd, buf, %zu) returned %zd";
-			int save_err = Bs_log_errno(log, fmt, read_size, bytes);
-			err = save_err ? save_err : 1;
-			goto bs_replace_directives_end;
+/*
+ * In a group being skipped, only a '#' at the start of a line matters:
+ * the rest of each line is passed over with memchr, and just its newline
+ * is written. Returns where the next directive's '#' is, or "len".
+ */
+static size_t bs_directives_skip(struct bs_directive_state *ds,
+				 const char *buf, size_t i, size_t len)
+{
+	struct bs_writer *out = ds->base.out;
+	while (i < len) {
+		if (ds->may_be_pre_proc_line) {
+			char c = buf[i];
+			if (c == '#') {
+				return i;
+			}
+			if (c == ' ' || c == '\t') {
+				++i;
+				continue;
+			}
+			ds->may_be_pre_proc_line = 0;
 		}
-		if (!bytes) {
-			goto bs_replace_directives_end;
+		const char *eol = memchr(buf + i, '\n', len - i);
+		if (!eol) {
+			return len;
 		}
-		ds->c = buf[0];
-		char c = ds->c;
+		bs_writer_putc(out, '\n');
+		ds->may_be_pre_proc_line = 1;
+		i = (size_t)(eol - buf) + 1;
+	}
+	return len;
+}
+
+static int bs_directives_feed(struct bs_stage *st, const char *buf,
+			      size_t len)
+{
+	struct bs_directive_state *ds = (struct bs_directive_state *)st;
+	struct bs_writer *out = st->out;
+	int err = 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		char c = buf[i];
+		ds->c = c;
 		if (ds->is_preproc) {
-			err = bs_handle_directive(ds, log);
+			err = bs_handle_directive(ds, st->log);
 			if (err) {
-				goto bs_replace_directives_end;
+				return err;
 			}
+		} else if (bs_directives_skipping(ds)
+			   && (c != '#' || !ds->may_be_pre_proc_line)) {
+			/* to just before the '#' */
+			i = bs_directives_skip(ds, buf, i, len) - 1;
 		} else if (!ds->may_be_pre_proc_line) {
-			bs_write(fd_to, buf, 1);
-			if (c == '\n') {
+			/* plain text through the end of the line */
+			const char *eol = memchr(buf + i, '\n', len - i);
+			size_t end = eol ? (size_t)(eol - buf) + 1 : len;
+			err = bs_directives_text(ds, buf + i, end - i, !!eol);
+			if (err) {
+				return err;
+			}
+			if (eol) {
 				ds->may_be_pre_proc_line = 1;
 			}
+			i = end - 1;
+		} else if (c == '\n') {
+			err = bs_directives_putc(ds, c);
 		} else if ((c != ' ') && (c != '\t') && (c != '#')) {
-			bs_write(ds->fd_to, buf, 1);
+			/* plain text, starting with this char */
 			ds->may_be_pre_proc_line = 0;
+			--i;
 		} else if (c == '#') {
+			err = bs_directives_text_end(ds);
 			ds->is_preproc = 1;
-			memset(ds->directive, 0x00, ds->directive_size);
-			ds->pos = 0;
+			bs_line_reset(&ds->directive);
 		} else {
-			bs_write(fd_to, buf, 1);
+			err = bs_directives_putc(ds, c);
+		}
+		if (err) {
+			return err;
 		}
 	}
+	return out->err;
+}
 
+static int bs_directives_finish(struct bs_stage *st)
+{
+	struct bs_directive_state *ds = (struct bs_directive_state *)st;
 	// TODO deal with dangling preproc line without EOL
+	int err = bs_directives_text_end(ds);
+	if (!err && ds->cond_len) {
+		Bs_log_error(st->log, "unterminated #if, %zu deep",
+			     ds->cond_len);
+		err = EINVAL;
+	}
+	return err ? err : st->out->err;
+}
+
+static void bs_directives_release(struct bs_stage *st)
+{
+	struct bs_directive_state *ds = (struct bs_directive_state *)st;
+	bs_line_close(&ds->directive);
+	bs_free(ds->line);
+	ds->line = NULL;
+	bs_free(ds->cond);
+	ds->cond = NULL;
+	bs_stream_release(&ds->tokens);
+}
+
+static int bs_directives_stage_init(struct bs_directive_state *ds, FILE *log)
+{
+	memset(ds, 0x00, sizeof(struct bs_directive_state));
+	ds->base.feed = bs_directives_feed;
+	ds->base.finish = bs_directives_finish;
+	ds->base.release = bs_directives_release;
+	ds->base.log = log;
+	ds->may_be_pre_proc_line = 1;
+	return bs_line_open(&ds->directive, log);
+}
+
+/* feed everything from fd_from through the chain starting at "first" */
+static int bs_run_stages(struct bs_stage *first, int fd_from,
+			 struct bs_writer *out, FILE *log)
+{
+	char inbuf[BS_IO_BUFSIZE];
+	struct bs_reader reader;
+	bs_reader_init(&reader, fd_from, inbuf, BS_IO_BUFSIZE, log);
+
+	/* regular files are scanned in place, pipes are streamed */
+	bs_reader_map(&reader);
 
-bs_replace_directives_end:
-	bs_free(ds->directive);
-	ds->directive = NULL;
+	/* the chain which walks the includes reads them ahead, by chunk */
+	struct bs_stage *last = first;
+	while (last->next) {
+		last = last->next;
+	}
+	int walks = (last->feed == bs_directives_feed);
+
+	int err = 0;
+	ssize_t bytes;
+	while ((bytes = bs_reader_fill(&reader)) > 0) {
+		if (walks) {
+			bs_prefetch_includes(reader.buf, reader.len);
+		}
+		err = first->feed(first, reader.buf, reader.len);
+		if (err) {
+			goto bs_run_stages_end;
+		}
+	}
+	if (bytes < 0) {
+		err = reader.err;
+		goto bs_run_stages_end;
+	}
+	err = first->finish(first);
+	if (bs_writer_flush(out) && !err) {
+		err = out->err;
+	}
+
+bs_run_stages_end:
+	if (out->behind) {
+		/* still writing from buffers on our callers' stacks */
+		bs_writer_flush(out);
+	}
+	bs_reader_unmap(&reader);
+	return err;
+}
+
+/* run a single stage as a bs_pipe_function */
+static int bs_pipe_stage(struct bs_stage *st, int fd_from, int fd_to,
+			 const char *name, FILE *log)
+{
+	char outbuf[BS_IO_BUFSIZE];
+	struct bs_writer writer;
+	bs_writer_init(&writer, fd_to, outbuf, BS_IO_BUFSIZE, log);
+	st->out = &writer;
+
+	int err = bs_run_stages(st, fd_from, &writer, log);
 
 	/* done with "fd_from" */
-	Bs_close_fd(fd_from, "replace-directives-from", log);
+	Bs_close_fd(fd_from, name, log);
 
 	return err;
 }
 
-int bs_include(int fdout, char *buf, size_t bufsize, size_t offset, FILE *log)
+int bs_strip_backslash_newline(int fd_from, int fd_to, FILE *log)
 {
-	assert(offset < bufsize);
-	(void)bufsize;
+	struct bs_strip_stage ss;
+	bs_strip_stage_init(&ss, log);
+	return bs_pipe_stage(&ss.base, fd_from, fd_to, "strip-backslash-from",
+			     log);
+}
+
+int bs_replace_comments(int fd_from, int fd_to, FILE *log)
+{
+	struct bs_comments_stage cs;
+	bs_comments_stage_init(&cs, log);
+	return bs_pipe_stage(&cs.base, fd_from, fd_to, "replace-comments-in",
+			     log);
+}
+
+/* the "from" of the unit, for its stage, which is not on the caller's thread */
+static const char *bs_pipes_from;
+
+int bs_replace_directives(int fd_from, int fd_to, FILE *log)
+{
+	struct bs_directive_state ds;
+	int err = bs_directives_stage_init(&ds, log);
+	if (err) {
+		Bs_close_fd(fd_from, "replace-directives-from", log);
+		return err;
+	}
+	const char *outer = bs_search_set_from(bs_pipes_from);
+	err = bs_pipe_stage(&ds.base, fd_from, fd_to,
+			    "replace-directives-from", log);
+	bs_search_set_from(outer);
+	bs_directives_release(&ds.base);
+	return err;
+}
+
+int bs_c_pre_proc_fused(int fdin, int fdout, FILE *log)
+{
+	char outbuf[BS_IO_BUFSIZE];
+	struct bs_writer writer;
+	bs_writer_init(&writer, fdout, outbuf, BS_IO_BUFSIZE, log);
+
+	struct bs_strip_stage ss;
+	struct bs_comments_stage cs;
+	struct bs_directive_state ds;
+	bs_strip_stage_init(&ss, log);
+	bs_comments_stage_init(&cs, log);
+	int err = bs_directives_stage_init(&ds, log);
+	if (err) {
+		goto bs_c_pre_proc_fused_end;
+	}
+	ss.base.next = &cs.base;
+	cs.base.next = &ds.base;
+	ds.base.out = &writer;
+
+	err = bs_run_stages(&ss.base, fdin, &writer, log);
+
+	bs_directives_release(&ds.base);
+
+bs_c_pre_proc_fused_end:
+	/* done with "fdin" */
+	Bs_close_fd(fdin, "fused-in", log);
+
+	return err;
+}
+
+/*
+ * Processed output of each included file, replayed when the same file is
+ * included again. An entry is only used while the file still has the
+ * same identity: device, inode, size, mtime and ctime, and while the
+ * macros, and the "#pragma once" files already included, are the same as
+ * when it was processed. Files which change the macros are not kept, as
+ * replaying the output would not.
+ *
+ * As the versions name the state rather than a point in one translation
+ * unit, the cache is shared by the threads of a batch, and kept between
+ * the translation units. An entry being replayed is counted in "refs", so
+ * it is not freed from under its reader when replaced.
+ */
+struct bs_include_cache_entry {
+	struct bs_include_cache_entry *next;
+	unsigned long long hash;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	unsigned long long macro_version;
+	unsigned long long once_version;
+	char *output;		/* from bs_malloc, may be NULL if empty */
+	size_t output_len;
+	char *deps;		/* the headers it includes, see bs-deps.h */
+	size_t deps_len;
+	size_t refs;
+	int linked;		/* still in the cache */
+};
+
+#define BS_INCLUDE_CACHE_BUCKETS 1024
+
+static struct bs_include_cache_entry
+*bs_include_cache[BS_INCLUDE_CACHE_BUCKETS];
+static pthread_mutex_t bs_include_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The "#pragma once" files this translation unit has included so far, an
+ * open addressing set of guard entries: unlike the guard table, which is
+ * shared by the threads of a batch, this is per translation unit.
+ */
+struct bs_once_set {
+	const struct bs_guard_entry **slots;
+	size_t capacity;	/* a power of two */
+	size_t count;
+	unsigned long long version;	/* as bs_macro_version() */
+};
 
+static _Thread_local struct bs_once_set bs_once;
+
+static unsigned long long bs_include_cache_hash(const char *path,
+						const struct stat *st)
+{
+	unsigned long long hash = BS_FNV1A_INIT;
+	hash = bs_fnv1a(hash, path, strlen(path));
+	hash = bs_fnv1a(hash, &st->st_dev, sizeof(st->st_dev));
+	hash = bs_fnv1a(hash, &st->st_ino, sizeof(st->st_ino));
+	return hash;
+}
+
+static int bs_timespec_eq(struct timespec a, struct timespec b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static int bs_include_cache_same_file(const struct bs_include_cache_entry *e,
+				      const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino
+	    && e->size == st->st_size && bs_timespec_eq(e->mtime, st->st_mtim)
+	    && bs_timespec_eq(e->ctime, st->st_ctim);
+}
+
+static void bs_include_cache_entry_free(struct bs_include_cache_entry *e)
+{
+	bs_free(e->output);
+	bs_free(e->deps);
+	bs_free(e->path);
+	bs_free(e);
+}
+
+/* called with the mutex held */
+static void bs_include_cache_unlink(struct bs_include_cache_entry **pos)
+{
+	struct bs_include_cache_entry *e = *pos;
+	*pos = e->next;
+	e->linked = 0;
+	if (!e->refs) {
+		bs_include_cache_entry_free(e);
+	}
+}
+
+/* a found entry is to be given back with bs_include_cache_release() */
+static struct bs_include_cache_entry *bs_include_cache_find(const char *path,
+							    const struct stat
+							    *st)
+{
+	unsigned long long hash = bs_include_cache_hash(path, st);
+	unsigned long long macro_version = bs_macro_version();
+	struct bs_include_cache_entry *e;
+	pthread_mutex_lock(&bs_include_cache_mutex);
+	e = bs_include_cache[hash % BS_INCLUDE_CACHE_BUCKETS];
+	for (; e; e = e->next) {
+		if (e->hash == hash && bs_include_cache_same_file(e, st)
+		    && e->macro_version == macro_version
+		    && e->once_version == bs_once.version
+		    && strcmp(e->path, path) == 0) {
+			++e->refs;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bs_include_cache_mutex);
+	return e;
+}
+
+static void bs_include_cache_release(struct bs_include_cache_entry *e)
+{
+	pthread_mutex_lock(&bs_include_cache_mutex);
+	if (!--e->refs && !e->linked) {
+		bs_include_cache_entry_free(e);
+	}
+	pthread_mutex_unlock(&bs_include_cache_mutex);
+}
+
+/* takes ownership of "output" and of "deps", both from bs_malloc */
+static void bs_include_cache_store(const char *path, const struct stat *st,
+				   char *output, size_t output_len,
+				   char *deps, size_t deps_len)
+{
+	size_t path_size = strlen(path) + 1;
+	struct bs_include_cache_entry *e;
+	e = bs_malloc(sizeof(struct bs_include_cache_entry));
+	char *path_copy = bs_malloc(path_size);
+	if (!e || !path_copy) {
+		bs_free(e);
+		bs_free(path_copy);
+		bs_free(deps);
+		bs_free(output);
+		return;
+	}
+	memcpy(path_copy, path, path_size);
+
+	e->hash = bs_include_cache_hash(path, st);
+	e->path = path_copy;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+	e->macro_version = bs_macro_version();
+	e->once_version = bs_once.version;
+	e->output = output;
+	e->output_len = output_len;
+	e->deps = deps;
+	e->deps_len = deps_len;
+	e->refs = 0;
+	e->linked = 1;
+
+	size_t bucket = e->hash % BS_INCLUDE_CACHE_BUCKETS;
+	pthread_mutex_lock(&bs_include_cache_mutex);
+	struct bs_include_cache_entry **pos = bs_include_cache + bucket;
+	while (*pos) {
+		struct bs_include_cache_entry *old = *pos;
+		if (old->hash != e->hash || strcmp(old->path, path) != 0) {
+			pos = &old->next;
+		} else if (!bs_include_cache_same_file(old, st)) {
+			/* the output of an older version of the file */
+			bs_include_cache_unlink(pos);
+		} else if (old->macro_version == e->macro_version
+			   && old->once_version == e->once_version) {
+			/* another thread processed it at the same time */
+			e->linked = 0;
+			break;
+		} else {
+			pos = &old->next;
+		}
+	}
+	if (e->linked) {
+		e->next = bs_include_cache[bucket];
+		bs_include_cache[bucket] = e;
+	}
+	pthread_mutex_unlock(&bs_include_cache_mutex);
+	if (!e->linked) {
+		bs_include_cache_entry_free(e);
+	}
+}
+
+static void bs_include_cache_drop(void)
+{
+	pthread_mutex_lock(&bs_include_cache_mutex);
+	for (size_t i = 0; i < BS_INCLUDE_CACHE_BUCKETS; ++i) {
+		while (bs_include_cache[i]) {
+			bs_include_cache_unlink(bs_include_cache + i);
+		}
+	}
+	pthread_mutex_unlock(&bs_include_cache_mutex);
+}
+
+static size_t bs_once_slot(const struct bs_once_set *set,
+			   const struct bs_guard_entry *guard)
+{
+	size_t mask = set->capacity - 1;
+	size_t i = (size_t)(guard->hash & mask);
+	while (set->slots[i] && set->slots[i] != guard) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static int bs_once_has(const struct bs_guard_entry *guard)
+{
+	return bs_once.count && bs_once.slots[bs_once_slot(&bs_once, guard)];
+}
+
+/* if out of memory, the file is simply included again */
+static void bs_once_add(const struct bs_guard_entry *guard)
+{
+	if ((bs_once.count + 1) * 2 > bs_once.capacity) {
+		struct bs_once_set grown = { NULL, 0, 0, bs_once.version };
+		grown.capacity = bs_once.capacity ? bs_once.capacity * 2 : 64;
+		size_t size = grown.capacity * sizeof(grown.slots[0]);
+		grown.slots = bs_malloc(size);
+		if (!grown.slots) {
+			return;
+		}
+		memset(grown.slots, 0x00, size);
+		for (size_t i = 0; i < bs_once.capacity; ++i) {
+			const struct bs_guard_entry *g = bs_once.slots[i];
+			if (g) {
+				grown.slots[bs_once_slot(&grown, g)] = g;
+				++grown.count;
+			}
+		}
+		bs_free(bs_once.slots);
+		bs_once = grown;
+	}
+	size_t i = bs_once_slot(&bs_once, guard);
+	if (!bs_once.slots[i]) {
+		bs_once.slots[i] = guard;
+		++bs_once.count;
+		bs_once.version ^= bs_hash_mix(guard->hash);
+	}
+}
+
+static void bs_once_clear(void)
+{
+	bs_free(bs_once.slots);
+	memset(&bs_once, 0x00, sizeof(struct bs_once_set));
+}
+
+void bs_translation_unit_reset(void)
+{
+	bs_macro_table_clear();
+	bs_once_clear();
+	bs_deps_reset();
+}
+
+void bs_thread_release(void)
+{
+	bs_translation_unit_reset();
+	bs_expr_cache_clear();
+}
+
+void bs_include_cache_clear(void)
+{
+	bs_once_clear();
+	bs_include_cache_drop();
+	bs_guard_table_clear();
+	bs_search_cache_clear();
+}
+
+static int bs_guard_macro_defined(const struct bs_guard_entry *guard)
+{
+	return bs_macro_find(guard->macro, guard->macro_len) != NULL;
+}
+
+static int bs_guard_skip(const char *path, const struct stat *st)
+{
+	struct bs_guard_entry *guard = bs_guard_find(path, st);
+	if (!guard) {
+		return 0;
+	}
+	switch (guard->kind) {
+	case bs_guard_once:
+		return bs_once_has(guard);
+	case bs_guard_macro:
+		return bs_guard_macro_defined(guard);
+	case bs_guard_none:
+		break;
+	}
+	return 0;
+}
+
+/* look over the unprocessed file once, to know if later includes can skip */
+static struct bs_guard_entry *bs_guard_scan(const char *path,
+					    const char *text,
+					    const struct stat *st)
+{
+	struct bs_guard_entry *scanned = bs_guard_find(path, st);
+	if (scanned) {
+		return scanned;
+	}
+
+	enum bs_guard_kind kind = bs_guard_none;
+	const char *macro = NULL;
+	size_t macro_len = 0;
+	size_t len = (size_t)st->st_size;
+	if (len) {
+		kind = bs_guard_detect(text, len, &macro, &macro_len);
+	}
+	off_t clean_from = (off_t)(len ? bs_guard_clean_from(text, len) : 0);
+	bs_guard_record(path, st, kind, macro, macro_len, clean_from);
+	return bs_guard_find(path, st);
+}
+
+/* if any identifier in "text" is a macro, it would not come out as is */
+static int bs_text_has_macro(const char *text, size_t len)
+{
+	if (!bs_macro_count()) {
+		return 0;
+	}
+	for (size_t i = 0; i < len;) {
+		if (!isalnum((unsigned char)text[i]) && text[i] != '_') {
+			++i;
+			continue;
+		}
+		size_t start = i;
+		while (i < len && (isalnum((unsigned char)text[i])
+				   || text[i] == '_')) {
+			++i;
+		}
+		/* a number is not looked up, the rest of a pp-number is */
+		if (!isdigit((unsigned char)text[start])
+		    && bs_macro_find(text + start, i - start)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Nested includes are an input stack on the thread of the includer's
+ * directives stage, so that the #defines of a header are seen after it:
+ * each #include pushes a frame of strip, comments and directives state
+ * onto the line arena, feeds it the mapped file, and pops it again. All
+ * of the frames write into the writer of the outermost file, and no
+ * level keeps a process, a pipe or an fd of its own, so how deep the
+ * includes go costs neither; BS_INCLUDE_DEPTH_MAX stops a header which
+ * includes itself without a guard.
+ */
+#ifndef BS_INCLUDE_DEPTH_MAX
+#define BS_INCLUDE_DEPTH_MAX 200
+#endif
+
+struct bs_include_frame {
+	struct bs_strip_stage ss;
+	struct bs_comments_stage cs;
+	struct bs_directive_state ds;
+};
+
+static _Thread_local size_t bs_include_depth = 0;
+
+/*
+ * Processes "text" into "out". The lines from "clean_from" on have no
+ * directive, comment or splice, as bs_guard_clean_from found: if the
+ * lines before leave nothing pending and no macro is used in the rest,
+ * the rest is written as it is, else it is processed as well.
+ */
+static int bs_include_text(struct bs_writer *out, const char *text,
+			   size_t len, size_t clean_from, FILE *log)
+{
+	if (bs_include_depth >= BS_INCLUDE_DEPTH_MAX) {
+		Bs_log_error(log, "#include nested depth %zu exceeds maximum"
+			     " of %d", bs_include_depth, BS_INCLUDE_DEPTH_MAX);
+		return ELOOP;
+	}
+
+	struct bs_arena_mark mark;
+	bs_arena_mark(&bs_line_arena, &mark);
+	struct bs_include_frame *f = bs_arena_alloc(&bs_line_arena,
+						    sizeof(*f));
+	if (!f) {
+		int save_err = Bs_log_errno(log, "include frame failed");
+		return save_err ? save_err : 1;
+	}
+	bs_strip_stage_init(&f->ss, log);
+	bs_comments_stage_init(&f->cs, log);
+	int err = bs_directives_stage_init(&f->ds, log);
+	if (err) {
+		goto bs_include_text_end;
+	}
+	f->ss.base.next = &f->cs.base;
+	f->cs.base.next = &f->ds.base;
+	f->ds.base.out = out;
+
+	++bs_include_depth;
+	struct bs_stage *first = &f->ss.base;
+	int as_is = 0;
+	if (clean_from) {
+		err = first->feed(first, text, clean_from);
+	}
+	if (!err && clean_from < len) {
+		as_is = f->cs.state == bs_comment_none && !f->ds.is_preproc
+		    && !f->ds.line_len && !bs_directives_skipping(&f->ds)
+		    && !bs_text_has_macro(text + clean_from, len - clean_from);
+	}
+	if (!err && !as_is && clean_from < len) {
+		err = first->feed(first, text + clean_from, len - clean_from);
+	}
+	if (!err) {
+		err = first->finish(first);
+	}
+	if (!err && as_is) {
+		err = bs_writer_write(out, text + clean_from, len - clean_from);
+	}
+	--bs_include_depth;
+	bs_directives_release(&f->ds.base);
+
+bs_include_text_end:
+	bs_line_arena_rewind(&mark);
+	return err;
+}
+
+/* what is not a regular file is read whole, to be processed the same */
+static int bs_include_read(int fdinclude, struct bs_writer *out, FILE *log)
+{
+	struct bs_writer text;
+	bs_writer_init(&text, -1, NULL, 0, log);
+	char buf[BS_IO_BUFSIZE];
+	int err = 0;
+	for (;;) {
+		ssize_t got = bs_read(fdinclude, buf, BS_IO_BUFSIZE);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			err = Bs_log_errno(log, "read(%d)", fdinclude);
+			err = err ? err : 1;
+			break;
+		}
+		if (!got) {
+			break;
+		}
+		err = bs_writer_write(&text, buf, (size_t)got);
+		if (err) {
+			break;
+		}
+	}
+	if (!err) {
+		err = bs_include_text(out, text.buf, text.len, text.len, log);
+	}
+	bs_free(text.buf);
+	return err;
+}
+
+/*
+ * process the mapped "text" of an include into "out", and keep what it
+ * wrote in the cache; "out" keeps everything in memory while an outer
+ * include is being kept, else it is only this one which is
+ */
+static int bs_include_and_cache(const char *path, const char *text,
+				const struct stat *st,
+				const struct bs_guard_entry *scanned,
+				struct bs_writer *out, FILE *log)
+{
+	size_t len = (size_t)st->st_size;
+
+	/* no use caching what is mostly copied as it is */
+	if (scanned && st->st_size - scanned->clean_from >= BS_CLEAN_MIN) {
+		return bs_include_text(out, text, len,
+				       (size_t)scanned->clean_from, log);
+	}
+
+	struct bs_writer kept;
+	struct bs_writer *to = out;
+	if (out->fd >= 0) {
+		bs_writer_init(&kept, -1, NULL, 0, log);
+		to = &kept;
+	}
+	size_t start = to->len;
+
+	unsigned long long macro_version = bs_macro_version();
+	unsigned long long once_version = bs_once.version;
+	size_t deps_mark = bs_deps_mark();
+	int err = bs_include_text(to, text, len, len, log);
+
+	char *output = NULL;
+	size_t output_len = to->len - start;
+	char *deps = NULL;
+	size_t deps_len = 0;
+	int keep = !err && macro_version == bs_macro_version()
+	    && once_version == bs_once.version
+	    && !bs_deps_copy(deps_mark, &deps, &deps_len);
+	if (to == &kept) {
+		if (!err) {
+			err = bs_writer_write(out, kept.buf, kept.len);
+		}
+		output = kept.buf;
+		if (!output_len) {
+			bs_free(output);
+			output = NULL;
+		}
+	} else if (keep && output_len) {
+		output = bs_malloc(output_len);
+		if (output) {
+			memcpy(output, to->buf + start, output_len);
+		} else {
+			keep = 0;
+			bs_free(deps);
+		}
+	}
+	if (keep && !err) {
+		bs_include_cache_store(path, st, output, output_len, deps,
+				       deps_len);
+	} else {
+		if (keep) {
+			bs_free(deps);
+		}
+		bs_free(output);
+	}
+	return err;
+}
+
+/*
+ * the directory of "path", in the line arena, for a "x.h" of it to be
+ * looked for there; NULL if it is the current one, or on error
+ */
+static char *bs_include_dir(const char *path, int *err, FILE *log)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash) {
+		return NULL;
+	}
+	size_t len = (slash == path) ? 1 : (size_t)(slash - path);
+	char *dir = bs_arena_alloc(&bs_line_arena, len + 1);
+	if (!dir) {
+		int save_err = Bs_log_errno(log, "directory of '%s'", path);
+		*err = save_err ? save_err : 1;
+		return NULL;
+	}
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	return dir;
+}
+
+static int bs_include_to(struct bs_writer *out, char *buf, size_t offset,
+			 FILE *log)
+{
 	int err = 0;
 	int fdinclude = -1;
+	const char *path = NULL;
+	const char *dir = bs_search_from();
+	struct bs_arena_mark mark;
+	bs_arena_mark(&bs_line_arena, &mark);
 
 	char *name, *name_end;
-	char delim1 = '"';
-	char delim2 = '"';
 	char *from = buf + offset;
+	char *delim = strpbrk(from, "\"<");
+	char delim1 = (delim && *delim == '<') ? '<' : '"';
+	char delim2 = (delim1 == '<') ? '>' : '"';
 	name = bs_name_from_include(from, delim1, delim2, &name_end, log);
 	if (!name) {
 		int save_err = Bs_log_errno(log, "no name from '%s'?\n", from);
@@ -309,17 +1546,110 @@ int bs_include(int fdout, char *buf, size_t bufsize, size_t offset, FILE *log)
 	*name_end = '\0';
 	// fprintf(stderr, "name: '%s'\n", name);
 
-	fdinclude = Bs_open_ro(name, &err, log);
-	if (fdinclude < 0) {
+	enum bs_search_kind kind;
+	kind = (delim1 == '<') ? bs_search_angle : bs_search_quote;
+	if (bs_search_find(name, kind, dir, &path, &fdinclude, log)) {
+		Bs_log_error(log, "%c%s%c not found", delim1, name, delim2);
+		err = ENOENT;
+		goto bs_include_end;
+	}
+	/* noted even if a guard skips it, as a change could make it not */
+	enum bs_deps_kind dep_kind = bs_search_in_system_dir(path)
+	    ? bs_deps_system : bs_deps_user;
+	if (bs_deps_note(dep_kind, delim1 == '<', name, path, dir)) {
+		Bs_log_error(log, "out of memory noting '%s'", path);
+		err = ENOMEM;
+		goto bs_include_end;
+	}
+
+	struct stat st;
+	struct bs_include_cache_entry *cached = NULL;
+	int st_err = (fdinclude >= 0) ? fstat(fdinclude, &st) : stat(path, &st);
+	if (st_err == 0) {
+		if (bs_guard_skip(path, &st)) {
+			goto bs_include_end;
+		}
+		cached = bs_include_cache_find(path, &st);
+	}
+	if (cached) {
+		err = bs_deps_note_all(cached->deps, cached->deps_len);
+		if (err) {
+			Bs_log_error(log, "out of memory noting the includes"
+				     " of '%s'", path);
+		} else {
+			err = bs_writer_write(out, cached->output,
+					      cached->output_len);
+		}
+		bs_include_cache_release(cached);
+		goto bs_include_once;
+	}
+
+	/* while it is processed, its "x.h" are looked for from its dir */
+	bs_search_set_from(bs_include_dir(path, &err, log));
+	if (err) {
 		goto bs_include_end;
 	}
 
-	err = bs_c_pre_proc(fdinclude, fdout, log);
+	if (fdinclude < 0) {
+		fdinclude = Bs_open_ro(path, &err, log);
+		if (fdinclude < 0) {
+			goto bs_include_end;
+		}
+		st_err = fstat(fdinclude, &st);
+	}
+
+	char *text = MAP_FAILED;
+	if (st_err == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		text = bs_mmap(NULL, (size_t)st.st_size, PROT_READ,
+			       MAP_PRIVATE, fdinclude, 0);
+	}
+	if (st_err || !S_ISREG(st.st_mode)
+	    || (st.st_size && text == MAP_FAILED)) {
+		err = bs_include_read(fdinclude, out, log);
+		goto bs_include_once;
+	}
+	/* the mapping is all that is needed of it */
+	Bs_close_fd(fdinclude, path, log);
+	fdinclude = -1;
+	if (text != MAP_FAILED) {
+		bs_prefetch_includes(text, (size_t)st.st_size);
+	}
+
+	const char *contents = (text == MAP_FAILED) ? "" : text;
+	struct bs_guard_entry *scanned = bs_guard_scan(path, contents, &st);
+	err = bs_include_and_cache(path, contents, &st, scanned, out, log);
+	if (text != MAP_FAILED) {
+		bs_munmap(text, (size_t)st.st_size);
+	}
+
+bs_include_once:
+	if (!err && st_err == 0) {
+		struct bs_guard_entry *guard = bs_guard_find(path, &st);
+		if (guard && guard->kind == bs_guard_once) {
+			bs_once_add(guard);
+		}
+	}
 
 bs_include_end:
 	if (fdinclude >= 0) {
-		// fdinclude is closed by bs_c_pre_proc
-		// Bs_close_fd(fdinclude, name, log);
+		Bs_close_fd(fdinclude, path, log);
+	}
+	bs_search_set_from(dir);
+	bs_line_arena_rewind(&mark);
+	return err;
+}
+
+int bs_include(int fdout, char *buf, size_t bufsize, size_t offset, FILE *log)
+{
+	assert(offset < bufsize);
+	(void)bufsize;
+
+	char outbuf[BS_IO_BUFSIZE];
+	struct bs_writer writer;
+	bs_writer_init(&writer, fdout, outbuf, BS_IO_BUFSIZE, log);
+	int err = bs_include_to(&writer, buf, offset, log);
+	if (bs_writer_flush(&writer) && !err) {
+		err = writer.err;
 	}
 	return err;
 }
@@ -348,43 +1678,350 @@ bs_name_from_include_end:
 	return name;
 }
 
+/* on a thread, or in a process, of its own, which the unit's state goes with */
+static int bs_replace_directives_stage(int fd_from, int fd_to, FILE *log)
+{
+	int err = bs_replace_directives(fd_from, fd_to, log);
+	bs_thread_release();
+	return err;
+}
+
 int bs_c_pre_proc(int fdin, int fdout, FILE *log)
 {
 	struct pipe_func_s transforms[] = {
 		{ bs_strip_backslash_newline, "bs_strip_backslash_newline" },
 		{ bs_replace_comments, "bs_replace_comments" },
-		{ bs_replace_directives, "bs_replace_directives" },
+		{ bs_replace_directives_stage, "bs_replace_directives" },
 		{ NULL, NULL }
 	};
+	/* one unit at a time is run through the stages */
+	bs_pipes_from = bs_search_from();
 	int err = bs_pipes(transforms, fdin, fdout, log);
+	bs_pipes_from = NULL;
 	return err;
 }
 
-int bs_cpp(int argc, char **argv)
+int bs_c_pre_proc_path(const char *in_path, const char *out_path,
+		       int (*pre_proc)(int fdin, int fdout, FILE *log),
+		       FILE *log)
 {
-	const char *in_path = argc > 1 ? argv[1] : NULL;
-	const char *out_path = argc > 2 ? argv[2] : NULL;
-	if (!in_path || !out_path) {
-		fprintf(stderr, "usage %s /path/to/in /path/to/out\n", argv[0]);
-		return 1;
-	}
-
 	int err = 0;
-	int fdin = Bs_open_ro(in_path, &err, stderr);
+	int fdin = Bs_open_ro(in_path, &err, log);
 	if (fdin < 0) {
-		return exit_val(err);
+		return err ? err : 1;
 	}
 
 	mode_t mode = 0644;
-	int fdout = Bs_open_rw(out_path, mode, &err, stderr);
+	int fdout = Bs_open_rw(out_path, mode, &err, log);
 	if (fdout < 0) {
-		Bs_close_fd(fdin, in_path, stderr);
-		return exit_val(err);
+		Bs_close_fd(fdin, in_path, log);
+		return err ? err : 1;
+	}
+
+	/* its "x.h" are looked for in its directory first */
+	struct bs_arena_mark mark;
+	bs_arena_mark(&bs_line_arena, &mark);
+	const char *outer = bs_search_set_from(bs_include_dir(in_path, &err,
+							      log));
+	/* "fdin" is closed by pre_proc */
+	if (err) {
+		Bs_close_fd(fdin, in_path, log);
+	} else {
+		err = pre_proc(fdin, fdout, log);
 	}
+	bs_search_set_from(outer);
+	bs_line_arena_rewind(&mark);
+
+	Bs_close_fd(fdout, out_path, log);
+	return err;
+}
+
+/* the fused engine as the one stage of bs_pipes_stats */
+static int bs_c_pre_proc_fused_counted(int fdin, int fdout, FILE *log)
+{
+	const struct pipe_func_s fused = {
+		bs_c_pre_proc_fused, "bs_c_pre_proc_fused"
+	};
+	struct bs_pipe_stats *st = bs_pipes_stats->stages;
+	memset(st, 0x00, sizeof(struct bs_pipe_stats));
+	snprintf(st->name, sizeof(st->name), "%s", fused.name);
+	bs_pipes_stats->len = 1;
+	return bs_pipe_stage_run(&fused, fdin, fdout, st, log);
+}
 
-	err = bs_c_pre_proc(fdin, fdout, stderr);
+int bs_c_pre_proc_unit(const char *in_path, const char *out_path,
+		       const struct bs_deps_opts *deps, FILE *log)
+{
+	bs_pipe_function fused = bs_pipes_stats ? bs_c_pre_proc_fused_counted
+	    : bs_c_pre_proc_fused;
+	int want_deps = deps && deps->mode != bs_deps_none;
+	if (!want_deps && !bs_cache_enabled()) {
+		return bs_c_pre_proc_path(in_path, out_path, fused, log);
+	}
 
-	Bs_close_fd(fdout, out_path, stderr);
+	/* for -M the output is not wanted, only the walk which makes it */
+	int only_deps = want_deps && deps->mode == bs_deps_only;
+	struct timespec start;
+	clock_gettime(CLOCK_REALTIME, &start);
+	bs_deps_reset();
 
+	int err = 0;
+	int hit = 0;
+	if (bs_cache_enabled()) {
+		err = bs_cache_fetch(in_path, only_deps ? NULL : out_path, &hit,
+				     log);
+	}
+	if (!err && !hit) {
+		const char *to = only_deps ? "/dev/null" : out_path;
+		err = bs_c_pre_proc_path(in_path, to, fused, log);
+		if (!err && !only_deps && bs_cache_enabled()) {
+			bs_cache_store(in_path, out_path, &start, log);
+		}
+	}
+	if (!err && want_deps) {
+		err = bs_deps_finish(in_path, out_path, deps, log);
+	}
+	return err;
+}
+
+/* "in out" pairs from the command line, and from a manifest, if any */
+static int bs_cpp_batch(char **paths, size_t paths_len, const char *manifest,
+			size_t workers, const struct bs_deps_opts *deps)
+{
+	char *text = NULL;
+	struct bs_batch_job *jobs = NULL;
+	size_t len = 0;
+	if (manifest) {
+		int err = bs_batch_manifest(manifest, &text, &jobs, &len,
+					    stderr);
+		if (err) {
+			return err;
+		}
+	}
+	size_t size = (len + paths_len / 2) * sizeof(struct bs_batch_job);
+	struct bs_batch_job *all = bs_malloc(size ? size : 1);
+	if (!all) {
+		fprintf(stderr, "out of memory for %zu jobs\n", size);
+		bs_free(jobs);
+		bs_free(text);
+		return 1;
+	}
+	if (len) {
+		memcpy(all, jobs, len * sizeof(struct bs_batch_job));
+	}
+	for (size_t i = 0; i + 1 < paths_len; i += 2, ++len) {
+		all[len].in_path = paths[i];
+		all[len].out_path = paths[i + 1];
+		all[len].err = 0;
+	}
+
+	if (deps->file && len > 1) {
+		fprintf(stderr, "-MF names one file, not one per unit\n");
+		bs_free(all);
+		bs_free(jobs);
+		bs_free(text);
+		return 1;
+	}
+
+	int err = bs_batch_run(all, len, workers ? workers : bs_batch_cpus(),
+			       deps, stderr);
+
+	bs_free(all);
+	bs_free(jobs);
+	bs_free(text);
+	return err;
+}
+
+int bs_cpp(int argc, char **argv)
+{
+	const char *manifest = NULL;
+	const char *serve_path = NULL;
+	const char *connect_path = NULL;
+	const char *cache_dir = NULL;
+	size_t workers = 0;
+	size_t prefetch = BS_PREFETCH_THREADS;
+	bs_pipe_function pre_proc = bs_c_pre_proc;
+	struct bs_deps_opts deps = { bs_deps_none, 0, 0, NULL };
+	struct bs_pipes_stats stats;
+	int stats_json = -1;
+	int usage = 0;
+
+	/* the -I and -isystem flags, as a server and its clients compare */
+	char *options = NULL;
+	size_t options_len = 0;
+	FILE *options_stream = open_memstream(&options, &options_len);
+	if (!options_stream) {
+		fprintf(stderr, "open_memstream failed\n");
+		return 1;
+	}
+
+	/* the in and out paths, moved to the front as they are found */
+	char **paths = argv + 1;
+	size_t paths_len = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--fused") == 0) {
+			pre_proc = bs_c_pre_proc_fused;
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			bs_pipes_backend = bs_pipes_threads;
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			manifest = argv[++i];
+			usage = usage || !manifest;
+		} else if (strcmp(argv[i], "--serve") == 0) {
+			serve_path = argv[++i];
+			usage = usage || !serve_path;
+		} else if (strcmp(argv[i], "--connect") == 0) {
+			connect_path = argv[++i];
+			usage = usage || !connect_path;
+		} else if (strcmp(argv[i], "--stats") == 0
+			   || strcmp(argv[i], "--stats=text") == 0) {
+			stats_json = 0;
+		} else if (strcmp(argv[i], "--stats=json") == 0) {
+			stats_json = 1;
+		} else if (strcmp(argv[i], "--pipe-size") == 0) {
+			const char *n = argv[++i];
+			char *end = NULL;
+			unsigned long val = n ? strtoul(n, &end, 10) : 0;
+			usage = usage || !n || *end;
+			bs_pipe_size = (size_t)val;
+		} else if (strcmp(argv[i], "--prefetch") == 0) {
+			const char *n = argv[++i];
+			char *end = NULL;
+			unsigned long val = n ? strtoul(n, &end, 10) : 0;
+			usage = usage || !n || *end;
+			prefetch = (size_t)val;
+		} else if (strcmp(argv[i], "--io-uring") == 0) {
+			bs_uring_enabled = 1;
+		} else if (strcmp(argv[i], "--cache-dir") == 0) {
+			cache_dir = argv[++i];
+			usage = usage || !cache_dir;
+		} else if (strcmp(argv[i], "-M") == 0
+			   || strcmp(argv[i], "-MM") == 0) {
+			deps.mode = bs_deps_only;
+			deps.skip_system = (argv[i][2] == 'M');
+		} else if (strcmp(argv[i], "-MD") == 0
+			   || strcmp(argv[i], "-MMD") == 0) {
+			deps.mode = bs_deps_also;
+			deps.skip_system = (argv[i][2] == 'M');
+		} else if (strcmp(argv[i], "-MP") == 0) {
+			deps.phony = 1;
+		} else if (strncmp(argv[i], "-MF", 3) == 0) {
+			deps.file = argv[i][3] ? argv[i] + 3 : argv[++i];
+			usage = usage || !deps.file;
+		} else if (strncmp(argv[i], "-j", 2) == 0) {
+			const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+			char *end = NULL;
+			unsigned long val = n ? strtoul(n, &end, 10) : 0;
+			usage = usage || !n || *end || !val;
+			workers = (size_t)val;
+		} else if (strncmp(argv[i], "-I", 2) == 0
+			   || strcmp(argv[i], "-isystem") == 0) {
+			int system = (argv[i][1] == 'i');
+			const char *dir = (system || !argv[i][2]) ? argv[++i]
+			    : argv[i] + 2;
+			if (!dir) {
+				usage = 1;
+			} else if (bs_search_add_dir(dir, system)) {
+				fprintf(stderr, "out of memory: %s\n", dir);
+				fclose(options_stream);
+				free(options);
+				return 1;
+			} else {
+				fprintf(options_stream, "%s%s%c",
+					system ? "-isystem" : "-I", dir, '\0');
+			}
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			usage = 1;
+		} else {
+			paths[paths_len++] = argv[i];
+		}
+	}
+	fclose(options_stream);
+
+	int batch = manifest || (workers && !serve_path) || paths_len > 2;
+	/* -MP and -MF only go with -M or -MD */
+	usage = usage || (deps.mode == bs_deps_none && (deps.phony
+							|| deps.file));
+	if (serve_path) {
+		usage = usage || batch || connect_path || paths_len;
+	} else if (connect_path) {
+		usage = usage || batch || paths_len != 2;
+	}
+	/* the server's units are its own, it writes no rules */
+	usage = usage || ((serve_path || connect_path)
+			  && (deps.mode != bs_deps_none || cache_dir));
+	/* a unit with a rule or in the cache is walked fused, in-process */
+	usage = usage || (bs_pipes_backend == bs_pipes_threads
+			  && (deps.mode != bs_deps_none || cache_dir));
+	/* the stages of one unit, not of many at once */
+	usage = usage || (stats_json >= 0 && (batch || serve_path
+					      || connect_path));
+	if (usage || (paths_len % 2) || (!batch && !serve_path && !paths_len)) {
+		fprintf(stderr, "usage %s [--fused|--threads]"
+			" [--stats[=json]] [--pipe-size bytes]"
+			" [-I dir]... [-isystem dir]..."
+			" /path/to/in /path/to/out\n"
+			"   or %s [-j workers] [--batch manifest]"
+			" [-I dir]... [-isystem dir]..."
+			" [/path/to/in /path/to/out]...\n"
+			"   the two above also take -M|-MM|-MD|-MMD [-MP]"
+			" [-MF file] for make rules,\n"
+			"   and --cache-dir dir to reuse the output"
+			" of unchanged units,\n"
+			"   either of which runs the unit fused,"
+			" and not with --threads,\n"
+			"   and --prefetch threads to read headers ahead"
+			" (0 for none)\n"
+			"   and --io-uring to queue the reads and writes"
+			" of the stages on an io_uring\n"
+			"   or %s --serve /path/to/socket [-j workers]"
+			" [-I dir]... [-isystem dir]...\n"
+			"   or %s --connect /path/to/socket"
+			" [-I dir]... [-isystem dir]..."
+			" /path/to/in /path/to/out\n",
+			argv[0], argv[0], argv[0], argv[0]);
+		free(options);
+		return 1;
+	}
+
+	bs_prefetch_threads = prefetch;
+	int err = 0;
+	if (cache_dir) {
+		err = bs_cache_open(cache_dir, options, options_len, stderr);
+		if (err) {
+			free(options);
+			return exit_val(err);
+		}
+	}
+	if (stats_json >= 0) {
+		memset(&stats, 0x00, sizeof(stats));
+		bs_pipes_stats = &stats;
+	}
+	if (serve_path) {
+		size_t n = workers ? workers : bs_batch_cpus();
+		err = bs_server_run(serve_path, options, options_len, n,
+				    stderr);
+	} else if (connect_path) {
+		err = bs_server_request(connect_path, options, options_len,
+					paths[0], paths[1], stderr);
+	} else if (batch) {
+		err = bs_cpp_batch(paths, paths_len, manifest, workers, &deps);
+	} else if (deps.mode != bs_deps_none || cache_dir) {
+		/* the other engines walk the includes in another process */
+		err = bs_c_pre_proc_unit(paths[0], paths[1], &deps, stderr);
+	} else {
+		if (bs_pipes_stats && pre_proc == bs_c_pre_proc_fused) {
+			pre_proc = bs_c_pre_proc_fused_counted;
+		}
+		err = bs_c_pre_proc_path(paths[0], paths[1], pre_proc, stderr);
+	}
+	if (bs_pipes_stats) {
+		bs_pipes_stats_print(stdout, bs_pipes_stats, stats_json);
+		bs_pipes_stats = NULL;
+	}
+	bs_prefetch_stop();
+	bs_prefetch_threads = 0;
+	bs_cache_close();
+	free(options);
 	return exit_val(err);
 }
@@ -6,8 +6,42 @@
 
 #include <stdio.h>
 
+#include "bs-deps.h"
+
 /* prototypes */
 int bs_cpp(int argc, char **argv);
 int bs_c_pre_proc(int fdin, int fdout, FILE *log);
 
+/* same transforms, single process, no fork() and no pipes */
+int bs_c_pre_proc_fused(int fdin, int fdout, FILE *log);
+
+/* opens "in_path", creates or truncates "out_path", and runs "pre_proc" */
+int bs_c_pre_proc_path(const char *in_path, const char *out_path,
+		       int (*pre_proc)(int fdin, int fdout, FILE *log),
+		       FILE *log);
+
+/*
+ * as bs_c_pre_proc_path() with bs_c_pre_proc_fused(), but first looks in
+ * the on-disk cache, if open, and then writes the make rule of the unit,
+ * as bs_deps_finish(); "deps" may be NULL
+ */
+int bs_c_pre_proc_unit(const char *in_path, const char *out_path,
+		       const struct bs_deps_opts *deps, FILE *log);
+
+/* forget everything learned about the files included so far */
+void bs_include_cache_clear(void);
+
+/*
+ * start a new translation unit on this thread: forget its macros and its
+ * "#pragma once" files, but keep the include search, the guards and the
+ * processed output of included files, which are checked as they are used
+ */
+void bs_translation_unit_reset(void);
+
+/*
+ * as a thread which preprocessed units is about to exit: give back all it
+ * kept from one unit to the next, the compiled #if expressions as well
+ */
+void bs_thread_release(void);
+
 #endif /* BS_CPP */
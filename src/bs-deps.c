@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <errno.h>
+#include <string.h>
+
+#include "bs-deps.h"
+#include "bs-util.h"
+
+struct bs_deps_entry {
+	const char *path;	/* in the arena, followed by name and from */
+	size_t len;
+	size_t name_len;
+	size_t from_len;
+	char kind;
+	char angle;
+};
+
+struct bs_deps_log {
+	struct bs_arena arena;
+	struct bs_deps_entry *entries;
+	size_t len;
+	size_t size;
+};
+
+/* each thread of a batch or a server preprocesses its own unit */
+static _Thread_local struct bs_deps_log bs_deps;
+
+void bs_deps_reset(void)
+{
+	bs_arena_release(&bs_deps.arena);
+	bs_free(bs_deps.entries);
+	memset(&bs_deps, 0x00, sizeof(struct bs_deps_log));
+}
+
+int bs_deps_note(enum bs_deps_kind kind, int angle, const char *name,
+		 const char *path, const char *from)
+{
+	if (bs_deps.len == bs_deps.size) {
+		size_t size = bs_deps.size ? bs_deps.size * 2 : 64;
+		struct bs_deps_entry *entries;
+		entries = bs_malloc(size * sizeof(struct bs_deps_entry));
+		if (!entries) {
+			return ENOMEM;
+		}
+		if (bs_deps.len) {
+			memcpy(entries, bs_deps.entries,
+			       bs_deps.len * sizeof(struct bs_deps_entry));
+		}
+		bs_free(bs_deps.entries);
+		bs_deps.entries = entries;
+		bs_deps.size = size;
+	}
+	/* only a "x.h" is looked for from the includer's directory */
+	if (angle || !from) {
+		from = "";
+	}
+	size_t len = strlen(path);
+	size_t name_len = strlen(name);
+	size_t from_len = strlen(from);
+	char *copy = bs_arena_alloc(&bs_deps.arena, len + 1 + name_len + 1
+				    + from_len + 1);
+	if (!copy) {
+		return ENOMEM;
+	}
+	memcpy(copy, path, len + 1);
+	memcpy(copy + len + 1, name, name_len + 1);
+	memcpy(copy + len + 1 + name_len + 1, from, from_len + 1);
+	struct bs_deps_entry *e = bs_deps.entries + bs_deps.len++;
+	e->path = copy;
+	e->len = len;
+	e->name_len = name_len;
+	e->from_len = from_len;
+	e->kind = (char)kind;
+	e->angle = angle ? '<' : '"';
+	return 0;
+}
+
+size_t bs_deps_mark(void)
+{
+	return bs_deps.len;
+}
+
+int bs_deps_copy(size_t mark, char **block, size_t *len)
+{
+	*block = NULL;
+	*len = 0;
+	for (size_t i = mark; i < bs_deps.len; ++i) {
+		const struct bs_deps_entry *e = bs_deps.entries + i;
+		*len += 2 + e->len + 1 + e->name_len + 1 + e->from_len + 1;
+	}
+	if (!*len) {
+		return 0;
+	}
+	*block = bs_malloc(*len);
+	if (!*block) {
+		*len = 0;
+		return ENOMEM;
+	}
+	char *pos = *block;
+	for (size_t i = mark; i < bs_deps.len; ++i) {
+		const struct bs_deps_entry *e = bs_deps.entries + i;
+		*pos++ = e->kind;
+		*pos++ = e->angle;
+		size_t size = e->len + 1 + e->name_len + 1 + e->from_len + 1;
+		memcpy(pos, e->path, size);
+		pos += size;
+	}
+	return 0;
+}
+
+int bs_deps_block_next(const char *block, size_t len, size_t *pos,
+		       struct bs_deps_note *note)
+{
+	if (*pos + 2 >= len) {
+		return 0;
+	}
+	const char *p = block + *pos;
+	const char *end = block + len;
+	const char *path_end = memchr(p + 2, '\0', (size_t)(end - p - 2));
+	const char *name_end = path_end ? memchr(path_end + 1, '\0',
+						 (size_t)(end - path_end - 1))
+	    : NULL;
+	const char *from_end = name_end ? memchr(name_end + 1, '\0',
+						 (size_t)(end - name_end - 1))
+	    : NULL;
+	if (!from_end) {
+		return 0;
+	}
+	note->kind = (enum bs_deps_kind)p[0];
+	note->angle = (p[1] == '<');
+	note->path = p + 2;
+	note->name = path_end + 1;
+	note->from = name_end + 1;
+	*pos = (size_t)(from_end + 1 - block);
+	return 1;
+}
+
+int bs_deps_note_all(const char *block, size_t len)
+{
+	size_t pos = 0;
+	struct bs_deps_note note;
+	while (bs_deps_block_next(block, len, &pos, &note)) {
+		int err = bs_deps_note(note.kind, note.angle, note.name,
+				       note.path, note.from);
+		if (err) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* as make reads it: spaces and '#' escaped, '$' doubled */
+static void bs_deps_put_path(FILE *out, const char *path)
+{
+	for (; *path; ++path) {
+		if (*path == ' ' || *path == '\t' || *path == '#') {
+			fputc('\\', out);
+		} else if (*path == '$') {
+			fputc('$', out);
+		}
+		fputc(*path, out);
+	}
+}
+
+/* the first note of each path, and which are to be written */
+static int bs_deps_firsts(const struct bs_deps_opts *opts,
+			  unsigned char *keep)
+{
+	size_t capacity = 64;
+	while (capacity < bs_deps.len * 2) {
+		capacity *= 2;
+	}
+	size_t *slots = bs_malloc(capacity * sizeof(size_t));
+	if (!slots) {
+		return ENOMEM;
+	}
+	/* slots hold index + 1, so that zero is empty */
+	memset(slots, 0x00, capacity * sizeof(size_t));
+	for (size_t i = 0; i < bs_deps.len; ++i) {
+		const struct bs_deps_entry *e = bs_deps.entries + i;
+		unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, e->path,
+						   e->len);
+		size_t j = (size_t)(hash & (capacity - 1));
+		keep[i] = !(opts->skip_system && e->kind == bs_deps_system);
+		if (e->kind == bs_deps_probe) {
+			keep[i] = 0;
+			continue;
+		}
+		while (slots[j]) {
+			const struct bs_deps_entry *o;
+			o = bs_deps.entries + slots[j] - 1;
+			if (o->len == e->len
+			    && memcmp(o->path, e->path, e->len) == 0) {
+				keep[i] = 0;
+				break;
+			}
+			j = (j + 1) & (capacity - 1);
+		}
+		if (!slots[j]) {
+			slots[j] = i + 1;
+		}
+	}
+	bs_free(slots);
+	return 0;
+}
+
+int bs_deps_write(FILE *out, const char *target, const char *source,
+		  const struct bs_deps_opts *opts)
+{
+	unsigned char *keep = bs_malloc(bs_deps.len + 1);
+	if (!keep) {
+		return ENOMEM;
+	}
+	int err = bs_deps_firsts(opts, keep);
+	if (err) {
+		bs_free(keep);
+		return err;
+	}
+
+	bs_deps_put_path(out, target);
+	fputc(':', out);
+	size_t column = strlen(target) + 1;
+	for (size_t i = 0; i <= bs_deps.len; ++i) {
+		if (i && !keep[i - 1]) {
+			continue;
+		}
+		const char *path = i ? bs_deps.entries[i - 1].path : source;
+		size_t len = strlen(path);
+		/* wrapped as gcc does, short of 80 columns */
+		if (i && column + 1 + len > 76) {
+			fputs(" \\\n", out);
+			column = 0;
+		}
+		fputc(' ', out);
+		bs_deps_put_path(out, path);
+		column += 1 + len;
+	}
+	fputc('\n', out);
+
+	if (opts->phony) {
+		for (size_t i = 0; i < bs_deps.len; ++i) {
+			if (keep[i]) {
+				fputc('\n', out);
+				bs_deps_put_path(out, bs_deps.entries[i].path);
+				fputs(":\n", out);
+			}
+		}
+	}
+	bs_free(keep);
+	return ferror(out) ? EIO : 0;
+}
+
+/* "dir/name.suffix" to "name" and "new_suffix", or "path" and "new_suffix" */
+static char *bs_deps_resuffix(const char *path, int strip_dir,
+			      const char *new_suffix)
+{
+	const char *base = strip_dir ? strrchr(path, '/') : NULL;
+	base = base ? base + 1 : path;
+	const char *slash = strrchr(base, '/');
+	const char *dot = strrchr(slash ? slash : base, '.');
+	size_t len = dot ? (size_t)(dot - base) : strlen(base);
+	size_t suffix_len = strlen(new_suffix);
+	char *result = bs_malloc(len + suffix_len + 1);
+	if (result) {
+		memcpy(result, base, len);
+		memcpy(result + len, new_suffix, suffix_len + 1);
+	}
+	return result;
+}
+
+int bs_deps_finish(const char *in_path, const char *out_path,
+		   const struct bs_deps_opts *opts, FILE *log)
+{
+	int err = 0;
+	char *target = bs_deps_resuffix(in_path, 1, ".o");
+	char *dep_path = NULL;
+	const char *path = opts->file;
+	if (!path && opts->mode == bs_deps_also) {
+		dep_path = bs_deps_resuffix(out_path, 0, ".d");
+		path = dep_path;
+	} else if (!path) {
+		path = out_path;
+	}
+	if (!target || !path) {
+		Bs_log_error(log, "out of memory for the rule of %s", in_path);
+		err = ENOMEM;
+		goto bs_deps_finish_end;
+	}
+
+	FILE *out = bs_fopen(path, "w");
+	if (!out) {
+		err = Bs_log_errno(log, "fopen(\"%s\", \"w\")", path);
+		err = err ? err : 1;
+		goto bs_deps_finish_end;
+	}
+	err = bs_deps_write(out, target, in_path, opts);
+	if (bs_fclose(out) && !err) {
+		err = Bs_log_errno(log, "fclose(\"%s\")", path);
+		err = err ? err : 1;
+	}
+	if (err) {
+		Bs_log_error(log, "writing the rule to %s failed", path);
+	}
+
+bs_deps_finish_end:
+	bs_free(dep_path);
+	bs_free(target);
+	return err;
+}
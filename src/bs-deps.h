@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_DEPS_H
+#define BS_DEPS_H 1
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Make rules for the headers a translation unit depends on, as with the
+ * -M family of flags of gcc. Every header the include walk resolves is
+ * noted as it goes, even one which a guard then skips, so there is no
+ * second scan: the rule is written once the unit is done.
+ *
+ * The notes are a log, with repeats, rather than a set, so that the part
+ * of it made while one header was processed can be kept with the cached
+ * output of that header, and noted again each time the output is replayed.
+ * Each note keeps the name the header was looked for by as well, and for
+ * a "x.h" the directory it was looked for from, and the __has_include
+ * probes are noted too, though not in a rule: together they are what the
+ * on-disk cache needs to know that a unit is unchanged.
+ */
+enum bs_deps_mode {
+	bs_deps_none = 0,
+	bs_deps_only,		/* -M, the rule instead of the output */
+	bs_deps_also		/* -MD, the rule as well as the output */
+};
+
+struct bs_deps_opts {
+	enum bs_deps_mode mode;
+	int skip_system;	/* -MM, -MMD */
+	int phony;		/* -MP */
+	const char *file;	/* -MF, or NULL */
+};
+
+enum bs_deps_kind {
+	bs_deps_user = 'u',	/* an #include found in a -I dir, or "." */
+	bs_deps_system = 's',	/* an #include found in an -isystem dir */
+	bs_deps_probe = 'h'	/* __has_include, "path" is "" if not found */
+};
+
+struct bs_deps_note {
+	enum bs_deps_kind kind;
+	int angle;		/* <name> rather than "name" */
+	const char *name;
+	const char *path;
+	const char *from;	/* see bs_search_find(), "" if none */
+};
+
+/* forget the notes of the translation unit before, on this thread */
+void bs_deps_reset(void);
+
+/* returns 0, or non-zero if out of memory; "from" may be NULL */
+int bs_deps_note(enum bs_deps_kind kind, int angle, const char *name,
+		 const char *path, const char *from);
+
+/* how many notes so far, a mark for bs_deps_copy() */
+size_t bs_deps_mark(void);
+
+/*
+ * the notes since "mark", as one block to bs_free(): the kind, '<' or '"',
+ * then the path, the name and "from", each NUL terminated; NULL, and *len
+ * 0, if none; returns 0, or non-zero if out of memory
+ */
+int bs_deps_copy(size_t mark, char **block, size_t *len);
+
+/* the note at *pos of a block, and moves *pos past it; 0 at the end */
+int bs_deps_block_next(const char *block, size_t len, size_t *pos,
+		       struct bs_deps_note *note);
+
+/* notes each of a block from bs_deps_copy() again */
+int bs_deps_note_all(const char *block, size_t len);
+
+/*
+ * writes "target: source header..." to "out", each header once, in the
+ * order first included, and with -MP an empty rule for each header too
+ */
+int bs_deps_write(FILE *out, const char *target, const char *source,
+		  const struct bs_deps_opts *opts);
+
+/*
+ * writes the rule for the unit just preprocessed from "in_path": to the
+ * -MF file, else for -M to "out_path" itself, and for -MD to "out_path"
+ * with its suffix replaced by ".d"; the target is "in_path" with its
+ * directory taken off and its suffix replaced by ".o"
+ */
+int bs_deps_finish(const char *in_path, const char *out_path,
+		   const struct bs_deps_opts *opts, FILE *log);
+
+#endif /* BS_DEPS_H */
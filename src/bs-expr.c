@@ -0,0 +1,1037 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <limits.h>
+#include <string.h>
+
+#include "bs-deps.h"
+#include "bs-expr.h"
+#include "bs-search.h"
+
+/* every value is kept as the bits of a uintmax_t, and a signedness */
+struct bs_expr_val {
+	unsigned long long v;
+	unsigned char is_unsigned;
+	unsigned char poison;	/* divided by zero, an error if it is used */
+};
+
+enum bs_expr_op {
+	/* binary */
+	bs_expr_mul = 0,
+	bs_expr_div,
+	bs_expr_mod,
+	bs_expr_add,
+	bs_expr_sub,
+	bs_expr_shl,
+	bs_expr_shr,
+	bs_expr_lt,
+	bs_expr_gt,
+	bs_expr_le,
+	bs_expr_ge,
+	bs_expr_eq,
+	bs_expr_ne,
+	bs_expr_and,
+	bs_expr_xor,
+	bs_expr_or,
+	bs_expr_land,
+	bs_expr_lor,
+	bs_expr_comma,
+	/* unary */
+	bs_expr_neg,
+	bs_expr_not,
+	bs_expr_compl,
+	/* a ? b : c */
+	bs_expr_select,
+	/* operands */
+	bs_expr_push,
+	bs_expr_ident,
+	bs_expr_defined,
+	bs_expr_has_include
+};
+
+/* one step of a postfix program */
+struct bs_expr_insn {
+	unsigned char op;
+	unsigned char flag;	/* push: unsigned, has_include: <angle> */
+	unsigned int len;	/* of the name */
+	union {
+		unsigned long long v;
+		const char *name;
+	} u;
+};
+
+static const struct bs_expr_binop {
+	const char *text;
+	enum bs_expr_op op;
+	int prec;
+} bs_expr_binops[] = {
+	{ "*", bs_expr_mul, 10 },
+	{ "/", bs_expr_div, 10 },
+	{ "%", bs_expr_mod, 10 },
+	{ "+", bs_expr_add, 9 },
+	{ "-", bs_expr_sub, 9 },
+	{ "<<", bs_expr_shl, 8 },
+	{ ">>", bs_expr_shr, 8 },
+	{ "<", bs_expr_lt, 7 },
+	{ ">", bs_expr_gt, 7 },
+	{ "<=", bs_expr_le, 7 },
+	{ ">=", bs_expr_ge, 7 },
+	{ "==", bs_expr_eq, 6 },
+	{ "!=", bs_expr_ne, 6 },
+	{ "&", bs_expr_and, 5 },
+	{ "^", bs_expr_xor, 4 },
+	{ "|", bs_expr_or, 3 },
+	{ "&&", bs_expr_land, 2 },
+	{ "||", bs_expr_lor, 1 },
+	{ NULL, 0, 0 }
+};
+
+/*************/
+/* compiling */
+/*************/
+#define BS_EXPR_INSNS_INLINE 64
+
+struct bs_expr_compiler {
+	const struct bs_token *toks;
+	size_t len;
+	size_t pos;
+	struct bs_expr_insn *insns;
+	size_t insns_len;
+	size_t insns_size;
+	size_t depth;
+	size_t max_depth;
+	const char *err;	/* the first error, if any */
+	struct bs_expr_insn inline_insns[BS_EXPR_INSNS_INLINE];
+};
+
+static void bs_expr_compiler_init(struct bs_expr_compiler *c,
+				  const struct bs_token *toks, size_t len)
+{
+	c->toks = toks;
+	c->len = len;
+	c->pos = 0;
+	c->insns = c->inline_insns;
+	c->insns_len = 0;
+	c->insns_size = BS_EXPR_INSNS_INLINE;
+	c->depth = 0;
+	c->max_depth = 0;
+	c->err = NULL;
+}
+
+static void bs_expr_compiler_release(struct bs_expr_compiler *c)
+{
+	if (c->insns != c->inline_insns) {
+		bs_free(c->insns);
+	}
+	c->insns = NULL;
+}
+
+static void bs_expr_error(struct bs_expr_compiler *c, const char *what)
+{
+	if (!c->err) {
+		c->err = what;
+	}
+}
+
+static void bs_expr_emit(struct bs_expr_compiler *c,
+			 const struct bs_expr_insn *insn)
+{
+	if (c->err) {
+		return;
+	}
+	if (c->insns_len == c->insns_size) {
+		size_t size = c->insns_size * 2;
+		struct bs_expr_insn *insns;
+		insns = bs_malloc(size * sizeof(struct bs_expr_insn));
+		if (!insns) {
+			bs_expr_error(c, "out of memory");
+			return;
+		}
+		memcpy(insns, c->insns,
+		       c->insns_len * sizeof(struct bs_expr_insn));
+		if (c->insns != c->inline_insns) {
+			bs_free(c->insns);
+		}
+		c->insns = insns;
+		c->insns_size = size;
+	}
+	c->insns[c->insns_len++] = *insn;
+
+	/* how deep the stack of values will be, once it runs */
+	if (insn->op >= bs_expr_push) {
+		++c->depth;
+	} else if (insn->op == bs_expr_select) {
+		c->depth -= 2;
+	} else if (insn->op < bs_expr_neg) {
+		--c->depth;
+	}
+	if (c->depth > c->max_depth) {
+		c->max_depth = c->depth;
+	}
+}
+
+static void bs_expr_emit_op(struct bs_expr_compiler *c, enum bs_expr_op op)
+{
+	struct bs_expr_insn insn;
+	memset(&insn, 0x00, sizeof(insn));
+	insn.op = (unsigned char)op;
+	bs_expr_emit(c, &insn);
+}
+
+static void bs_expr_emit_name(struct bs_expr_compiler *c, enum bs_expr_op op,
+			      const char *name, size_t len, int flag)
+{
+	struct bs_expr_insn insn;
+	memset(&insn, 0x00, sizeof(insn));
+	insn.op = (unsigned char)op;
+	insn.flag = (unsigned char)flag;
+	insn.len = (unsigned int)len;
+	insn.u.name = name;
+	bs_expr_emit(c, &insn);
+}
+
+static int bs_expr_is(const struct bs_token *tok, const char *s)
+{
+	size_t len = strlen(s);
+	return tok->kind == bs_token_punct && tok->len == len
+	    && memcmp(tok->text, s, len) == 0;
+}
+
+static int bs_expr_ident_is(const struct bs_token *tok, const char *s)
+{
+	size_t len = strlen(s);
+	return tok->kind == bs_token_ident && tok->len == len
+	    && memcmp(tok->text, s, len) == 0;
+}
+
+/* is the next token the punctuator "s"? if so, it is taken */
+static int bs_expr_accept(struct bs_expr_compiler *c, const char *s)
+{
+	if (c->pos < c->len && bs_expr_is(c->toks + c->pos, s)) {
+		++c->pos;
+		return 1;
+	}
+	return 0;
+}
+
+static const struct bs_expr_binop *bs_expr_binop_at(struct bs_expr_compiler
+						    *c)
+{
+	if (c->pos >= c->len || c->toks[c->pos].kind != bs_token_punct) {
+		return NULL;
+	}
+	for (size_t i = 0; bs_expr_binops[i].text; ++i) {
+		if (bs_expr_is(c->toks + c->pos, bs_expr_binops[i].text)) {
+			return bs_expr_binops + i;
+		}
+	}
+	return NULL;
+}
+
+static int bs_expr_digit(char c, unsigned base)
+{
+	int d = -1;
+	if (c >= '0' && c <= '9') {
+		d = c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		d = 10 + (c - 'a');
+	} else if (c >= 'A' && c <= 'F') {
+		d = 10 + (c - 'A');
+	}
+	return (d >= 0 && (unsigned)d < base) ? d : -1;
+}
+
+static void bs_expr_number(struct bs_expr_compiler *c,
+			   const struct bs_token *tok)
+{
+	struct bs_expr_insn insn;
+	memset(&insn, 0x00, sizeof(insn));
+	insn.op = bs_expr_push;
+
+	const char *s = tok->text;
+	size_t len = tok->len;
+	size_t i = 0;
+	unsigned base = 10;
+	if (len > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		base = 16;
+		i = 2;
+	} else if (len > 1 && s[0] == '0' && (s[1] == 'b' || s[1] == 'B')) {
+		base = 2;
+		i = 2;
+	} else if (s[0] == '0') {
+		base = 8;
+	}
+
+	size_t digits = 0;
+	unsigned long long v = 0;
+	for (; i < len; ++i) {
+		int d = bs_expr_digit(s[i], base);
+		if (d < 0) {
+			break;
+		}
+		if (v > (ULLONG_MAX - (unsigned)d) / base) {
+			bs_expr_error(c, "integer constant too large");
+		}
+		v = (v * base) + (unsigned)d;
+		++digits;
+	}
+	if (!digits && base != 8) {
+		bs_expr_error(c, "invalid integer constant");
+	}
+	for (; i < len; ++i) {
+		if (s[i] == 'u' || s[i] == 'U') {
+			insn.flag = 1;
+		} else if (s[i] != 'l' && s[i] != 'L') {
+			bs_expr_error(c, "invalid integer constant");
+		}
+	}
+	if (v > LLONG_MAX) {
+		insn.flag = 1;
+	}
+	insn.u.v = v;
+	bs_expr_emit(c, &insn);
+}
+
+static unsigned long long bs_expr_escape(const char *s, size_t len,
+					 size_t *pos)
+{
+	size_t i = *pos;
+	char c = s[i++];
+	unsigned long long v = 0;
+	switch (c) {
+	case 'n':
+		v = '\n';
+		break;
+	case 't':
+		v = '\t';
+		break;
+	case 'r':
+		v = '\r';
+		break;
+	case 'a':
+		v = '\a';
+		break;
+	case 'b':
+		v = '\b';
+		break;
+	case 'f':
+		v = '\f';
+		break;
+	case 'v':
+		v = '\v';
+		break;
+	case 'e':
+		v = 27;
+		break;
+	case 'x':
+		while (i < len && bs_expr_digit(s[i], 16) >= 0) {
+			v = (v << 4) | (unsigned)bs_expr_digit(s[i++], 16);
+		}
+		break;
+	default:
+		if (c >= '0' && c <= '7') {
+			v = (unsigned)(c - '0');
+			for (size_t n = 1; n < 3 && i < len
+			     && s[i] >= '0' && s[i] <= '7'; ++n) {
+				v = (v << 3) | (unsigned)(s[i++] - '0');
+			}
+		} else {
+			v = (unsigned char)c;
+		}
+	}
+	*pos = i;
+	return v;
+}
+
+/* 'a' is an int, as a (signed) char converted; 'ab' packs the bytes */
+static void bs_expr_char(struct bs_expr_compiler *c,
+			 const struct bs_token *tok)
+{
+	struct bs_expr_insn insn;
+	memset(&insn, 0x00, sizeof(insn));
+	insn.op = bs_expr_push;
+
+	const char *s = tok->text;
+	size_t len = tok->len;
+	size_t i = 0;
+	while (i < len && s[i] != '\'') {
+		++i;
+	}
+	int wide = (i > 0);
+	++i;
+
+	size_t chars = 0;
+	unsigned long long v = 0;
+	while (i < len && s[i] != '\'') {
+		unsigned long long ch = (unsigned char)s[i++];
+		if (ch == '\\' && i < len) {
+			ch = bs_expr_escape(s, len, &i);
+		}
+		v = wide ? ch : ((v << 8) | (ch & 0xff));
+		++chars;
+	}
+	if (!chars) {
+		bs_expr_error(c, "empty character constant");
+	} else if (!wide && chars == 1) {
+		v = (unsigned long long)(long long)(signed char)v;
+	}
+	insn.u.v = v;
+	bs_expr_emit(c, &insn);
+}
+
+/* after "defined": "X" or "( X )" */
+static void bs_expr_parse_defined(struct bs_expr_compiler *c)
+{
+	int paren = bs_expr_accept(c, "(");
+	if (c->pos >= c->len || c->toks[c->pos].kind != bs_token_ident) {
+		bs_expr_error(c, "\"defined\" without a macro name");
+		return;
+	}
+	const struct bs_token *name = c->toks + c->pos++;
+	if (paren && !bs_expr_accept(c, ")")) {
+		bs_expr_error(c, "missing ')' after \"defined\"");
+		return;
+	}
+	bs_expr_emit_name(c, bs_expr_defined, name->text, name->len, 0);
+}
+
+/* after "__has_include": ( "x.h" ) or ( <x.h> ) */
+static void bs_expr_parse_has_include(struct bs_expr_compiler *c)
+{
+	if (!bs_expr_accept(c, "(") || c->pos >= c->len) {
+		bs_expr_error(c, "missing '(' after __has_include");
+		return;
+	}
+	const struct bs_token *tok = c->toks + c->pos;
+	if (tok->kind == bs_token_literal && tok->text[0] == '"'
+	    && tok->len >= 2) {
+		++c->pos;
+		bs_expr_emit_name(c, bs_expr_has_include, tok->text + 1,
+				  tok->len - 2, 0);
+	} else if (bs_expr_accept(c, "<")) {
+		/* the name is the source text between the '<' and '>' */
+		size_t start = c->pos;
+		while (c->pos < c->len && !bs_expr_is(c->toks + c->pos, ">")) {
+			++c->pos;
+		}
+		if (c->pos == start || c->pos == c->len) {
+			bs_expr_error(c, "bad __has_include <name>");
+			return;
+		}
+		const char *name = c->toks[start].text;
+		size_t len = (size_t)(c->toks[c->pos].text - name);
+		while (len && (name[len - 1] == ' ' || name[len - 1] == '\t')) {
+			--len;
+		}
+		++c->pos;
+		bs_expr_emit_name(c, bs_expr_has_include, name, len, 1);
+	} else {
+		bs_expr_error(c, "bad __has_include operand");
+		return;
+	}
+	if (!bs_expr_accept(c, ")")) {
+		bs_expr_error(c, "missing ')' after __has_include");
+	}
+}
+
+static void bs_expr_comma_expr(struct bs_expr_compiler *c);
+
+static void bs_expr_unary(struct bs_expr_compiler *c)
+{
+	if (c->err) {
+		return;
+	}
+	if (c->pos >= c->len) {
+		bs_expr_error(c, "missing operand");
+		return;
+	}
+	if (bs_expr_accept(c, "+")) {
+		bs_expr_unary(c);
+		return;
+	}
+	static const struct {
+		const char *text;
+		enum bs_expr_op op;
+	} unops[] = {
+		{ "-", bs_expr_neg },
+		{ "~", bs_expr_compl },
+		{ "!", bs_expr_not }
+	};
+	for (size_t i = 0; i < 3; ++i) {
+		if (bs_expr_accept(c, unops[i].text)) {
+			bs_expr_unary(c);
+			bs_expr_emit_op(c, unops[i].op);
+			return;
+		}
+	}
+	if (bs_expr_accept(c, "(")) {
+		bs_expr_comma_expr(c);
+		if (!bs_expr_accept(c, ")")) {
+			bs_expr_error(c, "missing ')'");
+		}
+		return;
+	}
+
+	const struct bs_token *tok = c->toks + c->pos++;
+	if (tok->kind == bs_token_number) {
+		bs_expr_number(c, tok);
+	} else if (tok->kind == bs_token_literal
+		   && tok->text[tok->len - 1] == '\'') {
+		bs_expr_char(c, tok);
+	} else if (bs_expr_ident_is(tok, "defined")) {
+		bs_expr_parse_defined(c);
+	} else if (bs_expr_ident_is(tok, "__has_include")) {
+		bs_expr_parse_has_include(c);
+	} else if (tok->kind == bs_token_ident) {
+		bs_expr_emit_name(c, bs_expr_ident, tok->text, tok->len, 0);
+	} else {
+		bs_expr_error(c, "unexpected token");
+	}
+}
+
+/* precedence climbing over the binary operators */
+static void bs_expr_binary(struct bs_expr_compiler *c, int min_prec)
+{
+	bs_expr_unary(c);
+	while (!c->err) {
+		const struct bs_expr_binop *binop = bs_expr_binop_at(c);
+		if (!binop || binop->prec < min_prec) {
+			break;
+		}
+		++c->pos;
+		bs_expr_binary(c, binop->prec + 1);
+		bs_expr_emit_op(c, binop->op);
+	}
+}
+
+static void bs_expr_cond(struct bs_expr_compiler *c)
+{
+	bs_expr_binary(c, 1);
+	if (c->err || !bs_expr_accept(c, "?")) {
+		return;
+	}
+	bs_expr_comma_expr(c);
+	if (!bs_expr_accept(c, ":")) {
+		bs_expr_error(c, "missing ':'");
+	}
+	bs_expr_cond(c);
+	bs_expr_emit_op(c, bs_expr_select);
+}
+
+static void bs_expr_comma_expr(struct bs_expr_compiler *c)
+{
+	bs_expr_cond(c);
+	while (!c->err && bs_expr_accept(c, ",")) {
+		bs_expr_cond(c);
+		bs_expr_emit_op(c, bs_expr_comma);
+	}
+}
+
+/* returns 0, or non-zero with c->err set */
+static int bs_expr_compile(struct bs_expr_compiler *c)
+{
+	if (!c->len) {
+		bs_expr_error(c, "no expression");
+	}
+	bs_expr_comma_expr(c);
+	if (!c->err && c->pos < c->len) {
+		bs_expr_error(c, "missing binary operator");
+	}
+	return c->err != NULL;
+}
+
+/*
+ * Can a macro with this body stand in for its value? Only if the body is
+ * one operand: unary operators in front of a single token, of a
+ * parenthesized group, of "defined X", or of "name(...)".
+ */
+static int bs_expr_closed(const struct bs_token *toks, size_t len)
+{
+	size_t i = 0;
+	while (i < len && (bs_expr_is(toks + i, "+")
+			   || bs_expr_is(toks + i, "-")
+			   || bs_expr_is(toks + i, "~")
+			   || bs_expr_is(toks + i, "!"))) {
+		++i;
+	}
+	if (i + 1 == len) {
+		return 1;
+	}
+	if (i + 2 == len && bs_expr_ident_is(toks + i, "defined")) {
+		return 1;
+	}
+	if (i + 1 < len && toks[i].kind == bs_token_ident) {
+		++i;
+	}
+	if (i >= len || !bs_expr_is(toks + i, "(")) {
+		return 0;
+	}
+	size_t depth = 0;
+	for (; i < len; ++i) {
+		if (bs_expr_is(toks + i, "(")) {
+			++depth;
+		} else if (bs_expr_is(toks + i, ")") && --depth == 0) {
+			return i + 1 == len;
+		}
+	}
+	return 0;
+}
+
+/*********/
+/* cache */
+/*********/
+struct bs_expr_prog {
+	struct bs_expr_prog *next;	/* in its bucket */
+	unsigned long long hash;
+	const char *text;
+	size_t text_len;
+	int ok;			/* compiled, as it is written */
+	int closed;		/* as a macro body, one operand */
+	size_t depth;
+	size_t len;
+	struct bs_expr_insn insns[];
+};
+
+struct bs_expr_cache {
+	struct bs_arena arena;
+	struct bs_expr_prog **buckets;
+	size_t buckets_len;	/* a power of two */
+	size_t count;
+};
+
+#define BS_EXPR_CACHE_MIN 256
+#define BS_EXPR_TOKENS_INLINE 64
+
+static _Thread_local struct bs_expr_cache bs_expr_cache;
+
+static int bs_expr_cache_reserve(void)
+{
+	struct bs_expr_cache *ec = &bs_expr_cache;
+	if (ec->count < ec->buckets_len) {
+		return 0;
+	}
+	size_t len = ec->buckets_len ? ec->buckets_len * 2 : BS_EXPR_CACHE_MIN;
+	struct bs_expr_prog **buckets;
+	buckets = bs_malloc(len * sizeof(struct bs_expr_prog *));
+	if (!buckets) {
+		return 1;
+	}
+	memset(buckets, 0x00, len * sizeof(struct bs_expr_prog *));
+	for (size_t i = 0; i < ec->buckets_len; ++i) {
+		while (ec->buckets[i]) {
+			struct bs_expr_prog *p = ec->buckets[i];
+			ec->buckets[i] = p->next;
+			p->next = buckets[p->hash & (len - 1)];
+			buckets[p->hash & (len - 1)] = p;
+		}
+	}
+	bs_free(ec->buckets);
+	ec->buckets = buckets;
+	ec->buckets_len = len;
+	return 0;
+}
+
+/* lexes and compiles "text", once; NULL if out of memory */
+static const struct bs_expr_prog *bs_expr_compiled(const char *text,
+						   size_t len)
+{
+	struct bs_expr_cache *ec = &bs_expr_cache;
+	unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, text, len);
+	if (ec->buckets_len) {
+		struct bs_expr_prog *p = ec->buckets[hash & (ec->buckets_len
+							     - 1)];
+		for (; p; p = p->next) {
+			if (p->hash == hash && p->text_len == len
+			    && memcmp(p->text, text, len) == 0) {
+				return p;
+			}
+		}
+	}
+	if (bs_expr_cache_reserve()) {
+		return NULL;
+	}
+
+	struct bs_token inline_toks[BS_EXPR_TOKENS_INLINE];
+	struct bs_token *toks = inline_toks;
+	size_t toks_len = 0;
+	size_t toks_size = BS_EXPR_TOKENS_INLINE;
+	struct bs_token tok;
+	for (size_t pos = 0; bs_lex(text, len, &pos, &tok);) {
+		if (toks_len == toks_size) {
+			toks_size *= 2;
+			struct bs_token *more;
+			more = bs_malloc(toks_size * sizeof(struct bs_token));
+			if (!more) {
+				toks_len = 0;
+				break;
+			}
+			memcpy(more, toks, toks_len * sizeof(struct bs_token));
+			if (toks != inline_toks) {
+				bs_free(toks);
+			}
+			toks = more;
+		}
+		toks[toks_len++] = tok;
+	}
+
+	struct bs_expr_compiler compiler;
+	struct bs_expr_compiler *c = &compiler;
+	bs_expr_compiler_init(c, toks, toks_len);
+	int ok = (toks_len || !len) && !bs_expr_compile(c);
+	size_t insns_len = ok ? c->insns_len : 0;
+
+	size_t size = sizeof(struct bs_expr_prog)
+	    + insns_len * sizeof(struct bs_expr_insn) + len + 1;
+	struct bs_expr_prog *p = bs_arena_alloc(&ec->arena, size);
+	if (p) {
+		char *copy = (char *)(p->insns + insns_len);
+		memcpy(copy, text, len);
+		copy[len] = '\0';
+		p->hash = hash;
+		p->text = copy;
+		p->text_len = len;
+		p->ok = ok;
+		p->closed = ok && bs_expr_closed(toks, toks_len);
+		p->depth = c->max_depth;
+		p->len = insns_len;
+		for (size_t i = 0; i < insns_len; ++i) {
+			p->insns[i] = c->insns[i];
+			if (p->insns[i].op >= bs_expr_ident) {
+				/* names point into the text, now the copy */
+				p->insns[i].u.name = copy
+				    + (p->insns[i].u.name - text);
+			}
+		}
+		size_t bucket = hash & (ec->buckets_len - 1);
+		p->next = ec->buckets[bucket];
+		ec->buckets[bucket] = p;
+		++ec->count;
+	}
+	bs_expr_compiler_release(c);
+	if (toks != inline_toks) {
+		bs_free(toks);
+	}
+	return p;
+}
+
+void bs_expr_cache_clear(void)
+{
+	bs_free(bs_expr_cache.buckets);
+	bs_arena_release(&bs_expr_cache.arena);
+	memset(&bs_expr_cache, 0x00, sizeof(struct bs_expr_cache));
+}
+
+/***********/
+/* running */
+/***********/
+#define BS_EXPR_FALLBACK (-1)
+#define BS_EXPR_NESTING_MAX 64
+
+/* the macros whose bodies are being run, which may not expand again */
+struct bs_expr_active {
+	const struct bs_macro *macro;
+	const struct bs_expr_active *next;
+	size_t depth;
+};
+
+static struct bs_expr_val bs_expr_apply(enum bs_expr_op op,
+					struct bs_expr_val a,
+					struct bs_expr_val b)
+{
+	struct bs_expr_val r = { 0, a.is_unsigned || b.is_unsigned,
+		a.poison || b.poison
+	};
+	long long sa = (long long)a.v;
+	long long sb = (long long)b.v;
+	unsigned long long count;
+	int cmp = r.is_unsigned ? (a.v > b.v) - (a.v < b.v)
+	    : (sa > sb) - (sa < sb);
+
+	switch (op) {
+	case bs_expr_mul:
+		r.v = a.v * b.v;
+		break;
+	case bs_expr_div:
+	case bs_expr_mod:
+		if (!b.v) {
+			r.poison = 1;
+		} else if (r.is_unsigned) {
+			r.v = (op == bs_expr_div) ? a.v / b.v : a.v % b.v;
+		} else if (sb == -1) {
+			/* LLONG_MIN / -1 wraps, rather than trapping */
+			r.v = (op == bs_expr_div) ? -a.v : 0;
+		} else {
+			r.v = (unsigned long long)((op == bs_expr_div)
+						   ? sa / sb : sa % sb);
+		}
+		break;
+	case bs_expr_add:
+		r.v = a.v + b.v;
+		break;
+	case bs_expr_sub:
+		r.v = a.v - b.v;
+		break;
+	case bs_expr_shl:
+	case bs_expr_shr:
+		/* a negative count shifts the other way, as GCC does */
+		r.is_unsigned = a.is_unsigned;
+		if (!b.is_unsigned && sb < 0) {
+			op = (op == bs_expr_shl) ? bs_expr_shr : bs_expr_shl;
+			count = -b.v;
+		} else {
+			count = b.v;
+		}
+		if (op == bs_expr_shl) {
+			r.v = (count >= 64) ? 0 : a.v << count;
+		} else if (a.is_unsigned || sa >= 0) {
+			r.v = (count >= 64) ? 0 : a.v >> count;
+		} else {
+			r.v = (count >= 64) ? ~0ULL : ~(~a.v >> count);
+		}
+		break;
+	case bs_expr_lt:
+		r.v = (cmp < 0);
+		r.is_unsigned = 0;
+		break;
+	case bs_expr_gt:
+		r.v = (cmp > 0);
+		r.is_unsigned = 0;
+		break;
+	case bs_expr_le:
+		r.v = (cmp <= 0);
+		r.is_unsigned = 0;
+		break;
+	case bs_expr_ge:
+		r.v = (cmp >= 0);
+		r.is_unsigned = 0;
+		break;
+	case bs_expr_eq:
+		r.v = (a.v == b.v);
+		r.is_unsigned = 0;
+		break;
+	case bs_expr_ne:
+		r.v = (a.v != b.v);
+		r.is_unsigned = 0;
+		break;
+	case bs_expr_and:
+		r.v = a.v & b.v;
+		break;
+	case bs_expr_xor:
+		r.v = a.v ^ b.v;
+		break;
+	case bs_expr_or:
+		r.v = a.v | b.v;
+		break;
+	case bs_expr_land:
+		/* the right is not evaluated if the left decides */
+		r.v = (a.v && b.v);
+		r.is_unsigned = 0;
+		r.poison = a.poison || (a.v && b.poison);
+		break;
+	case bs_expr_lor:
+		r.v = (a.v || b.v);
+		r.is_unsigned = 0;
+		r.poison = a.poison || (!a.v && b.poison);
+		break;
+	case bs_expr_comma:
+		r = b;
+		r.poison = a.poison || b.poison;
+		break;
+	default:
+		break;
+	}
+	return r;
+}
+
+static int bs_expr_run(const struct bs_expr_insn *insns, size_t len,
+		       size_t depth, int expanded,
+		       const struct bs_expr_active *active,
+		       struct bs_expr_val *result, FILE *log);
+
+static int bs_expr_has(const struct bs_expr_insn *insn, FILE *log)
+{
+	char name[PATH_MAX];
+	if (insn->len >= PATH_MAX) {
+		return 0;
+	}
+	memcpy(name, insn->u.name, insn->len);
+	name[insn->len] = '\0';
+
+	const char *path = NULL;
+	int fd = -1;
+	enum bs_search_kind kind = insn->flag ? bs_search_angle
+	    : bs_search_quote;
+	const char *from = bs_search_from();
+	int found = !bs_search_find(name, kind, from, &path, &fd, log);
+	if (fd >= 0) {
+		bs_close(fd);
+	}
+	/* not a dependency, but its answer is part of the unit's */
+	if (bs_deps_note(bs_deps_probe, insn->flag, name, found ? path : "",
+			 from)) {
+		Bs_log_error(log, "out of memory noting '%s'", name);
+	}
+	return found;
+}
+
+/* an identifier: 0, or the value of its object-like macro's body */
+static int bs_expr_macro(const struct bs_expr_insn *insn,
+			 const struct bs_expr_active *active,
+			 struct bs_expr_val *val, FILE *log)
+{
+	memset(val, 0x00, sizeof(struct bs_expr_val));
+	const struct bs_macro *m = bs_macro_find(insn->u.name, insn->len);
+	if (!m) {
+		return 0;
+	}
+	for (const struct bs_expr_active *a = active; a; a = a->next) {
+		if (a->macro == m) {
+			return 0;
+		}
+	}
+	if (m->function_like
+	    || (active && active->depth >= BS_EXPR_NESTING_MAX)) {
+		return BS_EXPR_FALLBACK;
+	}
+	const struct bs_expr_prog *p = bs_expr_compiled(m->body, m->body_len);
+	if (!p) {
+		Bs_log_error(log, "out of memory compiling '%s'", m->body);
+		return ENOMEM;
+	}
+	if (!p->ok || !p->closed) {
+		return BS_EXPR_FALLBACK;
+	}
+	struct bs_expr_active self = { m, active, active ? active->depth + 1
+		: 1
+	};
+	return bs_expr_run(p->insns, p->len, p->depth, 0, &self, val, log);
+}
+
+/*
+ * A division by zero only poisons its value, which is an error if it
+ * makes it to the result: 0 && 1 / 0 is fine. Returns 0, an error, or
+ * BS_EXPR_FALLBACK if a macro needs a real expansion.
+ */
+static int bs_expr_run(const struct bs_expr_insn *insns, size_t len,
+		       size_t depth, int expanded,
+		       const struct bs_expr_active *active,
+		       struct bs_expr_val *result, FILE *log)
+{
+	struct bs_expr_val stack[depth ? depth : 1];
+	size_t sp = 0;
+	for (size_t i = 0; i < len; ++i) {
+		const struct bs_expr_insn *insn = insns + i;
+		struct bs_expr_val *top = stack + sp - 1;
+		int err;
+		switch (insn->op) {
+		case bs_expr_push:
+			stack[sp].v = insn->u.v;
+			stack[sp].is_unsigned = insn->flag;
+			stack[sp++].poison = 0;
+			break;
+		case bs_expr_defined:
+			stack[sp].v = bs_macro_find(insn->u.name, insn->len)
+			    != NULL;
+			stack[sp].is_unsigned = 0;
+			stack[sp++].poison = 0;
+			break;
+		case bs_expr_has_include:
+			stack[sp].v = (unsigned)bs_expr_has(insn, log);
+			stack[sp].is_unsigned = 0;
+			stack[sp++].poison = 0;
+			break;
+		case bs_expr_ident:
+			memset(stack + sp, 0x00, sizeof(struct bs_expr_val));
+			if (!expanded) {
+				err = bs_expr_macro(insn, active, stack + sp,
+						    log);
+				if (err) {
+					return err;
+				}
+			}
+			++sp;
+			break;
+		case bs_expr_neg:
+			top->v = -top->v;
+			break;
+		case bs_expr_compl:
+			top->v = ~top->v;
+			break;
+		case bs_expr_not:
+			top->v = !top->v;
+			top->is_unsigned = 0;
+			break;
+		case bs_expr_select:{
+				sp -= 2;
+				top = stack + sp - 1;
+				struct bs_expr_val *b = top + 1;
+				struct bs_expr_val *c = top + 2;
+				struct bs_expr_val r = top->v ? *b : *c;
+				r.is_unsigned = b->is_unsigned
+				    || c->is_unsigned;
+				r.poison = r.poison || top->poison;
+				*top = r;
+			}
+			break;
+		default:
+			--sp;
+			stack[sp - 1] = bs_expr_apply(insn->op, stack[sp - 1],
+						      stack[sp]);
+			break;
+		}
+	}
+	*result = stack[0];
+	return 0;
+}
+
+static int bs_expr_result(const struct bs_expr_val *r, long long *value,
+			  FILE *log)
+{
+	if (r->poison) {
+		Bs_log_error(log, "division by zero in #if expression");
+		return 1;
+	}
+	*value = (long long)r->v;
+	return 0;
+}
+
+int bs_expr_eval(const struct bs_token *toks, size_t len, long long *value,
+		 FILE *log)
+{
+	struct bs_expr_compiler compiler;
+	struct bs_expr_compiler *c = &compiler;
+	bs_expr_compiler_init(c, toks, len);
+	int err = bs_expr_compile(c);
+	if (err) {
+		Bs_log_error(log, "%s in #if expression", c->err);
+	} else {
+		struct bs_expr_val r;
+		err = bs_expr_run(c->insns, c->insns_len, c->max_depth, 1,
+				  NULL, &r, log);
+		err = err ? err : bs_expr_result(&r, value, log);
+	}
+	bs_expr_compiler_release(c);
+	return err;
+}
+
+int bs_expr_if(const char *text, size_t len, long long *value, FILE *log)
+{
+	const struct bs_expr_prog *p = bs_expr_compiled(text, len);
+	if (!p) {
+		Bs_log_error(log, "out of memory compiling '%.*s'", (int)len,
+			     text);
+		return ENOMEM;
+	}
+	struct bs_expr_val r;
+	int err = BS_EXPR_FALLBACK;
+	if (p->ok) {
+		err = bs_expr_run(p->insns, p->len, p->depth, 0, NULL, &r, log);
+	}
+	if (err == BS_EXPR_FALLBACK) {
+		const struct bs_token *toks = NULL;
+		size_t toks_len = 0;
+		err = bs_macro_expand_if(text, len, &toks, &toks_len, log);
+		return err ? err : bs_expr_eval(toks, toks_len, value, log);
+	}
+	return err ? err : bs_expr_result(&r, value, log);
+}
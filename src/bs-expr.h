@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_EXPR_H
+#define BS_EXPR_H 1
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "bs-macro.h"
+
+/*
+ * #if expressions, with the integer arithmetic of intmax_t and uintmax_t.
+ *
+ * Each distinct expression text is parsed once, into a short postfix
+ * program which is kept in a cache, and which looks up its identifiers
+ * in the macro table each time it runs: "defined X" checks X, and an
+ * object-like macro stands for its own (also compiled, also cached)
+ * body, if that body is a single operand such as "0x0500" or "(A|B)".
+ * Anything else, function-like macros for one, falls back to expanding
+ * the text first and then compiling the result, as a preprocessor must.
+ */
+
+/* returns 0, or non-zero on a syntax error or division by zero (logged) */
+int bs_expr_if(const char *text, size_t len, long long *value, FILE *log);
+
+/*
+ * evaluates tokens which have already been macro-expanded, identifiers
+ * which are left over count as 0
+ */
+int bs_expr_eval(const struct bs_token *toks, size_t len, long long *value,
+		 FILE *log);
+
+/* forget every compiled expression */
+void bs_expr_cache_clear(void);
+
+#endif /* BS_EXPR_H */
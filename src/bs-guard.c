@@ -0,0 +1,408 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "bs-guard.h"
+#include "bs-scan.h"
+#include "bs-util.h"
+
+/*
+ * A small lexer over the raw file contents: it understands comments,
+ * string and character literals and backslash-newline splices well
+ * enough to find the directives at the start of each line.
+ */
+struct bs_guard_lex {
+	const char *p;
+	const char *end;
+};
+
+static void bs_guard_splice(struct bs_guard_lex *lx)
+{
+	while ((lx->end - lx->p) >= 2 && lx->p[0] == '\\' && lx->p[1] == '\n') {
+		lx->p += 2;
+	}
+}
+
+static int bs_guard_at(struct bs_guard_lex *lx, size_t i, char c)
+{
+	return (size_t)(lx->end - lx->p) > i && lx->p[i] == c;
+}
+
+static void bs_guard_skip_block_comment(struct bs_guard_lex *lx)
+{
+	lx->p += 2;
+	while (lx->p < lx->end) {
+		const char *star = memchr(lx->p, '*', lx->end - lx->p);
+		if (!star) {
+			break;
+		}
+		lx->p = star + 1;
+		if (bs_guard_at(lx, 0, '/')) {
+			lx->p += 1;
+			return;
+		}
+	}
+	lx->p = lx->end;
+}
+
+/* whitespace and comments, newlines too if "cross_lines" */
+static void bs_guard_skip_space(struct bs_guard_lex *lx, int cross_lines)
+{
+	while (1) {
+		bs_guard_splice(lx);
+		if (lx->p >= lx->end) {
+			return;
+		}
+		char c = *lx->p;
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v'
+		    || (c == '\n' && cross_lines)) {
+			lx->p += 1;
+		} else if (c == '/' && bs_guard_at(lx, 1, '*')) {
+			bs_guard_skip_block_comment(lx);
+		} else if (c == '/' && bs_guard_at(lx, 1, '/')) {
+			const char *eol = memchr(lx->p, '\n', lx->end - lx->p);
+			lx->p = eol ? eol : lx->end;
+		} else {
+			return;
+		}
+	}
+}
+
+static void bs_guard_skip_literal(struct bs_guard_lex *lx, char quote)
+{
+	lx->p += 1;
+	while (lx->p < lx->end) {
+		char c = *lx->p;
+		if (c == '\\' && (lx->end - lx->p) >= 2) {
+			lx->p += 2;
+		} else if (c == quote) {
+			lx->p += 1;
+			return;
+		} else if (c == '\n') {
+			return;
+		} else {
+			lx->p += 1;
+		}
+	}
+}
+
+static const struct bs_scan_set bs_guard_line_set =
+Bs_scan_set('\n', '"', '\'', '/');
+
+/* to just past the end of the logical line */
+static void bs_guard_skip_line(struct bs_guard_lex *lx)
+{
+	while (lx->p < lx->end) {
+		lx->p += bs_scan(lx->p, lx->end - lx->p, &bs_guard_line_set);
+		if (lx->p >= lx->end) {
+			return;
+		}
+		char c = *lx->p;
+		if (c == '\n') {
+			int spliced = (lx->p[-1] == '\\');
+			lx->p += 1;
+			if (!spliced) {
+				return;
+			}
+		} else if (c == '"' || c == '\'') {
+			bs_guard_skip_literal(lx, c);
+		} else if (bs_guard_at(lx, 1, '*')) {
+			bs_guard_skip_block_comment(lx);
+		} else if (bs_guard_at(lx, 1, '/')) {
+			bs_guard_skip_space(lx, 0);
+		} else {
+			lx->p += 1;
+		}
+	}
+}
+
+static int bs_guard_is_ident_char(char c, int first)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+	    || (!first && c >= '0' && c <= '9');
+}
+
+static size_t bs_guard_ident(struct bs_guard_lex *lx, const char **start)
+{
+	bs_guard_skip_space(lx, 0);
+	*start = lx->p;
+	while (lx->p < lx->end && bs_guard_is_ident_char(*lx->p,
+							 lx->p == *start)) {
+		lx->p += 1;
+	}
+	return (size_t)(lx->p - *start);
+}
+
+static int bs_guard_word(const char *s, size_t len, const char *word)
+{
+	return len == strlen(word) && memcmp(s, word, len) == 0;
+}
+
+static int bs_guard_punct(struct bs_guard_lex *lx, char c)
+{
+	bs_guard_skip_space(lx, 0);
+	if (lx->p < lx->end && *lx->p == c) {
+		lx->p += 1;
+		return 1;
+	}
+	return 0;
+}
+
+static int bs_guard_at_eol(struct bs_guard_lex *lx)
+{
+	bs_guard_skip_space(lx, 0);
+	return lx->p >= lx->end || *lx->p == '\n';
+}
+
+/* after "#if": "!defined X" or "!defined(X)", nothing else */
+static size_t bs_guard_if_not_defined(struct bs_guard_lex *lx,
+				      const char **macro)
+{
+	const char *word;
+	if (!bs_guard_punct(lx, '!')) {
+		return 0;
+	}
+	size_t len = bs_guard_ident(lx, &word);
+	if (!bs_guard_word(word, len, "defined")) {
+		return 0;
+	}
+	int paren = bs_guard_punct(lx, '(');
+	len = bs_guard_ident(lx, macro);
+	if (!len || (paren && !bs_guard_punct(lx, ')'))) {
+		return 0;
+	}
+	return bs_guard_at_eol(lx) ? len : 0;
+}
+
+enum bs_guard_kind bs_guard_detect(const char *buf, size_t len,
+				   const char **macro, size_t *macro_len)
+{
+	struct bs_guard_lex lexer = { buf, buf + len };
+	struct bs_guard_lex *lx = &lexer;
+
+	enum { before, inside, after } phase = before;
+	const char *guard = NULL;
+	size_t guard_len = 0;
+	int expect_define = 0;
+	size_t depth = 0;
+	int ok = 1;
+	int once = 0;
+
+	while (!once) {
+		bs_guard_skip_space(lx, 1);
+		if (lx->p >= lx->end) {
+			break;
+		}
+		if (*lx->p != '#') {
+			/* text outside of the guard means it does not guard */
+			ok = ok && (phase == inside);
+			bs_guard_skip_line(lx);
+			continue;
+		}
+
+		lx->p += 1;
+		const char *name;
+		size_t name_len = bs_guard_ident(lx, &name);
+		const char *word;
+		size_t word_len;
+
+		if (bs_guard_word(name, name_len, "pragma")) {
+			word_len = bs_guard_ident(lx, &word);
+			once = once || bs_guard_word(word, word_len, "once");
+		} else if (!name_len || !ok) {
+			/* the null directive, or only "#pragma once" matters */
+		} else if (phase == before) {
+			if (bs_guard_word(name, name_len, "ifndef")) {
+				guard_len = bs_guard_ident(lx, &guard);
+				ok = guard_len && bs_guard_at_eol(lx);
+			} else if (bs_guard_word(name, name_len, "if")) {
+				guard_len = bs_guard_if_not_defined(lx, &guard);
+				ok = (guard_len != 0);
+			} else {
+				ok = 0;
+			}
+			phase = inside;
+			depth = 1;
+			expect_define = 1;
+		} else if (phase == inside) {
+			if (expect_define) {
+				word_len = bs_guard_ident(lx, &word);
+				ok = bs_guard_word(name, name_len, "define")
+				    && word_len == guard_len
+				    && memcmp(word, guard, guard_len) == 0;
+				expect_define = 0;
+			} else if (bs_guard_word(name, name_len, "if")
+				   || bs_guard_word(name, name_len, "ifdef")
+				   || bs_guard_word(name, name_len, "ifndef")) {
+				++depth;
+			} else if (bs_guard_word(name, name_len, "endif")) {
+				if (--depth == 0) {
+					phase = after;
+				}
+			} else if (depth == 1
+				   && (bs_guard_word(name, name_len, "else")
+				       || bs_guard_word(name, name_len, "elif")
+				       || bs_guard_word(name, name_len,
+							"elifdef")
+				       || bs_guard_word(name, name_len,
+							"elifndef"))) {
+				ok = 0;
+			}
+		} else {
+			ok = 0;
+		}
+		bs_guard_skip_line(lx);
+	}
+
+	if (once) {
+		return bs_guard_once;
+	}
+	if (ok && phase == after) {
+		*macro = guard;
+		*macro_len = guard_len;
+		return bs_guard_macro;
+	}
+	return bs_guard_none;
+}
+
+#define BS_GUARD_BUCKETS 1024
+
+/*
+ * What a file is guarded by does not depend on the translation unit, so
+ * the table is shared by the threads of a batch. Entries are not freed
+ * until the table is cleared: one replaced by a rescan of a changed file
+ * is moved to the "retired" list.
+ */
+static struct bs_guard_entry *bs_guard_table[BS_GUARD_BUCKETS];
+static struct bs_guard_entry *bs_guard_retired;
+static const struct bs_scan_set bs_guard_scan_unclean =
+Bs_scan_set('#', '/', '\\');
+
+size_t bs_guard_clean_from(const char *buf, size_t len)
+{
+	size_t last = len;
+	for (size_t i = 0; i < len; ++i) {
+		i += bs_scan(buf + i, len - i, &bs_guard_scan_unclean);
+		if (i == len) {
+			break;
+		}
+		last = i;
+	}
+	if (last == len) {
+		return 0;
+	}
+	/* a splice joins the next line to this one */
+	size_t from = last + 1;
+	if (buf[last] == '\\' && from < len && buf[from] == '\n') {
+		++from;
+	}
+	const char *eol = memchr(buf + from, '\n', len - from);
+	return eol ? (size_t)(eol - buf) + 1 : len;
+}
+
+static pthread_mutex_t bs_guard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int bs_guard_same_file(const struct bs_guard_entry *e,
+			      const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino
+	    && e->size == st->st_size
+	    && e->mtime.tv_sec == st->st_mtim.tv_sec
+	    && e->mtime.tv_nsec == st->st_mtim.tv_nsec
+	    && e->ctime.tv_sec == st->st_ctim.tv_sec
+	    && e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* the entry for "path", whatever version of the file it was scanned from */
+static struct bs_guard_entry **bs_guard_lookup(unsigned long long hash,
+					       const char *path)
+{
+	struct bs_guard_entry **pos = bs_guard_table + hash % BS_GUARD_BUCKETS;
+	for (; *pos; pos = &(*pos)->next) {
+		if ((*pos)->hash == hash && strcmp((*pos)->path, path) == 0) {
+			return pos;
+		}
+	}
+	return pos;
+}
+
+struct bs_guard_entry *bs_guard_find(const char *path, const struct stat *st)
+{
+	unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, path, strlen(path));
+	pthread_mutex_lock(&bs_guard_mutex);
+	struct bs_guard_entry *e = *bs_guard_lookup(hash, path);
+	pthread_mutex_unlock(&bs_guard_mutex);
+	return (e && bs_guard_same_file(e, st)) ? e : NULL;
+}
+
+int bs_guard_record(const char *path, const struct stat *st,
+		    enum bs_guard_kind kind, const char *macro,
+		    size_t macro_len, off_t clean_from)
+{
+	size_t path_size = strlen(path) + 1;
+	if (kind != bs_guard_macro) {
+		macro_len = 0;
+	}
+	size_t size = sizeof(struct bs_guard_entry) + path_size + macro_len + 1;
+	struct bs_guard_entry *e = bs_malloc(size);
+	if (!e) {
+		return 1;
+	}
+	memset(e, 0x00, size);
+
+	e->hash = bs_fnv1a(BS_FNV1A_INIT, path, path_size - 1);
+	e->path = (char *)(e + 1);
+	memcpy(e->path, path, path_size);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+	e->kind = kind;
+	e->clean_from = clean_from;
+	if (kind == bs_guard_macro) {
+		e->macro = e->path + path_size;
+		memcpy(e->macro, macro, macro_len);
+		e->macro_len = macro_len;
+	}
+
+	pthread_mutex_lock(&bs_guard_mutex);
+	struct bs_guard_entry **pos = bs_guard_lookup(e->hash, e->path);
+	struct bs_guard_entry *old = *pos;
+	if (old && bs_guard_same_file(old, st)) {
+		/* another thread scanned it as well */
+		pthread_mutex_unlock(&bs_guard_mutex);
+		bs_free(e);
+		return 0;
+	}
+	if (old) {
+		*pos = old->next;
+		old->next = bs_guard_retired;
+		bs_guard_retired = old;
+	}
+	size_t bucket = e->hash % BS_GUARD_BUCKETS;
+	e->next = bs_guard_table[bucket];
+	bs_guard_table[bucket] = e;
+	pthread_mutex_unlock(&bs_guard_mutex);
+	return 0;
+}
+
+void bs_guard_table_clear(void)
+{
+	pthread_mutex_lock(&bs_guard_mutex);
+	for (size_t i = 0; i < BS_GUARD_BUCKETS; ++i) {
+		while (bs_guard_table[i]) {
+			struct bs_guard_entry *e = bs_guard_table[i];
+			bs_guard_table[i] = e->next;
+			bs_free(e);
+		}
+	}
+	while (bs_guard_retired) {
+		struct bs_guard_entry *e = bs_guard_retired;
+		bs_guard_retired = e->next;
+		bs_free(e);
+	}
+	pthread_mutex_unlock(&bs_guard_mutex);
+}
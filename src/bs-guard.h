@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_GUARD_H
+#define BS_GUARD_H 1
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * The multiple-include optimization: a file which is wholly wrapped in
+ *	#ifndef X
+ *	#define X
+ *	...
+ *	#endif
+ * or which says "#pragma once", does not need to be opened again once it
+ * has been included, for as long as X stays defined.
+ */
+enum bs_guard_kind {
+	bs_guard_none = 0,	/* scanned, not guarded */
+	bs_guard_once,		/* #pragma once */
+	bs_guard_macro		/* #ifndef X / #define X ... #endif */
+};
+
+struct bs_guard_entry {
+	struct bs_guard_entry *next;
+	unsigned long long hash;
+	char *path;
+	dev_t dev;		/* the identity of the file when scanned */
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	enum bs_guard_kind kind;
+	char *macro;		/* NUL terminated, bs_guard_macro only */
+	size_t macro_len;
+	off_t clean_from;	/* see bs_guard_clean_from */
+};
+
+/* scans (unprocessed) file contents, *macro points into buf */
+enum bs_guard_kind bs_guard_detect(const char *buf, size_t len,
+				   const char **macro, size_t *macro_len);
+
+/*
+ * the offset of the start of the line after which (unprocessed) file
+ * contents have no '#', '/' or '\\', so no directive, comment or splice;
+ * "len" if the last line has one
+ */
+size_t bs_guard_clean_from(const char *buf, size_t len);
+
+/* NULL if the path has not been scanned yet, or was since changed */
+struct bs_guard_entry *bs_guard_find(const char *path, const struct stat *st);
+
+/*
+ * returns 0, or non-zero if out of memory; an entry for an older version
+ * of the file is replaced, though it stays valid until the table is
+ * cleared, as it may still be in use
+ */
+int bs_guard_record(const char *path, const struct stat *st,
+		    enum bs_guard_kind kind, const char *macro,
+		    size_t macro_len, off_t clean_from);
+
+void bs_guard_table_clear(void);
+
+#endif /* BS_GUARD_H */
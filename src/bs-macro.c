@@ -0,0 +1,1375 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <limits.h>
+#include <string.h>
+
+#include "bs-macro.h"
+
+/* a slot is empty (NULL), a tombstone, or holds a macro */
+struct bs_macro_slot {
+	unsigned long long hash;
+	struct bs_macro *macro;
+};
+
+static struct bs_macro bs_macro_tombstone;
+
+struct bs_macro_table {
+	struct bs_arena arena;
+	struct bs_macro_slot *slots;
+	size_t capacity;	/* a power of two */
+	size_t count;
+	size_t used;		/* count, plus tombstones */
+	unsigned long long version;
+};
+
+#define BS_MACRO_TABLE_MIN 1024
+
+/* each thread of a batch preprocesses its own translation unit */
+static _Thread_local struct bs_macro_table bs_macros;
+
+static unsigned long long bs_macro_hash(const char *name, size_t len)
+{
+	return bs_fnv1a(BS_FNV1A_INIT, name, len);
+}
+
+static struct bs_macro_slot *bs_macro_slot(unsigned long long hash,
+					   const char *name, size_t len,
+					   int for_insert)
+{
+	if (!bs_macros.capacity) {
+		return NULL;
+	}
+	size_t mask = bs_macros.capacity - 1;
+	struct bs_macro_slot *tombstone = NULL;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct bs_macro_slot *slot = bs_macros.slots + i;
+		struct bs_macro *m = slot->macro;
+		if (!m) {
+			if (!for_insert) {
+				return NULL;
+			}
+			return tombstone ? tombstone : slot;
+		}
+		if (m == &bs_macro_tombstone) {
+			if (!tombstone) {
+				tombstone = slot;
+			}
+		} else if (slot->hash == hash && m->name_len == len
+			   && memcmp(m->name, name, len) == 0) {
+			return slot;
+		}
+	}
+}
+
+struct bs_macro *bs_macro_find(const char *name, size_t name_len)
+{
+	if (!bs_macros.count) {
+		return NULL;
+	}
+	unsigned long long hash = bs_macro_hash(name, name_len);
+	struct bs_macro_slot *slot = bs_macro_slot(hash, name, name_len, 0);
+	return slot ? slot->macro : NULL;
+}
+
+/* keeps the load at or under one half, also clearing out tombstones */
+static int bs_macro_table_reserve(void)
+{
+	if ((bs_macros.used + 1) * 2 <= bs_macros.capacity) {
+		return 0;
+	}
+	size_t capacity = bs_macros.capacity ? bs_macros.capacity
+	    : BS_MACRO_TABLE_MIN;
+	while ((bs_macros.count + 1) * 2 > capacity) {
+		capacity *= 2;
+	}
+	size_t size = capacity * sizeof(struct bs_macro_slot);
+	struct bs_macro_slot *slots = bs_malloc(size);
+	if (!slots) {
+		return 1;
+	}
+	memset(slots, 0x00, size);
+
+	struct bs_macro_slot *old = bs_macros.slots;
+	size_t old_capacity = bs_macros.capacity;
+	bs_macros.slots = slots;
+	bs_macros.capacity = capacity;
+	bs_macros.used = bs_macros.count;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		struct bs_macro *m = old[i].macro;
+		if (m && m != &bs_macro_tombstone) {
+			size_t mask = capacity - 1;
+			size_t j = old[i].hash & mask;
+			while (slots[j].macro) {
+				j = (j + 1) & mask;
+			}
+			slots[j] = old[i];
+		}
+	}
+	bs_free(old);
+	return 0;
+}
+
+static int bs_macro_same(const struct bs_macro *m, int function_like,
+			 int variadic, const struct bs_token *params,
+			 size_t params_len, const char *body, size_t body_len)
+{
+	if (m->function_like != function_like || m->variadic != variadic
+	    || m->params_len != params_len || m->body_len != body_len
+	    || memcmp(m->body, body, body_len) != 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < params_len; ++i) {
+		if (m->params[i].len != params[i].len
+		    || memcmp(m->params[i].text, params[i].text,
+			      params[i].len) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The version of the table is the XOR of the fingerprints of all of the
+ * macros in it, so it names the set of definitions rather than the order
+ * they came in: two translation units which reach the same macros have
+ * the same version, and a cache keyed by it may be shared between them.
+ */
+static unsigned long long bs_macro_fingerprint(const struct bs_macro *m)
+{
+	unsigned char kind = (unsigned char)(m->function_like
+					     | (m->variadic << 1));
+	unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, m->name,
+					   m->name_len + 1);
+	hash = bs_fnv1a(hash, &kind, 1);
+	for (size_t i = 0; i < m->params_len; ++i) {
+		hash = bs_fnv1a(hash, m->params[i].text, m->params[i].len);
+		hash = bs_fnv1a(hash, ",", 1);
+	}
+	hash = bs_fnv1a(hash, m->body, m->body_len);
+	return bs_hash_mix(hash);
+}
+
+/* the body is lexed once, here, with the parameters already resolved */
+static void bs_macro_tokens(struct bs_macro *m, struct bs_token *tokens)
+{
+	size_t pos = 0;
+	struct bs_token tok;
+	for (size_t n = 0; bs_lex(m->body, m->body_len, &pos, &tok); ++n) {
+		if (tok.kind == bs_token_ident) {
+			for (size_t i = 0; i < m->params_len; ++i) {
+				if (tok.len == m->params[i].len
+				    && memcmp(tok.text, m->params[i].text,
+					      tok.len) == 0) {
+					tok.kind = bs_token_param;
+					tok.param = (unsigned short)i;
+					break;
+				}
+			}
+		}
+		tokens[n] = tok;
+	}
+}
+
+static int bs_macro_define_full(const char *name, size_t name_len,
+				int function_like, int variadic,
+				const struct bs_token *params,
+				size_t params_len, const char *body,
+				size_t body_len)
+{
+	if (bs_macro_table_reserve()) {
+		return 1;
+	}
+	unsigned long long hash = bs_macro_hash(name, name_len);
+	struct bs_macro_slot *slot = bs_macro_slot(hash, name, name_len, 1);
+	struct bs_macro *old = slot->macro;
+	if (old && old != &bs_macro_tombstone
+	    && bs_macro_same(old, function_like, variadic, params, params_len,
+			     body, body_len)) {
+		/* an identical redefinition changes nothing */
+		return 0;
+	}
+
+	size_t tokens_len = 0;
+	struct bs_token tok;
+	for (size_t pos = 0; bs_lex(body, body_len, &pos, &tok);) {
+		++tokens_len;
+	}
+	size_t names_size = 0;
+	for (size_t i = 0; i < params_len; ++i) {
+		names_size += params[i].len;
+	}
+
+	size_t size = sizeof(struct bs_macro)
+	    + (tokens_len + params_len) * sizeof(struct bs_token)
+	    + name_len + 1 + body_len + 1 + names_size;
+	struct bs_macro *m = bs_arena_alloc(&bs_macros.arena, size);
+	if (!m) {
+		return 1;
+	}
+	struct bs_token *tokens = (struct bs_token *)(m + 1);
+	struct bs_token *param_copies = tokens + tokens_len;
+	char *name_copy = (char *)(param_copies + params_len);
+	memcpy(name_copy, name, name_len);
+	name_copy[name_len] = '\0';
+	char *body_copy = name_copy + name_len + 1;
+	memcpy(body_copy, body, body_len);
+	body_copy[body_len] = '\0';
+	char *names = body_copy + body_len + 1;
+	for (size_t i = 0; i < params_len; ++i) {
+		param_copies[i] = params[i];
+		memcpy(names, params[i].text, params[i].len);
+		param_copies[i].text = names;
+		names += params[i].len;
+	}
+
+	m->name = name_copy;
+	m->name_len = name_len;
+	m->body = body_copy;
+	m->body_len = body_len;
+	m->function_like = function_like;
+	m->variadic = variadic;
+	m->params_len = params_len;
+	m->params = param_copies;
+	m->tokens_len = tokens_len;
+	m->tokens = tokens;
+	bs_macro_tokens(m, tokens);
+
+	if (!old) {
+		++bs_macros.used;
+	}
+	if (!old || old == &bs_macro_tombstone) {
+		++bs_macros.count;
+	} else {
+		bs_macros.version ^= bs_macro_fingerprint(old);
+	}
+	slot->hash = hash;
+	slot->macro = m;
+	bs_macros.version ^= bs_macro_fingerprint(m);
+	return 0;
+}
+
+int bs_macro_define(const char *name, size_t name_len, const char *body,
+		    size_t body_len)
+{
+	return bs_macro_define_full(name, name_len, 0, 0, NULL, 0, body,
+				    body_len);
+}
+
+void bs_macro_undef(const char *name, size_t name_len)
+{
+	if (!bs_macros.count) {
+		return;
+	}
+	unsigned long long hash = bs_macro_hash(name, name_len);
+	struct bs_macro_slot *slot = bs_macro_slot(hash, name, name_len, 0);
+	if (slot) {
+		bs_macros.version ^= bs_macro_fingerprint(slot->macro);
+		slot->macro = &bs_macro_tombstone;
+		--bs_macros.count;
+	}
+}
+
+size_t bs_macro_count(void)
+{
+	return bs_macros.count;
+}
+
+unsigned long long bs_macro_version(void)
+{
+	return bs_macros.version;
+}
+
+static void bs_expander_release(void);
+
+void bs_macro_table_clear(void)
+{
+	bs_free(bs_macros.slots);
+	bs_arena_release(&bs_macros.arena);
+	memset(&bs_macros, 0x00, sizeof(struct bs_macro_table));
+	bs_expander_release();
+}
+
+
+/*********/
+/* lexer */
+/*********/
+static int bs_is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static int bs_is_ident(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+	    || bs_is_digit(c);
+}
+
+static int bs_is_ident_start(char c)
+{
+	return bs_is_ident(c) && !bs_is_digit(c);
+}
+
+static int bs_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/* L"x", u"x", U"x" and u8"x" are literals, not identifiers */
+static int bs_is_literal_prefix(const char *s, size_t len)
+{
+	return (len == 1 && (s[0] == 'L' || s[0] == 'u' || s[0] == 'U'))
+	    || (len == 2 && s[0] == 'u' && s[1] == '8');
+}
+
+static size_t bs_skip_literal(const char *text, size_t i, size_t len)
+{
+	char quote = text[i++];
+	while (i < len && text[i] != quote && text[i] != '\n') {
+		i += (text[i] == '\\' && i + 1 < len) ? 2 : 1;
+	}
+	return (i < len && text[i] == quote) ? i + 1 : i;
+}
+
+/* pp-number: digits, identifier chars, '.', and signed exponents */
+static size_t bs_skip_pp_number(const char *text, size_t i, size_t len)
+{
+	while (i < len) {
+		char c = text[i];
+		if ((c == '+' || c == '-')
+		    && (text[i - 1] == 'e' || text[i - 1] == 'E'
+			|| text[i - 1] == 'p' || text[i - 1] == 'P')) {
+			++i;
+		} else if (bs_is_ident(c) || c == '.') {
+			++i;
+		} else {
+			break;
+		}
+	}
+	return i;
+}
+
+static size_t bs_punct_len(const char *s, size_t len)
+{
+	static const char *const puncts[] = {
+		"<<=", ">>=", "...", "->", "++", "--", "<<", ">>", "<=", ">=",
+		"==", "!=", "&&", "||", "*=", "/=", "%=", "+=", "-=", "&=",
+		"^=", "|=", "##", "::", NULL
+	};
+	for (size_t i = 0; puncts[i]; ++i) {
+		size_t n = (i < 3) ? 3 : 2;
+		if (n <= len && memcmp(s, puncts[i], n) == 0) {
+			return n;
+		}
+	}
+	return 1;
+}
+
+int bs_lex(const char *text, size_t len, size_t *pos, struct bs_token *tok)
+{
+	size_t i = *pos;
+	unsigned char flags = 0;
+	while (i < len && (bs_is_space(text[i]) || text[i] == '\n')) {
+		flags = BS_TOKEN_SPACE;
+		++i;
+	}
+	if (i >= len) {
+		*pos = i;
+		return 0;
+	}
+
+	size_t start = i;
+	char c = text[i];
+	unsigned char kind;
+	if (bs_is_ident_start(c)) {
+		while (i < len && bs_is_ident(text[i])) {
+			++i;
+		}
+		kind = bs_token_ident;
+		if (i < len && (text[i] == '"' || text[i] == '\'')
+		    && bs_is_literal_prefix(text + start, i - start)) {
+			i = bs_skip_literal(text, i, len);
+			kind = bs_token_literal;
+		}
+	} else if (bs_is_digit(c)
+		   || (c == '.' && i + 1 < len && bs_is_digit(text[i + 1]))) {
+		i = bs_skip_pp_number(text, i + 1, len);
+		kind = bs_token_number;
+	} else if (c == '"' || c == '\'') {
+		i = bs_skip_literal(text, i, len);
+		kind = bs_token_literal;
+	} else {
+		i += bs_punct_len(text + i, len - i);
+		kind = bs_token_punct;
+	}
+
+	tok->text = text + start;
+	tok->len = (unsigned int)(i - start);
+	tok->kind = kind;
+	tok->flags = flags;
+	tok->param = 0;
+	tok->hide = NULL;
+	*pos = i;
+	return 1;
+}
+
+static int bs_stream_grow(struct bs_token_stream *ts)
+{
+	size_t size = ts->size ? ts->size * 2 : 256;
+	size_t each = sizeof(unsigned int) * 2 + 2;
+	unsigned char *block = bs_malloc(size * each);
+	if (!block) {
+		return ENOMEM;
+	}
+	/* the widest arrays first, so that each is aligned */
+	unsigned int *off = (unsigned int *)block;
+	unsigned int *lens = off + size;
+	unsigned char *kind = (unsigned char *)(lens + size);
+	unsigned char *flags = kind + size;
+	if (ts->count) {
+		memcpy(off, ts->off, ts->count * sizeof(unsigned int));
+		memcpy(lens, ts->lens, ts->count * sizeof(unsigned int));
+		memcpy(kind, ts->kind, ts->count);
+		memcpy(flags, ts->flags, ts->count);
+	}
+	bs_free(ts->off);
+	ts->off = off;
+	ts->lens = lens;
+	ts->kind = kind;
+	ts->flags = flags;
+	ts->size = size;
+	return 0;
+}
+
+int bs_stream_lex(struct bs_token_stream *ts, const char *text, size_t len)
+{
+	ts->text = text;
+	ts->len = len;
+	ts->count = 0;
+	if (len > UINT_MAX) {
+		return EFBIG;
+	}
+	struct bs_token tok;
+	for (size_t pos = 0; bs_lex(text, len, &pos, &tok);) {
+		if (ts->count == ts->size && bs_stream_grow(ts)) {
+			return ENOMEM;
+		}
+		size_t i = ts->count++;
+		ts->off[i] = (unsigned int)(tok.text - text);
+		ts->lens[i] = tok.len;
+		ts->kind[i] = tok.kind;
+		ts->flags[i] = tok.flags;
+	}
+	return 0;
+}
+
+void bs_stream_release(struct bs_token_stream *ts)
+{
+	bs_free(ts->off);
+	memset(ts, 0x00, sizeof(struct bs_token_stream));
+}
+
+static void bs_stream_get(const struct bs_token_stream *ts, size_t i,
+			  struct bs_token *tok)
+{
+	tok->text = ts->text + ts->off[i];
+	tok->len = ts->lens[i];
+	tok->kind = ts->kind[i];
+	tok->flags = ts->flags[i];
+	tok->param = 0;
+	tok->hide = NULL;
+}
+
+/* just past the end of the i-th token, in the text */
+static size_t bs_stream_end(const struct bs_token_stream *ts, size_t i)
+{
+	return (size_t)ts->off[i] + ts->lens[i];
+}
+
+static int bs_token_is(const struct bs_token *tok, const char *s)
+{
+	size_t len = strlen(s);
+	return tok->len == len && memcmp(tok->text, s, len) == 0
+	    && tok->kind != bs_token_literal;
+}
+
+/* if written next to each other, would these become one token? */
+static int bs_would_paste(char a, char b)
+{
+	static const char ops[] = "+-*/%<>=&|^!:#";
+	if (bs_is_ident(a)) {
+		return bs_is_ident(b) || b == '.' || b == '"' || b == '\'';
+	}
+	if (a == '.') {
+		return b == '.' || bs_is_digit(b);
+	}
+	return memchr(ops, a, sizeof(ops) - 1) && b
+	    && (memchr(ops, b, sizeof(ops) - 1) || b == '.');
+}
+
+/*************/
+/* expansion */
+/*************/
+
+/*
+ * A hide set is the set of macros a token came out of, which must not
+ * expand again from it; they are short immutable lists sharing tails.
+ */
+struct bs_hideset {
+	const struct bs_macro *macro;
+	const struct bs_hideset *next;
+};
+
+struct bs_token_vec {
+	struct bs_token *toks;
+	size_t len;
+	size_t size;
+};
+
+/* where tokens come from once an expansion runs out of its own */
+struct bs_token_src {
+	const struct bs_token_stream *ts;
+	size_t pos;		/* the index of the next token */
+	int final;
+};
+
+struct bs_arg {
+	size_t start;		/* into bs_args.toks */
+	size_t end;
+	int expanded;		/* done lazily, at most once */
+	struct bs_token_vec expansion;
+};
+
+struct bs_args {
+	size_t len;
+	struct bs_token_vec toks;
+	struct bs_arg *arg;
+};
+
+/*
+ * Everything an expansion allocates comes from the arena, which is reset
+ * (keeping its chunks) when the outermost expansion is done.
+ */
+struct bs_expander {
+	struct bs_arena arena;
+	int oom;
+	FILE *log;
+};
+
+static _Thread_local struct bs_expander bs_expander;
+
+static void bs_expander_release(void)
+{
+	bs_arena_release(&bs_expander.arena);
+}
+
+#define BS_EXPAND_MORE (-1)
+
+static void *bs_expander_alloc(struct bs_expander *x, size_t size)
+{
+	void *p = bs_arena_alloc(&x->arena, size);
+	if (!p) {
+		x->oom = 1;
+	}
+	return p;
+}
+
+static void bs_token_push(struct bs_expander *x, struct bs_token_vec *v,
+			  const struct bs_token *tok)
+{
+	if (v->len == v->size) {
+		size_t size = v->size ? v->size * 2 : 16;
+		struct bs_token *toks;
+		toks = bs_expander_alloc(x, size * sizeof(struct bs_token));
+		if (!toks) {
+			return;
+		}
+		if (v->len) {
+			memcpy(toks, v->toks, v->len * sizeof(struct bs_token));
+		}
+		v->toks = toks;
+		v->size = size;
+	}
+	v->toks[v->len++] = *tok;
+}
+
+static int bs_hideset_has(const struct bs_hideset *hs,
+			  const struct bs_macro *m)
+{
+	for (; hs; hs = hs->next) {
+		if (hs->macro == m) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static const struct bs_hideset *bs_hideset_add(struct bs_expander *x,
+					       const struct bs_hideset *hs,
+					       const struct bs_macro *m)
+{
+	if (bs_hideset_has(hs, m)) {
+		return hs;
+	}
+	struct bs_hideset *node;
+	node = bs_expander_alloc(x, sizeof(struct bs_hideset));
+	if (!node) {
+		return hs;
+	}
+	node->macro = m;
+	node->next = hs;
+	return node;
+}
+
+static const struct bs_hideset *bs_hideset_union(struct bs_expander *x,
+						 const struct bs_hideset *a,
+						 const struct bs_hideset *b)
+{
+	for (; b; b = b->next) {
+		a = bs_hideset_add(x, a, b->macro);
+	}
+	return a;
+}
+
+static const struct bs_hideset *bs_hideset_intersect(struct bs_expander *x,
+						     const struct bs_hideset
+						     *a,
+						     const struct bs_hideset
+						     *b)
+{
+	const struct bs_hideset *result = NULL;
+	for (; a; a = a->next) {
+		if (bs_hideset_has(b, a->macro)) {
+			result = bs_hideset_add(x, result, a->macro);
+		}
+	}
+	return result;
+}
+
+/* 1 if there is a next token: the stack first, then the source */
+static int bs_token_next(struct bs_token_vec *stack, struct bs_token_src *src,
+			 struct bs_token *tok, int peek)
+{
+	if (stack->len) {
+		*tok = stack->toks[stack->len - 1];
+		stack->len -= peek ? 0 : 1;
+		return 1;
+	}
+	if (!src || src->pos >= src->ts->count) {
+		return 0;
+	}
+	bs_stream_get(src->ts, src->pos, tok);
+	src->pos += peek ? 0 : 1;
+	return 1;
+}
+
+/* the arguments after the '(', through the matching ')' */
+static int bs_collect_args(struct bs_expander *x, const struct bs_macro *m,
+			   struct bs_token_vec *stack,
+			   struct bs_token_src *src, struct bs_args *args,
+			   struct bs_token *rparen)
+{
+	size_t max = m->params_len ? m->params_len : 1;
+	memset(args, 0x00, sizeof(struct bs_args));
+	args->arg = bs_expander_alloc(x, max * sizeof(struct bs_arg));
+	if (!args->arg) {
+		return ENOMEM;
+	}
+	memset(args->arg, 0x00, max * sizeof(struct bs_arg));
+
+	size_t depth = 0;
+	struct bs_token tok;
+	while (1) {
+		if (!bs_token_next(stack, src, &tok, 0)) {
+			if (src && !src->final) {
+				return BS_EXPAND_MORE;
+			}
+			Bs_log_error(x->log, "unterminated argument list"
+				     " invoking macro '%s'", m->name);
+			return 1;
+		}
+		if (bs_token_is(&tok, "(")) {
+			++depth;
+		} else if (bs_token_is(&tok, ")")) {
+			if (!depth) {
+				break;
+			}
+			--depth;
+		} else if (!depth && bs_token_is(&tok, ",")
+			   && !(m->variadic
+				&& args->len + 1 == m->params_len)) {
+			if (args->len + 1 >= max) {
+				Bs_log_error(x->log, "macro '%s' passed too"
+					     " many arguments", m->name);
+				return 1;
+			}
+			args->arg[args->len++].end = args->toks.len;
+			args->arg[args->len].start = args->toks.len;
+			continue;
+		}
+		bs_token_push(x, &args->toks, &tok);
+	}
+	args->arg[args->len++].end = args->toks.len;
+	*rparen = tok;
+
+	if (!m->params_len && args->arg[0].start == args->arg[0].end) {
+		args->len = 0;
+	} else if (m->variadic && args->len + 1 == m->params_len) {
+		args->arg[args->len].start = args->toks.len;
+		args->arg[args->len++].end = args->toks.len;
+	}
+	if (args->len != m->params_len) {
+		Bs_log_error(x->log, "macro '%s' requires %zu arguments,"
+			     " but %zu given", m->name, m->params_len,
+			     args->len);
+		return 1;
+	}
+	return x->oom ? ENOMEM : 0;
+}
+
+static int bs_expand(struct bs_expander *x, struct bs_token_vec *stack,
+		     struct bs_token_src *src, struct bs_token_vec *out);
+
+/* an argument, fully macro-expanded on its own, done at most once */
+static int bs_arg_expanded(struct bs_expander *x, struct bs_args *args,
+			   size_t i, const struct bs_token_vec **expansion)
+{
+	struct bs_arg *arg = args->arg + i;
+	*expansion = &arg->expansion;
+	if (arg->expanded) {
+		return 0;
+	}
+	arg->expanded = 1;
+
+	struct bs_token_vec stack = { NULL, 0, 0 };
+	for (size_t j = arg->end; j > arg->start; --j) {
+		bs_token_push(x, &stack, args->toks.toks + j - 1);
+	}
+	return bs_expand(x, &stack, NULL, &arg->expansion);
+}
+
+/* the unexpanded tokens of an argument */
+static const struct bs_token *bs_arg_raw(const struct bs_args *args, size_t i,
+					 size_t *len)
+{
+	*len = args->arg[i].end - args->arg[i].start;
+	return args->toks.toks + args->arg[i].start;
+}
+
+/* #x, the spelling of the unexpanded argument as a string literal */
+static struct bs_token bs_stringify(struct bs_expander *x,
+				    const struct bs_args *args, size_t i)
+{
+	size_t len;
+	const struct bs_token *toks = bs_arg_raw(args, i, &len);
+
+	size_t size = 2;
+	for (size_t j = 0; j < len; ++j) {
+		size += 1 + (2 * toks[j].len);
+	}
+	struct bs_token str = { "\"\"", 2, bs_token_literal, 0, 0, NULL };
+	char *buf = bs_expander_alloc(x, size);
+	if (!buf) {
+		return str;
+	}
+
+	size_t n = 0;
+	buf[n++] = '"';
+	for (size_t j = 0; j < len; ++j) {
+		if (j && (toks[j].flags & BS_TOKEN_SPACE)) {
+			buf[n++] = ' ';
+		}
+		int escape = (toks[j].kind == bs_token_literal);
+		for (size_t k = 0; k < toks[j].len; ++k) {
+			char c = toks[j].text[k];
+			if (escape && (c == '"' || c == '\\')) {
+				buf[n++] = '\\';
+			}
+			buf[n++] = c;
+		}
+	}
+	buf[n++] = '"';
+	str.text = buf;
+	str.len = (unsigned int)n;
+	return str;
+}
+
+/* a ## b, a placemarker on either side just gives the other */
+static struct bs_token bs_paste(struct bs_expander *x,
+				const struct bs_token *a,
+				const struct bs_token *b)
+{
+	if (a->kind == bs_token_placemarker) {
+		struct bs_token result = *b;
+		result.flags = a->flags;
+		return result;
+	}
+	if (b->kind == bs_token_placemarker) {
+		return *a;
+	}
+
+	struct bs_token result = *a;
+	char *buf = bs_expander_alloc(x, a->len + b->len);
+	if (!buf) {
+		return result;
+	}
+	memcpy(buf, a->text, a->len);
+	memcpy(buf + a->len, b->text, b->len);
+	size_t pos = 0;
+	bs_lex(buf, a->len + b->len, &pos, &result);
+	result.len = a->len + b->len;
+	result.flags = a->flags;
+	result.hide = NULL;
+	return result;
+}
+
+/* the index of the ')' closing the '(' at "open" in the macro body */
+static size_t bs_vaopt_close(const struct bs_macro *m, size_t open)
+{
+	size_t depth = 0;
+	for (size_t i = open; i < m->tokens_len; ++i) {
+		if (bs_token_is(m->tokens + i, "(")) {
+			++depth;
+		} else if (bs_token_is(m->tokens + i, ")") && !--depth) {
+			return i;
+		}
+	}
+	return m->tokens_len;
+}
+
+static void bs_push_arg(struct bs_expander *x, struct bs_token_vec *r,
+			const struct bs_token *toks, size_t len,
+			const struct bs_token *param)
+{
+	static const struct bs_token placemarker = {
+		"", 0, bs_token_placemarker, 0, 0, NULL
+	};
+	if (!len) {
+		toks = &placemarker;
+		len = 1;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		struct bs_token tok = toks[i];
+		if (i == 0) {
+			tok.flags = param->flags;
+		}
+		bs_token_push(x, r, &tok);
+	}
+}
+
+/* the replacement list with the arguments in, pushed back for rescan */
+static int bs_subst(struct bs_expander *x, const struct bs_macro *m,
+		    struct bs_args *args, const struct bs_token *name,
+		    const struct bs_hideset *hs, struct bs_token_vec *stack)
+{
+	struct bs_token_vec r = { NULL, 0, 0 };
+	size_t vaopt_end = m->tokens_len;
+	size_t va = m->params_len - 1;
+
+	for (size_t i = 0; i < m->tokens_len; ++i) {
+		const struct bs_token *t = m->tokens + i;
+		const struct bs_token *next = NULL;
+		if (i + 1 < m->tokens_len) {
+			next = m->tokens + i + 1;
+		}
+		if (i == vaopt_end) {
+			continue;
+		}
+		if (!m->function_like) {
+			bs_token_push(x, &r, t);
+			continue;
+		}
+
+		if (bs_token_is(t, "#") && next
+		    && next->kind == bs_token_param) {
+			struct bs_token str;
+			str = bs_stringify(x, args, next->param);
+			str.flags = t->flags;
+			bs_token_push(x, &r, &str);
+			++i;
+		} else if (bs_token_is(t, "##") && next) {
+			struct bs_token left = { "", 0, bs_token_placemarker,
+				0, 0, NULL
+			};
+			if (r.len) {
+				left = r.toks[--r.len];
+			}
+			const struct bs_token *right = next;
+			size_t right_len = 1;
+			if (next->kind == bs_token_param) {
+				right = bs_arg_raw(args, next->param,
+						   &right_len);
+			}
+			if (m->variadic && next->kind == bs_token_param
+			    && next->param == va && bs_token_is(&left, ",")) {
+				/* gnu: ", ## args" drops the comma if empty */
+				if (right_len) {
+					bs_token_push(x, &r, &left);
+					bs_push_arg(x, &r, right, right_len,
+						    next);
+				}
+				++i;
+				continue;
+			}
+			bs_push_arg(x, &r, right, right_len, next);
+			struct bs_token *first = r.toks + r.len - right_len;
+			if (right_len == 0) {
+				first = r.toks + r.len - 1;
+			}
+			if (!x->oom) {
+				*first = bs_paste(x, &left, first);
+			}
+			++i;
+		} else if (t->kind == bs_token_param) {
+			const struct bs_token *toks;
+			size_t len;
+			if (next && bs_token_is(next, "##")) {
+				toks = bs_arg_raw(args, t->param, &len);
+			} else {
+				const struct bs_token_vec *expanded;
+				int err = bs_arg_expanded(x, args, t->param,
+							  &expanded);
+				if (err) {
+					return err;
+				}
+				toks = expanded->toks;
+				len = expanded->len;
+			}
+			bs_push_arg(x, &r, toks, len, t);
+		} else if (m->variadic && bs_token_is(t, "__VA_OPT__")
+			   && next && bs_token_is(next, "(")) {
+			size_t close = bs_vaopt_close(m, i + 1);
+			if (args->arg[va].start == args->arg[va].end) {
+				bs_push_arg(x, &r, NULL, 0, t);
+				i = close;
+			} else {
+				vaopt_end = close;
+				++i;
+			}
+		} else {
+			bs_token_push(x, &r, t);
+		}
+	}
+	if (x->oom) {
+		return ENOMEM;
+	}
+
+	/* the next token may need a space, so as not to join the last */
+	if (stack->len) {
+		stack->toks[stack->len - 1].flags |= BS_TOKEN_AVOID_PASTE;
+	}
+	size_t pushed_from = stack->len;
+	for (size_t i = r.len; i; --i) {
+		struct bs_token tok = r.toks[i - 1];
+		if (tok.kind == bs_token_placemarker) {
+			continue;
+		}
+		tok.hide = tok.hide ? bs_hideset_union(x, tok.hide, hs) : hs;
+		tok.flags &= (unsigned char)~BS_TOKEN_AVOID_PASTE;
+		bs_token_push(x, stack, &tok);
+	}
+	if (stack->len > pushed_from) {
+		/* the expansion takes the place, and spacing, of the name */
+		struct bs_token *tok = stack->toks + stack->len - 1;
+		tok->flags = (name->flags & BS_TOKEN_SPACE)
+		    | BS_TOKEN_AVOID_PASTE;
+	}
+	return x->oom ? ENOMEM : 0;
+}
+
+static int bs_expand(struct bs_expander *x, struct bs_token_vec *stack,
+		     struct bs_token_src *src, struct bs_token_vec *out)
+{
+	struct bs_token tok;
+	while (stack->len) {
+		tok = stack->toks[--stack->len];
+		struct bs_macro *m = NULL;
+		if (tok.kind == bs_token_ident) {
+			m = bs_macro_find(tok.text, tok.len);
+		}
+		if (!m || (tok.flags & BS_TOKEN_NO_EXPAND)
+		    || bs_hideset_has(tok.hide, m)) {
+			bs_token_push(x, out, &tok);
+			continue;
+		}
+
+		const struct bs_hideset *hs;
+		struct bs_args args;
+		int err;
+		if (!m->function_like) {
+			hs = bs_hideset_add(x, tok.hide, m);
+			err = bs_subst(x, m, NULL, &tok, hs, stack);
+			if (err) {
+				return err;
+			}
+			continue;
+		}
+
+		struct bs_token paren;
+		if (!bs_token_next(stack, src, &paren, 1)) {
+			if (src && !src->final) {
+				return BS_EXPAND_MORE;
+			}
+			bs_token_push(x, out, &tok);
+			continue;
+		}
+		if (!bs_token_is(&paren, "(")) {
+			bs_token_push(x, out, &tok);
+			continue;
+		}
+		bs_token_next(stack, src, &paren, 0);
+
+		struct bs_token rparen;
+		err = bs_collect_args(x, m, stack, src, &args, &rparen);
+		if (err) {
+			return err;
+		}
+		hs = bs_hideset_intersect(x, tok.hide, rparen.hide);
+		hs = bs_hideset_add(x, hs, m);
+		err = bs_subst(x, m, &args, &tok, hs, stack);
+		if (err) {
+			return err;
+		}
+	}
+	return x->oom ? ENOMEM : 0;
+}
+
+static int bs_tokens_write(const struct bs_token_vec *v, char *prev,
+			   struct bs_writer *out)
+{
+	for (size_t i = 0; i < v->len; ++i) {
+		const struct bs_token *tok = v->toks + i;
+		if (!tok->len) {
+			continue;
+		}
+		if ((tok->flags & BS_TOKEN_SPACE)
+		    || ((tok->flags & BS_TOKEN_AVOID_PASTE)
+			&& bs_would_paste(*prev, tok->text[0]))) {
+			bs_writer_putc(out, ' ');
+		}
+		bs_writer_write(out, tok->text, tok->len);
+		*prev = tok->text[tok->len - 1];
+	}
+	return out->err;
+}
+
+/* expands the invocation at token "start", *end is the token after it */
+static int bs_expand_at(struct bs_expander *x,
+			const struct bs_token_stream *ts, size_t start,
+			int final, size_t *end, size_t *newlines,
+			struct bs_writer *out)
+{
+	struct bs_token_src src = { ts, start, final };
+	struct bs_token_vec stack = { NULL, 0, 0 };
+	struct bs_token_vec result = { NULL, 0, 0 };
+
+	x->oom = 0;
+	struct bs_token tok;
+	bs_stream_get(ts, src.pos++, &tok);
+	/* the space before it is in the text already written */
+	tok.flags &= ~BS_TOKEN_SPACE;
+	bs_token_push(x, &stack, &tok);
+	int err = bs_expand(x, &stack, &src, &result);
+	if (!err) {
+		const char *text = ts->text;
+		size_t from = ts->off[start];
+		size_t to = bs_stream_end(ts, src.pos - 1);
+		char prev = from ? text[from - 1] : '\n';
+		err = bs_tokens_write(&result, &prev, out);
+		if (to < ts->len && bs_would_paste(prev, text[to])) {
+			bs_writer_putc(out, ' ');
+		}
+		const char *nl = text + from;
+		while ((nl = memchr(nl, '\n', (size_t)(text + to - nl)))) {
+			++*newlines;
+			++nl;
+		}
+		*end = src.pos;
+	}
+	if (err == ENOMEM) {
+		Bs_log_error(x->log, "out of memory expanding '%.*s'",
+			     (int)tok.len, tok.text);
+	}
+	bs_arena_reset(&x->arena);
+	return err;
+}
+
+static int bs_write_newlines(struct bs_writer *out, size_t newlines)
+{
+	for (size_t i = 0; i < newlines; ++i) {
+		bs_writer_putc(out, '\n');
+	}
+	return out->err;
+}
+
+int bs_macro_expand(const struct bs_token_stream *ts, int final,
+		    size_t *consumed, size_t *newlines, struct bs_writer *out,
+		    FILE *log)
+{
+	const char *text = ts->text;
+	*consumed = ts->len;
+	struct bs_expander *x = &bs_expander;
+	x->log = log;
+
+	size_t flushed = 0;
+	size_t i = bs_macros.count ? 0 : ts->count;
+	while (i < ts->count) {
+		/* only the kinds are looked at, until an identifier */
+		const unsigned char *ident = memchr(ts->kind + i,
+						    bs_token_ident,
+						    ts->count - i);
+		if (!ident) {
+			break;
+		}
+		i = (size_t)(ident - ts->kind);
+		struct bs_macro *m = bs_macro_find(text + ts->off[i],
+						   ts->lens[i]);
+		if (!m) {
+			++i;
+			continue;
+		}
+		size_t start = ts->off[i];
+		if (m->function_like) {
+			if (i + 1 == ts->count && !final) {
+				/* the '(' may be on a line not yet seen */
+				*consumed = start;
+				break;
+			}
+			if (i + 1 == ts->count || ts->lens[i + 1] != 1
+			    || text[ts->off[i + 1]] != '(') {
+				++i;
+				continue;
+			}
+		}
+
+		bs_writer_write(out, text + flushed, start - flushed);
+		size_t end = i;
+		int err = bs_expand_at(x, ts, i, final, &end, newlines, out);
+		if (err == BS_EXPAND_MORE) {
+			*consumed = start;
+			flushed = start;
+			break;
+		}
+		if (err) {
+			return err;
+		}
+		flushed = bs_stream_end(ts, end - 1);
+		i = end;
+	}
+	bs_writer_write(out, text + flushed, *consumed - flushed);
+	if (*consumed < ts->len) {
+		return out->err;
+	}
+	int err = bs_write_newlines(out, *newlines);
+	*newlines = 0;
+	return err;
+}
+
+/*
+ * The operand of "defined X" or "defined ( X )", and all of what is in
+ * "__has_include ( ... )", are not expanded. Returns the next *pos.
+ */
+static size_t bs_protect(struct bs_expander *x, const char *text,
+			 size_t len, size_t pos, int has_include,
+			 struct bs_token_vec *in)
+{
+	size_t depth = 0;
+	struct bs_token tok;
+	size_t next = pos;
+	while (bs_lex(text, len, &next, &tok)) {
+		if (bs_token_is(&tok, "(")) {
+			++depth;
+		} else if (bs_token_is(&tok, ")") && depth) {
+			--depth;
+		} else if (!depth && !has_include
+			   && tok.kind != bs_token_ident) {
+			break;
+		}
+		tok.flags |= BS_TOKEN_NO_EXPAND;
+		bs_token_push(x, in, &tok);
+		pos = next;
+		if (!depth) {
+			break;
+		}
+	}
+	return pos;
+}
+
+int bs_macro_expand_if(const char *text, size_t len,
+		       const struct bs_token **toks, size_t *toks_len,
+		       FILE *log)
+{
+	struct bs_expander *x = &bs_expander;
+	x->log = log;
+	x->oom = 0;
+	bs_arena_reset(&x->arena);
+
+	struct bs_token_vec in = { NULL, 0, 0 };
+	struct bs_token_vec stack = { NULL, 0, 0 };
+	struct bs_token_vec result = { NULL, 0, 0 };
+	struct bs_token tok;
+	size_t pos = 0;
+	while (bs_lex(text, len, &pos, &tok)) {
+		bs_token_push(x, &in, &tok);
+		int has_include = bs_token_is(&tok, "__has_include");
+		if (has_include || bs_token_is(&tok, "defined")) {
+			pos = bs_protect(x, text, len, pos, has_include, &in);
+		}
+	}
+	for (size_t i = in.len; i; --i) {
+		bs_token_push(x, &stack, in.toks + i - 1);
+	}
+	int err = x->oom ? ENOMEM : bs_expand(x, &stack, NULL, &result);
+	if (err == ENOMEM) {
+		Bs_log_error(log, "out of memory expanding '%.*s'", (int)len,
+			     text);
+	}
+	*toks = result.toks;
+	*toks_len = result.len;
+	return err;
+}
+
+/**************/
+/* directives */
+/**************/
+static size_t bs_directive_name(const char *text, size_t len, size_t *pos)
+{
+	size_t i = *pos;
+	while (i < len && bs_is_space(text[i])) {
+		++i;
+	}
+	size_t start = i;
+	if (i < len && bs_is_ident_start(text[i])) {
+		while (i < len && bs_is_ident(text[i])) {
+			++i;
+		}
+	}
+	*pos = i;
+	return i - start;
+}
+
+#define BS_MACRO_PARAMS_MAX 256
+
+/* after the '(', through the ')' */
+static int bs_macro_params(const char *text, size_t len, size_t *pos,
+			   struct bs_token *params, size_t *params_len,
+			   int *variadic)
+{
+	static const char va_args[] = "__VA_ARGS__";
+	struct bs_token tok;
+	*params_len = 0;
+	*variadic = 0;
+	while (bs_lex(text, len, pos, &tok)) {
+		if (bs_token_is(&tok, ")") && !*params_len) {
+			return 0;
+		}
+		if (*params_len == BS_MACRO_PARAMS_MAX) {
+			return 1;
+		}
+		if (bs_token_is(&tok, "...")) {
+			*variadic = 1;
+			tok.text = va_args;
+			tok.len = sizeof(va_args) - 1;
+			tok.kind = bs_token_ident;
+		}
+		if (tok.kind != bs_token_ident) {
+			return 1;
+		}
+		params[(*params_len)++] = tok;
+		if (!bs_lex(text, len, pos, &tok)) {
+			return 1;
+		}
+		if (!*variadic && bs_token_is(&tok, "...")) {
+			/* gnu: named variadic parameter */
+			*variadic = 1;
+			if (!bs_lex(text, len, pos, &tok)) {
+				return 1;
+			}
+		}
+		if (bs_token_is(&tok, ")")) {
+			return 0;
+		}
+		if (*variadic || !bs_token_is(&tok, ",")) {
+			return 1;
+		}
+	}
+	return 1;
+}
+
+int bs_macro_define_directive(const char *text, size_t len, FILE *log)
+{
+	size_t i = 0;
+	size_t name_len = bs_directive_name(text, len, &i);
+	if (!name_len) {
+		Bs_log_error(log, "#define without a name: '%.*s'", (int)len,
+			     text);
+		return 1;
+	}
+	const char *name = text + i - name_len;
+
+	struct bs_token params[BS_MACRO_PARAMS_MAX];
+	size_t params_len = 0;
+	int variadic = 0;
+	int function_like = (i < len && text[i] == '(');
+	if (function_like) {
+		++i;
+		if (bs_macro_params(text, len, &i, params, &params_len,
+				    &variadic)) {
+			Bs_log_error(log, "bad parameters for '%.*s': '%.*s'",
+				     (int)name_len, name, (int)len, text);
+			return 1;
+		}
+	}
+
+	/* the body, trimmed, with each run of whitespace as one space */
+	char stack_buf[256] = { 0 };
+	char *body = (len <= sizeof(stack_buf)) ? stack_buf : bs_malloc(len);
+	if (!body) {
+		Bs_log_errno(log, "malloc(%zu) failed", len);
+		return 1;
+	}
+	size_t body_len = 0;
+	while (i < len) {
+		if (bs_is_space(text[i])) {
+			while (i < len && bs_is_space(text[i])) {
+				++i;
+			}
+			if (body_len && i < len) {
+				body[body_len++] = ' ';
+			}
+			continue;
+		}
+		size_t end = i + 1;
+		if (text[i] == '"' || text[i] == '\'') {
+			end = bs_skip_literal(text, i, len);
+		}
+		memcpy(body + body_len, text + i, end - i);
+		body_len += end - i;
+		i = end;
+	}
+
+	int err = bs_macro_define_full(name, name_len, function_like,
+				       variadic, params, params_len, body,
+				       body_len);
+	if (err) {
+		Bs_log_error(log, "out of memory defining '%.*s'",
+			     (int)name_len, name);
+	}
+	if (body != stack_buf) {
+		bs_free(body);
+	}
+	return err;
+}
+
+int bs_macro_undef_directive(const char *text, size_t len, FILE *log)
+{
+	size_t i = 0;
+	size_t name_len = bs_directive_name(text, len, &i);
+	if (!name_len) {
+		Bs_log_error(log, "#undef without a name: '%.*s'", (int)len,
+			     text);
+		return 1;
+	}
+	bs_macro_undef(text + i - name_len, name_len);
+	return 0;
+}
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_MACRO_H
+#define BS_MACRO_H 1
+
+#include <stddef.h>
+
+#include "bs-util.h"
+
+enum bs_token_kind {
+	bs_token_ident = 0,
+	bs_token_number,
+	bs_token_literal,	/* string or character */
+	bs_token_punct,
+	bs_token_param,		/* a parameter in a macro body */
+	bs_token_placemarker	/* an empty argument, during ## only */
+};
+
+#define BS_TOKEN_SPACE 0x01	/* whitespace in front */
+#define BS_TOKEN_AVOID_PASTE 0x02	/* space if it would join the last */
+#define BS_TOKEN_NO_EXPAND 0x04	/* an operand of "defined", say */
+
+struct bs_hideset;
+
+struct bs_token {
+	const char *text;
+	unsigned int len;
+	unsigned char kind;
+	unsigned char flags;
+	unsigned short param;	/* index, bs_token_param only */
+	const struct bs_hideset *hide;	/* macros which may not expand */
+};
+
+/*
+ * The macro table: names and bodies are interned in an arena, and found
+ * through an open-addressing hash table, so neither a lookup nor a
+ * #define costs a malloc of its own. Bodies are kept as tokens, so that
+ * an expansion does not need to lex them again.
+ */
+struct bs_macro {
+	const char *name;
+	size_t name_len;
+	const char *body;	/* whitespace trimmed and collapsed */
+	size_t body_len;
+	int function_like;
+	int variadic;		/* the last parameter takes the rest */
+	size_t params_len;
+	const struct bs_token *params;
+	size_t tokens_len;
+	const struct bs_token *tokens;
+};
+
+/* an object-like macro, returns 0, or non-zero if out of memory */
+int bs_macro_define(const char *name, size_t name_len, const char *body,
+		    size_t body_len);
+
+void bs_macro_undef(const char *name, size_t name_len);
+
+/* NULL if not defined */
+struct bs_macro *bs_macro_find(const char *name, size_t name_len);
+
+size_t bs_macro_count(void);
+
+/*
+ * changes whenever a macro is defined differently, or undefined, so that
+ * anything which depends on the set of macros can tell if it still holds;
+ * the same set of definitions has the same version, whatever their order
+ */
+unsigned long long bs_macro_version(void);
+
+void bs_macro_table_clear(void);
+
+/* the next token at or after *pos, returns 0 at the end of the text */
+int bs_lex(const char *text, size_t len, size_t *pos, struct bs_token *tok);
+
+/*
+ * The tokens of a text, lexed once, as parallel arrays: scanning for an
+ * identifier touches one byte per token, rather than a whole bs_token.
+ * The arrays are one allocation which is kept, and only grows, from one
+ * text to the next; offsets are into "text", which is not copied.
+ */
+struct bs_token_stream {
+	const char *text;
+	size_t len;
+	size_t count;
+	size_t size;
+	unsigned int *off;
+	unsigned int *lens;
+	unsigned char *kind;
+	unsigned char *flags;
+};
+
+/* replaces the tokens of "ts" with those of "text" */
+int bs_stream_lex(struct bs_token_stream *ts, const char *text, size_t len);
+
+void bs_stream_release(struct bs_token_stream *ts);
+
+/*
+ * Writes the text of "ts" to "out", with every macro replaced by its
+ * expansion. Unless "final", an invocation which may take arguments from
+ * text not yet seen is not written, and *consumed is set to the offset
+ * where it starts. The newlines an invocation spreads over are written
+ * after the text, they are added to *newlines and held there until all
+ * is consumed.
+ */
+int bs_macro_expand(const struct bs_token_stream *ts, int final,
+		    size_t *consumed, size_t *newlines, struct bs_writer *out,
+		    FILE *log);
+
+/*
+ * The controlling expression of an #if or #elif, macro-expanded into
+ * *toks, but with the operands of "defined" and "__has_include" left as
+ * they are. The tokens stay valid until the next expansion.
+ */
+int bs_macro_expand_if(const char *text, size_t len,
+		       const struct bs_token **toks, size_t *toks_len,
+		       FILE *log);
+
+/* parses "NAME body" or "NAME(params) body" as after "#define" */
+int bs_macro_define_directive(const char *text, size_t len, FILE *log);
+
+/* parses "NAME" as after "#undef" */
+int bs_macro_undef_directive(const char *text, size_t len, FILE *log);
+
+#endif /* BS_MACRO_H */
@@ -0,0 +1,369 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bs-prefetch.h"
+#include "bs-scan.h"
+#include "bs-search.h"
+#include "bs-util.h"
+
+size_t bs_prefetch_threads = 0;
+
+/* it is only a hint: past this many waiting, more names are dropped */
+#ifndef BS_PREFETCH_QUEUE_MAX
+#define BS_PREFETCH_QUEUE_MAX 1024
+#endif
+
+struct bs_prefetch_name {
+	struct bs_prefetch_name *next;
+	enum bs_search_kind kind;
+	const char *from;	/* after the name, or NULL */
+	char name[];
+};
+
+struct bs_prefetch_seen {
+	unsigned long long hash;
+	unsigned long long epoch;	/* the latest it was read ahead in */
+};
+
+struct bs_prefetch_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work;	/* a name was queued, or stop */
+	pthread_cond_t idle;	/* none of the threads is busy */
+	struct bs_prefetch_name *head;
+	struct bs_prefetch_name *tail;
+	size_t queued;
+	size_t busy;
+	int stop;
+	int started;		/* tried to, even if it failed */
+	pthread_t *threads;
+	size_t threads_len;
+	/* the names seen, an open addressing set of hashes, 0 is empty */
+	struct bs_prefetch_seen *seen;
+	size_t seen_capacity;	/* a power of two */
+	size_t seen_count;
+};
+
+static struct bs_prefetch_pool bs_prefetch = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t bs_prefetch_once = PTHREAD_ONCE_INIT;
+
+static const struct bs_scan_set bs_prefetch_hash = Bs_scan_set('#');
+
+static void bs_prefetch_one(const struct bs_prefetch_name *n, FILE *log)
+{
+	const char *path = NULL;
+	int fd = -1;
+	if (bs_search_find(n->name, n->kind, n->from, &path, &fd, log)) {
+		return;
+	}
+	/*
+	 * not bs_open and bs_close, as these threads run alongside whatever
+	 * a test, or a caller, has put in the hooks
+	 */
+	if (fd < 0) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd >= 0) {
+		bs_fadvise(fd, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+static void *bs_prefetch_run(void *arg)
+{
+	struct bs_prefetch_pool *p = arg;
+	pthread_mutex_lock(&p->mutex);
+	for (;;) {
+		while (!p->head && !p->stop) {
+			pthread_cond_wait(&p->work, &p->mutex);
+		}
+		if (p->stop) {
+			break;
+		}
+		struct bs_prefetch_name *n = p->head;
+		p->head = n->next;
+		if (!p->head) {
+			p->tail = NULL;
+		}
+		--p->queued;
+		++p->busy;
+		pthread_mutex_unlock(&p->mutex);
+
+		/*
+		 * not the log of the caller which queued it, which may be
+		 * gone by now, as a request's is in --serve
+		 */
+		bs_prefetch_one(n, stderr);
+		bs_free(n);
+
+		pthread_mutex_lock(&p->mutex);
+		if (!--p->busy) {
+			pthread_cond_broadcast(&p->idle);
+		}
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+
+/* called with the mutex held */
+static void bs_prefetch_drop_queue(struct bs_prefetch_pool *p)
+{
+	while (p->head) {
+		struct bs_prefetch_name *n = p->head;
+		p->head = n->next;
+		bs_free(n);
+	}
+	p->tail = NULL;
+	p->queued = 0;
+}
+
+/*
+ * A fork must not copy the search cache's mutex held by a thread which
+ * will not be in the child, so it waits until none of them is busy, and
+ * keeps them from starting on the next name until it is done
+ */
+static void bs_prefetch_fork_prepare(void)
+{
+	struct bs_prefetch_pool *p = &bs_prefetch;
+	pthread_mutex_lock(&p->mutex);
+	while (p->busy) {
+		pthread_cond_wait(&p->idle, &p->mutex);
+	}
+}
+
+static void bs_prefetch_fork_parent(void)
+{
+	pthread_mutex_unlock(&bs_prefetch.mutex);
+}
+
+/* the threads are not in the child, it starts its own if it needs them */
+static void bs_prefetch_fork_child(void)
+{
+	struct bs_prefetch_pool *p = &bs_prefetch;
+	bs_prefetch_drop_queue(p);
+	bs_free(p->threads);
+	p->threads = NULL;
+	p->threads_len = 0;
+	p->started = 0;
+	p->stop = 0;
+	p->seen_count = 0;
+	if (p->seen) {
+		memset(p->seen, 0x00, p->seen_capacity * sizeof(*p->seen));
+	}
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+static void bs_prefetch_atfork(void)
+{
+	pthread_atfork(bs_prefetch_fork_prepare, bs_prefetch_fork_parent,
+		       bs_prefetch_fork_child);
+}
+
+/* called with the mutex held, returns the number of threads running */
+static size_t bs_prefetch_start(struct bs_prefetch_pool *p)
+{
+	if (p->started) {
+		return p->threads_len;
+	}
+	p->started = 1;
+	pthread_once(&bs_prefetch_once, bs_prefetch_atfork);
+
+	p->threads = bs_malloc(bs_prefetch_threads * sizeof(pthread_t));
+	if (!p->threads) {
+		return 0;
+	}
+	for (size_t i = 0; i < bs_prefetch_threads; ++i) {
+		int err = pthread_create(p->threads + p->threads_len, NULL,
+					 bs_prefetch_run, p);
+		if (err) {
+			/* fewer threads will do, as will none */
+			break;
+		}
+		++p->threads_len;
+	}
+	return p->threads_len;
+}
+
+/*
+ * called with the mutex held, returns 1 if "hash" was not seen before, or
+ * only in an earlier epoch
+ */
+static int bs_prefetch_seen_add(struct bs_prefetch_pool *p,
+				unsigned long long hash,
+				unsigned long long epoch)
+{
+	if (2 * (p->seen_count + 1) > p->seen_capacity) {
+		size_t capacity = p->seen_capacity ? 2 * p->seen_capacity : 256;
+		struct bs_prefetch_seen *seen;
+		seen = bs_malloc(capacity * sizeof(*seen));
+		if (!seen) {
+			return 0;
+		}
+		memset(seen, 0x00, capacity * sizeof(*seen));
+		for (size_t i = 0; i < p->seen_capacity; ++i) {
+			unsigned long long h = p->seen[i].hash;
+			size_t j = h & (capacity - 1);
+			while (h && seen[j].hash) {
+				j = (j + 1) & (capacity - 1);
+			}
+			seen[j] = p->seen[i];
+		}
+		bs_free(p->seen);
+		p->seen = seen;
+		p->seen_capacity = capacity;
+	}
+	size_t i = hash & (p->seen_capacity - 1);
+	for (; p->seen[i].hash; i = (i + 1) & (p->seen_capacity - 1)) {
+		if (p->seen[i].hash == hash) {
+			if (p->seen[i].epoch >= epoch) {
+				return 0;
+			}
+			p->seen[i].epoch = epoch;
+			return 1;
+		}
+	}
+	p->seen[i].hash = hash;
+	p->seen[i].epoch = epoch;
+	++p->seen_count;
+	return 1;
+}
+
+static void bs_prefetch_queue(const char *name, size_t len,
+			      enum bs_search_kind kind)
+{
+	/* a "x.h" is looked for from the directory of the file with it */
+	const char *from = (kind == bs_search_quote) ? bs_search_from() : NULL;
+	size_t from_size = from ? strlen(from) + 1 : 0;
+	unsigned long long hash = bs_fnv1a(BS_FNV1A_INIT, &kind, sizeof(kind));
+	hash = bs_fnv1a(hash, name, len);
+	hash = from ? bs_fnv1a(hash, from, from_size) : hash;
+	hash = hash ? hash : 1;
+	unsigned long long epoch = bs_search_current_epoch();
+
+	struct bs_prefetch_pool *p = &bs_prefetch;
+	pthread_mutex_lock(&p->mutex);
+	if (!bs_prefetch_start(p) || p->queued >= BS_PREFETCH_QUEUE_MAX
+	    || !bs_prefetch_seen_add(p, hash, epoch)) {
+		goto bs_prefetch_queue_end;
+	}
+	struct bs_prefetch_name *n = bs_malloc(sizeof(*n) + len + 1
+					       + from_size);
+	if (!n) {
+		goto bs_prefetch_queue_end;
+	}
+	n->next = NULL;
+	n->kind = kind;
+	memcpy(n->name, name, len);
+	n->name[len] = '\0';
+	n->from = NULL;
+	if (from) {
+		memcpy(n->name + len + 1, from, from_size);
+		n->from = n->name + len + 1;
+	}
+	if (p->tail) {
+		p->tail->next = n;
+	} else {
+		p->head = n;
+	}
+	p->tail = n;
+	++p->queued;
+	pthread_cond_signal(&p->work);
+
+bs_prefetch_queue_end:
+	pthread_mutex_unlock(&p->mutex);
+}
+
+static size_t bs_prefetch_blanks(const char *text, size_t i, size_t len)
+{
+	while (i < len && (text[i] == ' ' || text[i] == '\t')) {
+		++i;
+	}
+	return i;
+}
+
+void bs_prefetch_includes(const char *text, size_t len)
+{
+	if (!bs_prefetch_threads) {
+		return;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		i += bs_scan(text + i, len - i, &bs_prefetch_hash);
+		if (i == len) {
+			break;
+		}
+		/* only as the first of its line */
+		size_t b = i;
+		while (b && (text[b - 1] == ' ' || text[b - 1] == '\t')) {
+			--b;
+		}
+		if (b && text[b - 1] != '\n') {
+			continue;
+		}
+		size_t j = bs_prefetch_blanks(text, i + 1, len);
+		if (len - j < 7 || memcmp(text + j, "include", 7) != 0) {
+			continue;
+		}
+		j = bs_prefetch_blanks(text, j + 7, len);
+		if (j == len || (text[j] != '"' && text[j] != '<')) {
+			continue;
+		}
+		char delim = (text[j] == '<') ? '>' : '"';
+		size_t start = ++j;
+		while (j < len && text[j] != delim && text[j] != '\n') {
+			++j;
+		}
+		if (j < len && text[j] == delim && j > start) {
+			enum bs_search_kind kind = (delim == '>')
+			    ? bs_search_angle : bs_search_quote;
+			bs_prefetch_queue(text + start, j - start, kind);
+		}
+		i = j;
+	}
+}
+
+void bs_prefetch_wait(void)
+{
+	struct bs_prefetch_pool *p = &bs_prefetch;
+	pthread_mutex_lock(&p->mutex);
+	while (p->threads_len && (p->head || p->busy)) {
+		pthread_cond_wait(&p->idle, &p->mutex);
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+
+void bs_prefetch_stop(void)
+{
+	struct bs_prefetch_pool *p = &bs_prefetch;
+	pthread_mutex_lock(&p->mutex);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->mutex);
+
+	for (size_t i = 0; i < p->threads_len; ++i) {
+		pthread_join(p->threads[i], NULL);
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	bs_prefetch_drop_queue(p);
+	bs_free(p->threads);
+	p->threads = NULL;
+	p->threads_len = 0;
+	p->started = 0;
+	p->stop = 0;
+	bs_free(p->seen);
+	p->seen = NULL;
+	p->seen_capacity = 0;
+	p->seen_count = 0;
+	pthread_mutex_unlock(&p->mutex);
+}
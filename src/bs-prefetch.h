@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_PREFETCH_H
+#define BS_PREFETCH_H 1
+
+#include <stddef.h>
+
+/*
+ * Read-ahead of the headers a file is about to include. Before a file, or
+ * a chunk of one read from a pipe, is processed by the stage which walks
+ * the includes, it is looked over for '#include "x.h"' and '#include
+ * <x.h>' lines, and the names are handed to a few I/O threads. Each looks
+ * the name up with bs_search_find(), so the probes of the -I dirs are in
+ * the search cache by the time the directive is reached, then opens what
+ * was found and asks the kernel to read it in with posix_fadvise(), so
+ * the read that follows need not wait on a cold disk or a network file
+ * system. It is only a hint: an #include in a group which is skipped is
+ * read ahead all the same, and one made by a macro is not.
+ *
+ * The threads are started with the first name, and are shared by all of
+ * the threads of the process. Each name is read ahead once per search
+ * epoch of the thread which meets it, see bs_search_new_epoch(), as the
+ * file may have changed since. A forked child starts threads of its own.
+ */
+
+/*
+ * how many I/O threads to start, 0 to not read ahead, as is the default;
+ * bs_cpp() sets it, to BS_PREFETCH_THREADS unless told otherwise, and
+ * a caller which sets it is to bs_prefetch_stop() once done
+ */
+extern size_t bs_prefetch_threads;
+
+#ifndef BS_PREFETCH_THREADS
+#define BS_PREFETCH_THREADS 2
+#endif
+
+/*
+ * queues the names of the #include lines of "text"; what goes wrong in
+ * the threads is theirs to log, on stderr
+ */
+void bs_prefetch_includes(const char *text, size_t len);
+
+/* returns once everything queued has been read ahead */
+void bs_prefetch_wait(void);
+
+/* drops what is still queued, and stops the threads */
+void bs_prefetch_stop(void);
+
+#endif /* BS_PREFETCH_H */
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "bs-scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BS_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (*bs_scan_func)(const char *buf, size_t len,
+			       const struct bs_scan_set *set);
+
+static size_t bs_scan_resolve(const char *buf, size_t len,
+			      const struct bs_scan_set *set);
+
+static _Atomic(bs_scan_func) bs_scan_impl = bs_scan_resolve;
+static _Atomic(enum bs_scan_isa) bs_scan_isa = bs_scan_isa_auto;
+
+static size_t bs_scan_scalar(const char *buf, size_t len,
+			     const struct bs_scan_set *set)
+{
+	const char *b = set->bytes;
+	switch (set->len) {
+	case 1:
+		for (size_t i = 0; i < len; ++i) {
+			if (buf[i] == b[0]) {
+				return i;
+			}
+		}
+		return len;
+	case 2:
+		for (size_t i = 0; i < len; ++i) {
+			if (buf[i] == b[0] || buf[i] == b[1]) {
+				return i;
+			}
+		}
+		return len;
+	case 3:
+		for (size_t i = 0; i < len; ++i) {
+			char c = buf[i];
+			if (c == b[0] || c == b[1] || c == b[2]) {
+				return i;
+			}
+		}
+		return len;
+	default:
+		for (size_t i = 0; i < len; ++i) {
+			char c = buf[i];
+			if (c == b[0] || c == b[1] || c == b[2] || c == b[3]) {
+				return i;
+			}
+		}
+		return len;
+	}
+}
+
+#ifdef BS_SCAN_X86
+/* unused slots repeat the first byte, so every set costs four compares */
+static char bs_scan_needle(const struct bs_scan_set *set, size_t i)
+{
+	return (i < set->len) ? set->bytes[i] : set->bytes[0];
+}
+
+static size_t bs_scan_sse2(const char *buf, size_t len,
+			   const struct bs_scan_set *set)
+{
+	const __m128i n0 = _mm_set1_epi8(bs_scan_needle(set, 0));
+	const __m128i n1 = _mm_set1_epi8(bs_scan_needle(set, 1));
+	const __m128i n2 = _mm_set1_epi8(bs_scan_needle(set, 2));
+	const __m128i n3 = _mm_set1_epi8(bs_scan_needle(set, 3));
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i h01 = _mm_or_si128(_mm_cmpeq_epi8(chunk, n0),
+					   _mm_cmpeq_epi8(chunk, n1));
+		__m128i h23 = _mm_or_si128(_mm_cmpeq_epi8(chunk, n2),
+					   _mm_cmpeq_epi8(chunk, n3));
+		__m128i hits = _mm_or_si128(h01, h23);
+		unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+		if (mask) {
+			return i + (size_t)__builtin_ctz(mask);
+		}
+	}
+	return i + bs_scan_scalar(buf + i, len - i, set);
+}
+
+__attribute__((target("avx2")))
+static size_t bs_scan_avx2(const char *buf, size_t len,
+			   const struct bs_scan_set *set)
+{
+	const __m256i n0 = _mm256_set1_epi8(bs_scan_needle(set, 0));
+	const __m256i n1 = _mm256_set1_epi8(bs_scan_needle(set, 1));
+	const __m256i n2 = _mm256_set1_epi8(bs_scan_needle(set, 2));
+	const __m256i n3 = _mm256_set1_epi8(bs_scan_needle(set, 3));
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i h01 = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, n0),
+					      _mm256_cmpeq_epi8(chunk, n1));
+		__m256i h23 = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, n2),
+					      _mm256_cmpeq_epi8(chunk, n3));
+		__m256i hits = _mm256_or_si256(h01, h23);
+		unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+		if (mask) {
+			return i + (size_t)__builtin_ctz(mask);
+		}
+	}
+	return i + bs_scan_sse2(buf + i, len - i, set);
+}
+#endif /* BS_SCAN_X86 */
+
+static int bs_scan_have_isa(enum bs_scan_isa isa)
+{
+	switch (isa) {
+	case bs_scan_isa_auto:
+	case bs_scan_isa_scalar:
+		return 1;
+#ifdef BS_SCAN_X86
+	case bs_scan_isa_sse2:
+		return 1;
+	case bs_scan_isa_avx2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#else
+	case bs_scan_isa_sse2:
+	case bs_scan_isa_avx2:
+		return 0;
+#endif
+	}
+	return 0;
+}
+
+int bs_scan_use_isa(enum bs_scan_isa isa)
+{
+	if (!bs_scan_have_isa(isa)) {
+		return 1;
+	}
+	if (isa == bs_scan_isa_auto) {
+		isa = bs_scan_have_isa(bs_scan_isa_avx2) ? bs_scan_isa_avx2
+		    : bs_scan_have_isa(bs_scan_isa_sse2) ? bs_scan_isa_sse2
+		    : bs_scan_isa_scalar;
+	}
+
+	bs_scan_func impl = bs_scan_scalar;
+#ifdef BS_SCAN_X86
+	if (isa == bs_scan_isa_sse2) {
+		impl = bs_scan_sse2;
+	} else if (isa == bs_scan_isa_avx2) {
+		impl = bs_scan_avx2;
+	}
+#endif
+	atomic_store(&bs_scan_isa, isa);
+	atomic_store(&bs_scan_impl, impl);
+	return 0;
+}
+
+const char *bs_scan_isa_name(void)
+{
+	switch (atomic_load(&bs_scan_isa)) {
+	case bs_scan_isa_scalar:
+		return "scalar";
+	case bs_scan_isa_sse2:
+		return "sse2";
+	case bs_scan_isa_avx2:
+		return "avx2";
+	case bs_scan_isa_auto:
+		break;
+	}
+	return "auto";
+}
+
+static size_t bs_scan_resolve(const char *buf, size_t len,
+			      const struct bs_scan_set *set)
+{
+	bs_scan_use_isa(bs_scan_isa_auto);
+	return atomic_load(&bs_scan_impl) (buf, len, set);
+}
+
+size_t bs_scan(const char *buf, size_t len, const struct bs_scan_set *set)
+{
+	bs_scan_func impl = atomic_load_explicit(&bs_scan_impl,
+						 memory_order_relaxed);
+	return impl(buf, len, set);
+}
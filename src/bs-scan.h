@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_SCAN_H
+#define BS_SCAN_H 1
+
+#include <stddef.h>
+
+/*
+ * Finds the next "interesting" byte, so that the plain text in front of
+ * it can be passed along in bulk instead of one byte at a time.
+ */
+#define BS_SCAN_SET_MAX 4
+
+struct bs_scan_set {
+	size_t len;
+	char bytes[BS_SCAN_SET_MAX];
+};
+
+#define Bs_scan_set(...) { \
+	.len = sizeof((char[]){ __VA_ARGS__ }), \
+	.bytes = { __VA_ARGS__ } }
+
+/* index of the first byte of buf which is in the set, or len if none */
+size_t bs_scan(const char *buf, size_t len, const struct bs_scan_set *set);
+
+enum bs_scan_isa {
+	bs_scan_isa_auto = 0,	/* the best the cpu supports */
+	bs_scan_isa_scalar,
+	bs_scan_isa_sse2,
+	bs_scan_isa_avx2
+};
+
+/* returns 0, or non-zero if the cpu does not support the isa */
+int bs_scan_use_isa(enum bs_scan_isa isa);
+
+const char *bs_scan_isa_name(void);
+
+#endif /* BS_SCAN_H */
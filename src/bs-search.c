@@ -0,0 +1,408 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bs-search.h"
+#include "bs-util.h"
+
+struct bs_search_dir {
+	struct bs_search_dir *next;
+	size_t index;		/* 0 is reserved for the current directory */
+	int system;
+	size_t len;
+	char path[];
+};
+
+static struct bs_search_dir *bs_search_dirs = NULL;
+static struct bs_search_dir *bs_search_dirs_last = NULL;
+static size_t bs_search_dirs_count = 0;
+
+int bs_search_add_dir(const char *dir, int system)
+{
+	size_t len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/') {
+		--len;
+	}
+	struct bs_search_dir *d = bs_malloc(sizeof(struct bs_search_dir)
+					    + len + 1);
+	if (!d) {
+		return 1;
+	}
+	d->next = NULL;
+	d->index = ++bs_search_dirs_count;
+	d->system = system;
+	d->len = len;
+	memcpy(d->path, dir, len);
+	d->path[len] = '\0';
+
+	/* the -I dirs are searched before all of the -isystem dirs */
+	struct bs_search_dir **pos = &bs_search_dirs;
+	if (!system) {
+		while (*pos && !(*pos)->system) {
+			pos = &(*pos)->next;
+		}
+	} else if (bs_search_dirs_last) {
+		pos = &bs_search_dirs_last->next;
+	}
+	d->next = *pos;
+	*pos = d;
+	if (!d->next) {
+		bs_search_dirs_last = d;
+	}
+	return 0;
+}
+
+void bs_search_dirs_clear(void)
+{
+	while (bs_search_dirs) {
+		struct bs_search_dir *d = bs_search_dirs;
+		bs_search_dirs = d->next;
+		bs_free(d);
+	}
+	bs_search_dirs_last = NULL;
+	bs_search_dirs_count = 0;
+	bs_search_cache_clear();
+}
+
+struct bs_search_entry {
+	struct bs_search_entry *next;
+	unsigned long long hash;
+	size_t dir_index;
+	char *name;
+	char *path;		/* NULL if "not in this dir" */
+	unsigned long long epoch;	/* when last known to hold */
+	int parent_found;	/* the dir the file would be in, for a miss */
+	dev_t parent_dev;
+	ino_t parent_ino;
+	struct timespec parent_mtime;
+};
+
+#define BS_SEARCH_BUCKETS 1024
+
+/*
+ * Shared by the threads of a batch: the dirs are all added before any
+ * search. Entries are not freed until the cache is cleared, as their
+ * paths are handed out; one found to be out of date is "retired".
+ */
+static struct bs_search_entry *bs_search_cache[BS_SEARCH_BUCKETS];
+static struct bs_search_entry *bs_search_retired;
+static pthread_mutex_t bs_search_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* zero for as long as every entry is trusted for the rest of the run */
+static atomic_ullong bs_search_epoch;
+
+/* the epoch of the request of this thread, or 0 to follow the latest */
+static _Thread_local unsigned long long bs_search_thread_epoch;
+
+void bs_search_new_epoch(void)
+{
+	bs_search_thread_epoch = atomic_fetch_add(&bs_search_epoch, 1) + 1;
+}
+
+/* the directory of the file with the #include being processed */
+static _Thread_local const char *bs_search_thread_from;
+
+const char *bs_search_set_from(const char *dir)
+{
+	const char *before = bs_search_thread_from;
+	bs_search_thread_from = dir;
+	return before;
+}
+
+const char *bs_search_from(void)
+{
+	return bs_search_thread_from;
+}
+
+unsigned long long bs_search_current_epoch(void)
+{
+	if (bs_search_thread_epoch) {
+		return bs_search_thread_epoch;
+	}
+	return atomic_load(&bs_search_epoch);
+}
+
+static unsigned long long bs_search_hash(size_t dir_index, const char *name)
+{
+	unsigned long long hash = BS_FNV1A_INIT;
+	hash = bs_fnv1a(hash, &dir_index, sizeof(dir_index));
+	return bs_fnv1a(hash, name, strlen(name));
+}
+
+static struct bs_search_entry *bs_search_cache_find(unsigned long long hash,
+						    size_t dir_index,
+						    const char *name)
+{
+	struct bs_search_entry *e = bs_search_cache[hash % BS_SEARCH_BUCKETS];
+	for (; e; e = e->next) {
+		if (e->hash == hash && e->dir_index == dir_index
+		    && strcmp(e->name, name) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* if out of memory, nothing is remembered, and NULL is returned */
+static struct bs_search_entry *bs_search_cache_store(unsigned long long hash,
+						     size_t dir_index,
+						     const char *name,
+						     const char *path,
+						     unsigned long long epoch,
+						     const struct stat *parent)
+{
+	size_t name_size = strlen(name) + 1;
+	size_t path_size = path ? strlen(path) + 1 : 0;
+	size_t size = sizeof(struct bs_search_entry) + name_size + path_size;
+	struct bs_search_entry *e = bs_malloc(size);
+	if (!e) {
+		return NULL;
+	}
+	e->hash = hash;
+	e->dir_index = dir_index;
+	e->name = (char *)(e + 1);
+	memcpy(e->name, name, name_size);
+	e->path = NULL;
+	if (path) {
+		e->path = e->name + name_size;
+		memcpy(e->path, path, path_size);
+	}
+	e->epoch = epoch;
+	e->parent_found = parent != NULL;
+	e->parent_dev = parent ? parent->st_dev : 0;
+	e->parent_ino = parent ? parent->st_ino : 0;
+	e->parent_mtime = parent ? parent->st_mtim : (struct timespec) { 0, 0 };
+
+	size_t bucket = hash % BS_SEARCH_BUCKETS;
+	pthread_mutex_lock(&bs_search_mutex);
+	struct bs_search_entry *other = bs_search_cache_find(hash, dir_index,
+							     name);
+	if (other) {
+		/* another thread probed it at the same time */
+		bs_free(e);
+		e = other;
+	} else {
+		e->next = bs_search_cache[bucket];
+		bs_search_cache[bucket] = e;
+	}
+	pthread_mutex_unlock(&bs_search_mutex);
+	return e;
+}
+
+void bs_search_cache_clear(void)
+{
+	pthread_mutex_lock(&bs_search_mutex);
+	for (size_t i = 0; i < BS_SEARCH_BUCKETS; ++i) {
+		while (bs_search_cache[i]) {
+			struct bs_search_entry *e = bs_search_cache[i];
+			bs_search_cache[i] = e->next;
+			bs_free(e);
+		}
+	}
+	while (bs_search_retired) {
+		struct bs_search_entry *e = bs_search_retired;
+		bs_search_retired = e->next;
+		bs_free(e);
+	}
+	pthread_mutex_unlock(&bs_search_mutex);
+}
+
+/* the directory which "probe" is, or would be, in */
+static int bs_search_parent_stat(const char *probe, struct stat *st)
+{
+	const char *slash = strrchr(probe, '/');
+	if (!slash) {
+		return stat(".", st);
+	}
+	char buf[PATH_MAX];
+	size_t len = (slash == probe) ? 1 : (size_t)(slash - probe);
+	memcpy(buf, probe, len);
+	buf[len] = '\0';
+	return stat(buf, st);
+}
+
+/*
+ * Checked once per epoch: a hit holds while the file is still there, and a
+ * miss while the directory it would be in has not changed, or still does
+ * not exist. Whether an earlier dir now has the file is up to its own
+ * entry, which is checked first.
+ */
+static int bs_search_still_holds(const struct bs_search_entry *e,
+				 const char *probe)
+{
+	struct stat st;
+	if (!e->epoch) {
+		return 0;
+	}
+	if (e->path) {
+		return stat(e->path, &st) == 0 && !S_ISDIR(st.st_mode);
+	}
+	if (bs_search_parent_stat(probe, &st)) {
+		return !e->parent_found;
+	}
+	return e->parent_found && e->parent_dev == st.st_dev
+	    && e->parent_ino == st.st_ino
+	    && e->parent_mtime.tv_sec == st.st_mtim.tv_sec
+	    && e->parent_mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+static void bs_search_retire(struct bs_search_entry *e)
+{
+	struct bs_search_entry **pos;
+	pos = bs_search_cache + e->hash % BS_SEARCH_BUCKETS;
+	for (; *pos; pos = &(*pos)->next) {
+		if (*pos == e) {
+			*pos = e->next;
+			e->next = bs_search_retired;
+			bs_search_retired = e;
+			return;
+		}
+	}
+}
+
+/* returns 1 if found, 0 if not in this dir, or -1 on error */
+static int bs_search_probe(const struct bs_search_dir *dir, const char *name,
+			   const char **path, int *fd, FILE *log)
+{
+	size_t dir_index = dir ? dir->index : 0;
+	unsigned long long hash = bs_search_hash(dir_index, name);
+	unsigned long long epoch = bs_search_current_epoch();
+	pthread_mutex_lock(&bs_search_mutex);
+	struct bs_search_entry *e = bs_search_cache_find(hash, dir_index, name);
+	unsigned long long e_epoch = e ? e->epoch : epoch;
+	pthread_mutex_unlock(&bs_search_mutex);
+
+	char buf[PATH_MAX];
+	const char *probe = name;
+	if (dir) {
+		size_t name_len = strlen(name);
+		if (dir->len + 1 + name_len + 1 > sizeof(buf)) {
+			Bs_log_error(log, "path too long: %s/%s", dir->path,
+				     name);
+			return -1;
+		}
+		memcpy(buf, dir->path, dir->len);
+		buf[dir->len] = '/';
+		memcpy(buf + dir->len + 1, name, name_len + 1);
+		probe = buf;
+	}
+
+	/* checked in a later epoch than ours is as good */
+	if (e && e_epoch < epoch) {
+		int holds = bs_search_still_holds(e, probe);
+		pthread_mutex_lock(&bs_search_mutex);
+		if (holds) {
+			e->epoch = (e->epoch > epoch) ? e->epoch : epoch;
+		} else {
+			bs_search_retire(e);
+			e = NULL;
+		}
+		pthread_mutex_unlock(&bs_search_mutex);
+	}
+	if (e) {
+		*path = e->path;
+		return e->path ? 1 : 0;
+	}
+
+	int probe_fd = bs_open(probe, O_RDONLY);
+	if (probe_fd < 0 && errno != ENOENT && errno != ENOTDIR
+	    && errno != EACCES) {
+		Bs_log_errno(log, "open(\"%s\", O_RDONLY)", probe);
+		return -1;
+	}
+	/* a directory of the name does not hide a file in a later dir */
+	struct stat st;
+	if (probe_fd >= 0 && fstat(probe_fd, &st) == 0
+	    && S_ISDIR(st.st_mode)) {
+		Bs_close_fd(probe_fd, probe, log);
+		probe_fd = -1;
+	}
+
+	/* the identity of a miss is only needed if it will be checked */
+	struct stat parent;
+	int parent_found = epoch && probe_fd < 0
+	    && bs_search_parent_stat(probe, &parent) == 0;
+	e = bs_search_cache_store(hash, dir_index, name,
+				  (probe_fd >= 0) ? probe : NULL, epoch,
+				  parent_found ? &parent : NULL);
+	if (probe_fd < 0) {
+		return 0;
+	}
+	if (!e) {
+		Bs_close_fd(probe_fd, probe, log);
+		Bs_log_error(log, "out of memory for '%s'", probe);
+		return -1;
+	}
+	*path = e->path;
+	*fd = probe_fd;
+	return 1;
+}
+
+int bs_search_in_system_dir(const char *path)
+{
+	const struct bs_search_dir *dir = bs_search_dirs;
+	for (; dir; dir = dir->next) {
+		if (dir->system && strncmp(path, dir->path, dir->len) == 0
+		    && path[dir->len] == '/') {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The directory of the includer is probed as the current one would be, for
+ * "from/name": the entry is kept under that path, so it is as distinct as
+ * the directory is, and "from/name" is the path the file is found by.
+ */
+static int bs_search_probe_from(const char *from, const char *name,
+				const char **path, int *fd, FILE *log)
+{
+	char buf[PATH_MAX];
+	size_t from_len = strlen(from);
+	while (from_len > 1 && from[from_len - 1] == '/') {
+		--from_len;
+	}
+	size_t name_len = strlen(name);
+	if (from_len + 1 + name_len + 1 > sizeof(buf)) {
+		Bs_log_error(log, "path too long: %s/%s", from, name);
+		return -1;
+	}
+	memcpy(buf, from, from_len);
+	size_t pos = from_len;
+	if (from[from_len - 1] != '/') {
+		buf[pos++] = '/';
+	}
+	memcpy(buf + pos, name, name_len + 1);
+	return bs_search_probe(NULL, buf, path, fd, log);
+}
+
+int bs_search_find(const char *name, enum bs_search_kind kind,
+		   const char *from, const char **path, int *fd, FILE *log)
+{
+	*path = NULL;
+	*fd = -1;
+
+	int found = 0;
+	if (name[0] != '/' && kind == bs_search_quote && from && from[0]
+	    && strcmp(from, ".") != 0) {
+		found = bs_search_probe_from(from, name, path, fd, log);
+	}
+	if (!found && (name[0] == '/' || kind == bs_search_quote)) {
+		found = bs_search_probe(NULL, name, path, fd, log);
+	}
+	if (name[0] != '/') {
+		struct bs_search_dir *dir = bs_search_dirs;
+		for (; dir && !found; dir = dir->next) {
+			found = bs_search_probe(dir, name, path, fd, log);
+		}
+	}
+	return (found == 1) ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_SEARCH_H
+#define BS_SEARCH_H 1
+
+#include <stdio.h>
+
+/*
+ * Include search paths: '#include "x.h"' looks in the directory of the
+ * file with the #include, as gcc does, then in the current directory, then
+ * the -I dirs, then the -isystem dirs; '#include <x.h>' looks only in the
+ * -I and -isystem dirs.
+ *
+ * Every probe of a directory is remembered, the misses as well as the
+ * hits, so each (directory, name) pair costs at most one open() per run.
+ */
+enum bs_search_kind {
+	bs_search_quote = 0,	/* "x.h" */
+	bs_search_angle		/* <x.h> */
+};
+
+/* returns 0, or non-zero if out of memory */
+int bs_search_add_dir(const char *dir, int system);
+
+void bs_search_dirs_clear(void);
+
+/*
+ * returns 0 if found, setting *path to the resolved path (owned by the
+ * cache) and *fd to the descriptor opened while probing, or to -1 if the
+ * path was already known and the file has not been opened; "from" is the
+ * directory of the file with the #include, NULL or "" for the current one
+ */
+int bs_search_find(const char *name, enum bs_search_kind kind,
+		   const char *from, const char **path, int *fd, FILE *log);
+
+/*
+ * The directory of the file this thread is processing the directives of,
+ * to pass as "from": returns the one before, to be put back once the file
+ * is done. "dir" is not copied. NULL, the default, is the current one.
+ */
+const char *bs_search_set_from(const char *dir);
+
+const char *bs_search_from(void);
+
+/* if "path", as found by bs_search_find(), is in one of the -isystem dirs */
+int bs_search_in_system_dir(const char *path);
+
+/* forget every remembered hit and miss */
+void bs_search_cache_clear(void);
+
+/*
+ * For a long running process, where the files may change between one
+ * request and the next: every remembered hit and miss is checked again,
+ * with a stat(), once, before this thread next uses it. The thread keeps
+ * the new epoch until its next request, and trusts what was checked in
+ * it or since, so that a request started on another thread does not have
+ * the lookups of this one checked again half way through.
+ */
+void bs_search_new_epoch(void);
+
+/* the epoch of this thread's lookups, 0 if entries are never checked */
+unsigned long long bs_search_current_epoch(void);
+
+#endif /* BS_SEARCH_H */
@@ -0,0 +1,419 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bs-cpp.h"
+#include "bs-search.h"
+#include "bs-server.h"
+#include "bs-util.h"
+
+#define BS_SERVER_REQUEST_MAX (64 * 1024)
+
+struct bs_server {
+	int fd;
+	const char *options;
+	size_t options_len;
+	char cwd[PATH_MAX];
+	FILE *log;
+};
+
+/* the listening socket, for the signal handler to shut down */
+static volatile sig_atomic_t bs_server_fd = -1;
+static volatile sig_atomic_t bs_server_stopping = 0;
+
+/* accept() then fails in every worker, which returns once it is done */
+static void bs_server_stop(int signum)
+{
+	(void)signum;
+	int save_errno = errno;
+	bs_server_stopping = 1;
+	if (bs_server_fd >= 0) {
+		shutdown(bs_server_fd, SHUT_RDWR);
+	}
+	errno = save_errno;
+}
+
+static int bs_server_address(const char *sock_path, struct sockaddr_un *addr,
+			     FILE *log)
+{
+	memset(addr, 0x00, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	size_t len = strlen(sock_path);
+	if (len >= sizeof(addr->sun_path)) {
+		Bs_log_error(log, "socket path too long: %s", sock_path);
+		return ENAMETOOLONG;
+	}
+	memcpy(addr->sun_path, sock_path, len + 1);
+	return 0;
+}
+
+/* returns the connected socket, or -1 with *err set, which is not logged */
+static int bs_server_connect(const char *sock_path, int *err, FILE *log)
+{
+	struct sockaddr_un addr;
+	*err = bs_server_address(sock_path, &addr, log);
+	if (*err) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		*err = errno ? errno : 1;
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		*err = errno ? errno : 1;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* like bs_write_all, but a peer which has gone away is not a SIGPIPE */
+static int bs_server_send(int fd, const char *data, size_t len, FILE *log)
+{
+	while (len) {
+		ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+			/* the client is gone, there is no one to tell */
+			return errno;
+		}
+		if (sent < 0) {
+			int err = Bs_log_errno(log, "send(%d, %zu)", fd, len);
+			return err ? err : 1;
+		}
+		data += sent;
+		len -= (size_t)sent;
+	}
+	return 0;
+}
+
+/* a request is complete once a field is empty */
+static int bs_server_request_complete(const char *buf, size_t len)
+{
+	for (size_t i = 1; i < len; ++i) {
+		if (buf[i] == '\0' && buf[i - 1] == '\0') {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* the field at *pos, or NULL if its NUL is not before "end" */
+static const char *bs_server_field(const char *buf, size_t *pos, size_t end)
+{
+	if (*pos >= end) {
+		return NULL;
+	}
+	const char *field = buf + *pos;
+	size_t len = strnlen(field, end - *pos);
+	if (len == end - *pos) {
+		return NULL;
+	}
+	*pos += len + 1;
+	return field;
+}
+
+static int bs_server_handle(struct bs_server *server, const char *req,
+			    size_t len, FILE *log)
+{
+	size_t pos = 0;
+	const char *magic = bs_server_field(req, &pos, len);
+	const char *cwd = bs_server_field(req, &pos, len);
+	const char *in_path = bs_server_field(req, &pos, len);
+	const char *out_path = bs_server_field(req, &pos, len);
+	if (!out_path || strcmp(magic, BS_SERVER_MAGIC) != 0 || !in_path[0]
+	    || !out_path[0]) {
+		Bs_log_error(log, "not a %s request", BS_SERVER_MAGIC);
+		return EPROTO;
+	}
+	if (strcmp(cwd, server->cwd) != 0) {
+		Bs_log_error(log, "the server runs in %s, not %s",
+			     server->cwd, cwd);
+		return EINVAL;
+	}
+	/* the options, up to and including the NUL which ends the last */
+	const char *options = req + pos;
+	const char *option;
+	do {
+		option = bs_server_field(req, &pos, len);
+	} while (option && option[0]);
+	/* the empty field which ends them is the end of the request */
+	if (!option || pos != len) {
+		Bs_log_error(log, "not a %s request", BS_SERVER_MAGIC);
+		return EPROTO;
+	}
+	size_t options_len = (size_t)(option - options);
+	if (options_len != server->options_len
+	    || memcmp(options, server->options, options_len) != 0) {
+		Bs_log_error(log, "the server runs with other -I/-isystem"
+			     " dirs, restart it to change them");
+		return EINVAL;
+	}
+
+	/* the files may have changed since the last request */
+	bs_search_new_epoch();
+	bs_translation_unit_reset();
+	return bs_c_pre_proc_path(in_path, out_path, bs_c_pre_proc_fused,
+				  log);
+}
+
+static void bs_server_serve(struct bs_server *server, int fd)
+{
+	char *req = bs_malloc(BS_SERVER_REQUEST_MAX);
+	char *logbuf = NULL;
+	size_t logbuf_len = 0;
+	FILE *log = open_memstream(&logbuf, &logbuf_len);
+	if (!req || !log) {
+		Bs_log_error(server->log, "out of memory for a request");
+		goto bs_server_serve_end;
+	}
+
+	size_t len = 0;
+	while (!bs_server_request_complete(req, len)) {
+		ssize_t got = bs_read(fd, req + len,
+				      BS_SERVER_REQUEST_MAX - len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			break;
+		}
+		len += (size_t)got;
+		if (len == BS_SERVER_REQUEST_MAX) {
+			break;
+		}
+	}
+
+	int status = EPROTO;
+	if (bs_server_request_complete(req, len)) {
+		status = bs_server_handle(server, req, len, log);
+	} else {
+		Bs_log_error(log, "incomplete request, %zu bytes", len);
+	}
+	fclose(log);
+	log = NULL;
+
+	char head[32];
+	int head_len = snprintf(head, sizeof(head), "%d\n", status);
+	if (!bs_server_send(fd, head, (size_t)head_len, server->log)) {
+		bs_server_send(fd, logbuf, logbuf_len, server->log);
+	}
+
+bs_server_serve_end:
+	if (log) {
+		fclose(log);
+	}
+	free(logbuf);
+	bs_free(req);
+}
+
+static void *bs_server_worker(void *arg)
+{
+	struct bs_server *server = (struct bs_server *)arg;
+	for (;;) {
+		int fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0 && bs_server_stopping) {
+			break;
+		}
+		if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+			continue;
+		}
+		if (fd < 0) {
+			Bs_log_errno(server->log, "accept(%d)", server->fd);
+			break;
+		}
+		bs_server_serve(server, fd);
+		Bs_close_fd(fd, "client", server->log);
+	}
+	bs_thread_release();
+	return NULL;
+}
+
+int bs_server_run(const char *sock_path, const char *options,
+		  size_t options_len, size_t workers, FILE *log)
+{
+	struct bs_server server;
+	memset(&server, 0x00, sizeof(struct bs_server));
+	server.fd = -1;
+	server.options = options;
+	server.options_len = options_len;
+	server.log = log;
+	if (!getcwd(server.cwd, sizeof(server.cwd))) {
+		int err = Bs_log_errno(log, "getcwd");
+		return err ? err : 1;
+	}
+
+	int err = 0;
+	int other = bs_server_connect(sock_path, &err, log);
+	if (other >= 0) {
+		Bs_close_fd(other, sock_path, log);
+		Bs_log_error(log, "a server is already listening on %s",
+			     sock_path);
+		return EADDRINUSE;
+	}
+	if (err == ENAMETOOLONG) {
+		return err;
+	}
+	/* left over from a server which is gone */
+	unlink(sock_path);
+
+	struct sockaddr_un addr;
+	bs_server_address(sock_path, &addr, log);
+	server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server.fd < 0) {
+		err = Bs_log_errno(log, "socket(AF_UNIX)");
+		return err ? err : 1;
+	}
+	if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr))
+	    || listen(server.fd, SOMAXCONN)) {
+		err = Bs_log_errno(log, "bind or listen on %s", sock_path);
+		err = err ? err : 1;
+		goto bs_server_run_end;
+	}
+
+	struct sigaction stop, old_int, old_term;
+	memset(&stop, 0x00, sizeof(struct sigaction));
+	stop.sa_handler = bs_server_stop;
+	sigemptyset(&stop.sa_mask);
+	bs_server_stopping = 0;
+	bs_server_fd = server.fd;
+	sigaction(SIGINT, &stop, &old_int);
+	sigaction(SIGTERM, &stop, &old_term);
+
+	workers = workers ? workers : 1;
+	pthread_t *threads = bs_malloc(workers * sizeof(pthread_t));
+	size_t started = 0;
+	for (; threads && started < workers - 1; ++started) {
+		int create_err = pthread_create(threads + started, NULL,
+						bs_server_worker, &server);
+		if (create_err) {
+			errno = create_err;
+			Bs_log_errno(log, "pthread_create (%zu of %zu)",
+				     started + 1, workers - 1);
+			break;
+		}
+	}
+
+	/* this thread serves as well, and only returns once stopped */
+	bs_server_worker(&server);
+	err = bs_server_stopping ? 0 : EIO;
+
+	shutdown(server.fd, SHUT_RDWR);
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	bs_free(threads);
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	bs_server_fd = -1;
+
+bs_server_run_end:
+	Bs_close_fd(server.fd, sock_path, log);
+	unlink(sock_path);
+	return err;
+}
+
+int bs_server_request(const char *sock_path, const char *options,
+		      size_t options_len, const char *in_path,
+		      const char *out_path, FILE *log)
+{
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		int err = Bs_log_errno(log, "getcwd");
+		return err ? err : 1;
+	}
+
+	int err = 0;
+	char *reply = NULL;
+	size_t reply_len = 0;
+	size_t reply_size = 0;
+	char *req = NULL;
+	size_t req_len = 0;
+	FILE *req_stream = open_memstream(&req, &req_len);
+	if (!req_stream) {
+		err = Bs_log_errno(log, "open_memstream");
+		return err ? err : 1;
+	}
+	fprintf(req_stream, "%s%c%s%c%s%c%s%c", BS_SERVER_MAGIC, '\0', cwd,
+		'\0', in_path, '\0', out_path, '\0');
+	fwrite(options, 1, options_len, req_stream);
+	fputc('\0', req_stream);
+	fclose(req_stream);
+
+	int fd = bs_server_connect(sock_path, &err, log);
+	if (fd < 0) {
+		errno = err;
+		Bs_log_errno(log, "connect to %s", sock_path);
+		goto bs_server_request_end;
+	}
+	err = bs_server_send(fd, req, req_len, log);
+	if (err) {
+		goto bs_server_request_end;
+	}
+	shutdown(fd, SHUT_WR);
+
+	for (;;) {
+		if (reply_len == reply_size) {
+			reply_size = reply_size ? reply_size * 2 : 4096;
+			char *grown = bs_malloc(reply_size + 1);
+			if (!grown) {
+				err = ENOMEM;
+				Bs_log_error(log, "malloc(%zu)", reply_size);
+				goto bs_server_request_end;
+			}
+			if (reply_len) {
+				memcpy(grown, reply, reply_len);
+			}
+			bs_free(reply);
+			reply = grown;
+		}
+		ssize_t got = bs_read(fd, reply + reply_len,
+				      reply_size - reply_len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			err = Bs_log_errno(log, "read(%d)", fd);
+			err = err ? err : 1;
+			goto bs_server_request_end;
+		}
+		if (!got) {
+			break;
+		}
+		reply_len += (size_t)got;
+	}
+	reply[reply_len] = '\0';
+
+	char *text = strchr(reply, '\n');
+	if (!text) {
+		Bs_log_error(log, "no reply from %s", sock_path);
+		err = EPROTO;
+		goto bs_server_request_end;
+	}
+	err = atoi(reply);
+	++text;
+	fwrite(text, 1, reply_len - (size_t)(text - reply), log);
+
+bs_server_request_end:
+	if (fd >= 0) {
+		Bs_close_fd(fd, sock_path, log);
+	}
+	bs_free(reply);
+	free(req);
+	return err;
+}
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_SERVER_H
+#define BS_SERVER_H 1
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A long running server on a Unix domain socket, which keeps the include
+ * search, the guard scans and the processed output of included files
+ * warm from one request to the next. Files may change between requests:
+ * each request checks what it uses of the caches again, by stat().
+ *
+ * A request is a list of NUL terminated fields, ended by an empty one:
+ *	BS_SERVER_MAGIC, the client's cwd, in path, out path, options...
+ * where the options are the -I and -isystem flags, each with its dir in
+ * the same field; they must be the same as those the server was started
+ * with, as must the cwd. The reply is the status, a newline, and then
+ * whatever was logged while preprocessing.
+ */
+#define BS_SERVER_MAGIC "bs-cpp/1"
+
+/*
+ * serves with "workers" threads until SIGINT or SIGTERM, then lets the
+ * requests being served finish and removes the socket; returns non-zero
+ * on error
+ */
+int bs_server_run(const char *sock_path, const char *options,
+		  size_t options_len, size_t workers, FILE *log);
+
+/*
+ * sends one request and waits for it to be done, what the server logged
+ * is copied to "log", returns the server's status or a local error
+ */
+int bs_server_request(const char *sock_path, const char *options,
+		      size_t options_len, const char *in_path,
+		      const char *out_path, FILE *log);
+
+#endif /* BS_SERVER_H */
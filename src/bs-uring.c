@@ -0,0 +1,292 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bs-uring.h"
+#include "bs-util.h"
+
+int bs_uring_enabled = 0;
+
+static int bs_uring_setup_syscall(unsigned entries, void *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int (*bs_uring_setup)(unsigned entries, void *params) =
+    bs_uring_setup_syscall;
+
+struct bs_uring {
+	int fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;		/* the same as sq_ring, if mapped as one */
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	_Atomic unsigned *sq_head;	/* moved by the kernel */
+	_Atomic unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	unsigned sq_queued;	/* our tail, ahead of *sq_tail until submit */
+
+	_Atomic unsigned *cq_head;
+	_Atomic unsigned *cq_tail;	/* moved by the kernel */
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct bs_uring_req cancel;	/* where cancellations complete */
+};
+
+static _Thread_local struct bs_uring *bs_uring_thread = NULL;
+static _Thread_local int bs_uring_failed = 0;
+
+static pthread_once_t bs_uring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t bs_uring_key;
+
+static void bs_uring_free(void *arg)
+{
+	struct bs_uring *u = arg;
+	if (u->sqes) {
+		bs_munmap(u->sqes, u->sqes_size);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		bs_munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if (u->sq_ring) {
+		bs_munmap(u->sq_ring, u->sq_ring_size);
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+	}
+	bs_free(u);
+}
+
+/* the ring is shared with the parent, the child sets up its own */
+static void bs_uring_fork_child(void)
+{
+	bs_uring_thread = NULL;
+	bs_uring_failed = 0;
+}
+
+/* the ring of a thread is closed as the thread exits */
+static void bs_uring_key_create(void)
+{
+	pthread_key_create(&bs_uring_key, bs_uring_free);
+	pthread_atfork(NULL, NULL, bs_uring_fork_child);
+}
+
+static void *bs_uring_map(int fd, size_t len, off_t offset)
+{
+	void *p = bs_mmap(NULL, len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, offset);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static int bs_uring_init(struct bs_uring *u)
+{
+	struct io_uring_params p;
+	memset(&p, 0x00, sizeof(p));
+	u->fd = bs_uring_setup(BS_URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		return -1;
+	}
+	/*
+	 * before 5.6 there is a ring, but no IORING_OP_READ and _WRITE, nor
+	 * reads at the file position, which this feature came with
+	 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes
+	    + p.cq_entries * sizeof(struct io_uring_cqe);
+	int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single && u->cq_ring_size > u->sq_ring_size) {
+		u->sq_ring_size = u->cq_ring_size;
+	}
+	u->sq_ring = bs_uring_map(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+	if (!u->sq_ring) {
+		return -1;
+	}
+	u->cq_ring = single ? u->sq_ring
+	    : bs_uring_map(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+	if (!u->cq_ring) {
+		return -1;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = bs_uring_map(u->fd, u->sqes_size, IORING_OFF_SQES);
+	if (!u->sqes) {
+		return -1;
+	}
+
+	char *sq = u->sq_ring;
+	u->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_queued = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+
+	char *cq = u->cq_ring;
+	u->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+struct bs_uring *bs_uring_get(void)
+{
+	if (!bs_uring_enabled || bs_uring_failed) {
+		return NULL;
+	}
+	if (bs_uring_thread) {
+		return bs_uring_thread;
+	}
+
+	pthread_once(&bs_uring_once, bs_uring_key_create);
+	struct bs_uring *u = bs_malloc(sizeof(struct bs_uring));
+	if (!u) {
+		bs_uring_failed = 1;
+		return NULL;
+	}
+	memset(u, 0x00, sizeof(struct bs_uring));
+	/* ENOSYS, EPERM where it is turned off, or too old: POSIX it is */
+	if (bs_uring_init(u) || pthread_setspecific(bs_uring_key, u)) {
+		bs_uring_free(u);
+		bs_uring_failed = 1;
+		return NULL;
+	}
+	bs_uring_thread = u;
+	return u;
+}
+
+static int bs_uring_enter(struct bs_uring *u, unsigned wait)
+{
+	unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+	unsigned to_submit = u->sq_queued - tail;
+	atomic_store_explicit(u->sq_tail, u->sq_queued, memory_order_release);
+	if (!to_submit && !wait) {
+		return 0;
+	}
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		long ret = syscall(__NR_io_uring_enter, u->fd, to_submit, wait,
+				   flags, NULL, 0);
+		if (ret >= 0 && (unsigned)ret >= to_submit) {
+			return 0;
+		}
+		if (ret > 0) {
+			/* the rest is still queued, try it again */
+			to_submit -= (unsigned)ret;
+			continue;
+		}
+		if (ret == 0) {
+			return EAGAIN;
+		}
+		if (errno != EINTR) {
+			return errno ? errno : 1;
+		}
+	}
+}
+
+int bs_uring_submit(struct bs_uring *u)
+{
+	return bs_uring_enter(u, 0);
+}
+
+/* the completions ready so far go to their requests */
+static unsigned bs_uring_reap(struct bs_uring *u)
+{
+	unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(u->cq_tail, memory_order_acquire);
+	unsigned reaped = tail - head;
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = u->cqes + (head & u->cq_mask);
+		struct bs_uring_req *req;
+		req = (struct bs_uring_req *)(uintptr_t)cqe->user_data;
+		req->res = cqe->res;
+		req->busy = 0;
+	}
+	atomic_store_explicit(u->cq_head, head, memory_order_release);
+	return reaped;
+}
+
+static int bs_uring_queue(struct bs_uring *u, struct bs_uring_req *req,
+			  int op, int fd, const void *buf, size_t len,
+			  off_t offset)
+{
+	unsigned head = atomic_load_explicit(u->sq_head, memory_order_acquire);
+	if (u->sq_queued - head >= u->sq_entries) {
+		int err = bs_uring_submit(u);
+		if (err) {
+			return err;
+		}
+	}
+
+	unsigned index = u->sq_queued & u->sq_mask;
+	struct io_uring_sqe *sqe = u->sqes + index;
+	memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+	sqe->opcode = (unsigned char)op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(uintptr_t)buf;
+	sqe->len = (unsigned)len;
+	sqe->off = (unsigned long long)offset;
+	sqe->user_data = (unsigned long long)(uintptr_t)req;
+	u->sq_array[index] = index;
+	++u->sq_queued;
+
+	req->busy = 1;
+	req->res = 0;
+	return 0;
+}
+
+int bs_uring_read(struct bs_uring *u, struct bs_uring_req *req, int fd,
+		  void *buf, size_t len, off_t offset)
+{
+	return bs_uring_queue(u, req, IORING_OP_READ, fd, buf, len, offset);
+}
+
+int bs_uring_write(struct bs_uring *u, struct bs_uring_req *req, int fd,
+		   const void *buf, size_t len, off_t offset)
+{
+	return bs_uring_queue(u, req, IORING_OP_WRITE, fd, buf, len, offset);
+}
+
+int bs_uring_wait(struct bs_uring *u, struct bs_uring_req *req)
+{
+	while (req->busy) {
+		if (bs_uring_reap(u)) {
+			continue;
+		}
+		int err = bs_uring_enter(u, 1);
+		if (err) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+int bs_uring_cancel(struct bs_uring *u, struct bs_uring_req *req)
+{
+	if (!req->busy) {
+		return 0;
+	}
+	/* the request to cancel is known by its user_data, given as addr */
+	int err = bs_uring_queue(u, &u->cancel, IORING_OP_ASYNC_CANCEL, -1,
+				 req, 0, 0);
+	return err ? err : bs_uring_wait(u, req);
+}
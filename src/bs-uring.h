@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#ifndef BS_URING_H
+#define BS_URING_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * An optional io_uring backend for the buffered i/o of bs-util.h, on the
+ * raw system calls, as liburing may not be there. With bs_uring_enabled
+ * set, each thread sets up a ring of its own the first time it is asked
+ * for one; if the kernel has no io_uring, or it is turned off, that is
+ * remembered and the thread stays with the POSIX calls.
+ *
+ * A request is queued, and only handed to the kernel by the next
+ * bs_uring_submit() or bs_uring_wait(), so that several can go in one
+ * system call. Each completion is routed to the bs_uring_req it was
+ * queued with, so the readers and writers of a thread share its ring.
+ */
+
+extern int bs_uring_enabled;
+
+/* the io_uring_setup(2) system call, for tests to intercept */
+extern int (*bs_uring_setup)(unsigned entries, void *params);
+
+#ifndef BS_URING_ENTRIES
+#define BS_URING_ENTRIES 32
+#endif
+
+struct bs_uring;
+
+/* in flight from when it is queued until bs_uring_wait() sees it done */
+struct bs_uring_req {
+	int busy;
+	int res;		/* bytes, or -errno */
+};
+
+/* the ring of this thread, set up if need be, or NULL to use POSIX */
+struct bs_uring *bs_uring_get(void);
+
+/*
+ * queue a read into, or a write from, "buf", at "offset" of "fd", or at
+ * its file position if "offset" is -1; returns 0, or the errno of a
+ * submission made to make room in the queue
+ */
+int bs_uring_read(struct bs_uring *u, struct bs_uring_req *req, int fd,
+		  void *buf, size_t len, off_t offset);
+
+int bs_uring_write(struct bs_uring *u, struct bs_uring_req *req, int fd,
+		   const void *buf, size_t len, off_t offset);
+
+/* hands what is queued to the kernel, returns 0 or the errno */
+int bs_uring_submit(struct bs_uring *u);
+
+/* returns 0 once "req" is done, or the errno if waiting failed */
+int bs_uring_wait(struct bs_uring *u, struct bs_uring_req *req);
+
+/*
+ * returns 0 once "req" is no longer in flight, cancelled (with -ECANCELED)
+ * or done, or the errno if that could not be had, in which case its buffer
+ * is still the kernel's
+ */
+int bs_uring_cancel(struct bs_uring *u, struct bs_uring_req *req);
+
+#endif /* BS_URING_H */
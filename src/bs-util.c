@@ -1,24 +1,45 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 /* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bs-uring.h"
 #include "bs-util.h"
 
+/* the stage this thread is running, while bs_pipes_stats is set */
+static _Thread_local struct bs_pipe_stats *bs_stats_current = NULL;
+
+static size_t bs_stats_channel_fill(int fd);
+
 /* global function pointers for tests to intercept */
 int (*bs_open)(const char *path, int options, ...) = open;
-int (*bs_close)(int fd) = close;
+int (*bs_close)(int fd) = bs_fd_close;
 
-ssize_t (*bs_read)(int fd, void *buf, size_t count) = read;
-ssize_t (*bs_write)(int fd, const void *buf, size_t count) = write;
+ssize_t (*bs_read)(int fd, void *buf, size_t count) = bs_fd_read;
+ssize_t (*bs_write)(int fd, const void *buf, size_t count) = bs_fd_write;
 
 pid_t (*bs_fork)(void) = fork;
 int (*bs_pipe)(int pipefd[2]) = pipe;
 
+void *(*bs_mmap)(void *addr, size_t length, int prot, int flags,
+		 int fd, off_t offset) = mmap;
+int (*bs_munmap)(void *addr, size_t length) = munmap;
+
 void *(*bs_malloc)(size_t size) = malloc;
 void (*bs_free)(void *p) = free;
 
@@ -27,11 +48,94 @@ int (*bs_fclose)(FILE *stream) = fclose;
 
 void (*bs_exit)(int status) = exit;
 
+static ssize_t bs_splice_fds(int fd_from, int fd_to, size_t len)
+{
+	return splice(fd_from, NULL, fd_to, NULL, len, SPLICE_F_MOVE);
+}
+
+static ssize_t bs_copy_file_range(int fd_from, int fd_to, size_t len)
+{
+	return copy_file_range(fd_from, NULL, fd_to, NULL, len, 0);
+}
+
+ssize_t (*bs_splice)(int fd_from, int fd_to, size_t len) = bs_splice_fds;
+ssize_t (*bs_copy_range)(int fd_from, int fd_to, size_t len) =
+    bs_copy_file_range;
+
+static int bs_fadvise_whole(int fd, int advice)
+{
+	return posix_fadvise(fd, 0, 0, advice);
+}
+
+int (*bs_fadvise)(int fd, int advice) = bs_fadvise_whole;
+
+#define BS_FD_COPY_CHUNK (1024 * 1024)
+
+/*
+ * returns 0 and sets *done at the end of "fd_from", or returns 0 with
+ * *done unset if "move" is not supported for these two fds, from where it
+ * got to; else the errno
+ */
+static int bs_fd_copy_kernel(int fd_from, int fd_to,
+			     ssize_t (*move)(int fd_from, int fd_to,
+					     size_t len), int *done,
+			     FILE *errlog)
+{
+	for (;;) {
+		ssize_t bytes = move(fd_from, fd_to, BS_FD_COPY_CHUNK);
+		if (bytes > 0) {
+			continue;
+		}
+		if (bytes == 0) {
+			*done = 1;
+			return 0;
+		}
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EINVAL:
+		case EBADF:
+		case EXDEV:
+		case ENOSYS:
+		case EOPNOTSUPP:
+			return 0;
+		default:
+			break;
+		}
+		const char *fmt = "copy from %d to %d failed";
+		int save_errno = Bs_log_errno(errlog, fmt, fd_from, fd_to);
+		return save_errno ? save_errno : 1;
+	}
+}
+
 int bs_fd_copy(int fd_from, int fd_to, char *buf, size_t bufsize, FILE *errlog)
 {
+	struct stat st_from;
+	struct stat st_to;
+	if (fstat(fd_from, &st_from) || fstat(fd_to, &st_to)) {
+		/* not a kernel fd, as a ring's is not */
+		st_from.st_mode = 0;
+		st_to.st_mode = 0;
+	}
+
+	int done = 0;
 	int err = 0;
+	if (S_ISFIFO(st_from.st_mode) || S_ISFIFO(st_to.st_mode)) {
+		err = bs_fd_copy_kernel(fd_from, fd_to, bs_splice, &done,
+					errlog);
+	} else if (S_ISREG(st_from.st_mode) && S_ISREG(st_to.st_mode)) {
+		err = bs_fd_copy_kernel(fd_from, fd_to, bs_copy_range, &done,
+					errlog);
+	}
+	if (err || done) {
+		return err;
+	}
+
 	ssize_t bytes = 0;
 	while ((bytes = bs_read(fd_from, buf, bufsize)) != 0) {
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
 		if (bytes < 0) {
 			const char *fmt = "read(%d, buf, %zu) returned %zd";
 			int save_errno =
@@ -39,14 +143,616 @@ int bs_fd_copy(int fd_from, int fd_to, char *buf, size_t bufsize, FILE *errlog)
 			err = save_errno ? save_errno : 1;
 			goto bs_fd_copy_end;
 		}
-		bs_write(fd_to, buf, bytes);
+		err = bs_write_all(fd_to, buf, (size_t)bytes, errlog);
+		if (err) {
+			goto bs_fd_copy_end;
+		}
 	}
 
 bs_fd_copy_end:
 	return err;
 }
 
+void bs_reader_init(struct bs_reader *r, int fd, char *buf, size_t bufsize,
+		    FILE *log)
+{
+	r->fd = fd;
+	r->buf = buf;
+	r->bufsize = bufsize;
+	r->pos = 0;
+	r->len = 0;
+	r->err = 0;
+	r->log = log;
+	r->map = NULL;
+	r->map_len = 0;
+	r->map_done = 0;
+	r->ahead = NULL;
+	r->ahead_checked = 0;
+}
+
+/*
+ * With bs_uring_enabled, a reader which streams keeps the next read in
+ * flight into one buffer while its caller works on the other, so a chunk
+ * which is ready by then is had without a system call. Both are its own,
+ * not the caller's, which may be gone before a read in flight is.
+ */
+struct bs_reader_ahead {
+	struct bs_uring *u;
+	struct bs_uring_req req;
+	char *own;		/* the buffer the reader was given */
+	char *bufs[2];
+	size_t next;		/* the one being read into */
+	int done;		/* at EOF, or failed */
+	int err;
+};
+
+static int bs_reader_ahead_start(struct bs_reader *r)
+{
+	if (r->ahead) {
+		return 1;
+	}
+	if (r->ahead_checked) {
+		return 0;
+	}
+	r->ahead_checked = 1;
+	struct bs_uring *u = bs_uring_get();
+	if (!u || r->fd < 0 || r->fd >= BS_RING_FD_BASE) {
+		return 0;
+	}
+	struct bs_reader_ahead *a = bs_malloc(sizeof(*a) + 2 * r->bufsize);
+	if (!a) {
+		return 0;
+	}
+	memset(a, 0x00, sizeof(*a));
+	a->u = u;
+	a->own = r->buf;
+	a->bufs[0] = (char *)(a + 1);
+	a->bufs[1] = a->bufs[0] + r->bufsize;
+	a->err = bs_uring_read(u, &a->req, r->fd, a->bufs[0], r->bufsize, -1);
+	a->done = a->err != 0;
+	r->ahead = a;
+	return 1;
+}
+
+/* as bs_read, but from the read in flight, and sends off the next */
+static ssize_t bs_reader_ahead_fill(struct bs_reader *r)
+{
+	struct bs_reader_ahead *a = r->ahead;
+	int err = a->req.busy ? bs_uring_wait(a->u, &a->req) : 0;
+	if (err || a->done) {
+		errno = err ? err : a->err;
+		return errno ? -1 : 0;
+	}
+	if (a->req.res <= 0) {
+		a->done = 1;
+		a->err = -a->req.res;
+		errno = a->err;
+		return a->err ? -1 : 0;
+	}
+
+	r->buf = a->bufs[a->next];
+	a->next = !a->next;
+	ssize_t bytes = a->req.res;
+
+	err = bs_uring_read(a->u, &a->req, r->fd, a->bufs[a->next],
+			    r->bufsize, -1);
+	if (!err) {
+		err = bs_uring_submit(a->u);
+	}
+	if (err) {
+		/* what was read is good, the next fill says what went wrong */
+		a->done = 1;
+		a->err = err;
+	}
+	return bytes;
+}
+
+static void bs_reader_ahead_end(struct bs_reader *r)
+{
+	struct bs_reader_ahead *a = r->ahead;
+	int err = bs_uring_cancel(a->u, &a->req);
+	r->buf = a->own;
+	r->ahead = NULL;
+	r->ahead_checked = 0;
+	if (err) {
+		/* the ring is gone, maybe still reading: leave it the buffer */
+		Bs_log_error(r->log, "io_uring read(%d) not cancelled: %d",
+			     r->fd, err);
+		return;
+	}
+	bs_free(a);
+}
+
+ssize_t bs_reader_fill(struct bs_reader *r)
+{
+	r->pos = 0;
+	r->len = 0;
+
+	if (r->map) {
+		if (r->map_done) {
+			return 0;
+		}
+		r->map_done = 1;
+		r->buf = r->map;
+		r->len = r->map_len;
+		if (bs_stats_current) {
+			bs_stats_current->bytes_in += r->len;
+		}
+		return (ssize_t)r->len;
+	}
+
+	ssize_t bytes;
+	if (bs_reader_ahead_start(r)) {
+		bytes = bs_reader_ahead_fill(r);
+	} else {
+		do {
+			bytes = bs_read(r->fd, r->buf, r->bufsize);
+		} while (bytes < 0 && errno == EINTR);
+	}
+	if (bs_stats_current) {
+		++bs_stats_current->reads;
+		bs_stats_current->bytes_in += (bytes > 0) ? (size_t)bytes : 0;
+	}
+	if (bytes < 0) {
+		const char *fmt = "read(%d, buf, %zu) returned %zd";
+		int save_errno = Bs_log_errno(r->log, fmt, r->fd, r->bufsize,
+					      bytes);
+		r->err = save_errno ? save_errno : 1;
+		return -1;
+	}
+	r->len = (size_t)bytes;
+	return bytes;
+}
+
+int bs_reader_map(struct bs_reader *r)
+{
+	struct stat st;
+	if (fstat(r->fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return 0;
+	}
+	/* partly read already, the rest is streamed from where it is */
+	if (lseek(r->fd, 0, SEEK_CUR) != 0) {
+		return 0;
+	}
+
+	size_t len = (size_t)st.st_size;
+	void *map = bs_mmap(NULL, len, PROT_READ, MAP_PRIVATE, r->fd, 0);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+	madvise(map, len, MADV_SEQUENTIAL);
+
+	r->map = map;
+	r->map_len = len;
+	r->map_done = 0;
+	return 1;
+}
+
+void bs_reader_unmap(struct bs_reader *r)
+{
+	if (r->ahead) {
+		bs_reader_ahead_end(r);
+	}
+	if (r->map) {
+		bs_munmap(r->map, r->map_len);
+		r->map = NULL;
+		r->map_len = 0;
+		r->buf = NULL;
+		r->pos = 0;
+		r->len = 0;
+	}
+}
+
+void bs_writer_init(struct bs_writer *w, int fd, char *buf, size_t bufsize,
+		    FILE *log)
+{
+	w->fd = fd;
+	w->buf = buf;
+	w->bufsize = bufsize;
+	w->len = 0;
+	w->err = 0;
+	w->log = log;
+	w->behind = NULL;
+	w->behind_checked = 0;
+}
+
+int bs_write_all(int fd, const char *data, size_t len, FILE *log)
+{
+	while (len) {
+		ssize_t bytes = bs_write(fd, data, len);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			const char *fmt = "write(%d, buf, %zu) returned %zd";
+			int save_errno = Bs_log_errno(log, fmt, fd, len, bytes);
+			return save_errno ? save_errno : 1;
+		}
+		data += bytes;
+		len -= (size_t)bytes;
+		if (bs_stats_current) {
+			struct bs_pipe_stats *st = bs_stats_current;
+			++st->writes;
+			st->bytes_out += (size_t)bytes;
+			size_t fill = bs_stats_channel_fill(fd);
+			st->peak_buffer = (fill > st->peak_buffer) ? fill
+			    : st->peak_buffer;
+		}
+	}
+	return 0;
+}
+
+/* a writer to memory has room for "need" more bytes after this */
+static int bs_writer_grow(struct bs_writer *w, size_t need)
+{
+	size_t size = w->bufsize ? w->bufsize : BS_IO_BUFSIZE;
+	while (size - w->len < need) {
+		size *= 2;
+	}
+	if (size == w->bufsize) {
+		return 0;
+	}
+	char *buf = bs_malloc(size);
+	if (!buf) {
+		int save_errno = Bs_log_errno(w->log, "writer of %zu bytes"
+					      " failed", size);
+		w->err = save_errno ? save_errno : ENOMEM;
+		return w->err;
+	}
+	if (w->len) {
+		memcpy(buf, w->buf, w->len);
+	}
+	bs_free(w->buf);
+	w->buf = buf;
+	w->bufsize = size;
+	return 0;
+}
+
+/*
+ * With bs_uring_enabled, a writer to a regular file writes behind: a full
+ * buffer is queued at its offset, and the writer goes on in the next of
+ * BS_WRITE_BEHIND buffers of its own; the caller's is only used again
+ * once none is in flight, as it may be gone before they are. The queued
+ * writes go to the kernel together when the writer runs out of buffers,
+ * and bs_writer_flush() waits for all of them, then moves the file
+ * position to where write() would have left it.
+ */
+#ifndef BS_WRITE_BEHIND
+#define BS_WRITE_BEHIND 4
+#endif
+
+struct bs_writer_behind {
+	struct bs_uring *u;
+	struct bs_uring_req reqs[BS_WRITE_BEHIND];
+	char *own;		/* the buffer the writer was given */
+	char *bufs[BS_WRITE_BEHIND];
+	size_t lens[BS_WRITE_BEHIND];
+	size_t done[BS_WRITE_BEHIND];
+	off_t offsets[BS_WRITE_BEHIND];
+	size_t next;		/* the buffer being filled */
+	off_t offset;		/* where it goes */
+};
+
+static int bs_writer_behind_start(struct bs_writer *w)
+{
+	if (w->behind) {
+		return 1;
+	}
+	if (w->behind_checked) {
+		return 0;
+	}
+	w->behind_checked = 1;
+	struct bs_uring *u = bs_uring_get();
+	struct stat st;
+	if (!u || w->fd >= BS_RING_FD_BASE || fstat(w->fd, &st)
+	    || !S_ISREG(st.st_mode) || (fcntl(w->fd, F_GETFL) & O_APPEND)) {
+		return 0;
+	}
+	off_t offset = lseek(w->fd, 0, SEEK_CUR);
+	if (offset < 0) {
+		return 0;
+	}
+	size_t bufs_size = BS_WRITE_BEHIND * w->bufsize;
+	struct bs_writer_behind *b = bs_malloc(sizeof(*b) + bufs_size);
+	if (!b) {
+		return 0;
+	}
+	memset(b, 0x00, sizeof(*b));
+	b->u = u;
+	b->offset = offset;
+	b->own = w->buf;
+	for (size_t i = 0; i < BS_WRITE_BEHIND; ++i) {
+		b->bufs[i] = (char *)(b + 1) + i * w->bufsize;
+	}
+	memcpy(b->bufs[0], w->buf, w->len);
+	w->buf = b->bufs[0];
+	w->behind = b;
+	return 1;
+}
+
+static int bs_writer_behind_queue(struct bs_writer *w, size_t i)
+{
+	struct bs_writer_behind *b = w->behind;
+	int err = bs_uring_write(b->u, b->reqs + i, w->fd,
+				 b->bufs[i] + b->done[i],
+				 b->lens[i] - b->done[i],
+				 b->offsets[i] + (off_t)b->done[i]);
+	if (err) {
+		errno = err;
+		int save_errno = Bs_log_errno(w->log, "io_uring write(%d)",
+					      w->fd);
+		w->err = save_errno ? save_errno : 1;
+	}
+	return w->err;
+}
+
+/* waits until buffer "i" is written, the rest of it again if short */
+static int bs_writer_behind_wait(struct bs_writer *w, size_t i)
+{
+	struct bs_writer_behind *b = w->behind;
+	struct bs_uring_req *req = b->reqs + i;
+	while (req->busy) {
+		int err = bs_uring_wait(b->u, req);
+		if (!err && req->res <= 0) {
+			err = req->res ? -req->res : EIO;
+		}
+		if (err) {
+			errno = err;
+			const char *fmt = "io_uring write(%d, buf, %zu)";
+			int save_errno = Bs_log_errno(w->log, fmt, w->fd,
+						      b->lens[i] - b->done[i]);
+			w->err = w->err ? w->err : save_errno ? save_errno : 1;
+			return w->err;
+		}
+		b->done[i] += (size_t)req->res;
+		if (bs_stats_current) {
+			++bs_stats_current->writes;
+			bs_stats_current->bytes_out += (size_t)req->res;
+		}
+		if (b->done[i] < b->lens[i] && bs_writer_behind_queue(w, i)) {
+			return w->err;
+		}
+	}
+	return 0;
+}
+
+static int bs_writer_behind_spill(struct bs_writer *w)
+{
+	struct bs_writer_behind *b = w->behind;
+	size_t i = b->next;
+	b->lens[i] = w->len;
+	b->done[i] = 0;
+	b->offsets[i] = b->offset;
+	if (bs_writer_behind_queue(w, i)) {
+		return w->err;
+	}
+	b->offset += (off_t)w->len;
+	w->len = 0;
+
+	/* if the next is still in flight, they all are: send them off */
+	b->next = (i + 1) % BS_WRITE_BEHIND;
+	w->buf = b->bufs[b->next];
+	return bs_writer_behind_wait(w, b->next);
+}
+
+static int bs_writer_behind_end(struct bs_writer *w)
+{
+	struct bs_writer_behind *b = w->behind;
+	int busy = 0;
+	for (size_t i = 0; i < BS_WRITE_BEHIND; ++i) {
+		bs_writer_behind_wait(w, i);
+	}
+	/* only if waiting failed, and it has already been said why */
+	for (size_t i = 0; i < BS_WRITE_BEHIND; ++i) {
+		busy = bs_uring_cancel(b->u, b->reqs + i) || busy;
+	}
+	if (!w->err && lseek(w->fd, b->offset, SEEK_SET) < 0) {
+		int save_errno = Bs_log_errno(w->log, "lseek(%d, %zd)", w->fd,
+					      (ssize_t)b->offset);
+		w->err = save_errno ? save_errno : 1;
+	}
+	/* what was not spilled, if a write failed */
+	memcpy(b->own, w->buf, w->len);
+	w->buf = b->own;
+	w->behind = NULL;
+	w->behind_checked = 0;
+	if (busy) {
+		/* the ring is gone, maybe still writing: leave it the bufs */
+		Bs_log_error(w->log, "io_uring writes to %d not cancelled",
+			     w->fd);
+		return w->err;
+	}
+	bs_free(b);
+	return w->err;
+}
+
+int bs_writer_spill(struct bs_writer *w)
+{
+	if (w->err) {
+		return w->err;
+	}
+	if (w->fd < 0) {
+		return (w->len < w->bufsize) ? 0 : bs_writer_grow(w, 1);
+	}
+	if (!w->len) {
+		return 0;
+	}
+	if (bs_writer_behind_start(w)) {
+		return bs_writer_behind_spill(w);
+	}
+	w->err = bs_write_all(w->fd, w->buf, w->len, w->log);
+	w->len = 0;
+	return w->err;
+}
+
+int bs_writer_flush(struct bs_writer *w)
+{
+	bs_writer_spill(w);
+	if (w->behind) {
+		bs_writer_behind_end(w);
+	}
+	return w->err;
+}
+
+int bs_writer_write(struct bs_writer *w, const char *data, size_t len)
+{
+	if (w->err) {
+		return w->err;
+	}
+	if (w->fd < 0 && bs_writer_grow(w, len)) {
+		return w->err;
+	}
+	if (len > (w->bufsize - w->len)) {
+		if (bs_writer_spill(w)) {
+			return w->err;
+		}
+		if (len >= w->bufsize && !w->behind) {
+			/* too big to coalesce, hand it straight through */
+			w->err = bs_write_all(w->fd, data, len, w->log);
+			return w->err;
+		}
+		/* writing behind, it goes through the buffers in turn */
+		while (len >= w->bufsize) {
+			memcpy(w->buf, data, w->bufsize);
+			w->len = w->bufsize;
+			data += w->bufsize;
+			len -= w->bufsize;
+			if (bs_writer_spill(w)) {
+				return w->err;
+			}
+		}
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+	return 0;
+}
+
+enum bs_pipes_backend bs_pipes_backend = bs_pipes_fork;
+
+size_t bs_pipe_size = BS_PIPE_SIZE;
+
+/* as big as bs_pipe_size, if the kernel lets it be; it is fine if not */
+static void bs_pipe_resize(int pipefd[2])
+{
+	if (!bs_pipe_size || bs_pipe_size > INT_MAX) {
+		return;
+	}
+	(void)fcntl(pipefd[1], F_SETPIPE_SZ, (int)bs_pipe_size);
+}
+
+struct bs_pipes_stats *bs_pipes_stats = NULL;
+
+static unsigned long long bs_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+int bs_pipe_stage_run(const struct pipe_func_s *func, int fd_from, int fd_to,
+		      struct bs_pipe_stats *stats, FILE *errlog)
+{
+	struct bs_pipe_stats *outer = bs_stats_current;
+	bs_stats_current = stats;
+	unsigned long long wall = bs_clock_ns(CLOCK_MONOTONIC);
+	unsigned long long cpu = bs_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	int err = func->pfunc(fd_from, fd_to, errlog);
+
+	stats->cpu_ns += bs_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	stats->wall_ns += bs_clock_ns(CLOCK_MONOTONIC) - wall;
+	stats->err = err;
+	bs_stats_current = outer;
+	return err;
+}
+
+void bs_pipes_stats_print(FILE *out, const struct bs_pipes_stats *stats,
+			  int json)
+{
+	if (json) {
+		fprintf(out, "{\"stages\": [");
+	} else {
+		fprintf(out, "%-28s %10s %10s %7s %7s %9s %9s %8s\n", "stage",
+			"bytes in", "bytes out", "reads", "writes", "wall ms",
+			"cpu ms", "peak buf");
+	}
+	for (size_t i = 0; i < stats->len; ++i) {
+		const struct bs_pipe_stats *s = stats->stages + i;
+		double wall_ms = (double)s->wall_ns / 1e6;
+		double cpu_ms = (double)s->cpu_ns / 1e6;
+		if (!json) {
+			fprintf(out, "%-28s %10llu %10llu %7llu %7llu %9.3f"
+				" %9.3f %8llu\n", s->name, s->bytes_in,
+				s->bytes_out, s->reads, s->writes, wall_ms,
+				cpu_ms, s->peak_buffer);
+			continue;
+		}
+		fprintf(out, "%s\n  {\"name\": \"%s\", \"bytes_in\": %llu,"
+			" \"bytes_out\": %llu, \"reads\": %llu,"
+			" \"writes\": %llu, \"wall_ms\": %.3f,"
+			" \"cpu_ms\": %.3f, \"peak_buffer\": %llu,"
+			" \"err\": %d}", i ? "," : "", s->name, s->bytes_in,
+			s->bytes_out, s->reads, s->writes, wall_ms, cpu_ms,
+			s->peak_buffer, s->err);
+	}
+	if (json) {
+		fprintf(out, "\n]}\n");
+	}
+}
+
 int bs_pipes(struct pipe_func_s *funcs, int fdin, int fdout, FILE *errlog)
+{
+	if (bs_pipes_stats) {
+		size_t len = 0;
+		for (; funcs[len].pfunc && len < BS_PIPE_STATS_MAX; ++len) {
+			struct bs_pipe_stats *s = bs_pipes_stats->stages + len;
+			memset(s, 0x00, sizeof(struct bs_pipe_stats));
+			snprintf(s->name, sizeof(s->name), "%s",
+				 funcs[len].name);
+		}
+		bs_pipes_stats->len = len;
+	}
+	if (bs_pipes_backend == bs_pipes_threads) {
+		return bs_pipes_threaded(funcs, fdin, fdout, errlog);
+	}
+	return bs_pipes_forked(funcs, fdin, fdout, errlog);
+}
+
+struct bs_pipe_stats_msg {
+	size_t stage;
+	struct bs_pipe_stats stats;
+};
+
+static void bs_pipes_stats_collect(struct bs_pipes_stats *stats, int fd,
+				   FILE *errlog)
+{
+	struct bs_pipe_stats_msg msg;
+	size_t have = 0;
+	for (;;) {
+		char *pos = ((char *)&msg) + have;
+		ssize_t bytes = bs_read(fd, pos, sizeof(msg) - have);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes < 0) {
+			Bs_log_errno(errlog, "read(%d) of stage stats", fd);
+			return;
+		}
+		if (bytes == 0) {
+			return;
+		}
+		have += (size_t)bytes;
+		if (have == sizeof(msg)) {
+			if (msg.stage < stats->len) {
+				stats->stages[msg.stage] = msg.stats;
+			}
+			have = 0;
+		}
+	}
+}
+
+int bs_pipes_forked(struct pipe_func_s *funcs, int fdin, int fdout,
+		    FILE *errlog)
 {
 	pid_t child_pid = 0;
 	int piperead;
@@ -55,10 +761,19 @@ int bs_pipes(struct pipe_func_s *funcs, int fdin, int fdout, FILE *errlog)
 	char name[80];
 	memset(name, 0x00, 80);
 
+	/* each child sends back its counters, small enough to be atomic */
+	struct bs_pipes_stats *stats = bs_pipes_stats;
+	int statsfd[2] = { -1, -1 };
+	if (stats && bs_pipe(statsfd)) {
+		Bs_log_errno(errlog, "stats pipe failed, not counting");
+		stats = NULL;
+	}
+
 	for (size_t i = 0; funcs[i].pfunc; ++i) {
 
 		int pipefd[2];
 		bs_pipe(pipefd);
+		bs_pipe_resize(pipefd);
 
 		piperead = pipefd[0];
 		pipewrite = pipefd[1];
@@ -84,6 +799,20 @@ int bs_pipes(struct pipe_func_s *funcs, int fdin, int fdout, FILE *errlog)
 			/* not using the "out" end of pipe */
 			Bs_close_fd(piperead, name, errlog);
 
+			if (stats && i < stats->len) {
+				bs_close(statsfd[0]);
+				struct bs_pipe_stats *st = stats->stages + i;
+				int childerr = bs_pipe_stage_run(funcs + i,
+								 incoming,
+								 pipewrite, st,
+								 errlog);
+				struct bs_pipe_stats_msg msg = { i, *st };
+				bs_write_all(statsfd[1], (const char *)&msg,
+					     sizeof(msg),
+					     errlog);
+				bs_exit(exit_val(childerr));
+			}
+
 			/* make my funk the p-funk, I want my funk uncut */
 			bs_pipe_function myfunc = funcs[i].pfunc;
 			int childerr = myfunc(incoming, pipewrite, errlog);
@@ -103,12 +832,18 @@ int bs_pipes(struct pipe_func_s *funcs, int fdin, int fdout, FILE *errlog)
 		incoming = piperead;
 	}
 
-	const size_t bufsize = 80;
-	char buf[80];
-	int err2 = bs_fd_copy(incoming, fdout, buf, bufsize, errlog);
+	char buf[BS_IO_BUFSIZE];
+	int err2 = bs_fd_copy(incoming, fdout, buf, BS_IO_BUFSIZE, errlog);
 	snprintf(name, 80, "parent finish incoming");
 	Bs_close_fd(incoming, name, errlog);
 
+	if (stats) {
+		/* EOF once every child has exited */
+		Bs_close_fd(statsfd[1], "stats pipe write", errlog);
+		bs_pipes_stats_collect(stats, statsfd[0], errlog);
+		Bs_close_fd(statsfd[0], "stats pipe read", errlog);
+	}
+
 	// snprintf(name, 80, "parent finish fdout");
 	// Bs_close_fd(fdout, name, errlog);
 
@@ -119,6 +854,359 @@ int bs_pipes(struct pipe_func_s *funcs, int fdin, int fdout, FILE *errlog)
 	return (err1 > err2) ? err1 : err2;
 }
 
+struct bs_ring {
+	char *buf;
+	size_t size;		/* a power of two */
+	_Atomic size_t head;	/* total bytes consumed */
+	_Atomic size_t tail;	/* total bytes produced */
+	atomic_int reader_closed;
+	atomic_int writer_closed;
+	atomic_int waiting;
+	unsigned closed_ends;	/* guarded by bs_rings_mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+#define BS_RING_MAX 1024
+#define BS_RING_SPINS 64
+
+static struct bs_ring *bs_rings[BS_RING_MAX];
+static pthread_mutex_t bs_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct bs_ring *bs_ring_from_fd(int fd)
+{
+	size_t slot = ((size_t)fd - BS_RING_FD_BASE) / 2;
+	return (slot < BS_RING_MAX) ? bs_rings[slot] : NULL;
+}
+
+/* bytes written to "fd" but not yet read, or 0 if that is unknown */
+static size_t bs_stats_channel_fill(int fd)
+{
+	if (fd >= BS_RING_FD_BASE) {
+		struct bs_ring *r = bs_ring_from_fd(fd);
+		if (r) {
+			return atomic_load(&r->tail) - atomic_load(&r->head);
+		}
+	}
+	int pending = 0;
+	if (ioctl(fd, FIONREAD, &pending) < 0 || pending < 0) {
+		return 0;
+	}
+	return (size_t)pending;
+}
+
+static int bs_ring_readable(struct bs_ring *r)
+{
+	return (atomic_load(&r->tail) != atomic_load(&r->head))
+	    || atomic_load(&r->writer_closed);
+}
+
+static int bs_ring_writable(struct bs_ring *r)
+{
+	return (atomic_load(&r->tail) - atomic_load(&r->head) < r->size)
+	    || atomic_load(&r->reader_closed);
+}
+
+/* spin briefly, then sleep until the other end makes progress */
+static void bs_ring_wait(struct bs_ring *r, int (*ready)(struct bs_ring *r))
+{
+	for (size_t i = 0; i < BS_RING_SPINS; ++i) {
+		if (ready(r)) {
+			return;
+		}
+		sched_yield();
+	}
+	pthread_mutex_lock(&r->mutex);
+	atomic_fetch_add(&r->waiting, 1);
+	while (!ready(r)) {
+		pthread_cond_wait(&r->cond, &r->mutex);
+	}
+	atomic_fetch_sub(&r->waiting, 1);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void bs_ring_wake(struct bs_ring *r)
+{
+	if (atomic_load(&r->waiting)) {
+		pthread_mutex_lock(&r->mutex);
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->mutex);
+	}
+}
+
+static ssize_t bs_ring_read(struct bs_ring *r, void *buf, size_t count)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t avail = 0;
+	while (count && !(avail = atomic_load(&r->tail) - head)) {
+		if (atomic_load(&r->writer_closed)) {
+			if (atomic_load(&r->tail) == head) {
+				return 0;
+			}
+		} else {
+			bs_ring_wait(r, bs_ring_readable);
+		}
+	}
+
+	size_t len = (count < avail) ? count : avail;
+	size_t off = head & (r->size - 1);
+	size_t first = (len < r->size - off) ? len : r->size - off;
+	memcpy(buf, r->buf + off, first);
+	memcpy(((char *)buf) + first, r->buf, len - first);
+
+	atomic_store(&r->head, head + len);
+	bs_ring_wake(r);
+	return (ssize_t)len;
+}
+
+static ssize_t bs_ring_write(struct bs_ring *r, const void *buf, size_t count)
+{
+	const char *from = buf;
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t left = count;
+	while (left) {
+		if (atomic_load(&r->reader_closed)) {
+			errno = EPIPE;
+			return -1;
+		}
+		size_t space = r->size - (tail - atomic_load(&r->head));
+		if (!space) {
+			bs_ring_wait(r, bs_ring_writable);
+			continue;
+		}
+		size_t len = (left < space) ? left : space;
+		size_t off = tail & (r->size - 1);
+		size_t first = (len < r->size - off) ? len : r->size - off;
+		memcpy(r->buf + off, from, first);
+		memcpy(r->buf, from + first, len - first);
+
+		tail += len;
+		from += len;
+		left -= len;
+		atomic_store(&r->tail, tail);
+		bs_ring_wake(r);
+	}
+	return (ssize_t)count;
+}
+
+static int bs_ring_close(int fd, struct bs_ring *r)
+{
+	int is_writer = (fd - BS_RING_FD_BASE) % 2;
+	atomic_int *mine = is_writer ? &r->writer_closed : &r->reader_closed;
+
+	if (atomic_exchange(mine, 1)) {
+		errno = EBADF;
+		return -1;
+	}
+	pthread_mutex_lock(&r->mutex);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	/* whichever end closes last frees the ring */
+	pthread_mutex_lock(&bs_rings_mutex);
+	int last = (++r->closed_ends == 2);
+	if (last) {
+		bs_rings[(fd - BS_RING_FD_BASE) / 2] = NULL;
+	}
+	pthread_mutex_unlock(&bs_rings_mutex);
+
+	if (last) {
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->mutex);
+		bs_free(r->buf);
+		bs_free(r);
+	}
+	return 0;
+}
+
+ssize_t bs_fd_read(int fd, void *buf, size_t count)
+{
+	if (fd < BS_RING_FD_BASE) {
+		return read(fd, buf, count);
+	}
+	struct bs_ring *r = bs_ring_from_fd(fd);
+	if (!r || (fd - BS_RING_FD_BASE) % 2) {
+		errno = EBADF;
+		return -1;
+	}
+	return bs_ring_read(r, buf, count);
+}
+
+ssize_t bs_fd_write(int fd, const void *buf, size_t count)
+{
+	if (fd < BS_RING_FD_BASE) {
+		return write(fd, buf, count);
+	}
+	struct bs_ring *r = bs_ring_from_fd(fd);
+	if (!r || !((fd - BS_RING_FD_BASE) % 2)) {
+		errno = EBADF;
+		return -1;
+	}
+	return bs_ring_write(r, buf, count);
+}
+
+int bs_fd_close(int fd)
+{
+	if (fd < BS_RING_FD_BASE) {
+		return close(fd);
+	}
+	struct bs_ring *r = bs_ring_from_fd(fd);
+	if (!r) {
+		errno = EBADF;
+		return -1;
+	}
+	return bs_ring_close(fd, r);
+}
+
+int bs_ring_pipe(int pipefd[2])
+{
+	struct bs_ring *r = bs_malloc(sizeof(struct bs_ring));
+	if (!r) {
+		return -1;
+	}
+	memset(r, 0x00, sizeof(struct bs_ring));
+	r->size = BS_RING_SIZE;
+	r->buf = bs_malloc(r->size);
+	if (!r->buf) {
+		bs_free(r);
+		return -1;
+	}
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+
+	size_t slot = BS_RING_MAX;
+	pthread_mutex_lock(&bs_rings_mutex);
+	for (size_t i = 0; i < BS_RING_MAX; ++i) {
+		if (!bs_rings[i]) {
+			bs_rings[i] = r;
+			slot = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bs_rings_mutex);
+
+	if (slot == BS_RING_MAX) {
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->mutex);
+		bs_free(r->buf);
+		bs_free(r);
+		errno = EMFILE;
+		return -1;
+	}
+	pipefd[0] = BS_RING_FD_BASE + (int)(2 * slot);
+	pipefd[1] = BS_RING_FD_BASE + (int)(2 * slot) + 1;
+	return 0;
+}
+
+struct bs_pipe_thread {
+	pthread_t thread;
+	const struct pipe_func_s *func;
+	struct bs_pipe_stats *stats;
+	int fd_from;
+	int fd_to;
+	int close_fd_to;
+	FILE *errlog;
+	int err;
+};
+
+static void *bs_pipe_thread_run(void *arg)
+{
+	struct bs_pipe_thread *t = arg;
+	if (t->stats) {
+		t->err = bs_pipe_stage_run(t->func, t->fd_from, t->fd_to,
+					   t->stats, t->errlog);
+	} else {
+		t->err = t->func->pfunc(t->fd_from, t->fd_to, t->errlog);
+	}
+	if (t->close_fd_to) {
+		/* the reader of the ring sees EOF */
+		bs_close(t->fd_to);
+	}
+	return NULL;
+}
+
+int bs_pipes_threaded(struct pipe_func_s *funcs, int fdin, int fdout,
+		      FILE *errlog)
+{
+	size_t count = 0;
+	while (funcs[count].pfunc) {
+		++count;
+	}
+
+	struct bs_pipe_thread *threads = NULL;
+	if (count) {
+		size_t size = count * sizeof(struct bs_pipe_thread);
+		threads = bs_malloc(size);
+		if (!threads) {
+			int save_errno = Bs_log_errno(errlog, "malloc(%zu)",
+						      size);
+			return save_errno ? save_errno : 1;
+		}
+		memset(threads, 0x00, size);
+	}
+
+	int err = 0;
+	size_t started = 0;
+	int incoming = fdin;
+	for (size_t i = 0; i < count; ++i) {
+		struct bs_pipe_thread *t = threads + i;
+		int pipefd[2] = { -1, -1 };
+		t->func = funcs + i;
+		if (bs_pipes_stats && i < bs_pipes_stats->len) {
+			t->stats = bs_pipes_stats->stages + i;
+		}
+		t->fd_from = incoming;
+		t->fd_to = fdout;
+		t->errlog = errlog;
+		if (i + 1 < count) {
+			if (bs_ring_pipe(pipefd)) {
+				const char *fmt = "ring pipe for %s failed";
+				int save_errno = Bs_log_errno(errlog, fmt,
+							      funcs[i].name);
+				err = save_errno ? save_errno : 1;
+				bs_close(incoming);
+				break;
+			}
+			t->fd_to = pipefd[1];
+			t->close_fd_to = 1;
+		}
+
+		int rv = pthread_create(&t->thread, NULL, bs_pipe_thread_run, t);
+		if (rv) {
+			errno = rv;
+			const char *fmt = "pthread_create for %s failed";
+			int save_errno = Bs_log_errno(errlog, fmt,
+						      funcs[i].name);
+			err = save_errno ? save_errno : 1;
+			bs_close(incoming);
+			if (t->close_fd_to) {
+				bs_close(pipefd[1]);
+				bs_close(pipefd[0]);
+			}
+			break;
+		}
+		++started;
+		incoming = pipefd[0];
+	}
+
+	if (!count) {
+		char buf[BS_IO_BUFSIZE];
+		err = bs_fd_copy(fdin, fdout, buf, BS_IO_BUFSIZE, errlog);
+		Bs_close_fd(fdin, "threaded pipes fdin", errlog);
+	}
+
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		if (!err) {
+			err = threads[i].err;
+		}
+	}
+
+	bs_free(threads);
+
+	return err;
+}
+
 int bs_open_ro(const char *path, int *err, FILE *log,
 	       const char *file, int line)
 {
@@ -176,19 +1264,151 @@ int bs_pipe_paths(struct pipe_func_s *funcs, const char *in_path,
 
 	mode_t mode = 0664;
 	int fdout = Bs_open_rw(out_path, mode, &err, errlog);
-	if (fdin < 0) {
+	if (fdout < 0) {
 		Bs_close_fd(fdin, in_path, errlog);
 		return err;
 	}
 
+	/* bs_pipes takes ownership of "fdin" */
 	err = bs_pipes(funcs, fdin, fdout, errlog);
 
 	Bs_close_fd(fdout, out_path, errlog);
-	Bs_close_fd(fdin, in_path, errlog);
 
 	return err;
 }
 
+unsigned long long bs_fnv1a(unsigned long long hash, const void *data,
+			    size_t len)
+{
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* the finalizer of splitmix64 */
+unsigned long long bs_hash_mix(unsigned long long hash)
+{
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+struct bs_arena_chunk {
+	struct bs_arena_chunk *next;
+	size_t size;
+	max_align_t data[];
+};
+
+static struct bs_arena_chunk *bs_arena_chunk(struct bs_arena *arena,
+					     size_t size)
+{
+	struct bs_arena_chunk **spare = &arena->spare;
+	for (; *spare; spare = &(*spare)->next) {
+		if ((*spare)->size >= size) {
+			struct bs_arena_chunk *chunk = *spare;
+			*spare = chunk->next;
+			return chunk;
+		}
+	}
+
+	size_t chunk_size = BS_ARENA_CHUNK_SIZE;
+	if (size > chunk_size) {
+		chunk_size = size;
+	}
+	struct bs_arena_chunk *chunk;
+	chunk = bs_malloc(sizeof(struct bs_arena_chunk) + chunk_size);
+	if (chunk) {
+		chunk->size = chunk_size;
+	}
+	return chunk;
+}
+
+void *bs_arena_alloc(struct bs_arena *arena, size_t size)
+{
+	const size_t align = sizeof(max_align_t);
+	size = (size + align - 1) & ~(align - 1);
+
+	struct bs_arena_chunk *head = arena->head;
+	if (!head || arena->used + size > head->size) {
+		struct bs_arena_chunk *chunk = bs_arena_chunk(arena, size);
+		if (!chunk) {
+			return NULL;
+		}
+		if (head && size > BS_ARENA_CHUNK_SIZE / 4) {
+			/* a big one-off, keep filling the current head */
+			chunk->next = head->next;
+			head->next = chunk;
+			arena->total += size;
+			return chunk->data;
+		}
+		chunk->next = head;
+		arena->head = chunk;
+		arena->used = 0;
+	}
+
+	void *p = ((char *)arena->head->data) + arena->used;
+	arena->used += size;
+	arena->total += size;
+	return p;
+}
+
+void bs_arena_reset(struct bs_arena *arena)
+{
+	while (arena->head) {
+		struct bs_arena_chunk *chunk = arena->head;
+		arena->head = chunk->next;
+		chunk->next = arena->spare;
+		arena->spare = chunk;
+	}
+	arena->used = 0;
+	arena->total = 0;
+}
+
+void bs_arena_mark(const struct bs_arena *arena, struct bs_arena_mark *mark)
+{
+	mark->head = arena->head;
+	mark->next = arena->head ? arena->head->next : NULL;
+	mark->used = arena->used;
+	mark->total = arena->total;
+}
+
+static void bs_arena_spare(struct bs_arena *arena,
+			   struct bs_arena_chunk **from)
+{
+	struct bs_arena_chunk *chunk = *from;
+	*from = chunk->next;
+	chunk->next = arena->spare;
+	arena->spare = chunk;
+}
+
+void bs_arena_rewind(struct bs_arena *arena, const struct bs_arena_mark *mark)
+{
+	while (arena->head != mark->head) {
+		bs_arena_spare(arena, &arena->head);
+	}
+	/* and the big one-offs put under it since */
+	while (arena->head && arena->head->next != mark->next) {
+		bs_arena_spare(arena, &arena->head->next);
+	}
+	arena->used = mark->used;
+	arena->total = mark->total;
+}
+
+void bs_arena_release(struct bs_arena *arena)
+{
+	bs_arena_reset(arena);
+	while (arena->spare) {
+		struct bs_arena_chunk *chunk = arena->spare;
+		arena->spare = chunk->next;
+		bs_free(chunk);
+	}
+}
+
 int bs_log_error(int perrno, const char *file, int line, FILE *errlog,
 		 const char *format, ...)
 {
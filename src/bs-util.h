@@ -19,9 +19,28 @@ extern int (*bs_close)(int fd);
 extern ssize_t (*bs_read)(int fd, void *buf, size_t count);
 extern ssize_t (*bs_write)(int fd, const void *buf, size_t count);
 
+/*
+ * the defaults of the three above: the system calls, or the ring end of
+ * a threaded bs_pipes for an fd at or above BS_RING_FD_BASE
+ */
+int bs_fd_close(int fd);
+ssize_t bs_fd_read(int fd, void *buf, size_t count);
+ssize_t bs_fd_write(int fd, const void *buf, size_t count);
+
 extern pid_t (*bs_fork)(void);
 extern int (*bs_pipe)(int pipefd[2]);
 
+/* splice(2) and copy_file_range(2), from and to the current offsets */
+extern ssize_t (*bs_splice)(int fd_from, int fd_to, size_t len);
+extern ssize_t (*bs_copy_range)(int fd_from, int fd_to, size_t len);
+
+/* posix_fadvise(2), of the whole of the file */
+extern int (*bs_fadvise)(int fd, int advice);
+
+extern void *(*bs_mmap)(void *addr, size_t length, int prot, int flags,
+			int fd, off_t offset);
+extern int (*bs_munmap)(void *addr, size_t length);
+
 extern void *(*bs_malloc)(size_t size);
 extern void (*bs_free)(void *p);
 
@@ -43,9 +62,187 @@ int bs_pipe_paths(struct pipe_func_s *funcs, const char *in_path,
 
 int bs_pipes(struct pipe_func_s *funcs, int fdin, int fdout, FILE *errlog);
 
+/* how bs_pipes runs each bs_pipe_function */
+enum bs_pipes_backend {
+	bs_pipes_fork = 0,	/* a child process per stage, kernel pipes */
+	bs_pipes_threads	/* a thread per stage, in-memory ring buffers */
+};
+extern enum bs_pipes_backend bs_pipes_backend;
+
+int bs_pipes_forked(struct pipe_func_s *funcs, int fdin, int fdout,
+		    FILE *errlog);
+
+int bs_pipes_threaded(struct pipe_func_s *funcs, int fdin, int fdout,
+		      FILE *errlog);
+
+/*
+ * Counters per stage, for --stats: while bs_pipes_stats is set, bs_pipes
+ * fills in an entry for each of its functions. A stage counts what goes
+ * through bs_reader_fill and bs_write_all on its own thread, or in its
+ * own process, which sends its counters back over a pipe when done.
+ */
+struct bs_pipe_stats {
+	char name[48];
+	unsigned long long bytes_in;	/* read, or mapped */
+	unsigned long long bytes_out;
+	unsigned long long reads;	/* calls to bs_read */
+	unsigned long long writes;	/* calls to bs_write */
+	unsigned long long wall_ns;
+	unsigned long long cpu_ns;
+	unsigned long long peak_buffer;	/* most left in its out ring or pipe */
+	int err;
+};
+
+#ifndef BS_PIPE_STATS_MAX
+#define BS_PIPE_STATS_MAX 8
+#endif
+
+struct bs_pipes_stats {
+	struct bs_pipe_stats stages[BS_PIPE_STATS_MAX];
+	size_t len;
+};
+
+extern struct bs_pipes_stats *bs_pipes_stats;
+
+/* runs "func" on this thread as one stage, counting into "stats" */
+int bs_pipe_stage_run(const struct pipe_func_s *func, int fd_from, int fd_to,
+		      struct bs_pipe_stats *stats, FILE *errlog);
+
+/* as a table of text, or as JSON */
+void bs_pipes_stats_print(FILE *out, const struct bs_pipes_stats *stats,
+			  int json);
+
+/*
+ * Single-producer/single-consumer ring buffers stand in for the kernel
+ * pipes of the threaded backend. Each end is given a pseudo file
+ * descriptor at or above BS_RING_FD_BASE, which bs_fd_read, bs_fd_write
+ * and bs_fd_close, the defaults of the i/o hooks, route to the ring.
+ */
+#ifndef BS_RING_SIZE
+#define BS_RING_SIZE (256 * 1024)
+#endif
+#define BS_RING_FD_BASE 0x40000000
+
+/*
+ * the capacity asked for, with F_SETPIPE_SZ, of each kernel pipe between
+ * the stages of the forked backend; 0 leaves the kernel's default, as does
+ * a kernel which refuses the size
+ */
+#ifndef BS_PIPE_SIZE
+#define BS_PIPE_SIZE (256 * 1024)
+#endif
+
+extern size_t bs_pipe_size;
+
+int bs_ring_pipe(int pipefd[2]);
+
+/*********************/
+/* buffered file i/o */
+/*********************/
+#ifndef BS_IO_BUFSIZE
+#define BS_IO_BUFSIZE (64 * 1024)
+#endif
+
+/*
+ * refillable input buffer, reads through the bs_read hook, or, once
+ * bs_reader_map succeeds, hands out the whole mapped file as one span
+ */
+struct bs_reader {
+	int fd;
+	char *buf;
+	size_t bufsize;
+	size_t pos;
+	size_t len;
+	int err;
+	FILE *log;
+	char *map;
+	size_t map_len;
+	int map_done;
+	struct bs_reader_ahead *ahead;	/* a read in flight, see bs-uring.h */
+	int ahead_checked;
+};
+
+/*
+ * coalescing output buffer, writes through the bs_write hook; with an fd
+ * of -1 it writes nowhere but keeps everything, growing its buffer from
+ * bs_malloc as needed, and the caller is to bs_free() the "buf"
+ */
+struct bs_writer {
+	int fd;
+	char *buf;
+	size_t bufsize;
+	size_t len;
+	int err;
+	FILE *log;
+	struct bs_writer_behind *behind;	/* writes in flight */
+	int behind_checked;
+};
+
+void bs_reader_init(struct bs_reader *r, int fd, char *buf, size_t bufsize,
+		    FILE *log);
+
+/* returns bytes now buffered, 0 at EOF, or -1 on error (see r->err) */
+ssize_t bs_reader_fill(struct bs_reader *r);
+
+/*
+ * maps a regular file for in-place scanning, returns 1 if mapped or 0 if
+ * the fd is not a non-empty regular file at offset 0 (or mmap fails), in
+ * which case the reader keeps streaming with bs_read
+ */
+int bs_reader_map(struct bs_reader *r);
+
+/* done with the reader: unmaps it, or waits for its read in flight */
+void bs_reader_unmap(struct bs_reader *r);
+
+/* returns 1 and sets *c, 0 at EOF, or -1 on error (see r->err) */
+static inline int bs_reader_getc(struct bs_reader *r, char *c)
+{
+	if (r->pos == r->len) {
+		ssize_t bytes = bs_reader_fill(r);
+		if (bytes <= 0) {
+			return (int)bytes;
+		}
+	}
+	*c = r->buf[r->pos++];
+	return 1;
+}
+
+void bs_writer_init(struct bs_writer *w, int fd, char *buf, size_t bufsize,
+		    FILE *log);
+
+/*
+ * returns 0 or the errno of the failed write (also kept in w->err), once
+ * everything buffered, or in flight, is written
+ */
+int bs_writer_flush(struct bs_writer *w);
+
+/* makes room in the buffer: writes it, or starts to (see bs-uring.h) */
+int bs_writer_spill(struct bs_writer *w);
+
+int bs_writer_write(struct bs_writer *w, const char *data, size_t len);
+
+static inline int bs_writer_putc(struct bs_writer *w, char c)
+{
+	if (w->len == w->bufsize) {
+		if (bs_writer_spill(w)) {
+			return w->err;
+		}
+	}
+	w->buf[w->len++] = c;
+	return 0;
+}
+
 /******************/
 /* file functions */
 /******************/
+/* writes all of "data", retrying short writes and EINTR */
+int bs_write_all(int fd, const char *data, size_t len, FILE *log);
+
+/*
+ * copies the rest of "fd_from" to "fd_to" in the kernel where it can:
+ * with bs_splice if either is a pipe, or bs_copy_range between files;
+ * else, or where those are not supported, through "buf"
+ */
 int bs_fd_copy(int fd_from, int fd_to, char *buf, size_t bufsize, FILE *errlog);
 
 int bs_open_ro(const char *path, int *err, FILE *log,
@@ -63,6 +260,62 @@ int bs_close_fd(int fd, const char *name, FILE *log, const char *file,
 #define Bs_close_fd(fd, name, log) \
 	bs_close_fd(fd, name, log, __FILE__, __LINE__);
 
+/***********/
+/* hashing */
+/***********/
+#define BS_FNV1A_INIT 0xcbf29ce484222325ULL
+
+/* 64-bit FNV-1a, pass BS_FNV1A_INIT or a previous result as "hash" */
+unsigned long long bs_fnv1a(unsigned long long hash, const void *data,
+			    size_t len);
+
+/*
+ * spreads the bits of a hash, for when hashes are combined with XOR, which
+ * would let the structure of raw FNV-1a values cancel out too easily
+ */
+unsigned long long bs_hash_mix(unsigned long long hash);
+
+/*********/
+/* arena */
+/*********/
+#ifndef BS_ARENA_CHUNK_SIZE
+#define BS_ARENA_CHUNK_SIZE (64 * 1024)
+#endif
+
+/*
+ * bump allocator over bs_malloc'ed chunks: many small allocations which
+ * all live until the whole arena is released
+ */
+struct bs_arena_chunk;
+
+struct bs_arena {
+	struct bs_arena_chunk *head;
+	struct bs_arena_chunk *spare;	/* kept by bs_arena_reset */
+	size_t used;		/* bytes handed out of head */
+	size_t total;		/* bytes handed out, all chunks */
+};
+
+/* returns NULL if out of memory, memory is aligned for any type */
+void *bs_arena_alloc(struct bs_arena *arena, size_t size);
+
+/* frees everything allocated, but keeps the chunks for reuse */
+void bs_arena_reset(struct bs_arena *arena);
+
+void bs_arena_release(struct bs_arena *arena);
+
+/* where an arena is, to go back to, keeping the chunks since for reuse */
+struct bs_arena_mark {
+	struct bs_arena_chunk *head;
+	struct bs_arena_chunk *next;
+	size_t used;
+	size_t total;
+};
+
+void bs_arena_mark(const struct bs_arena *arena, struct bs_arena_mark *mark);
+
+/* frees what was allocated since "mark", which must be of "arena" */
+void bs_arena_rewind(struct bs_arena *arena, const struct bs_arena_mark *mark);
+
 /*****************/
 /* error logging */
 /*****************/
@@ -30,11 +30,11 @@ main(void)
 EOF
 
 cat << EOF > $BS_EXE_EXPECT
- # define FORTY_TWO 42
+ 
 int  
 main(void)
 {
-	return FORTY_TWO;
+	return 42;
 }
 EOF
 
@@ -42,4 +42,16 @@ $BS_EXE $BS_EXE_IN $BS_EXE_OUT
 
 diff -u $BS_EXE_EXPECT $BS_EXE_OUT
 
-rm -f $BS_EXE_IN $BS_EXE_OUT $BS_EXE_EXPECT
+# the same output, with a count of what went through each stage
+BS_EXE_STATS=${BS_EXE_OUT}.stats
+rm -f $BS_EXE_OUT
+$BS_EXE --stats=json $BS_EXE_IN $BS_EXE_OUT > $BS_EXE_STATS
+diff -u $BS_EXE_EXPECT $BS_EXE_OUT
+STAGES=$(grep -c '"name": "bs_' $BS_EXE_STATS)
+COUNTED=$(grep -c '"bytes_in": [1-9].*"bytes_out": [1-9]' $BS_EXE_STATS)
+if [ $STAGES -eq 0 ] || [ $STAGES -ne $COUNTED ]; then
+	cat $BS_EXE_STATS
+	false
+fi
+
+rm -f $BS_EXE_IN $BS_EXE_OUT $BS_EXE_EXPECT $BS_EXE_STATS
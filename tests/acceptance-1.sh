@@ -2,7 +2,7 @@
 # SPDX-License-Identifier: GPL-3.0-or-later
 # Copyright (C) 2022 Eric Herman <eric@freesa.org>
 
-BS_CPP=$1
+BS_CPP="$@"
 
 if [ "_${BS_CPP}_" == "__" ]; then
 	BS_CPP=build/bs-cpp
@@ -37,4 +37,75 @@ $BS_CPP bar.c bar.c.i
 
 diff -uw bar.c.expected bar.c.i
 
+# headers long enough that their lines after the last directive, comment
+# or splice are copied as they are, unless a macro is used in them
+rm -f gen.h plain.h gen.c gen.c.expected gen.c.i
+echo '#pragma once' > gen.h
+echo '#pragma once' > plain.h
+echo '#define SCALE 3' > gen.c
+echo '#include "gen.h"' >> gen.c
+echo '#include "plain.h"' >> gen.c
+echo '' > gen.c.expected
+echo '#pragma once' >> gen.c.expected
+for i in $(seq 1 200); do
+	echo "static const int gen_$i = SCALE  * $i;" >> gen.h
+	echo "static const int gen_$i = 3  * $i;" >> gen.c.expected
+done
+echo '' >> gen.c.expected
+echo '#pragma once' >> gen.c.expected
+for i in $(seq 1 200); do
+	echo "static  const int plain_$i = $i ;" >> plain.h
+	echo "static  const int plain_$i = $i ;" >> gen.c.expected
+done
+echo '' >> gen.c.expected
+
+$BS_CPP gen.c gen.c.i
+
+diff -u gen.c.expected gen.c.i
+
+# includes nested deeper than there are fds to spare, as a level takes
+# none, and a header which includes itself stops with an error
+rm -f chain_*.h chain.c chain.c.expected chain.c.i loop.h loop.c loop.c.i
+DEPTH=150
+echo '#include "chain_1.h"' > chain.c
+for i in $(seq 1 $DEPTH); do
+	if [ $i -lt $DEPTH ]; then
+		echo "#include \"chain_$((i + 1)).h\"" > chain_$i.h
+	else
+		echo -n > chain_$i.h
+	fi
+	echo "int chain_$i;" >> chain_$i.h
+done
+seq $DEPTH -1 1 | sed -e 's/.*/int chain_&;/' > chain.c.expected
+
+(ulimit -n 32 && $BS_CPP chain.c chain.c.i)
+
+grep -v '^$' chain.c.i | diff -u chain.c.expected -
+
+echo '#include "loop.h"' > loop.h
+echo '#include "loop.h"' > loop.c
+if $BS_CPP loop.c loop.c.i 2> /dev/null; then
+	echo "expected loop.h to fail"
+	false
+fi
+
+# a quoted include is looked for next to the file with it first, as gcc
+# does, ahead of one of the same name in the current directory
+rm -rf near b.h near.c.i
+mkdir -p near/sub
+echo '#include "b.h"' > near/sub/a.h
+echo '#include "../c.h"' > near/sub/b.h
+echo 'int near_b;' >> near/sub/b.h
+echo 'int near_c;' > near/c.h
+echo 'int far_b;' > b.h
+echo '#include "sub/a.h"' > near/near.c
+echo '#include "c.h"' >> near/near.c
+
+$BS_CPP near/near.c near.c.i
+
+grep -v '^$' near.c.i | diff -u - <(printf 'int near_c;\nint near_b;\nint near_c;\n')
+
 rm -f foo.h bar.c bar.c.expected bar.c.i
+rm -f gen.h plain.h gen.c gen.c.expected gen.c.i
+rm -f chain_*.h chain.c chain.c.expected chain.c.i loop.h loop.c loop.c.i
+rm -rf near b.h near.c.i
@@ -0,0 +1,70 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-3.0-or-later
+# Copyright (C) 2022 Eric Herman <eric@freesa.org>
+
+# batch mode: many translation units, one run, a pool of workers
+
+BS_CPP="$@"
+
+if [ "_${BS_CPP}_" == "__" ]; then
+	BS_CPP=build/bs-cpp
+fi
+
+set -e
+
+DIR=batch-tmp
+rm -rf $DIR
+mkdir -p $DIR/inc
+
+cat << EOF > $DIR/inc/once.h
+#pragma once
+int once(void);
+EOF
+
+cat << EOF > $DIR/inc/guarded.h
+#ifndef GUARDED_H
+#define GUARDED_H
+int guarded(NAME);
+#endif
+EOF
+
+rm -f $DIR/manifest
+for i in $(seq 1 40); do
+	cat << EOF > $DIR/tu-$i.c
+#define NAME tu_$i
+#include "once.h"
+#include <guarded.h>
+#include "once.h"
+#include <guarded.h>
+int f_$i(void) { return NAME; }
+EOF
+	cat << EOF > $DIR/tu-$i.c.expected
+#pragma once
+int once(void);
+int guarded(tu_$i);
+int f_$i(void) { return tu_$i; }
+EOF
+	if [ $i -le 30 ]; then
+		echo "$DIR/tu-$i.c $DIR/tu-$i.c.i" >> $DIR/manifest
+	else
+		PAIRS="$PAIRS $DIR/tu-$i.c $DIR/tu-$i.c.i"
+	fi
+done
+
+$BS_CPP -j 4 -I $DIR/inc --batch $DIR/manifest $PAIRS
+
+for i in $(seq 1 40); do
+	# only the text matters here, not the lines the directives leave
+	grep -v '^\s*$' $DIR/tu-$i.c.i | diff -uw $DIR/tu-$i.c.expected -
+done
+
+# a missing input fails the run, but not the other units
+echo "$DIR/missing.c $DIR/missing.c.i" >> $DIR/manifest
+rm -f $DIR/tu-1.c.i
+if $BS_CPP -j 2 -I $DIR/inc --batch $DIR/manifest 2> /dev/null; then
+	echo "expected a failure for $DIR/missing.c"
+	exit 1
+fi
+grep -v '^\s*$' $DIR/tu-1.c.i | diff -uw $DIR/tu-1.c.expected -
+
+rm -rf $DIR
@@ -0,0 +1,90 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-3.0-or-later
+# Copyright (C) 2022 Eric Herman <eric@freesa.org>
+
+# server mode: the caches stay warm between requests, but see file changes
+
+BS_CPP="$@"
+
+if [ "_${BS_CPP}_" == "__" ]; then
+	BS_CPP=build/bs-cpp
+fi
+
+set -e
+
+DIR=server-tmp
+SOCK=$DIR/bs-cpp.sock
+rm -rf $DIR
+mkdir -p $DIR/inc-a $DIR/inc-b
+
+function stop_server() {
+	if [ -n "$SERVER_PID" ]; then
+		kill $SERVER_PID 2> /dev/null || true
+		wait $SERVER_PID 2> /dev/null || true
+	fi
+}
+trap stop_server EXIT
+
+$BS_CPP --serve $SOCK -j 2 -I $DIR/inc-a -I $DIR/inc-b &
+SERVER_PID=$!
+for i in $(seq 1 100); do
+	if [ -S $SOCK ]; then
+		break
+	fi
+	sleep 0.05
+done
+
+function check() {
+	$BS_CPP --connect $SOCK -I $DIR/inc-a -I $DIR/inc-b $DIR/tu.c $DIR/tu.i
+	echo "$1" > $DIR/tu.expected
+	grep -v '^\s*$' $DIR/tu.i | diff -uw $DIR/tu.expected -
+}
+
+cat << EOF > $DIR/tu.c
+#include "h.h"
+int x = V;
+EOF
+
+cat << EOF > $DIR/inc-b/h.h
+#define V 1
+EOF
+check "int x = 1;"
+check "int x = 1;"
+
+# the same file, changed
+sleep 0.01
+cat << EOF > $DIR/inc-b/h.h
+#define V 2
+EOF
+check "int x = 2;"
+
+# a file which now shadows the one found before
+cat << EOF > $DIR/inc-a/h.h
+#define V 3
+EOF
+check "int x = 3;"
+
+rm $DIR/inc-a/h.h
+check "int x = 2;"
+
+# the flags must be those the server was started with
+if $BS_CPP --connect $SOCK -I $DIR/inc-b $DIR/tu.c $DIR/tu.i 2> /dev/null
+then
+	echo "expected other -I dirs to be refused"
+	exit 1
+fi
+
+# only one server per socket
+if $BS_CPP --serve $SOCK 2> /dev/null; then
+	echo "expected a second server to be refused"
+	exit 1
+fi
+
+# stopped by SIGTERM, the server removes its socket
+stop_server
+SERVER_PID=
+if [ -e $SOCK ]; then
+	echo "expected $SOCK to be removed"
+	exit 1
+fi
+rm -rf $DIR
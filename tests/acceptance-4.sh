@@ -0,0 +1,131 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-3.0-or-later
+# Copyright (C) 2022 Eric Herman <eric@freesa.org>
+
+# make rules from the include walk: -M, -MM, -MD, -MP and -MF
+
+BS_CPP="$@"
+
+if [ "_${BS_CPP}_" == "__" ]; then
+	BS_CPP=build/bs-cpp
+fi
+
+set -e
+
+DIR=deps-tmp
+rm -rf $DIR
+mkdir -p $DIR/inc $DIR/sys
+
+cat << EOF > $DIR/inc/common.h
+#ifndef COMMON_H
+#define COMMON_H
+int common(void);
+#endif
+EOF
+
+for h in a b; do
+	cat << EOF > $DIR/inc/$h.h
+#ifndef ${h}_H
+#define ${h}_H
+#include "common.h"
+int $h(void);
+#endif
+EOF
+done
+
+# no guard and no macros, so kept in the cache, along with what it includes
+cat << EOF > $DIR/inc/x.h
+#include "y.h"
+int x(void);
+EOF
+echo 'int y(void);' > $DIR/inc/y.h
+
+cat << EOF > $DIR/sys/sys.h
+#pragma once
+int sys(void);
+EOF
+
+for u in one two; do
+	cat << EOF > $DIR/$u.c
+#include "a.h"
+#include <sys.h>
+#include "b.h"
+#include "a.h"
+#include "x.h"
+#ifdef NOT_DEFINED
+#include "not-there.h"
+#endif
+int $u(void) { return a() + b(); }
+EOF
+done
+
+# -M: only the rule, to the out path
+$BS_CPP -M -I $DIR/inc -isystem $DIR/sys $DIR/one.c $DIR/one.d
+cat << EOF > $DIR/one.d.expected
+one.o: $DIR/one.c $DIR/inc/a.h $DIR/inc/common.h \\
+ $DIR/sys/sys.h $DIR/inc/b.h $DIR/inc/x.h $DIR/inc/y.h
+EOF
+diff -u $DIR/one.d.expected $DIR/one.d
+
+# -MM: the system headers are left out
+$BS_CPP -MM -I $DIR/inc -isystem $DIR/sys $DIR/one.c $DIR/one.d
+cat << EOF > $DIR/one.d.expected
+one.o: $DIR/one.c $DIR/inc/a.h $DIR/inc/common.h \\
+ $DIR/inc/b.h $DIR/inc/x.h $DIR/inc/y.h
+EOF
+diff -u $DIR/one.d.expected $DIR/one.d
+
+# -MD with -MP, in a batch: the output, and a .d beside it; the second
+# unit replays the cached output of x.h, and notes y.h from it
+rm -f $DIR/one.d
+$BS_CPP -j 1 -MMD -MP -I $DIR/inc -isystem $DIR/sys \
+	$DIR/one.c $DIR/one.i $DIR/two.c $DIR/two.i
+for u in one two; do
+	grep -q "int $u(void) { return a() + b(); }" $DIR/$u.i
+	cat << EOF > $DIR/$u.d.expected
+$u.o: $DIR/$u.c $DIR/inc/a.h $DIR/inc/common.h \\
+ $DIR/inc/b.h $DIR/inc/x.h $DIR/inc/y.h
+
+$DIR/inc/a.h:
+
+$DIR/inc/common.h:
+
+$DIR/inc/b.h:
+
+$DIR/inc/x.h:
+
+$DIR/inc/y.h:
+EOF
+	diff -u $DIR/$u.d.expected $DIR/$u.d
+done
+
+# -MF names the rule's file, instead of the .d
+rm -f $DIR/two.d
+$BS_CPP --fused -MD -MF $DIR/rule.mk -I $DIR/inc -isystem $DIR/sys \
+	$DIR/two.c $DIR/two.i
+grep -q "^two.o: $DIR/two.c " $DIR/rule.mk
+if [ -e $DIR/two.d ]; then
+	echo "unexpected $DIR/two.d"
+	exit 1
+fi
+
+# no rule if the unit fails
+rm -f $DIR/three.d
+echo '#include "not-there.h"' > $DIR/three.c
+if $BS_CPP -MD -I $DIR/inc $DIR/three.c $DIR/three.i 2> /dev/null; then
+	echo "expected a failure for $DIR/three.c"
+	exit 1
+fi
+if [ -e $DIR/three.d ]; then
+	echo "unexpected $DIR/three.d"
+	exit 1
+fi
+
+# a rule is made by the fused engine, not a --threads one
+if $BS_CPP --threads -MD -I $DIR/inc $DIR/two.c $DIR/two.i 2> /dev/null
+then
+	echo "expected --threads with -MD to be refused"
+	exit 1
+fi
+
+rm -rf $DIR
@@ -0,0 +1,121 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-3.0-or-later
+# Copyright (C) 2022 Eric Herman <eric@freesa.org>
+
+# the on-disk cache: a unit is only preprocessed again once it changed
+
+BS_CPP="$@"
+
+if [ "_${BS_CPP}_" == "__" ]; then
+	BS_CPP=build/bs-cpp
+fi
+
+set -e
+
+DIR=cache-tmp
+rm -rf $DIR
+mkdir -p $DIR/first $DIR/inc
+
+cat << EOF > $DIR/inc/h.h
+#ifndef H_H
+#define H_H
+int h(void);
+#endif
+EOF
+
+cat << EOF > $DIR/unit.c
+#include "h.h"
+#if __has_include("maybe.h")
+#include "maybe.h"
+#endif
+int unit(void) { return h(); }
+EOF
+
+function run() {
+	$BS_CPP --cache-dir $DIR/cache -MD -I $DIR/first -I $DIR/inc \
+		$DIR/unit.c $DIR/unit.i
+	grep -v '^\s*$' $DIR/unit.i > $DIR/unit.txt
+}
+
+# the output, as cached, is marked, to tell a hit from a miss
+function mark_cached() {
+	for f in $DIR/cache/*.i; do
+		echo "/* from the cache */" >> $f
+	done
+}
+
+function expect() {
+	if [ "$1" == "hit" ]; then
+		grep -q 'from the cache' $DIR/unit.txt
+	else
+		if grep -q 'from the cache' $DIR/unit.txt; then
+			echo "expected a miss: $2"
+			exit 1
+		fi
+	fi
+}
+
+run
+grep -q 'int h(void);' $DIR/unit.txt
+grep -q "unit.o: $DIR/unit.c $DIR/inc/h.h" $DIR/unit.d
+ls $DIR/cache/*.meta > /dev/null
+mark_cached
+rm $DIR/unit.d
+
+run
+expect hit "unchanged"
+# the rule is made from the cache as well
+grep -q "unit.o: $DIR/unit.c $DIR/inc/h.h" $DIR/unit.d
+
+# a new mtime, but the same contents, is still a hit
+sleep 0.01
+touch $DIR/inc/h.h $DIR/unit.c
+run
+expect hit "only touched"
+
+# changed contents
+sed -i -e 's/int h(void);/long h(void);/' $DIR/inc/h.h
+run
+expect miss "changed"
+grep -q 'long h(void);' $DIR/unit.txt
+mark_cached
+
+# a header of the same name, now found first
+sleep 0.01
+cp $DIR/inc/h.h $DIR/first/h.h
+echo 'int shadow(void);' >> $DIR/first/h.h
+run
+expect miss "shadowed"
+grep -q 'int shadow(void);' $DIR/unit.txt
+rm $DIR/first/h.h
+run
+expect miss "no longer shadowed"
+mark_cached
+
+# one next to the unit, looked for ahead of the -I dirs
+cp $DIR/inc/h.h $DIR/h.h
+echo 'int near(void);' >> $DIR/h.h
+run
+expect miss "next to the unit"
+grep -q 'int near(void);' $DIR/unit.txt
+rm $DIR/h.h
+run
+expect miss "no longer next to the unit"
+mark_cached
+
+# what __has_include looked for, and did not find, is now there
+echo 'int maybe(void);' > $DIR/inc/maybe.h
+run
+expect miss "__has_include"
+grep -q 'int maybe(void);' $DIR/unit.txt
+grep -q "$DIR/inc/maybe.h" $DIR/unit.d
+mark_cached
+run
+expect hit "with maybe.h"
+
+# other options, another unit
+$BS_CPP --cache-dir $DIR/cache -I $DIR/inc $DIR/unit.c $DIR/unit.i
+grep -v '^\s*$' $DIR/unit.i > $DIR/unit.txt
+expect miss "other options"
+
+rm -rf $DIR
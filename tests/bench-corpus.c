@@ -0,0 +1,248 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+/*
+ * synthetic corpus for bench-driver: translation units which are long,
+ * heavy with comments and line splices, over a deep and wide graph of
+ * guarded headers, and a header of macros which expand into each other
+ *
+ *	bench-corpus dir [units [lines [depth [width [seed]]]]]
+ *
+ * writes the units to dir/src, the headers to dir/inc, and the pairs of
+ * in and out paths to dir/manifest, as --batch reads
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define BENCH_MACROS 256
+#define BENCH_CHAIN 16		/* each macro expands the one before it */
+#define BENCH_FANOUT 3		/* includes per header, of the next level */
+
+static uint64_t rng_state;
+
+/* xorshift64*, the same corpus for the same seed */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static size_t rng_below(size_t n)
+{
+	return (size_t)(rng() % n);
+}
+
+static const char *words[] = {
+	"widget", "frame", "buffer", "index", "count", "state", "token",
+	"value", "offset", "length", "cursor", "node", "entry", "table",
+};
+
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *word(void)
+{
+	return words[rng_below(WORDS)];
+}
+
+static FILE *open_out(const char *dir, const char *sub, const char *name)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s/%s", dir, sub, name);
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return f;
+}
+
+static void comment_block(FILE *f, size_t lines)
+{
+	fprintf(f, "/*\n");
+	for (size_t i = 0; i < lines; ++i) {
+		fprintf(f, " * the %s of the %s, unless the %s is \"quoted\""
+			" or // not\n", word(), word(), word());
+	}
+	fprintf(f, " */\n");
+}
+
+static void macros_header(const char *dir)
+{
+	FILE *f = open_out(dir, "inc", "macros.h");
+	fprintf(f, "#ifndef BENCH_MACROS_H\n#define BENCH_MACROS_H\n\n");
+	comment_block(f, 12);
+	for (size_t i = 0; i < BENCH_MACROS; ++i) {
+		if (i % BENCH_CHAIN == 0) {
+			fprintf(f, "#define M%zu(a, b) ((a) + (b))\n", i);
+		} else if (i % 3 == 0) {
+			/* spliced over several lines */
+			fprintf(f, "#define M%zu(a, b) \\\n"
+				"\t(M%zu((a), (b)) \\\n"
+				"\t * %zu /* scaled */ \\\n"
+				"\t + ((b) >> 1))\n", i, i - 1, i);
+		} else {
+			fprintf(f, "#define M%zu(a, b) (M%zu(b, a) ^ %zu)"
+				" // swapped\n", i, i - 1, i);
+		}
+	}
+	fprintf(f, "#define STR(x) #x\n#define CAT(a, b) a ## b\n");
+	fprintf(f, "#define VARIADIC(fmt, ...) printf(fmt, __VA_ARGS__)\n");
+	fprintf(f, "\n#endif /* BENCH_MACROS_H */\n");
+	fclose(f);
+}
+
+static void graph_header(const char *dir, size_t d, size_t w, size_t depth,
+			 size_t width)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "g%zu_%zu.h", d, w);
+	FILE *f = open_out(dir, "inc", name);
+	int once = (w % 3 == 2);
+	if (once) {
+		fprintf(f, "#pragma once\n");
+	} else {
+		fprintf(f, "#ifndef G%zu_%zu_H\n#define G%zu_%zu_H\n", d, w, d,
+			w);
+	}
+	comment_block(f, 4 + rng_below(8));
+	if (d + 1 < depth) {
+		for (size_t k = 0; k < BENCH_FANOUT && k < width; ++k) {
+			size_t next = (w + k * 7) % width;
+			fprintf(f, "#include \"g%zu_%zu.h\"\n", d + 1, next);
+		}
+	}
+	fprintf(f, "#include <macros.h>\n\n");
+	fprintf(f, "struct g%zu_%zu {\n", d, w);
+	for (size_t i = 0; i < 8; ++i) {
+		fprintf(f, "\tint %s_%zu; /* the %s */\n", word(), i, word());
+	}
+	fprintf(f, "};\n\n");
+	for (size_t i = 0; i < 6; ++i) {
+		size_t m = rng_below(BENCH_MACROS);
+		fprintf(f, "#define G%zu_%zu_%zu(x) M%zu((x), %zu)\n", d, w, i,
+			m, i);
+		fprintf(f, "static inline int g%zu_%zu_%zu(int %s)\n"
+			"{\n\treturn G%zu_%zu_%zu(%s);\n}\n", d, w, i,
+			words[i % WORDS], d, w, i, words[i % WORDS]);
+	}
+	fprintf(f, once ? "\n" : "\n#endif\n");
+	fclose(f);
+}
+
+static void unit_source(const char *dir, size_t u, size_t lines,
+			size_t width)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "u%zu.c", u);
+	FILE *f = open_out(dir, "src", name);
+	comment_block(f, 6);
+	fprintf(f, "#include <macros.h>\n");
+	for (size_t k = 0; k < 4 && k < width; ++k) {
+		fprintf(f, "#include \"g0_%zu.h\"\n", (u + k * 5) % width);
+	}
+	fprintf(f, "#define UNIT %zu\n\n", u);
+
+	size_t line = 0;
+	for (size_t fn = 0; line < lines; ++fn) {
+		comment_block(f, 1 + rng_below(4));
+		fprintf(f, "int unit_%zu_%zu(int %s, int %s) // the %s\n{\n",
+			u, fn, "a", "b", word());
+		line += 8;
+		size_t body = 10 + rng_below(30);
+		for (size_t i = 0; i < body; ++i, ++line) {
+			size_t m = rng_below(BENCH_MACROS);
+			switch (rng_below(6)) {
+			case 0:
+				fprintf(f, "\ta += M%zu(a, b); /* %s */\n", m,
+					word());
+				break;
+			case 1:
+				/* a splice in the middle of an expression */
+				fprintf(f, "\tb = (a * %zu) + \\\n"
+					"\t    (b - UNIT); // spliced\n",
+					rng_below(1000));
+				++line;
+				break;
+			case 2:
+				fprintf(f, "\tconst char *s%zu = \"/* not a"
+					" comment */ // nor this\";\n", i);
+				break;
+			case 3:
+				fprintf(f, "#if UNIT %% 2\n\ta -= %zu;\n"
+					"#else\n\tb -= %zu;\n#endif\n",
+					rng_below(100), rng_below(100));
+				line += 4;
+				break;
+			case 4:
+				fprintf(f, "\tif (a > '%c') { b = CAT(a, )"
+					" + %zu; }\n", (char)('a' + i % 26),
+					rng_below(50));
+				break;
+			default:
+				fprintf(f, "\t/* %s %s */ a ^= b; // %s\n",
+					word(), word(), word());
+				break;
+			}
+		}
+		fprintf(f, "\treturn a + b;\n}\n\n");
+	}
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [units [lines [depth [width"
+			" [seed]]]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *dir = argv[1];
+	size_t units = (argc > 2) ? (size_t)atol(argv[2]) : 64;
+	size_t lines = (argc > 3) ? (size_t)atol(argv[3]) : 4000;
+	size_t depth = (argc > 4) ? (size_t)atol(argv[4]) : 6;
+	size_t width = (argc > 5) ? (size_t)atol(argv[5]) : 12;
+	rng_state = (argc > 6) ? (uint64_t)atoll(argv[6]) : 0x5eed;
+	rng_state = rng_state ? rng_state : 1;
+	width = width ? width : 1;
+
+	char path[4096];
+	const char *subs[] = { "", "/src", "/inc", "/out" };
+	for (size_t i = 0; i < sizeof(subs) / sizeof(subs[0]); ++i) {
+		snprintf(path, sizeof(path), "%s%s", dir, subs[i]);
+		if (mkdir(path, 0777) && errno != EEXIST) {
+			fprintf(stderr, "mkdir(%s): %s\n", path,
+				strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	macros_header(dir);
+	for (size_t d = 0; d < depth; ++d) {
+		for (size_t w = 0; w < width; ++w) {
+			graph_header(dir, d, w, depth, width);
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/manifest", dir);
+	FILE *manifest = fopen(path, "w");
+	if (!manifest) {
+		fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fprintf(manifest, "# %zu units of %zu lines, headers %zu deep and"
+		" %zu wide\n", units, lines, depth, width);
+	for (size_t u = 0; u < units; ++u) {
+		unit_source(dir, u, lines, width);
+		fprintf(manifest, "%s/src/u%zu.c %s/out/u%zu.i\n", dir, u, dir,
+			u);
+	}
+	fclose(manifest);
+	return EXIT_SUCCESS;
+}
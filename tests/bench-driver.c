@@ -0,0 +1,426 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+/*
+ * throughput of bs-cpp over a corpus from bench-corpus
+ *
+ *	bench-driver corpus-dir [out.json [label [rounds]]]
+ *
+ * Each engine runs bs_cpp() in this process, with the same arguments the
+ * build/bs-cpp binary would get, once per unit, or once for the whole
+ * manifest in batch mode; the state a new process would not have is reset
+ * in between. The stages are also timed alone: strip, then comments, then
+ * directives, which processes the included headers too.
+ *
+ * MB/s is over the source bytes of the corpus: each unit, and each header
+ * its include walk finds, once per unit. The syscalls are those made
+ * through the bs_* hooks, of this process only: for the forking engine,
+ * the children's are not counted. Each figure is the best of the rounds.
+ */
+
+#define _GNU_SOURCE
+
+#include "bs-batch.h"
+#include "bs-cpp.h"
+#include "bs-deps.h"
+#include "bs-expr.h"
+#include "bs-search.h"
+#include "bs-util.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the stages, each a bs_pipe_function, from bs-cpp.c */
+int bs_strip_backslash_newline(int fd_from, int fd_to, FILE *log);
+int bs_replace_comments(int fd_from, int fd_to, FILE *log);
+int bs_replace_directives(int fd_from, int fd_to, FILE *log);
+
+static atomic_ulong syscalls;
+
+static int (*next_open)(const char *path, int options, ...);
+static int (*next_close)(int fd);
+static ssize_t (*next_read)(int fd, void *buf, size_t count);
+static ssize_t (*next_write)(int fd, const void *buf, size_t count);
+static void *(*next_mmap)(void *addr, size_t length, int prot, int flags,
+			  int fd, off_t offset);
+static int (*next_munmap)(void *addr, size_t length);
+static int (*next_pipe)(int pipefd[2]);
+static pid_t (*next_fork)(void);
+static ssize_t (*next_splice)(int fd_from, int fd_to, size_t len);
+static ssize_t (*next_copy_range)(int fd_from, int fd_to, size_t len);
+
+static int counted_open(const char *path, int options, ...)
+{
+	atomic_fetch_add(&syscalls, 1);
+	/* the mode is only read for O_CREAT, passing it always is harmless */
+	va_list ap;
+	va_start(ap, options);
+	int mode = va_arg(ap, int);
+	va_end(ap);
+	return next_open(path, options, mode);
+}
+
+static int counted_close(int fd)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_close(fd);
+}
+
+static ssize_t counted_read(int fd, void *buf, size_t count)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_read(fd, buf, count);
+}
+
+static ssize_t counted_write(int fd, const void *buf, size_t count)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_write(fd, buf, count);
+}
+
+static void *counted_mmap(void *addr, size_t length, int prot, int flags,
+			  int fd, off_t offset)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_mmap(addr, length, prot, flags, fd, offset);
+}
+
+static int counted_munmap(void *addr, size_t length)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_munmap(addr, length);
+}
+
+static int counted_pipe(int pipefd[2])
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_pipe(pipefd);
+}
+
+static pid_t counted_fork(void)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_fork();
+}
+
+static ssize_t counted_splice(int fd_from, int fd_to, size_t len)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_splice(fd_from, fd_to, len);
+}
+
+static ssize_t counted_copy_range(int fd_from, int fd_to, size_t len)
+{
+	atomic_fetch_add(&syscalls, 1);
+	return next_copy_range(fd_from, fd_to, len);
+}
+
+static void count_syscalls(void)
+{
+	next_open = bs_open;
+	next_close = bs_close;
+	next_read = bs_read;
+	next_write = bs_write;
+	next_mmap = bs_mmap;
+	next_munmap = bs_munmap;
+	next_pipe = bs_pipe;
+	next_fork = bs_fork;
+	next_splice = bs_splice;
+	next_copy_range = bs_copy_range;
+	bs_open = counted_open;
+	bs_close = counted_close;
+	bs_read = counted_read;
+	bs_write = counted_write;
+	bs_mmap = counted_mmap;
+	bs_munmap = counted_munmap;
+	bs_pipe = counted_pipe;
+	bs_fork = counted_fork;
+	bs_splice = counted_splice;
+	bs_copy_range = counted_copy_range;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/* what a new process would start without */
+static void fresh_process(void)
+{
+	bs_include_cache_clear();
+	bs_search_dirs_clear();
+	bs_translation_unit_reset();
+	bs_expr_cache_clear();
+	bs_pipes_backend = bs_pipes_fork;
+}
+
+struct result {
+	const char *name;
+	double seconds;
+	unsigned long syscalls;
+};
+
+struct corpus {
+	char inc_flag[4096];
+	char manifest[4096];
+	char *text;
+	struct bs_batch_job *jobs;
+	size_t len;
+	size_t bytes;
+};
+
+/* returns non-zero if a unit failed */
+static int run_engine(const struct corpus *c, const char *flag,
+		      struct result *r)
+{
+	fflush(stdout);
+	fflush(stderr);
+	unsigned long before = atomic_load(&syscalls);
+	double start = now();
+	int err = 0;
+	for (size_t i = 0; i < c->len && !err; ++i) {
+		char *argv[6];
+		int argc = 0;
+		argv[argc++] = "bs-cpp";
+		if (flag) {
+			argv[argc++] = (char *)flag;
+		}
+		argv[argc++] = (char *)c->inc_flag;
+		argv[argc++] = (char *)c->jobs[i].in_path;
+		argv[argc++] = (char *)c->jobs[i].out_path;
+		argv[argc] = NULL;
+		err = bs_cpp(argc, argv);
+		fresh_process();
+	}
+	double seconds = now() - start;
+	if (!r->seconds || seconds < r->seconds) {
+		r->seconds = seconds;
+		r->syscalls = atomic_load(&syscalls) - before;
+	}
+	return err;
+}
+
+static int run_batch(const struct corpus *c, struct result *r)
+{
+	char jobs[32];
+	snprintf(jobs, sizeof(jobs), "-j%zu", bs_batch_cpus());
+	char *argv[] = { "bs-cpp", jobs, (char *)c->inc_flag, "--batch",
+		(char *)c->manifest, NULL
+	};
+	fflush(stdout);
+	fflush(stderr);
+	unsigned long before = atomic_load(&syscalls);
+	double start = now();
+	int err = bs_cpp(5, argv);
+	double seconds = now() - start;
+	fresh_process();
+	if (!r->seconds || seconds < r->seconds) {
+		r->seconds = seconds;
+		r->syscalls = atomic_load(&syscalls) - before;
+	}
+	return err;
+}
+
+/* each stage alone, into a memory file for the next */
+static int run_stages(const struct corpus *c, struct result *stages)
+{
+	bs_pipe_function funcs[] = {
+		bs_strip_backslash_newline,
+		bs_replace_comments,
+		bs_replace_directives
+	};
+	double seconds[3] = { 0, 0, 0 };
+	unsigned long counts[3] = { 0, 0, 0 };
+	int err = 0;
+	bs_search_add_dir(c->inc_flag + 2, 0);
+	for (size_t i = 0; i < c->len && !err; ++i) {
+		int fd = bs_open(c->jobs[i].in_path, O_RDONLY);
+		for (size_t s = 0; s < 3 && fd >= 0 && !err; ++s) {
+			int to = (s < 2) ? memfd_create("bench", MFD_CLOEXEC)
+			    : bs_open("/dev/null", O_WRONLY);
+			unsigned long before = atomic_load(&syscalls);
+			double start = now();
+			err = funcs[s](fd, to, stderr);
+			seconds[s] += now() - start;
+			counts[s] += atomic_load(&syscalls) - before;
+			lseek(to, 0, SEEK_SET);
+			fd = (s < 2) ? to : -1;
+			if (s == 2) {
+				bs_close(to);
+			}
+		}
+		bs_translation_unit_reset();
+	}
+	fresh_process();
+	for (size_t s = 0; s < 3; ++s) {
+		if (!stages[s].seconds || seconds[s] < stages[s].seconds) {
+			stages[s].seconds = seconds[s];
+			stages[s].syscalls = counts[s];
+		}
+	}
+	return err;
+}
+
+/* each unit, and the headers each includes, once per unit */
+static int source_bytes(struct corpus *c)
+{
+	c->bytes = 0;
+	bs_search_add_dir(c->inc_flag + 2, 0);
+	for (size_t i = 0; i < c->len; ++i) {
+		struct stat st;
+		bs_translation_unit_reset();
+		int err = bs_c_pre_proc_path(c->jobs[i].in_path, "/dev/null",
+					     bs_c_pre_proc_fused, stderr);
+		if (err || stat(c->jobs[i].in_path, &st)) {
+			fprintf(stderr, "%s failed\n", c->jobs[i].in_path);
+			return 1;
+		}
+		c->bytes += (size_t)st.st_size;
+
+		char *notes = NULL;
+		size_t len = 0;
+		if (bs_deps_copy(0, &notes, &len)) {
+			return 1;
+		}
+		struct bs_deps_note note;
+		size_t pos = 0;
+		const char **seen = calloc(len + 1, sizeof(const char *));
+		size_t seen_len = 0;
+		while (seen && bs_deps_block_next(notes, len, &pos, &note)) {
+			if (note.kind == bs_deps_probe || !note.path[0]) {
+				continue;
+			}
+			size_t j = 0;
+			while (j < seen_len && strcmp(seen[j], note.path)) {
+				++j;
+			}
+			if (j == seen_len && !stat(note.path, &st)) {
+				seen[seen_len++] = note.path;
+				c->bytes += (size_t)st.st_size;
+			}
+		}
+		free(seen);
+		bs_free(notes);
+	}
+	fresh_process();
+	return 0;
+}
+
+static void put_result(FILE *out, const struct result *r, size_t bytes,
+		       int last)
+{
+	double mb = (double)bytes / (1024.0 * 1024.0);
+	fprintf(out, "    \"%s\": { \"seconds\": %.6f, \"mb_per_s\": %.3f,"
+		" \"syscalls_per_mb\": %.1f }%s\n", r->name, r->seconds,
+		mb / r->seconds, (double)r->syscalls / mb, last ? "" : ",");
+}
+
+static void put_row(const struct result *r, size_t bytes)
+{
+	double mb = (double)bytes / (1024.0 * 1024.0);
+	printf("%-12s %10.4f %10.2f %14.1f\n", r->name, r->seconds,
+	       mb / r->seconds, (double)r->syscalls / mb);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s corpus-dir [out.json [label"
+			" [rounds]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *dir = argv[1];
+	const char *json_path = (argc > 2) ? argv[2] : NULL;
+	const char *label = (argc > 3) ? argv[3] : "";
+	size_t rounds = (argc > 4) ? (size_t)atol(argv[4]) : 3;
+	rounds = rounds ? rounds : 1;
+
+	struct corpus c;
+	memset(&c, 0x00, sizeof(struct corpus));
+	snprintf(c.inc_flag, sizeof(c.inc_flag), "-I%s/inc", dir);
+	snprintf(c.manifest, sizeof(c.manifest), "%s/manifest", dir);
+	if (bs_batch_manifest(c.manifest, &c.text, &c.jobs, &c.len, stderr)
+	    || !c.len) {
+		fprintf(stderr, "no units in %s\n", c.manifest);
+		return EXIT_FAILURE;
+	}
+	if (source_bytes(&c)) {
+		return EXIT_FAILURE;
+	}
+	count_syscalls();
+
+	struct result engines[] = {
+		{ "fork", 0, 0 },
+		{ "threads", 0, 0 },
+		{ "fused", 0, 0 },
+		{ "batch", 0, 0 },
+	};
+	struct result stages[] = {
+		{ "strip", 0, 0 },
+		{ "comments", 0, 0 },
+		{ "directives", 0, 0 },
+	};
+	int err = 0;
+	for (size_t r = 0; r < rounds && !err; ++r) {
+		err = run_engine(&c, NULL, engines + 0)
+		    || run_engine(&c, "--threads", engines + 1)
+		    || run_engine(&c, "--fused", engines + 2)
+		    || run_batch(&c, engines + 3)
+		    || run_stages(&c, stages);
+	}
+	if (err) {
+		fprintf(stderr, "a run failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu units, %.2f MB of source, best of %zu rounds\n", c.len,
+	       (double)c.bytes / (1024.0 * 1024.0), rounds);
+	printf("%-12s %10s %10s %14s\n", "", "seconds", "MB/s", "syscalls/MB");
+	for (size_t i = 0; i < 4; ++i) {
+		put_row(engines + i, c.bytes);
+	}
+	for (size_t i = 0; i < 3; ++i) {
+		put_row(stages + i, c.bytes);
+	}
+
+	if (json_path) {
+		FILE *out = fopen(json_path, "w");
+		if (!out) {
+			perror(json_path);
+			return EXIT_FAILURE;
+		}
+		fprintf(out, "{\n  \"label\": \"");
+		for (const char *p = label; *p; ++p) {
+			if (*p != '"' && *p != '\\' && *p >= ' ') {
+				fputc(*p, out);
+			}
+		}
+		fprintf(out, "\",\n  \"units\": %zu,\n  \"bytes\": %zu,\n"
+			"  \"rounds\": %zu,\n  \"workers\": %zu,\n", c.len,
+			c.bytes, rounds, bs_batch_cpus());
+		fprintf(out, "  \"engines\": {\n");
+		for (size_t i = 0; i < 4; ++i) {
+			put_result(out, engines + i, c.bytes, i == 3);
+		}
+		fprintf(out, "  },\n  \"stages\": {\n");
+		for (size_t i = 0; i < 3; ++i) {
+			put_result(out, stages + i, c.bytes, i == 2);
+		}
+		fprintf(out, "  }\n}\n");
+		fclose(out);
+		printf("wrote %s\n", json_path);
+	}
+
+	bs_free(c.jobs);
+	bs_free(c.text);
+	return EXIT_SUCCESS;
+}
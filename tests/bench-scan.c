@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+/* microbenchmark: bytes/cycle of the fast-skip scanner and the stages */
+
+#include "bs-cpp.h"
+#include "bs-scan.h"
+#include "bs-util.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycle"
+static uint64_t ticks(void)
+{
+	return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static uint64_t ticks(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+static const char *sample = "\
+static int frobnicate(struct widget *w, const char *name, size_t len)\n\
+{\n\
+	int err = 0;\n\
+	for (size_t i = 0; i < len; ++i) {\n\
+		err += widget_poke(w, name[i], i * 2 + 1);\n\
+	}\n\
+	return err; // done\n\
+}\n\
+\n\
+/* a block comment, about\n\
+ * twice a screen long */\n\
+#define WIDGET_MAX (1024 * 4)\n";
+
+static char *make_corpus(size_t size)
+{
+	char *buf = malloc(size);
+	size_t sample_len = strlen(sample);
+	for (size_t i = 0; i < size; i += sample_len) {
+		size_t n = (size - i < sample_len) ? size - i : sample_len;
+		memcpy(buf + i, sample, n);
+	}
+	return buf;
+}
+
+static double bench_scan(const char *buf, size_t len,
+			 const struct bs_scan_set *set, size_t rounds)
+{
+	size_t found = 0;
+	uint64_t start = ticks();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < len; ++i) {
+			i += bs_scan(buf + i, len - i, set);
+			++found;
+		}
+	}
+	uint64_t elapsed = ticks() - start;
+	if (!found) {
+		fprintf(stderr, "nothing found?\n");
+	}
+	return ((double)len * (double)rounds) / (double)elapsed;
+}
+
+static double bench_fused(const char *path, size_t len, size_t rounds)
+{
+	uint64_t elapsed = 0;
+	for (size_t r = 0; r < rounds; ++r) {
+		int fdin = open(path, O_RDONLY);
+		int fdout = open("/dev/null", O_WRONLY);
+		uint64_t start = ticks();
+		bs_c_pre_proc_fused(fdin, fdout, stderr);
+		elapsed += ticks() - start;
+		close(fdout);
+	}
+	return ((double)len * (double)rounds) / (double)elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = (argc > 1) ? (size_t)atol(argv[1]) : (16 * 1024 * 1024);
+	size_t rounds = (argc > 2) ? (size_t)atol(argv[2]) : 5;
+
+	char *corpus = make_corpus(size);
+
+	char path[] = "/tmp/bench-scan-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || bs_write_all(fd, corpus, size, stderr)) {
+		fprintf(stderr, "could not write the corpus to %s\n", path);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	const struct bs_scan_set strip = Bs_scan_set('\\');
+	const struct bs_scan_set comment = Bs_scan_set('/', '"', '\'');
+	const struct bs_scan_set block = Bs_scan_set('*');
+
+	const enum bs_scan_isa isas[] = {
+		bs_scan_isa_scalar,
+		bs_scan_isa_sse2,
+		bs_scan_isa_avx2
+	};
+
+	printf("%zu bytes x %zu rounds, bytes/%s (higher is better)\n",
+	       size, rounds, BENCH_UNIT);
+	printf("%-8s %10s %10s %10s %10s\n", "isa", "strip", "comment",
+	       "block", "fused");
+	for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); ++i) {
+		if (bs_scan_use_isa(isas[i])) {
+			continue;
+		}
+		printf("%-8s %10.3f %10.3f %10.3f %10.3f\n",
+		       bs_scan_isa_name(),
+		       bench_scan(corpus, size, &strip, rounds),
+		       bench_scan(corpus, size, &comment, rounds),
+		       bench_scan(corpus, size, &block, rounds),
+		       bench_fused(path, size, rounds));
+	}
+
+	unlink(path);
+	free(corpus);
+	return 0;
+}
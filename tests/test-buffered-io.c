@@ -0,0 +1,291 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-cpp.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+unsigned read_calls = 0;
+unsigned write_calls = 0;
+unsigned read_interrupts = 0;
+
+ssize_t counting_read(int fd, void *buf, size_t count)
+{
+	++read_calls;
+	if (read_interrupts) {
+		--read_interrupts;
+		errno = EINTR;
+		return -1;
+	}
+	return read(fd, buf, count);
+}
+
+ssize_t counting_write(int fd, const void *buf, size_t count)
+{
+	++write_calls;
+	return write(fd, buf, count);
+}
+
+int bs_strip_backslash_newline(int fd_from, int fd_to, FILE *log);
+
+unsigned test_strip_is_buffered(void)
+{
+	unsigned failures = 0;
+
+	const char *in_txt = "int a\\\n = 1;\nint b = 2;\\";
+	const char *expect = "int a = 1;\nint b = 2;\\";
+
+	/* a pipe can not be mapped, so it is streamed */
+	int pipefd[2];
+	pipe(pipefd);
+	write(pipefd[1], in_txt, strlen(in_txt));
+	close(pipefd[1]);
+	int fdin = pipefd[0];
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	read_calls = 0;
+	write_calls = 0;
+	bs_read = counting_read;
+	bs_write = counting_write;
+
+	int err = bs_strip_backslash_newline(fdin, fdout, stderr);
+
+	bs_read = bs_fd_read;
+	bs_write = bs_fd_write;
+
+	char outbuf[80];
+	memset(outbuf, 0x00, 80);
+	rewind(out);
+	size_t len = fread(outbuf, 1, 79, out);
+	fclose(out);
+
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+	failures += Check(len == strlen(expect), "len: %zu\n", len);
+	failures += Check(strcmp(outbuf, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, outbuf);
+
+	/* one read of the data, one read to see EOF */
+	failures += Check(read_calls == 2, "read_calls: %u\n", read_calls);
+	failures += Check(write_calls == 1, "write_calls: %u\n", write_calls);
+
+	return failures;
+}
+
+void *failing_mmap(void *addr, size_t length, int prot, int flags,
+		   int fd, off_t offset)
+{
+	(void)addr;
+	(void)length;
+	(void)prot;
+	(void)flags;
+	(void)fd;
+	(void)offset;
+	return MAP_FAILED;
+}
+
+/* strips the file after "skip", already read by whoever handed it over */
+unsigned strip_regular_file(const char *skip, unsigned expect_reads)
+{
+	unsigned failures = 0;
+
+	const char *in_txt = "#define A \\\n 1\n";
+	const char *expect = "#define A  1\n";
+
+	FILE *in = tmpfile();
+	fprintf(in, "%s%s", skip, in_txt);
+	fflush(in);
+	int fdin = dup(fileno(in));
+	fclose(in);
+	lseek(fdin, (off_t)strlen(skip), SEEK_SET);
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	read_calls = 0;
+	bs_read = counting_read;
+
+	int err = bs_strip_backslash_newline(fdin, fdout, stderr);
+
+	bs_read = bs_fd_read;
+
+	char outbuf[80];
+	memset(outbuf, 0x00, 80);
+	rewind(out);
+	fread(outbuf, 1, 79, out);
+	fclose(out);
+
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+	failures += Check(strcmp(outbuf, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, outbuf);
+	failures += Check(read_calls == expect_reads, "read_calls: %u\n",
+			  read_calls);
+
+	return failures;
+}
+
+unsigned test_strip_maps_regular_file(void)
+{
+	return strip_regular_file("", 0);
+}
+
+unsigned test_strip_streams_from_offset(void)
+{
+	return strip_regular_file("#define SKIPPED\n", 2);
+}
+
+unsigned test_strip_streams_if_mmap_fails(void)
+{
+	bs_mmap = failing_mmap;
+	unsigned failures = strip_regular_file("", 2);
+	bs_mmap = mmap;
+	return failures;
+}
+
+unsigned test_strip_retries_interrupted_read(void)
+{
+	bs_mmap = failing_mmap;
+	read_interrupts = 1;
+	unsigned failures = strip_regular_file("", 3);
+	bs_mmap = mmap;
+	return failures;
+}
+
+unsigned test_writer_coalesces(void)
+{
+	unsigned failures = 0;
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	char buf[8];
+	struct bs_writer writer;
+	bs_writer_init(&writer, fdout, buf, 8, stderr);
+
+	write_calls = 0;
+	bs_write = counting_write;
+
+	for (size_t i = 0; i < 6; ++i) {
+		bs_writer_putc(&writer, 'a' + i);
+	}
+	failures += Check(write_calls == 0, "write_calls: %u\n", write_calls);
+
+	/* does not fit with what is already buffered */
+	bs_writer_write(&writer, "0123", 4);
+	failures += Check(write_calls == 1, "write_calls: %u\n", write_calls);
+
+	/* larger than the buffer, passes through after a flush */
+	bs_writer_write(&writer, "ABCDEFGHIJ", 10);
+	failures += Check(write_calls == 3, "write_calls: %u\n", write_calls);
+
+	bs_writer_putc(&writer, '\n');
+	int err = bs_writer_flush(&writer);
+	failures += Check(write_calls == 4, "write_calls: %u\n", write_calls);
+
+	bs_write = bs_fd_write;
+
+	const char *expect = "abcdef0123ABCDEFGHIJ\n";
+	char outbuf[80];
+	memset(outbuf, 0x00, 80);
+	rewind(out);
+	fread(outbuf, 1, 79, out);
+	fclose(out);
+
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+	failures += Check(strcmp(outbuf, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, outbuf);
+
+	return failures;
+}
+
+unsigned splice_calls = 0;
+ssize_t (*real_splice)(int fd_from, int fd_to, size_t len);
+
+ssize_t counting_splice(int fd_from, int fd_to, size_t len)
+{
+	++splice_calls;
+	return real_splice(fd_from, fd_to, len);
+}
+
+ssize_t unsupported_splice(int fd_from, int fd_to, size_t len)
+{
+	(void)fd_from;
+	(void)fd_to;
+	(void)len;
+	++splice_calls;
+	errno = EINVAL;
+	return -1;
+}
+
+unsigned fd_copy_from_pipe(ssize_t (*splice_hook)(int, int, size_t),
+			   unsigned expect_reads)
+{
+	unsigned failures = 0;
+
+	const char *in_txt = "int a = 1;\nint b = 2;\n";
+	int pipefd[2];
+	pipe(pipefd);
+	write(pipefd[1], in_txt, strlen(in_txt));
+	close(pipefd[1]);
+
+	FILE *out = tmpfile();
+
+	real_splice = bs_splice;
+	bs_splice = splice_hook;
+	bs_read = counting_read;
+	splice_calls = 0;
+	read_calls = 0;
+	char buf[8];
+	int err = bs_fd_copy(pipefd[0], fileno(out), buf, 8, stderr);
+	bs_read = bs_fd_read;
+	bs_splice = real_splice;
+	close(pipefd[0]);
+
+	char outbuf[80];
+	memset(outbuf, 0x00, 80);
+	rewind(out);
+	fread(outbuf, 1, 79, out);
+	fclose(out);
+
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+	failures += Check(strcmp(outbuf, in_txt) == 0,
+			  "expected: '%s'\n but was: '%s'\n", in_txt, outbuf);
+	failures += Check(splice_calls > 0, "splice_calls: %u\n", splice_calls);
+	failures += Check(read_calls == expect_reads, "read_calls: %u != %u\n",
+			  read_calls, expect_reads);
+
+	return failures;
+}
+
+unsigned test_fd_copy_splices_pipe(void)
+{
+	return fd_copy_from_pipe(counting_splice, 0);
+}
+
+unsigned test_fd_copy_falls_back(void)
+{
+	/* 22 bytes, 8 at a time, and the read of EOF */
+	return fd_copy_from_pipe(unsupported_splice, 4);
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_strip_is_buffered);
+	failures += run_test(test_strip_maps_regular_file);
+	failures += run_test(test_strip_streams_from_offset);
+	failures += run_test(test_strip_streams_if_mmap_fails);
+	failures += run_test(test_strip_retries_interrupted_read);
+	failures += run_test(test_writer_coalesces);
+	failures += run_test(test_fd_copy_splices_pipe);
+	failures += run_test(test_fd_copy_falls_back);
+
+	return failures_to_status("test_exit_reason", failures);
+}
@@ -0,0 +1,253 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-cpp.h"
+#include "bs-expr.h"
+#include "bs-macro.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ssize_t one_byte_read(int fd, void *buf, size_t count)
+{
+	(void)count;
+	return read(fd, buf, 1);
+}
+
+void *no_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	      off_t offset)
+{
+	(void)addr;
+	(void)length;
+	(void)prot;
+	(void)flags;
+	(void)fd;
+	(void)offset;
+	return MAP_FAILED;
+}
+
+unsigned check_if(const char *expr, int expect_err, long long expect)
+{
+	unsigned failures = 0;
+
+	char logbuf[240];
+	memset(logbuf, 0x00, sizeof(logbuf));
+	FILE *log = fmemopen(logbuf, sizeof(logbuf), "w");
+
+	/* expanded first, then the compiled and cached, twice */
+	const struct bs_token *toks = NULL;
+	size_t toks_len = 0;
+	long long value[3] = { -12345, -12345, -12345 };
+	int err[3];
+	err[0] = bs_macro_expand_if(expr, strlen(expr), &toks, &toks_len, log);
+	err[0] = err[0] ? err[0] : bs_expr_eval(toks, toks_len, value, log);
+	err[1] = bs_expr_if(expr, strlen(expr), value + 1, log);
+	err[2] = bs_expr_if(expr, strlen(expr), value + 2, log);
+	fclose(log);
+
+	for (size_t i = 0; i < 3; ++i) {
+		if (expect_err) {
+			failures += Check(err[i] != 0,
+					  "expected an error for '%s' (%zu)",
+					  expr, i);
+		} else {
+			failures += Check(err[i] == 0, "error %d for '%s': %s",
+					  err[i], expr, logbuf);
+			failures += Check(value[i] == expect,
+					  "'%s' expected %lld, was %lld (%zu)",
+					  expr, expect, value[i], i);
+		}
+	}
+	if (expect_err) {
+		failures += Check(strlen(logbuf) > 0, "nothing logged for '%s'",
+				  expr);
+	}
+	return failures;
+}
+
+unsigned test_if_expressions(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	bs_macro_define_directive("VERSION 0x0502", 14, stderr);
+	bs_macro_define_directive("EMPTY", 5, stderr);
+	bs_macro_define_directive("SQ(x) ((x) * (x))", 17, stderr);
+	bs_macro_define_directive("SUM 1 + 2", 9, stderr);
+	bs_macro_define_directive("SELF (SELF + 1)", 15, stderr);
+	bs_macro_define_directive("NEST (VERSION & 0xff)", 21, stderr);
+	bs_macro_define_directive("HAS defined(SQ)", 15, stderr);
+	bs_macro_define_directive("OP +", 4, stderr);
+
+	failures += check_if("1", 0, 1);
+	failures += check_if("0", 0, 0);
+	failures += check_if("defined VERSION && VERSION >= 0x0500", 0, 1);
+	failures += check_if("defined(EMPTY) && !defined ( NOPE )", 0, 1);
+	failures += check_if("NOPE + 3", 0, 3);
+	failures += check_if("SQ(3) + SQ(VERSION - 0x500)", 0, 13);
+	failures += check_if("1 + 2 * 3 - 4 / 2 % 3", 0, 5);
+	failures += check_if("(1 << 4) | (256 >> 2) ^ 3", 0, 83);
+	failures += check_if("-1 < 0", 0, 1);
+	failures += check_if("-1 < 0u", 0, 0);
+	failures += check_if("0xffffffffffffffff == -1", 0, 1);
+	failures += check_if("~0 == -1 && 010 == 8 && 0b101 == 5", 0, 1);
+	failures += check_if("'a' == 97 && '\\n' == 10 && '\\377' < 0", 0, 1);
+	failures += check_if("1 ? 2 : 3", 0, 2);
+	failures += check_if("0 ? 2 : 1 ? 4 : 5", 0, 4);
+	failures += check_if("0 && 1 / 0", 0, 0);
+	failures += check_if("1 || 1 % 0", 0, 1);
+	failures += check_if("1 ? 7 : 1 / 0", 0, 7);
+	failures += check_if("(2, 3)", 0, 3);
+	failures += check_if("10L + 5ull", 0, 15);
+	failures += check_if("SUM * 3", 0, 7);
+	failures += check_if("SELF", 0, 1);
+	failures += check_if("-NEST == -2 && HAS", 0, 1);
+	failures += check_if("2 OP 2", 0, 4);
+	failures += check_if("(1 ? -1 : 0u) > 0", 0, 1);
+	failures += check_if("__has_include(\"qux-cond.h\")", 0, 1);
+	failures += check_if("__has_include(\"no-such.h\")", 0, 0);
+	failures += check_if("__has_include(<qux-cond.h>)", 0, 0);
+
+	failures += check_if("", 1, 0);
+	failures += check_if("EMPTY", 1, 0);
+	failures += check_if("1 / 0", 1, 0);
+	failures += check_if("(1", 1, 0);
+	failures += check_if("1 2", 1, 0);
+	failures += check_if("1 ? 2", 1, 0);
+	failures += check_if("defined", 1, 0);
+	failures += check_if("defined(X", 1, 0);
+	failures += check_if("1.5", 1, 0);
+	failures += check_if("\"str\"", 1, 0);
+	failures += check_if("__has_include(x)", 1, 0);
+
+	bs_macro_table_clear();
+	return failures;
+}
+
+unsigned test_compiled_sees_macro_changes(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	bs_expr_cache_clear();
+	const char *expr = "defined(V) && V >= 0x0500";
+	long long value = -1;
+
+	failures += Check(bs_expr_if(expr, strlen(expr), &value, stderr) == 0,
+			  "error");
+	failures += Check(value == 0, "expected 0, was %lld", value);
+
+	bs_macro_define_directive("V 0x0600", 8, stderr);
+	failures += Check(bs_expr_if(expr, strlen(expr), &value, stderr) == 0,
+			  "error");
+	failures += Check(value == 1, "expected 1, was %lld", value);
+
+	bs_macro_define_directive("V 0x0400", 8, stderr);
+	failures += Check(bs_expr_if(expr, strlen(expr), &value, stderr) == 0,
+			  "error");
+	failures += Check(value == 0, "expected 0, was %lld", value);
+
+	bs_macro_table_clear();
+	bs_expr_cache_clear();
+	return failures;
+}
+
+unsigned check_pre_proc(const char *in_txt, const char *expect,
+			int one_byte)
+{
+	unsigned failures = 0;
+
+	FILE *in = tmpfile();
+	fprintf(in, "%s", in_txt);
+	fflush(in);
+	rewind(in);
+	FILE *out = tmpfile();
+
+	if (one_byte) {
+		bs_mmap = no_mmap;
+		bs_read = one_byte_read;
+	}
+	bs_macro_table_clear();
+	int err = bs_c_pre_proc_fused(dup(fileno(in)), fileno(out), stderr);
+	bs_macro_table_clear();
+	bs_read = bs_fd_read;
+	bs_mmap = mmap;
+
+	char actual[400];
+	memset(actual, 0x00, sizeof(actual));
+	rewind(out);
+	size_t len = fread(actual, 1, sizeof(actual) - 1, out);
+	fclose(out);
+	fclose(in);
+
+	failures += Check(err == 0, "error %d\n", err);
+	failures += Check(len == strlen(expect) && strcmp(actual, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, actual);
+
+	return failures;
+}
+
+unsigned test_conditional_groups(void)
+{
+	unsigned failures = 0;
+
+	const char *in_txt = "#define A 2\n"
+	    "#ifdef A\n"
+	    "a\n"
+	    "#else\n"
+	    "not a\n"
+	    "#endif\n"
+	    "#ifndef A\n"
+	    "  # include \"does-not-exist.h\"\n"
+	    "  #error not reached\n"
+	    "#elif A == 1\n"
+	    "one\n"
+	    "#elif A == 2\n"
+	    "two # not a directive\n"
+	    "#if 0\n"
+	    "#elif 1\n"
+	    "nested\n"
+	    "#endif\n"
+	    "#else\n"
+	    "#if 1\n"
+	    "#define B\n"
+	    "#endif\n"
+	    "#endif\n"
+	    "#if 0\n"
+	    "x = \"#endif\";\n"
+	    "#  if 1\n"
+	    "    #else\n"
+	    "#endif\n"
+	    "#else\n"
+	    "#ifdef B\n"
+	    "b\n"
+	    "#endif\n"
+	    "end A\n"
+	    "#endif\n";
+	const char *expect = "\n\na\n\n\n\n\n\n\n\n\n\n"
+	    "two # not a directive\n\n\nnested\n\n\n\n\n\n\n"
+	    "\n\n\n\n\n\n\n\n\nend 2\n\n";
+
+	failures += check_pre_proc(in_txt, expect, 0);
+	failures += check_pre_proc(in_txt, expect, 1);
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	FILE *qux = fopen("qux-cond.h", "w");
+	fclose(qux);
+	failures += run_test(test_if_expressions);
+	remove("qux-cond.h");
+	failures += run_test(test_compiled_sees_macro_changes);
+	failures += run_test(test_conditional_groups);
+
+	return failures_to_status("test_exit_reason", failures);
+}
@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-cpp.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const char *in_txt = "\
+/*\n\
+*/#/* */defi\\\n\
+ne FORTY_\\\n\
+TWO 4\\\n\
+2\n\
+int // foo\n\
+main(void)\n\
+{\n\
+	const char *s = \"http://example.com/*\";\n\
+	return FORTY_TWO / 2 **s;\n\
+}\n\
+";
+
+const char *expect = "\
+ \n\
+int  \n\
+main(void)\n\
+{\n\
+	const char *s = \"http://example.com/*\";\n\
+	return 42 / 2 **s;\n\
+}\n\
+";
+
+ssize_t one_byte_read(int fd, void *buf, size_t count)
+{
+	(void)count;
+	return read(fd, buf, 1);
+}
+
+void *no_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	      off_t offset)
+{
+	(void)addr;
+	(void)length;
+	(void)prot;
+	(void)flags;
+	(void)fd;
+	(void)offset;
+	return MAP_FAILED;
+}
+
+unsigned run_pre_proc(bs_pipe_function pre_proc, char *outbuf, size_t size)
+{
+	unsigned failures = 0;
+
+	FILE *in = tmpfile();
+	fprintf(in, "%s", in_txt);
+	fflush(in);
+	rewind(in);
+	int fdin = dup(fileno(in));
+	fclose(in);
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	int err = pre_proc(fdin, fdout, stderr);
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+
+	memset(outbuf, 0x00, size);
+	rewind(out);
+	fread(outbuf, 1, size - 1, out);
+	fclose(out);
+
+	return failures;
+}
+
+unsigned test_fused_matches_expected(void)
+{
+	unsigned failures = 0;
+
+	char outbuf[80 * 24];
+	failures += run_pre_proc(bs_c_pre_proc_fused, outbuf, 80 * 24);
+	failures += Check(strcmp(outbuf, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, outbuf);
+
+	return failures;
+}
+
+unsigned test_fused_matches_piped(void)
+{
+	unsigned failures = 0;
+
+	char piped[80 * 24];
+	failures += run_pre_proc(bs_c_pre_proc, piped, 80 * 24);
+
+	char fused[80 * 24];
+	failures += run_pre_proc(bs_c_pre_proc_fused, fused, 80 * 24);
+
+	failures += Check(strcmp(piped, fused) == 0,
+			  "piped: '%s'\n fused: '%s'\n", piped, fused);
+
+	return failures;
+}
+
+unsigned test_fused_one_byte_at_a_time(void)
+{
+	unsigned failures = 0;
+
+	bs_mmap = no_mmap;
+	bs_read = one_byte_read;
+	char outbuf[80 * 24];
+	failures += run_pre_proc(bs_c_pre_proc_fused, outbuf, 80 * 24);
+	bs_read = bs_fd_read;
+	bs_mmap = mmap;
+
+	failures += Check(strcmp(outbuf, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, outbuf);
+
+	return failures;
+}
+
+unsigned test_threaded_matches_expected(void)
+{
+	unsigned failures = 0;
+
+	bs_pipes_backend = bs_pipes_threads;
+	char outbuf[80 * 24];
+	failures += run_pre_proc(bs_c_pre_proc, outbuf, 80 * 24);
+	bs_pipes_backend = bs_pipes_fork;
+
+	failures += Check(strcmp(outbuf, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, outbuf);
+	/* the ring ends are routed to without touching the hooks */
+	failures += Check(bs_read == bs_fd_read, "bs_read hook changed\n");
+	failures += Check(bs_write == bs_fd_write, "bs_write hook changed\n");
+	failures += Check(bs_close == bs_fd_close, "bs_close hook changed\n");
+
+	return failures;
+}
+
+unsigned test_threaded_wraps_ring(void)
+{
+	unsigned failures = 0;
+
+	const char *line = "int x; /* comment */ int y; // more\n";
+	const char *out_line = "int x;   int y;  \n";
+	size_t lines = (3 * BS_RING_SIZE) / strlen(line);
+
+	FILE *in = tmpfile();
+	for (size_t i = 0; i < lines; ++i) {
+		fputs(line, in);
+	}
+	fflush(in);
+	rewind(in);
+	int fdin = dup(fileno(in));
+	fclose(in);
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	bs_pipes_backend = bs_pipes_threads;
+	int err = bs_c_pre_proc(fdin, fdout, stderr);
+	bs_pipes_backend = bs_pipes_fork;
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+
+	rewind(out);
+	char buf[80];
+	size_t matched = 0;
+	while (fgets(buf, 80, out)) {
+		if (strcmp(buf, out_line) != 0) {
+			failures += Check(0, "line %zu: '%s'\n", matched, buf);
+			break;
+		}
+		++matched;
+	}
+	fclose(out);
+	failures += Check(matched == lines, "%zu != %zu\n", matched, lines);
+
+	return failures;
+}
+
+/* a #define far longer than a path, its line grows as it is read */
+unsigned test_fused_long_define(void)
+{
+	unsigned failures = 0;
+
+	size_t terms = 80 * 1000;
+	FILE *in = tmpfile();
+	fputs("#define LONG ", in);
+	for (size_t i = 0; i < terms; ++i) {
+		fputs("1+", in);
+	}
+	fputs("1\nint x = LONG;\n", in);
+	fflush(in);
+	rewind(in);
+	int fdin = dup(fileno(in));
+	fclose(in);
+
+	FILE *out = tmpfile();
+	int err = bs_c_pre_proc_fused(fdin, fileno(out), stderr);
+	failures += Check(err == 0, "expected err == 0, but was %d\n", err);
+
+	rewind(out);
+	size_t size = (2 * terms) + 80;
+	char *buf = calloc(1, size);
+	size_t len = fread(buf, 1, size - 1, out);
+	fclose(out);
+
+	const char *head = "\nint x = 1+1+";
+	failures += Check(strncmp(buf, head, strlen(head)) == 0,
+			  "expected '%s...' but was '%.40s...'\n", head, buf);
+	size_t expect_len = strlen("\nint x = ;\n") + (2 * terms) + 1;
+	failures += Check(len == expect_len, "expected %zu bytes, not %zu\n",
+			  expect_len, len);
+	free(buf);
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_fused_matches_expected);
+	failures += run_test(test_fused_matches_piped);
+	failures += run_test(test_fused_one_byte_at_a_time);
+	failures += run_test(test_threaded_matches_expected);
+	failures += run_test(test_threaded_wraps_ring);
+	failures += run_test(test_fused_long_define);
+
+	return failures_to_status("test_exit_reason", failures);
+}
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-guard.h"
+#include "test-util.h"
+
+#include <string.h>
+
+unsigned check_detect(const char *txt, enum bs_guard_kind expect_kind,
+		      const char *expect_macro)
+{
+	unsigned failures = 0;
+
+	const char *macro = NULL;
+	size_t macro_len = 0;
+	enum bs_guard_kind kind;
+	kind = bs_guard_detect(txt, strlen(txt), &macro, &macro_len);
+
+	failures += Check(kind == expect_kind,
+			  "expected kind %d but was %d for:\n%s\n",
+			  (int)expect_kind, (int)kind, txt);
+	if (kind == bs_guard_macro && expect_macro) {
+		failures += Check(macro_len == strlen(expect_macro)
+				  && memcmp(macro, expect_macro,
+					    macro_len) == 0,
+				  "expected '%s' but was '%.*s'\n",
+				  expect_macro, (int)macro_len, macro);
+	}
+
+	return failures;
+}
+
+unsigned test_detect_guarded(void)
+{
+	unsigned failures = 0;
+
+	failures += check_detect("#ifndef FOO_H\n"
+				 "#define FOO_H 1\n"
+				 "int foo(void);\n"
+				 "#endif\n", bs_guard_macro, "FOO_H");
+
+	failures += check_detect("/* license */\n"
+				 "  #  if !defined ( BAR_H ) // x\n"
+				 "# define BAR_H\n"
+				 "#ifdef X\n"
+				 "int x;\n"
+				 "#else\n"
+				 "int y;\n"
+				 "#endif\n"
+				 "const char *s = \"#endif\";\n"
+				 "#endif /* BAR_H */\n"
+				 "\n", bs_guard_macro, "BAR_H");
+
+	failures += check_detect("#ifndef \\\n"
+				 "SPLICED\n"
+				 "#define SPLICED\n"
+				 "#endif", bs_guard_macro, "SPLICED");
+
+	failures += check_detect("int a;\n"
+				 "#pragma once\n", bs_guard_once, NULL);
+
+	return failures;
+}
+
+unsigned test_detect_not_guarded(void)
+{
+	unsigned failures = 0;
+
+	failures += check_detect("", bs_guard_none, NULL);
+
+	failures += check_detect("int foo(void);\n", bs_guard_none, NULL);
+
+	failures += check_detect("#ifndef FOO_H\n"
+				 "#define FOO_H\n"
+				 "#endif\n"
+				 "int foo(void);\n", bs_guard_none, NULL);
+
+	failures += check_detect("int foo(void);\n"
+				 "#ifndef FOO_H\n"
+				 "#define FOO_H\n"
+				 "#endif\n", bs_guard_none, NULL);
+
+	failures += check_detect("#ifndef FOO_H\n"
+				 "#define BAR_H\n"
+				 "#endif\n", bs_guard_none, NULL);
+
+	failures += check_detect("#ifndef FOO_H\n"
+				 "#define FOO_H\n"
+				 "#else\n"
+				 "int foo(void);\n"
+				 "#endif\n", bs_guard_none, NULL);
+
+	failures += check_detect("#ifndef FOO_H\n"
+				 "#define FOO_H\n", bs_guard_none, NULL);
+
+	failures += check_detect("#if !defined(FOO_H) && X\n"
+				 "#define FOO_H\n"
+				 "#endif\n", bs_guard_none, NULL);
+
+	failures += check_detect("#ifndef FOO_H\n"
+				 "#define FOO_H\n"
+				 "/* #endif */\n", bs_guard_none, NULL);
+
+	return failures;
+}
+
+unsigned test_guard_table(void)
+{
+	unsigned failures = 0;
+
+	struct stat st;
+	memset(&st, 0x00, sizeof(st));
+	st.st_ino = 7;
+	st.st_mtim.tv_sec = 1000;
+
+	failures += Check(bs_guard_find("a.h", &st) == NULL, "a.h?\n");
+
+	failures += Check(bs_guard_record("a.h", &st, bs_guard_macro, "A_H_xyz",
+					  3, 0) == 0, "record a.h\n");
+	failures += Check(bs_guard_record("b.h", &st, bs_guard_once, NULL, 0,
+					  0) == 0, "record b.h\n");
+
+	struct bs_guard_entry *a = bs_guard_find("a.h", &st);
+	failures += Check(a && a->kind == bs_guard_macro
+			  && strcmp(a->macro, "A_H") == 0, "a.h not found\n");
+	struct bs_guard_entry *b = bs_guard_find("b.h", &st);
+	failures += Check(b && b->kind == bs_guard_once, "b.h not found\n");
+
+	/* a changed file is scanned again, the old entry stays readable */
+	struct stat changed = st;
+	changed.st_mtim.tv_sec = 1001;
+	failures += Check(bs_guard_find("a.h", &changed) == NULL,
+			  "a.h changed\n");
+	failures += Check(bs_guard_record("a.h", &changed, bs_guard_none, NULL,
+					  0, 0) == 0, "record a.h again\n");
+	struct bs_guard_entry *again = bs_guard_find("a.h", &changed);
+	failures += Check(again && again->kind == bs_guard_none,
+			  "a.h not rescanned\n");
+	failures += Check(bs_guard_find("a.h", &st) == NULL, "a.h stale\n");
+	failures += Check(strcmp(a->macro, "A_H") == 0, "a.h retired\n");
+
+	bs_guard_table_clear();
+	failures += Check(bs_guard_find("a.h", &changed) == NULL,
+			  "a.h not cleared\n");
+
+	return failures;
+}
+
+unsigned check_clean_from(const char *txt, const char *expect_clean)
+{
+	size_t len = strlen(txt);
+	size_t from = bs_guard_clean_from(txt, len);
+	return Check(strcmp(txt + from, expect_clean) == 0,
+		     "expected clean '%s' but was '%s'\n", expect_clean,
+		     txt + from);
+}
+
+unsigned test_clean_from(void)
+{
+	unsigned failures = 0;
+
+	failures += check_clean_from("int a;\nint b;\n", "int a;\nint b;\n");
+	failures += check_clean_from("#pragma once\nint a;\nint b;\n",
+				     "int a;\nint b;\n");
+	failures += check_clean_from("#pragma once\n/* x */ int a;\nint b;",
+				     "int b;");
+	/* the splice makes the line after it part of the directive */
+	failures += check_clean_from("#define A \\\n 1\nint a;\n", "int a;\n");
+	failures += check_clean_from("int a;\n#endif\n", "");
+	failures += check_clean_from("int a;\n#endif", "");
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_detect_guarded);
+	failures += run_test(test_detect_not_guarded);
+	failures += run_test(test_guard_table);
+	failures += run_test(test_clean_from);
+
+	return failures_to_status("test_exit_reason", failures);
+}
@@ -0,0 +1,286 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-cpp.h"
+#include "bs-macro.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ssize_t one_byte_read(int fd, void *buf, size_t count)
+{
+	(void)count;
+	return read(fd, buf, 1);
+}
+
+void *no_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	      off_t offset)
+{
+	(void)addr;
+	(void)length;
+	(void)prot;
+	(void)flags;
+	(void)fd;
+	(void)offset;
+	return MAP_FAILED;
+}
+
+unsigned check_expand(const char *txt, const char *expect)
+{
+	unsigned failures = 0;
+
+	FILE *out = tmpfile();
+	char buf[80];
+	struct bs_writer writer;
+	bs_writer_init(&writer, fileno(out), buf, sizeof(buf), stderr);
+
+	struct bs_token_stream ts;
+	memset(&ts, 0x00, sizeof(ts));
+	size_t consumed = 0;
+	size_t newlines = 0;
+	int err = bs_stream_lex(&ts, txt, strlen(txt));
+	err += bs_macro_expand(&ts, 1, &consumed, &newlines, &writer, stderr);
+	err += bs_writer_flush(&writer);
+	bs_stream_release(&ts);
+
+	char actual[1024];
+	memset(actual, 0x00, sizeof(actual));
+	rewind(out);
+	size_t len = fread(actual, 1, sizeof(actual) - 1, out);
+	fclose(out);
+
+	failures += Check(err == 0, "error %d\n", err);
+	failures += Check(consumed == strlen(txt), "consumed %zu\n", consumed);
+	failures += Check(len == strlen(expect) && strcmp(actual, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, actual);
+
+	return failures;
+}
+
+unsigned check_define(const char *directive)
+{
+	return Check(bs_macro_define_directive(directive, strlen(directive),
+					       stderr) == 0,
+		     "failed: '%s'\n", directive);
+}
+
+unsigned test_define_and_expand(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	failures += check_define(" FOO 42");
+	failures += check_define("BAR  FOO   +\t FOO ");
+	failures += check_define("EMPTY");
+	failures += check_define("SELF (1 + SELF)");
+	failures += check_define("PING PONG");
+	failures += check_define("PONG PING");
+	failures += check_define("STR \"FOO  BAR\"");
+
+	failures += check_expand("int x = FOO;\n", "int x = 42;\n");
+	failures += check_expand("BAR\n", "42 + 42\n");
+	failures += check_expand("a EMPTY b", "a  b");
+	failures += check_expand("SELF", "(1 + SELF)");
+	failures += check_expand("PING PONG", "PING PONG");
+	failures += check_expand("STR", "\"FOO  BAR\"");
+	failures += check_expand("FOOD _FOO FOO_ 0xFOO 1e+FOO .5FOO",
+				 "FOOD _FOO FOO_ 0xFOO 1e+FOO .5FOO");
+	failures += check_expand("\"FOO\" 'F' L\"FOO\" u8\"FOO\" L FOO",
+				 "\"FOO\" 'F' L\"FOO\" u8\"FOO\" L 42");
+
+	bs_macro_table_clear();
+	return failures;
+}
+
+unsigned test_undef_and_version(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	unsigned long long version = bs_macro_version();
+
+	failures += check_define("FOO 1");
+	failures += Check(bs_macro_version() != version, "define\n");
+
+	version = bs_macro_version();
+	failures += check_define("FOO   1 ");
+	failures += Check(bs_macro_version() == version, "same again\n");
+
+	failures += check_define("FOO 2");
+	failures += Check(bs_macro_version() != version, "redefine\n");
+	failures += check_expand("FOO", "2");
+
+	version = bs_macro_version();
+	bs_macro_undef("BAR", 3);
+	failures += Check(bs_macro_version() == version, "undef BAR\n");
+
+	failures += Check(bs_macro_undef_directive(" FOO", 4, stderr) == 0,
+			  "undef FOO\n");
+	failures += Check(bs_macro_version() != version, "undef FOO\n");
+	failures += Check(bs_macro_find("FOO", 3) == NULL, "FOO?\n");
+	failures += Check(bs_macro_count() == 0, "count %zu\n",
+			  bs_macro_count());
+	failures += check_expand("FOO", "FOO");
+
+	bs_macro_table_clear();
+	return failures;
+}
+
+unsigned test_function_like(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	failures += check_define("ADD(a, b) ((a) + (b))");
+	failures += check_define("TWICE(x) ADD(x, x)");
+	failures += check_define("NONE() 7");
+	failures += check_define("STR(x) #x");
+	failures += check_define("XSTR(x) STR(x)");
+	failures += check_define("CAT(a, b) a ## b");
+	failures += check_define("ONE 1");
+	failures += check_define("f(x) x * g");
+	failures += check_define("g(x) f(x)");
+	failures += check_define("AP(x) x ADD");
+	failures += check_define("NEG -1");
+
+	failures += check_expand("ADD(1, 2)", "((1) + (2))");
+	failures += check_expand("TWICE(ADD(1,2))",
+				 "((((1) + (2))) + (((1) + (2))))");
+	failures += check_expand("ADD((1, 2), 3)", "(((1, 2)) + (3))");
+	failures += check_expand("ADD;", "ADD;");
+	failures += check_expand("NONE() NONE ( )", "7 7");
+	failures += check_expand("STR( a  +\"b\\n\" ) STR()",
+				 "\"a +\\\"b\\\\n\\\"\" \"\"");
+	failures += check_expand("STR(ONE) XSTR(ONE)", "\"ONE\" \"1\"");
+	failures += check_expand("CAT(ON, E) CAT(, x) CAT(x, ) CAT(,)",
+				 "1 x x ");
+	failures += check_expand("CAT(1, 0.5e)+1", "10.5e+1");
+	/* f(2) gives 2 * g, g(9) gives f(9), which expands as GCC does */
+	failures += check_expand("f(2)(9)", "2 * 9 * g");
+	failures += check_expand("AP(3)(4, 5)", "3 ((4) + (5))");
+	failures += check_expand("-NEG", "- -1");
+
+	bs_macro_table_clear();
+	return failures;
+}
+
+unsigned test_variadic(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	failures += check_define("LOG(fmt, ...) log(fmt __VA_OPT__(,)"
+				 " __VA_ARGS__)");
+	failures += check_define("GNU(fmt, args...) gnu(fmt , ## args)");
+	failures += check_define("CALL(f, ...) f(__VA_ARGS__)");
+
+	failures += check_expand("LOG(\"x\")", "log(\"x\")");
+	failures += check_expand("LOG(\"x\", 1, (2, 3))",
+				 "log(\"x\", 1, (2, 3))");
+	failures += check_expand("GNU(\"x\")", "gnu(\"x\")");
+	failures += check_expand("GNU(\"x\", 1, 2)", "gnu(\"x\" , 1, 2)");
+	failures += check_expand("CALL(LOG, \"%d\", 3)",
+				 "log(\"%d\", 3)");
+
+	bs_macro_table_clear();
+	return failures;
+}
+
+unsigned test_many_macros(void)
+{
+	unsigned failures = 0;
+
+	bs_macro_table_clear();
+	const size_t count = 150 * 1000;
+	char name[40];
+	char body[40];
+	for (size_t i = 0; i < count; ++i) {
+		int name_len = snprintf(name, sizeof(name), "M_%zu", i);
+		int body_len = snprintf(body, sizeof(body), "%zu", i * 3);
+		failures += Check(bs_macro_define(name, (size_t)name_len,
+						  body, (size_t)body_len) == 0,
+				  "define %s\n", name);
+		if (i % 2) {
+			bs_macro_undef(name, (size_t)name_len);
+		}
+	}
+	failures += Check(bs_macro_count() == count / 2, "count %zu\n",
+			  bs_macro_count());
+	for (size_t i = 0; i < count; i += 997) {
+		int name_len = snprintf(name, sizeof(name), "M_%zu", i);
+		snprintf(body, sizeof(body), "%zu", i * 3);
+		struct bs_macro *m = bs_macro_find(name, (size_t)name_len);
+		if (i % 2) {
+			failures += Check(m == NULL, "%s defined\n", name);
+		} else {
+			failures += Check(m && strcmp(m->body, body) == 0,
+					  "%s not %s\n", name, body);
+		}
+	}
+
+	bs_macro_table_clear();
+	return failures;
+}
+
+unsigned test_expand_split_lines(void)
+{
+	unsigned failures = 0;
+
+	const char *in_txt = "#define ONE 1\n"
+	    "#define TWO ONE + ONE\n"
+	    "#define ADD(a, b) a + b\n"
+	    "int x = TWO;\n"
+	    "int y = ADD(1,\n"
+	    "\t2) * ADD\n"
+	    "  (3, 4);\n"
+	    "#undef ONE\n"
+	    "TWO";
+	const char *expect = "\n\n\nint x = 1 + 1;\n"
+	    "int y = 1 + 2 * 3 + 4;\n\n\n\nONE + ONE";
+
+	FILE *in = tmpfile();
+	fprintf(in, "%s", in_txt);
+	fflush(in);
+	rewind(in);
+	FILE *out = tmpfile();
+
+	/* the stages are fed one byte at a time */
+	bs_mmap = no_mmap;
+	bs_read = one_byte_read;
+	bs_macro_table_clear();
+	int err = bs_c_pre_proc_fused(dup(fileno(in)), fileno(out), stderr);
+	bs_macro_table_clear();
+	bs_read = bs_fd_read;
+	bs_mmap = mmap;
+
+	char actual[160];
+	memset(actual, 0x00, sizeof(actual));
+	rewind(out);
+	size_t len = fread(actual, 1, sizeof(actual) - 1, out);
+	fclose(out);
+	fclose(in);
+
+	failures += Check(err == 0, "error %d\n", err);
+	failures += Check(len == strlen(expect) && strcmp(actual, expect) == 0,
+			  "expected: '%s'\n but was: '%s'\n", expect, actual);
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_define_and_expand);
+	failures += run_test(test_undef_and_version);
+	failures += run_test(test_function_like);
+	failures += run_test(test_variadic);
+	failures += run_test(test_many_macros);
+	failures += run_test(test_expand_split_lines);
+
+	return failures_to_status("test_exit_reason", failures);
+}
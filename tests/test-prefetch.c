@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-prefetch.h"
+#include "bs-search.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+atomic_uint advised = 0;
+
+int counting_fadvise(int fd, int advice)
+{
+	(void)fd;
+	if (advice == POSIX_FADV_WILLNEED) {
+		++advised;
+	}
+	return 0;
+}
+
+char root[] = "/tmp/test-prefetch-XXXXXX";
+
+void make_file(const char *name)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	FILE *f = fopen(path, "w");
+	fprintf(f, "int %c;\n", name[0]);
+	fclose(f);
+}
+
+unsigned check_known(const char *name, int expect_known)
+{
+	unsigned failures = 0;
+
+	const char *path = NULL;
+	int fd = -1;
+	int err = bs_search_find(name, bs_search_angle, NULL, &path, &fd,
+				 stderr);
+	failures += Check(!err, "'%s' not found\n", name);
+	failures += Check((fd < 0) == expect_known, "%s: fd %d\n", name, fd);
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return failures;
+}
+
+unsigned test_prefetch_reads_includes_ahead(void)
+{
+	unsigned failures = 0;
+
+	mkdtemp(root);
+	make_file("a.h");
+	make_file("b.h");
+	make_file("c.h");
+	bs_search_add_dir(root, 0);
+	bs_prefetch_threads = BS_PREFETCH_THREADS;
+	int (*orig_fadvise)(int fd, int advice) = bs_fadvise;
+	bs_fadvise = counting_fadvise;
+
+	const char *text = "#include <a.h>\n"
+	    "  #  include\t<b.h>\n"
+	    "#include <a.h>\n"
+	    "int x; # include <c.h>\n"
+	    "#include HEADER\n" "#include <missing.h>\n" "#include <a.h";
+	bs_prefetch_includes(text, strlen(text));
+	bs_prefetch_wait();
+
+	/* once each, and only what was found */
+	failures += Check(advised == 2, "expected 2 but was %u\n", advised);
+	failures += check_known("a.h", 1);
+	failures += check_known("b.h", 1);
+	failures += check_known("c.h", 0);
+
+	/* names seen are not read ahead again, until a new epoch */
+	bs_prefetch_includes(text, 15);
+	bs_prefetch_wait();
+	failures += Check(advised == 2, "expected 2 but was %u\n", advised);
+	bs_search_new_epoch();
+	bs_prefetch_includes(text, 15);
+	bs_prefetch_wait();
+	failures += Check(advised == 3, "expected 3 but was %u\n", advised);
+
+	bs_prefetch_stop();
+	bs_prefetch_threads = 0;
+	bs_fadvise = orig_fadvise;
+	bs_search_dirs_clear();
+	bs_search_cache_clear();
+
+	const char *files[] = { "a.h", "b.h", "c.h", "" };
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+		char path[256];
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		remove(path);
+	}
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_prefetch_reads_includes_ahead);
+
+	return failures_to_status("test_exit_reason", failures);
+}
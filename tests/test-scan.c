@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-scan.h"
+#include "test-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const enum bs_scan_isa isas[] = {
+	bs_scan_isa_scalar,
+	bs_scan_isa_sse2,
+	bs_scan_isa_avx2
+};
+
+const size_t isas_len = sizeof(isas) / sizeof(isas[0]);
+
+size_t naive_scan(const char *buf, size_t len, const struct bs_scan_set *set)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (memchr(set->bytes, buf[i], set->len)) {
+			return i;
+		}
+	}
+	return len;
+}
+
+unsigned check_every_offset(const char *buf, size_t len,
+			    const struct bs_scan_set *set)
+{
+	unsigned failures = 0;
+	for (size_t i = 0; i < isas_len; ++i) {
+		if (bs_scan_use_isa(isas[i])) {
+			continue;	/* not on this cpu */
+		}
+		for (size_t start = 0; start < len; ++start) {
+			for (size_t end = start; end <= len; end += 7) {
+				size_t expect = naive_scan(buf + start,
+							   end - start, set);
+				size_t actual = bs_scan(buf + start,
+							end - start, set);
+				if (expect != actual) {
+					failures +=
+					    Check(expect == actual,
+						  "%s [%zu,%zu): %zu != %zu\n",
+						  bs_scan_isa_name(), start,
+						  end, expect, actual);
+					goto check_every_offset_end;
+				}
+			}
+		}
+	}
+
+check_every_offset_end:
+	bs_scan_use_isa(bs_scan_isa_auto);
+	return failures;
+}
+
+unsigned test_scan_sets(void)
+{
+	unsigned failures = 0;
+
+	char buf[200];
+	srand(42);
+	for (size_t i = 0; i < sizeof(buf); ++i) {
+		/* mostly plain text, a few interesting bytes */
+		int r = rand() % 64;
+		buf[i] = (r == 0) ? '/' : (r == 1) ? '*' : (r == 2) ? '\n'
+		    : (r == 3) ? '\\' : (r == 4) ? '"' : 'a' + (r % 26);
+	}
+
+	const struct bs_scan_set one = Bs_scan_set('\\');
+	const struct bs_scan_set two = Bs_scan_set('*', '/');
+	const struct bs_scan_set three = Bs_scan_set('/', '"', '\'');
+	const struct bs_scan_set four = Bs_scan_set('\\', '"', '\n', '*');
+	const struct bs_scan_set high = Bs_scan_set((char)0xE9, '\0');
+
+	failures += check_every_offset(buf, sizeof(buf), &one);
+	failures += check_every_offset(buf, sizeof(buf), &two);
+	failures += check_every_offset(buf, sizeof(buf), &three);
+	failures += check_every_offset(buf, sizeof(buf), &four);
+
+	buf[150] = (char)0xE9;
+	failures += check_every_offset(buf, sizeof(buf), &high);
+
+	return failures;
+}
+
+unsigned test_scan_isa_names(void)
+{
+	unsigned failures = 0;
+
+	failures += Check(bs_scan_use_isa(bs_scan_isa_scalar) == 0, "scalar");
+	failures += Check(strcmp(bs_scan_isa_name(), "scalar") == 0, "%s",
+			  bs_scan_isa_name());
+
+	failures += Check(bs_scan_use_isa(bs_scan_isa_auto) == 0, "auto");
+	failures += Check(strcmp(bs_scan_isa_name(), "auto") != 0, "%s",
+			  bs_scan_isa_name());
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_scan_sets);
+	failures += run_test(test_scan_isa_names);
+
+	return failures_to_status("test_exit_reason", failures);
+}
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-search.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+unsigned opens = 0;
+
+int counting_open(const char *path, int options, ...)
+{
+	++opens;
+	return open(path, options);
+}
+
+char root[] = "/tmp/test-search-XXXXXX";
+
+void make_file(const char *name, const char *txt)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	FILE *f = fopen(path, "w");
+	fprintf(f, "%s", txt);
+	fclose(f);
+}
+
+void make_dir(const char *name, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s", root, name);
+	mkdir(path, 0700);
+}
+
+unsigned check_find(const char *name, enum bs_search_kind kind,
+		    const char *from, const char *expect_dir,
+		    unsigned expect_opens, int expect_fd)
+{
+	unsigned failures = 0;
+
+	const char *path = NULL;
+	int fd = -1;
+	opens = 0;
+	int err = bs_search_find(name, kind, from, &path, &fd, stderr);
+
+	if (!expect_dir) {
+		failures += Check(err, "expected '%s' not found, but %s\n",
+				  name, path);
+	} else {
+		char expect[256];
+		snprintf(expect, sizeof(expect), "%s/%s", expect_dir, name);
+		failures += Check(!err, "'%s' not found\n", name);
+		failures += Check(path && strcmp(path, expect) == 0,
+				  "expected '%s' but was '%s'\n", expect, path);
+	}
+	failures += Check(opens == expect_opens,
+			  "%s: expected %u opens but was %u\n", name,
+			  expect_opens, opens);
+	failures += Check((fd >= 0) == expect_fd, "%s: fd %d\n", name, fd);
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return failures;
+}
+
+unsigned test_search_remembers_hits_and_misses(void)
+{
+	unsigned failures = 0;
+
+	char dir_a[128], dir_b[128], dir_sys[128], dir_sub[128], path[256];
+	mkdtemp(root);
+	make_dir("a", dir_a, sizeof(dir_a));
+	make_dir("b", dir_b, sizeof(dir_b));
+	make_dir("sys", dir_sys, sizeof(dir_sys));
+	make_file("b/x.h", "int x;\n");
+	make_file("sys/x.h", "int sys_x;\n");
+	make_file("sys/y.h", "int y;\n");
+	make_dir("a/d.h", path, sizeof(path));
+	make_file("b/d.h", "int d;\n");
+	make_dir("b/sub", dir_sub, sizeof(dir_sub));
+	make_file("b/sub/q.h", "int q;\n");
+
+	bs_open = counting_open;
+	bs_search_add_dir(dir_sys, 1);
+	bs_search_add_dir(dir_a, 0);
+	bs_search_add_dir(dir_b, 0);
+
+	/* -I dirs first, in order, then -isystem */
+	failures += check_find("x.h", bs_search_angle, NULL, dir_b, 2, 1);
+	failures += check_find("x.h", bs_search_angle, NULL, dir_b, 0, 0);
+	failures += check_find("y.h", bs_search_angle, NULL, dir_sys, 3, 1);
+	failures += check_find("y.h", bs_search_angle, NULL, dir_sys, 0, 0);
+
+	/* misses are remembered, too */
+	failures += check_find("z.h", bs_search_angle, NULL, NULL, 3, 0);
+	failures += check_find("z.h", bs_search_angle, NULL, NULL, 0, 0);
+
+	/* quoted tries the current dir, then shares what is known */
+	failures += check_find("x.h", bs_search_quote, NULL, dir_b, 1, 0);
+	failures += check_find("x.h", bs_search_quote, NULL, dir_b, 0, 0);
+
+	/* a directory of the name is passed over, as if not there */
+	failures += check_find("d.h", bs_search_angle, NULL, dir_b, 2, 1);
+	failures += check_find("d.h", bs_search_angle, NULL, dir_b, 0, 0);
+
+	/* quoted tries the includer's dir first, angled does not */
+	failures += check_find("q.h", bs_search_quote, dir_sub, dir_sub, 1, 1);
+	failures += check_find("q.h", bs_search_quote, dir_sub, dir_sub, 0, 0);
+	failures += check_find("q.h", bs_search_angle, dir_sub, NULL, 3, 0);
+	failures += check_find("x.h", bs_search_quote, dir_sub, dir_b, 1, 0);
+
+	bs_open = open;
+	bs_search_dirs_clear();
+
+	const char *files[] = { "b/x.h", "sys/x.h", "sys/y.h", "a/d.h", "b/d.h",
+		"b/sub/q.h", "b/sub", "a", "b", "sys", ""
+	};
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		remove(path);
+	}
+
+	return failures;
+}
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	failures += run_test(test_search_remembers_hits_and_misses);
+
+	return failures_to_status("test_exit_reason", failures);
+}
@@ -173,7 +173,7 @@ unsigned test_simple_include(void)
 			  " but was: '%s'\n", foo_h_txt, outbuf);
 
 	bs_open = open;
-	bs_close = close;
+	bs_close = bs_fd_close;
 
 	return failures;
 }
@@ -233,7 +233,130 @@ unsigned test_simple_include_include(void)
 			  " but was: '%s'\n", baz_txt, outbuf);
 
 	bs_open = open;
-	bs_close = close;
+	bs_close = bs_fd_close;
+
+	return failures;
+}
+
+const char *counted_path = "qux.h";
+unsigned opens_of_qux_h = 0;
+
+int counting_open(const char *path, int options, ...)
+{
+	if (strcmp(path, counted_path) == 0) {
+		++opens_of_qux_h;
+	}
+	return open(path, options);
+}
+
+unsigned test_repeat_include_is_cached(void)
+{
+	unsigned failures = 0;
+
+	const char *qux_h_txt = "int qux(void); /* qux */\n";
+	const char *qux_h_out = "int qux(void);  \n";
+
+	FILE *qux_h = fopen("qux.h", "w");
+	fprintf(qux_h, "%s", qux_h_txt);
+	fclose(qux_h);
+
+	bs_include_cache_clear();
+	opens_of_qux_h = 0;
+	bs_open = counting_open;
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	int err = 0;
+	for (size_t i = 0; i < 3; ++i) {
+		char linebuf[80];
+		strncpy(linebuf, "#include \"qux.h\"\n", 80);
+		err += bs_include(fdout, linebuf, 80, 1, stderr);
+	}
+
+	bs_open = open;
+
+	char outbuf[80 * 24];
+	slurp(outbuf, 80 * 24, out);
+	fclose(out);
+	remove("qux.h");
+	bs_include_cache_clear();
+
+	char expect[80 * 24];
+	snprintf(expect, 80 * 24, "%s%s%s", qux_h_out, qux_h_out, qux_h_out);
+
+	failures += Check(err == 0, "expected error == 0, but was %d\n", err);
+	failures += Check(opens_of_qux_h == 1, "opened %u times\n",
+			  opens_of_qux_h);
+	failures += Check((strcmp(outbuf, expect) == 0),
+			  "expected: '%s'\n"
+			  " but was: '%s'\n", expect, outbuf);
+
+	return failures;
+}
+
+unsigned check_guarded_include(const char *name, const char *txt,
+			       const char *expect)
+{
+	unsigned failures = 0;
+
+	FILE *header = fopen(name, "w");
+	fprintf(header, "%s", txt);
+	fclose(header);
+
+	bs_include_cache_clear();
+	counted_path = name;
+	opens_of_qux_h = 0;
+	bs_open = counting_open;
+
+	FILE *out = tmpfile();
+	int fdout = fileno(out);
+
+	int err = 0;
+	for (size_t i = 0; i < 3; ++i) {
+		char linebuf[80];
+		snprintf(linebuf, 80, "#include \"%s\"\n", name);
+		err += bs_include(fdout, linebuf, 80, 1, stderr);
+	}
+
+	bs_open = open;
+	counted_path = "qux.h";
+
+	char outbuf[80 * 24];
+	slurp(outbuf, 80 * 24, out);
+	fclose(out);
+	remove(name);
+	bs_include_cache_clear();
+
+	failures += Check(err == 0, "expected error == 0, but was %d\n", err);
+	failures += Check(opens_of_qux_h == 1, "%s opened %u times\n", name,
+			  opens_of_qux_h);
+	failures += Check((strcmp(outbuf, expect) == 0),
+			  "expected: '%s'\n"
+			  " but was: '%s'\n", expect, outbuf);
+
+	return failures;
+}
+
+unsigned test_guarded_include_is_skipped(void)
+{
+	unsigned failures = 0;
+
+	failures += check_guarded_include("guarded.h",
+					  "#ifndef GUARDED_H\n"
+					  "#define GUARDED_H 1\n"
+					  "int guarded(void);\n"
+					  "#endif /* GUARDED_H */\n",
+					  "\n"
+					  "\n"
+					  "int guarded(void);\n"
+					  "\n");
+
+	failures += check_guarded_include("once.h",
+					  "#pragma once\n"
+					  "int once(void);\n",
+					  "#pragma once\n"
+					  "int once(void);\n");
 
 	return failures;
 }
@@ -244,6 +367,8 @@ int main(void)
 
 	failures += run_test(test_simple_include);
 	failures += run_test(test_simple_include_include);
+	failures += run_test(test_repeat_include_is_cached);
+	failures += run_test(test_guarded_include_is_skipped);
 
 	return failures_to_status("test_exit_reason", failures);
 }
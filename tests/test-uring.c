@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (C) 2022 Eric Herman <eric@freesa.org> */
+
+#include "bs-uring.h"
+#include "bs-util.h"
+#include "test-util.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNKS 1000
+
+int (*real_uring_setup)(unsigned entries, void *params);
+
+int no_uring_setup(unsigned entries, void *params)
+{
+	(void)entries;
+	(void)params;
+	errno = ENOSYS;
+	return -1;
+}
+
+/* a ring, as of a kernel before 5.6, without IORING_OP_READ and _WRITE */
+int old_uring_setup(unsigned entries, void *params)
+{
+	int fd = real_uring_setup(entries, params);
+	struct io_uring_params *p = params;
+	p->features &= ~IORING_FEAT_RW_CUR_POS;
+	return fd;
+}
+
+/* if this kernel, and whatever filters its system calls, has a ring */
+int uring_available(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0x00, sizeof(p));
+	int fd = real_uring_setup(1, &p);
+	if (fd < 0) {
+		return 0;
+	}
+	close(fd);
+	return (p.features & IORING_FEAT_RW_CUR_POS) != 0;
+}
+
+size_t chunk(char *buf, size_t i)
+{
+	return (size_t)sprintf(buf, "chunk %zu of %d, %.*s\n", i, CHUNKS,
+			       (int)(i % 50), "................................"
+			       "..................");
+}
+
+/* the chunks through a small writer to a file, starting at "skip" */
+unsigned check_write_chunks(const char *skip, int expect_ring)
+{
+	unsigned failures = 0;
+
+	FILE *out = tmpfile();
+	fputs(skip, out);
+	fflush(out);
+
+	char buf[64];
+	struct bs_writer writer;
+	bs_writer_init(&writer, fileno(out), buf, sizeof(buf), stderr);
+
+	char line[80];
+	size_t total = strlen(skip);
+	for (size_t i = 0; i < CHUNKS; ++i) {
+		size_t len = chunk(line, i);
+		if (i % 7) {
+			bs_writer_write(&writer, line, len);
+		} else {
+			for (size_t j = 0; j < len; ++j) {
+				bs_writer_putc(&writer, line[j]);
+			}
+		}
+		total += len;
+	}
+	failures += Check(!writer.behind == !expect_ring,
+			  "expected to write behind: %d\n", expect_ring);
+	int err = bs_writer_flush(&writer);
+	failures += Check(!err, "bs_writer_flush: %d\n", err);
+	failures += Check(writer.buf == buf, "buffer not given back\n");
+
+	/* the file position is where write() would have left it */
+	long pos = ftell(out);
+	failures += Check(pos == (long)total, "%ld != %zu\n", pos, total);
+
+	char *actual = calloc(1, total + 1);
+	rewind(out);
+	size_t got = fread(actual, 1, total + 1, out);
+	fclose(out);
+	failures += Check(got == total, "read %zu of %zu\n", got, total);
+
+	size_t at = strlen(skip);
+	for (size_t i = 0; i < CHUNKS && !failures; ++i) {
+		size_t len = chunk(line, i);
+		failures += Check(memcmp(actual + at, line, len) == 0,
+				  "chunk %zu differs: '%.*s'\n", i, (int)len,
+				  actual + at);
+		at += len;
+	}
+	free(actual);
+
+	return failures;
+}
+
+/* the chunks through a pipe, read by a small reader */
+unsigned check_read_pipe(int expect_ring)
+{
+	unsigned failures = 0;
+
+	int fds[2];
+	failures += Check(!pipe(fds), "pipe\n");
+	FILE *in = fdopen(fds[1], "w");
+	char line[80];
+	size_t total = 0;
+	for (size_t i = 0; i < 100; ++i) {
+		total += chunk(line, i);
+		fputs(line, in);
+	}
+	fclose(in);
+
+	char buf[64];
+	struct bs_reader reader;
+	bs_reader_init(&reader, fds[0], buf, sizeof(buf), stderr);
+	size_t read = 0;
+	size_t i = 0;
+	size_t at = 0;
+	chunk(line, 0);
+	ssize_t bytes;
+	while ((bytes = bs_reader_fill(&reader)) > 0) {
+		for (size_t j = 0; j < (size_t)bytes; ++j, ++at) {
+			if (!line[at]) {
+				chunk(line, ++i);
+				at = 0;
+			}
+			failures += Check(reader.buf[j] == line[at],
+					  "chunk %zu at %zu\n", i, at);
+		}
+		read += (size_t)bytes;
+		failures += Check(!reader.ahead == !expect_ring,
+				  "expected to read ahead: %d\n", expect_ring);
+	}
+	bs_reader_unmap(&reader);
+	close(fds[0]);
+	failures += Check(bytes == 0, "bs_reader_fill: %zd\n", bytes);
+	failures += Check(read == total, "read %zu of %zu\n", read, total);
+	failures += Check(reader.buf == buf, "buffer not given back\n");
+
+	return failures;
+}
+
+unsigned check_io(int expect_ring)
+{
+	unsigned failures = 0;
+
+	failures += check_write_chunks("", expect_ring);
+	failures += check_write_chunks("already there\n", expect_ring);
+	failures += check_read_pipe(expect_ring);
+
+	return failures;
+}
+
+unsigned test_uring_io_ring(void)
+{
+	if (!uring_available()) {
+		printf("  (skipped, no io_uring with IORING_OP_READ here)\n");
+		return 0;
+	}
+	bs_uring_enabled = 1;
+	unsigned failures = Check(bs_uring_get() != NULL, "expected a ring\n");
+	failures += check_io(1);
+	bs_uring_enabled = 0;
+	return failures;
+}
+
+unsigned test_uring_io_posix(void)
+{
+	return check_io(0);
+}
+
+/* setup is intercepted, and the failure remembered, by this thread */
+unsigned check_fallback(int (*setup)(unsigned entries, void *params))
+{
+	bs_uring_enabled = 1;
+	bs_uring_setup = setup;
+	unsigned failures = Check(bs_uring_get() == NULL, "expected no ring\n");
+	failures += check_io(0);
+	bs_uring_setup = real_uring_setup;
+	bs_uring_enabled = 0;
+	return failures;
+}
+
+unsigned test_uring_io_without_uring(void)
+{
+	return check_fallback(no_uring_setup);
+}
+
+unsigned test_uring_io_without_read_op(void)
+{
+	return check_fallback(old_uring_setup);
+}
+
+struct named_test {
+	const char *name;
+	unsigned (*func)(void);
+	unsigned failures;
+};
+
+void *named_test_run(void *arg)
+{
+	struct named_test *t = arg;
+	t->failures = run_named_test(t->name, t->func);
+	return NULL;
+}
+
+/* each on a thread of its own, as a thread keeps its ring, or its lack */
+unsigned run_named_test_on_thread(const char *name, unsigned (*func)(void))
+{
+	struct named_test t = { name, func, 0 };
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, named_test_run, &t)) {
+		return Check(0, "pthread_create for %s\n", name);
+	}
+	pthread_join(thread, NULL);
+	return t.failures;
+}
+
+#define run_test_on_thread(func) run_named_test_on_thread(#func, func)
+
+int main(void)
+{
+	unsigned failures = 0;
+
+	real_uring_setup = bs_uring_setup;
+	failures += run_test_on_thread(test_uring_io_ring);
+	failures += run_test_on_thread(test_uring_io_posix);
+	failures += run_test_on_thread(test_uring_io_without_uring);
+	failures += run_test_on_thread(test_uring_io_without_read_op);
+
+	return failures_to_status("test_exit_reason", failures);
+}